@@ -0,0 +1,2 @@
+#!/bin/bash
+./bin/spoq_replay -cert_file:./certs/client_cert.pem -key_file:./certs/client_key.pem -ca_file:./certs/ca_cert.pem -target:127.0.0.1 "$@"
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "msquic.h"
+#include "quic_config.h"
+#include "spoq_log.h"
+#include "spoq_metrics.h"
+
+//
+// Admission control and rate limiting of the server's clients.
+//
+// Limits are kept per client certificate identity and per sensor id, so one
+// sensor stuck in a reconnect loop, or flooding readings, is held back
+// without the rest of the fleet noticing. An identity is a hash of the DER
+// certificate the client authenticated with. The server carries it in the
+// resumption tickets it issues, since a resumed connection presents no
+// certificate. A sensor is the id its client negotiates.
+//
+// Each identity and each sensor may hold up to MaxConnections connections
+// at once and start up to HandshakeRate a second. A connection over either
+// limit is refused. Each sensor's readings are also metered by two token
+// buckets, on messages and on bytes a second. What a stream receives is
+// charged whether or not the tokens are there, since it has arrived
+// already. A stream whose sensor is in debt beyond a second's burst is
+// paused until the debt is paid off, and with -rate_action:reject its
+// connection is closed instead.
+//
+// Every limit is one atomic word updated without a lock: a connection count,
+// or for a bucket the time its last token will be refilled (the generic
+// cell rate algorithm). The tables that find the entry of an identity or a
+// sensor are only searched as a connection is identified or negotiates.
+//
+
+// Entries a table keeps before it forgets idle ones, and refuses new keys
+// when there are none to forget
+constexpr size_t ADMISSION_MAX_ENTRIES = 64 * 1024;
+
+// Longest a stream over its sensor's rate is paused at a time. It is paused
+// again on its next receive if still in debt, which keeps well within the
+// idle timeout.
+constexpr uint64_t ADMISSION_MAX_PAUSE_NS = 250 * 1000 * 1000;
+
+// Tokens that rate limited buckets hold, in seconds of their rate
+constexpr double ADMISSION_BURST_SECONDS = 1;
+
+// Token bucket of Rate tokens a second holding up to Burst. Rather than a
+// token count refilled on a timer, it keeps the time at which every token
+// taken so far will have been refilled, so taking is one compare-exchange.
+class TOKEN_BUCKET {
+ public:
+  // Refills Rate tokens a second, up to Burst and at least one. A rate of 0
+  // never limits.
+  void Configure(double Rate, double Burst) {
+    TokenNs = Rate > 0 ? 1e9 / Rate : 0;
+    BurstNs = (uint64_t)(std::max(Burst, 1.0) * TokenNs);
+  }
+
+  bool Limited() const { return TokenNs != 0; }
+
+  // Takes Cost tokens at Now, whether or not they are there. Returns how
+  // long until the bucket is back within its burst, 0 if it is.
+  uint64_t Take(uint64_t Cost, uint64_t Now) {
+    if (TokenNs == 0) {
+      return 0;
+    }
+    const uint64_t Charge = (uint64_t)((double)Cost * TokenNs);
+    uint64_t Due = Refilled.load(std::memory_order_relaxed);
+    uint64_t Next;
+    do {
+      Next = std::max(Due, Now) + Charge;
+    } while (!Refilled.compare_exchange_weak(Due, Next,
+                                             std::memory_order_relaxed));
+    return Next > Now + BurstNs ? Next - Now - BurstNs : 0;
+  }
+
+  // Takes Cost tokens at Now if the bucket stays within its burst
+  bool TryTake(uint64_t Cost, uint64_t Now) {
+    if (TokenNs == 0) {
+      return true;
+    }
+    const uint64_t Charge = (uint64_t)((double)Cost * TokenNs);
+    uint64_t Due = Refilled.load(std::memory_order_relaxed);
+    uint64_t Next;
+    do {
+      Next = std::max(Due, Now) + Charge;
+      if (Next > Now + BurstNs) {
+        return false;
+      }
+    } while (!Refilled.compare_exchange_weak(Due, Next,
+                                             std::memory_order_relaxed));
+    return true;
+  }
+
+  // True once every token taken has been refilled
+  bool Full(uint64_t Now) const {
+    return Refilled.load(std::memory_order_relaxed) <= Now;
+  }
+
+ private:
+  double TokenNs = 0;
+  uint64_t BurstNs = 0;
+  std::atomic<uint64_t> Refilled{0};
+};
+
+// Limits of every identity, or of every sensor. A limit of 0 is no limit.
+struct ADMISSION_LIMITS {
+  // Connections held at once
+  uint32_t MaxConnections = 0;
+  // Connections started a second
+  double HandshakeRate = 0;
+  // Messages and bytes received a second
+  double MessageRate = 0;
+  double ByteRate = 0;
+
+  bool Limited() const {
+    return MaxConnections != 0 || HandshakeRate > 0 || MessageRate > 0 ||
+           ByteRate > 0;
+  }
+};
+
+// The limits' state for one identity or sensor
+struct ADMISSION_ENTRY {
+  std::atomic<uint32_t> Connections{0};
+  TOKEN_BUCKET Handshakes;
+  TOKEN_BUCKET Messages;
+  TOKEN_BUCKET Bytes;
+};
+
+enum class ADMISSION_RESULT {
+  ADMITTED,
+  TOO_MANY_CONNECTIONS,
+  TOO_MANY_HANDSHAKES,
+  // The table holds ADMISSION_MAX_ENTRIES keys, none of them idle
+  TABLE_FULL
+};
+
+inline const char* ToString(ADMISSION_RESULT Result) {
+  switch (Result) {
+    case ADMISSION_RESULT::ADMITTED:
+      return "admitted";
+    case ADMISSION_RESULT::TOO_MANY_CONNECTIONS:
+      return "too many connections";
+    case ADMISSION_RESULT::TOO_MANY_HANDSHAKES:
+      return "too many handshakes";
+    case ADMISSION_RESULT::TABLE_FULL:
+      return "admission table full";
+  }
+  return "unknown";
+}
+
+// Identity of the client that authenticated with Certificate, the DER
+// encoding msquic hands over with portable certificates. It is the 64-bit
+// FNV-1a hash of the encoding, never 0, which stands for none.
+inline uint64_t AdmissionIdentity(_In_ const QUIC_BUFFER* Certificate) {
+  uint64_t Hash = 0xcbf29ce484222325ull;
+  for (uint32_t i = 0; i < Certificate->Length; ++i) {
+    Hash = (Hash ^ Certificate->Buffer[i]) * 0x100000001b3ull;
+  }
+  return Hash != 0 ? Hash : 1;
+}
+
+// The entries of the identities, or sensors, seen so far. An entry lives as
+// long as a connection holds it, and is forgotten once none does and its
+// buckets are full again, when the table would otherwise grow past
+// ADMISSION_MAX_ENTRIES.
+class ADMISSION_TABLE {
+ public:
+  // Sets the limits. Must be called before the first Admit.
+  void Configure(const ADMISSION_LIMITS& NewLimits) { Limits = NewLimits; }
+
+  bool Limited() const { return Limits.Limited(); }
+
+  // Counts a new connection of Key against its limits at Now. When it is
+  // admitted, *Entry is the key's entry, which the connection holds until it
+  // calls Release.
+  ADMISSION_RESULT Admit(uint64_t Key, uint64_t Now,
+                         _Out_ ADMISSION_ENTRY** Entry) {
+    *Entry = nullptr;
+    {
+      std::shared_lock<std::shared_mutex> Guard(Lock);
+      auto It = Entries.find(Key);
+      if (It != Entries.end()) {
+        return Charge(It->second.get(), Now, Entry);
+      }
+    }
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    auto It = Entries.find(Key);
+    if (It == Entries.end()) {
+      if (Entries.size() >= ADMISSION_MAX_ENTRIES && !Sweep(Now)) {
+        return ADMISSION_RESULT::TABLE_FULL;
+      }
+      auto New = std::make_unique<ADMISSION_ENTRY>();
+      New->Handshakes.Configure(Limits.HandshakeRate,
+                                Limits.HandshakeRate * ADMISSION_BURST_SECONDS);
+      New->Messages.Configure(Limits.MessageRate,
+                              Limits.MessageRate * ADMISSION_BURST_SECONDS);
+      New->Bytes.Configure(Limits.ByteRate,
+                           Limits.ByteRate * ADMISSION_BURST_SECONDS);
+      It = Entries.emplace(Key, std::move(New)).first;
+    }
+    return Charge(It->second.get(), Now, Entry);
+  }
+
+  // Lets go of an entry Admit handed out
+  void Release(_In_ ADMISSION_ENTRY* Entry) {
+    Entry->Connections.fetch_sub(1, std::memory_order_release);
+  }
+
+  size_t Size() const {
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    return Entries.size();
+  }
+
+ private:
+  // Takes a handshake token and a connection from Entry. Called under Lock,
+  // so that Sweep never sees a connection count going up from 0.
+  ADMISSION_RESULT Charge(_In_ ADMISSION_ENTRY* Entry, uint64_t Now,
+                          _Out_ ADMISSION_ENTRY** Admitted) {
+    if (!Entry->Handshakes.TryTake(1, Now)) {
+      return ADMISSION_RESULT::TOO_MANY_HANDSHAKES;
+    }
+    const uint32_t Held =
+        Entry->Connections.fetch_add(1, std::memory_order_acq_rel) + 1;
+    if (Limits.MaxConnections != 0 && Held > Limits.MaxConnections) {
+      Entry->Connections.fetch_sub(1, std::memory_order_release);
+      return ADMISSION_RESULT::TOO_MANY_CONNECTIONS;
+    }
+    *Admitted = Entry;
+    return ADMISSION_RESULT::ADMITTED;
+  }
+
+  // Forgets the entries no connection holds whose buckets are full, which
+  // are no different from new ones. Returns true if there is room for a new
+  // entry. Called with Lock held exclusively.
+  bool Sweep(uint64_t Now) {
+    for (auto It = Entries.begin(); It != Entries.end();) {
+      const ADMISSION_ENTRY& Entry = *It->second;
+      if (Entry.Connections.load(std::memory_order_acquire) == 0 &&
+          Entry.Handshakes.Full(Now) && Entry.Messages.Full(Now) &&
+          Entry.Bytes.Full(Now)) {
+        It = Entries.erase(It);
+      } else {
+        ++It;
+      }
+    }
+    return Entries.size() < ADMISSION_MAX_ENTRIES;
+  }
+
+  ADMISSION_LIMITS Limits;
+  mutable std::shared_mutex Lock;
+  std::unordered_map<uint64_t, std::unique_ptr<ADMISSION_ENTRY>> Entries;
+};
+
+// Re-enables receive on paused streams when their pause is over. Pausing
+// and resuming are queued to the stream's msquic worker, so the thread only
+// waits for the earliest one that is due. A stream must be cancelled before
+// it is closed; the lock makes sure its handle is not used after that.
+class RECEIVE_RESUMER {
+ public:
+  ~RECEIVE_RESUMER() { Stop(); }
+
+  void Start() {
+    Thread = std::thread([this] { Run(); });
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Stopping = true;
+    }
+    Wake.notify_one();
+    if (Thread.joinable()) {
+      Thread.join();
+    }
+  }
+
+  bool Running() const { return Thread.joinable(); }
+
+  // Pauses receive on Stream until At, on MetricNow's clock
+  void Pause(_In_ HQUIC Stream, uint64_t At) {
+    MsQuic->StreamReceiveSetEnabled(Stream, FALSE);
+    bool Earliest;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Earliest = Paused.empty() || At < Paused.begin()->first;
+      Paused.emplace(At, Stream);
+    }
+    if (Earliest) {
+      Wake.notify_one();
+    }
+  }
+
+  // Forgets the pauses of Stream, before it is closed
+  void Cancel(_In_ HQUIC Stream) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    for (auto It = Paused.begin(); It != Paused.end();) {
+      It = It->second == Stream ? Paused.erase(It) : std::next(It);
+    }
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    while (!Stopping) {
+      if (Paused.empty()) {
+        Wake.wait(Guard);
+        continue;
+      }
+      const uint64_t Now = MetricNow();
+      auto It = Paused.begin();
+      if (It->first > Now) {
+        Wake.wait_for(Guard, std::chrono::nanoseconds(It->first - Now));
+        continue;
+      }
+      MsQuic->StreamReceiveSetEnabled(It->second, TRUE);
+      Paused.erase(It);
+    }
+  }
+
+  std::mutex Lock;
+  std::condition_variable Wake;
+  bool Stopping = false;
+  std::multimap<uint64_t, HQUIC> Paused;
+  std::thread Thread;
+};
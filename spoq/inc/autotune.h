@@ -0,0 +1,279 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "msquic.h"
+#include "quic_config.h"
+#include "spoq_log.h"
+#include "spoq_metrics.h"
+
+//
+// Flow-control autotuning from live connection statistics.
+//
+// msquic's default windows suit neither end of our links: a LAN connection
+// needs far less than the 16 MiB connection window, and a satellite path
+// needs far more than the 64 KiB a new stream starts with. A TUNING_PROFILE,
+// loaded from the -tuning file, sets the windows, send buffering and pacing
+// every connection starts with, and the bounds the tuner keeps to.
+//
+// Each time a connection's transport statistics are sampled, its
+// CONNECTION_TUNER measures the receive rate since the last sample and, with
+// the smoothed RTT, the bandwidth-delay product. The connection's flow
+// control window is set to BdpMultiplier times that through SetParam, within
+// the profile's bounds. msquic grows each stream's receive window up to the
+// connection window as the stream is drained, so one knob covers both. When
+// the window is what limits the rate, the measured BDP is the window itself
+// and the next target is BdpMultiplier times larger, so a high-BDP link
+// ramps up geometrically until the path, not the window, is the limit. Once
+// traffic falls the window shrinks back, keeping memory tight. Changes
+// smaller than the profile's hysteresis are skipped.
+//
+// A profile file has one "key = value" per line; "#" starts a comment. Sizes
+// take a k or m suffix.
+//
+//   stream_recv_window  initial receive window of a stream, a power of two
+//   conn_window         initial connection flow control window
+//   initial_rtt_ms      RTT assumed before the first sample
+//   send_buffering      true or false
+//   pacing              true or false
+//   min_window          smallest window the tuner sets (64k)
+//   max_window          largest window the tuner sets (16m)
+//   bdp_multiplier      windows in bandwidth-delay products (2)
+//   hysteresis          smallest change applied, a fraction (0.25)
+//   adaptive            false to only apply the initial settings
+//
+
+// msquic's connection flow control window when none is set
+constexpr uint32_t TUNING_DEFAULT_CONN_WINDOW = 16 * 1024 * 1024;
+
+struct TUNING_PROFILE {
+  // Initial settings, 0 (or -1 for flags) to keep msquic's defaults
+  uint32_t StreamRecvWindow = 0;
+  uint32_t ConnWindow = 0;
+  uint32_t InitialRttMs = 0;
+  int SendBuffering = -1;
+  int Pacing = -1;
+  // Bounds and behaviour of the tuner
+  uint32_t MinWindow = 64 * 1024;
+  uint32_t MaxWindow = 16 * 1024 * 1024;
+  double BdpMultiplier = 2;
+  double Hysteresis = 0.25;
+  // Tune connections; set by Load unless the file says otherwise
+  bool Adaptive = false;
+
+  // Reads the profile at Path. Logs and returns false on a malformed file.
+  bool Load(const char* Path) {
+    FILE* File = fopen(Path, "r");
+    if (File == nullptr) {
+      SPOQ_LOG_ERROR("Tuning profile {} not readable", Path);
+      return false;
+    }
+    Adaptive = true;
+    char Line[256];
+    uint32_t LineNumber = 0;
+    bool Ok = true;
+    while (Ok && fgets(Line, sizeof(Line), File) != nullptr) {
+      ++LineNumber;
+      std::string_view Text(Line);
+      Text = Text.substr(0, Text.find('#'));
+      const size_t Equals = Text.find('=');
+      if (Trim(Text).empty()) {
+        continue;
+      }
+      Ok = Equals != std::string_view::npos &&
+           Set(Trim(Text.substr(0, Equals)), Trim(Text.substr(Equals + 1)));
+      if (!Ok) {
+        SPOQ_LOG_ERROR("Tuning profile {}:{}: cannot parse '{}'", Path,
+                       LineNumber, Trim(Text));
+      }
+    }
+    fclose(File);
+    if (Ok && MinWindow > MaxWindow) {
+      SPOQ_LOG_ERROR("Tuning profile {}: min_window exceeds max_window",
+                     Path);
+      Ok = false;
+    }
+    if (Ok && StreamRecvWindow != 0 &&
+        !std::has_single_bit(StreamRecvWindow)) {
+      SPOQ_LOG_ERROR("Tuning profile {}: stream_recv_window must be a power "
+                     "of two", Path);
+      Ok = false;
+    }
+    return Ok;
+  }
+
+  // Applies the initial settings on top of those already in Settings
+  void Apply(QUIC_SETTINGS* Settings) const {
+    if (StreamRecvWindow != 0) {
+      Settings->StreamRecvWindowDefault = StreamRecvWindow;
+      Settings->IsSet.StreamRecvWindowDefault = TRUE;
+    }
+    if (ConnWindow != 0) {
+      Settings->ConnFlowControlWindow = ConnWindow;
+      Settings->IsSet.ConnFlowControlWindow = TRUE;
+    }
+    if (InitialRttMs != 0) {
+      Settings->InitialRttMs = InitialRttMs;
+      Settings->IsSet.InitialRttMs = TRUE;
+    }
+    if (SendBuffering >= 0) {
+      Settings->SendBufferingEnabled = SendBuffering ? TRUE : FALSE;
+      Settings->IsSet.SendBufferingEnabled = TRUE;
+    }
+    if (Pacing >= 0) {
+      Settings->PacingEnabled = Pacing ? TRUE : FALSE;
+      Settings->IsSet.PacingEnabled = TRUE;
+    }
+  }
+
+ private:
+  static std::string_view Trim(std::string_view Text) {
+    while (!Text.empty() && isspace((unsigned char)Text.front())) {
+      Text.remove_prefix(1);
+    }
+    while (!Text.empty() && isspace((unsigned char)Text.back())) {
+      Text.remove_suffix(1);
+    }
+    return Text;
+  }
+
+  static bool ParseBytes(std::string_view Text, uint32_t* Bytes) {
+    const std::string Value(Text);
+    char* End;
+    uint64_t Parsed = strtoull(Value.c_str(), &End, 10);
+    if (End == Value.c_str()) {
+      return false;
+    }
+    if (*End == 'k' || *End == 'K') {
+      Parsed <<= 10;
+      ++End;
+    } else if (*End == 'm' || *End == 'M') {
+      Parsed <<= 20;
+      ++End;
+    }
+    if (*End != '\0' || Parsed > UINT32_MAX) {
+      return false;
+    }
+    *Bytes = (uint32_t)Parsed;
+    return true;
+  }
+
+  static bool ParseFlag(std::string_view Text, int* Flag) {
+    if (Text == "true") {
+      *Flag = 1;
+    } else if (Text == "false") {
+      *Flag = 0;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  static bool ParseFraction(std::string_view Text, double* Fraction) {
+    const std::string Value(Text);
+    char* End;
+    *Fraction = strtod(Value.c_str(), &End);
+    return End != Value.c_str() && *End == '\0' && *Fraction >= 0;
+  }
+
+  bool Set(std::string_view Key, std::string_view Value) {
+    int Flag;
+    if (Key == "stream_recv_window") {
+      return ParseBytes(Value, &StreamRecvWindow);
+    } else if (Key == "conn_window") {
+      return ParseBytes(Value, &ConnWindow);
+    } else if (Key == "initial_rtt_ms") {
+      return ParseBytes(Value, &InitialRttMs);
+    } else if (Key == "send_buffering") {
+      return ParseFlag(Value, &SendBuffering);
+    } else if (Key == "pacing") {
+      return ParseFlag(Value, &Pacing);
+    } else if (Key == "min_window") {
+      return ParseBytes(Value, &MinWindow);
+    } else if (Key == "max_window") {
+      return ParseBytes(Value, &MaxWindow);
+    } else if (Key == "bdp_multiplier") {
+      return ParseFraction(Value, &BdpMultiplier) && BdpMultiplier >= 1;
+    } else if (Key == "hysteresis") {
+      return ParseFraction(Value, &Hysteresis);
+    } else if (Key == "adaptive" && ParseFlag(Value, &Flag)) {
+      Adaptive = Flag != 0;
+      return true;
+    }
+    return false;
+  }
+};
+
+// Per-connection tuning state, used on the connection's callback thread
+class CONNECTION_TUNER {
+ public:
+  // Feeds one statistics sample of Connection, taken at Now, and sets a new
+  // flow control window if the measured bandwidth-delay product calls for
+  // one. The window and BDP are published in Metrics.
+  void Update(_In_ HQUIC Connection, const TUNING_PROFILE& Profile,
+              const QUIC_STATISTICS_V2& Stats, uint64_t Now,
+              CONNECTION_METRICS& Metrics) {
+    if (Window == 0) {
+      Window =
+          Profile.ConnWindow != 0 ? Profile.ConnWindow
+                                  : TUNING_DEFAULT_CONN_WINDOW;
+      Metrics.FlowControlWindow.Set(Window);
+    }
+    const uint64_t Elapsed = Now - LastTime;
+    const uint64_t Received = Stats.RecvTotalBytes - LastReceived;
+    const bool First = LastTime == 0;
+    LastTime = Now;
+    LastReceived = Stats.RecvTotalBytes;
+    if (First || Elapsed == 0 || Stats.Rtt == 0) {
+      return;
+    }
+
+    const double Rate = (double)Received * 1e9 / (double)Elapsed;
+    const uint64_t Bdp = (uint64_t)(Rate * Stats.Rtt / 1e6);
+    Metrics.BdpBytes.Set(Bdp);
+    const uint32_t Target = (uint32_t)std::clamp<double>(
+        Bdp * Profile.BdpMultiplier, Profile.MinWindow, Profile.MaxWindow);
+    const uint32_t Change = Target > Window ? Target - Window : Window - Target;
+    if (Change == 0 || Change < Profile.Hysteresis * Window) {
+      return;
+    }
+
+    QUIC_SETTINGS Settings = {0};
+    Settings.ConnFlowControlWindow = Target;
+    Settings.IsSet.ConnFlowControlWindow = TRUE;
+    // Streams opened from now on start at the new window too, rounded down
+    // to the power of two msquic requires
+    Settings.StreamRecvWindowDefault = std::bit_floor(Target);
+    Settings.IsSet.StreamRecvWindowDefault = TRUE;
+    QUIC_STATUS Status;
+    if (QUIC_FAILED(Status = MsQuic->SetParam(Connection,
+                                              QUIC_PARAM_CONN_SETTINGS,
+                                              sizeof(Settings), &Settings))) {
+      SPOQ_LOG_WARN("[{}] Flow control window not changed, {}", Connection,
+                    SpoqLogHex(Status));
+      SpoqMetrics().AutotuneFailures.Add();
+      return;
+    }
+    SPOQ_LOG_DEBUG("[{}] Flow control window {} -> {} bytes (RTT {} us, "
+                   "{} B/s)", Connection, Window, Target, Stats.Rtt,
+                   (uint64_t)Rate);
+    (Target > Window ? SpoqMetrics().AutotuneIncreases
+                     : SpoqMetrics().AutotuneDecreases)
+        .Add();
+    Window = Target;
+    Metrics.FlowControlWindow.Set(Window);
+    Metrics.WindowChanges.Add();
+  }
+
+ private:
+  uint32_t Window = 0;
+  uint64_t LastTime = 0;
+  uint64_t LastReceived = 0;
+};
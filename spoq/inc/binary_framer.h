@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "msquic.h"
+#include "ndjson_framer.h"
+#include "spoq_pdu.h"
+
+//
+// Per-stream reassembly of length-prefixed binary PDUs.
+//
+// Works like NDJSON_FRAMER, but frame boundaries come from each PDU's varint
+// length prefix instead of a newline scan. Frames inside one QUIC_BUFFER are
+// handed out as views into msquic's buffers; only a frame straddling two
+// buffers is gathered into the carry buffer. A short trailing partial frame
+// is left inside msquic when the event made progress, and the event is
+// finished with NdjsonReceiveComplete in the same way.
+//
+
+class BINARY_FRAMER {
+ public:
+  // Splits the buffers of one RECEIVE event into PDU bodies (length prefix
+  // removed) and calls OnFrame with each one. Consumed is set to the number
+  // of bytes to pass to StreamReceiveComplete. Fails on a malformed prefix or
+  // a frame longer than SPOQ_BINARY_MAX_LENGTH.
+  template <typename FrameHandler>
+  QUIC_STATUS Receive(_In_reads_(BufferCount) const QUIC_BUFFER* Buffers,
+                      uint32_t BufferCount, _Out_ uint64_t* Consumed,
+                      FrameHandler&& OnFrame) {
+    uint64_t Total = 0;
+    bool FoundFrame = false;
+    const uint8_t* Tail = nullptr;
+    size_t TailLength = 0;
+
+    for (uint32_t i = 0; i < BufferCount; ++i) {
+      const uint8_t* Data = Buffers[i].Buffer;
+      const uint8_t* End = Data + Buffers[i].Length;
+      Total += Buffers[i].Length;
+
+      // The previous segment's trailing partial frame continues here
+      if (TailLength != 0) {
+        Carry.append((const char*)Tail, TailLength);
+        TailLength = 0;
+      }
+
+      // Complete the carried frame first, a prefix byte at a time until its
+      // length is known
+      while (!Carry.empty() && Data < End) {
+        size_t Needed = 0;
+        if (!FrameLength((const uint8_t*)Carry.data(), Carry.size(),
+                         &Needed)) {
+          Carry.clear();
+          return QUIC_STATUS_INVALID_PARAMETER;
+        }
+        size_t Take = Needed == 0 ? 1 : Needed - Carry.size();
+        if (Take > (size_t)(End - Data)) {
+          Take = End - Data;
+        }
+        Carry.append((const char*)Data, Take);
+        Data += Take;
+        if (Needed != 0 && Carry.size() == Needed) {
+          OnFrame(std::string_view(Carry).substr(Needed - BodyLength));
+          Carry.clear();
+          FoundFrame = true;
+        }
+      }
+
+      // Then hand out every frame that lies wholly inside the segment
+      while (Data < End) {
+        size_t Needed = 0;
+        if (!FrameLength(Data, End - Data, &Needed)) {
+          return QUIC_STATUS_INVALID_PARAMETER;
+        }
+        if (Needed == 0 || Needed > (size_t)(End - Data)) {
+          Tail = Data;
+          TailLength = End - Data;
+          break;
+        }
+        OnFrame(std::string_view((const char*)Data + Needed - BodyLength,
+                                 BodyLength));
+        Data += Needed;
+        FoundFrame = true;
+      }
+    }
+
+    *Consumed = Total;
+    if (TailLength == 0) {
+      return QUIC_STATUS_SUCCESS;
+    }
+    if (FoundFrame && TailLength <= NDJSON_MAX_DEFERRED_LENGTH) {
+      *Consumed = Total - TailLength;
+      return QUIC_STATUS_SUCCESS;
+    }
+    Carry.append((const char*)Tail, TailLength);
+    return QUIC_STATUS_SUCCESS;
+  }
+
+  // Bytes of a partial frame currently held in the carry buffer
+  size_t CarriedLength() const { return Carry.size(); }
+
+ private:
+  // Sets *Needed to the full length (prefix and body) of the frame starting
+  // at Data, or 0 if the prefix itself is still incomplete. Also records the
+  // body length. Fails on an oversized or malformed prefix.
+  bool FrameLength(const uint8_t* Data, size_t Length, size_t* Needed) {
+    const uint8_t* P = Data;
+    uint64_t Body = 0;
+    if (!GetVarint(&P, Data + Length, &Body)) {
+      *Needed = 0;
+      return Length < SPOQ_VARINT_MAX_LENGTH;
+    }
+    if (Body > SPOQ_BINARY_MAX_LENGTH) {
+      return false;
+    }
+    BodyLength = (size_t)Body;
+    *Needed = (P - Data) + BodyLength;
+    return true;
+  }
+
+  std::string Carry = {};
+  size_t BodyLength = 0;
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <thread>
+
+#include "ingest_queue.h"
+#include "msquic.h"
+#include "send_pool.h"
+#include "spoq_log.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+
+//
+// Capture of decoded application traffic, for replay with spoq_replay.
+//
+// With -capture:<path> the server records every message it receives and the
+// client every message it sends or receives, together with the opening and
+// closing of connections. A message is recorded as its body, without the
+// newline or length prefix that framed it, and its wire version says how to
+// frame it again.
+//
+// A capture file is the CAPTURE_FILE_HEADER followed by records, each a run
+// of varints and the body:
+//
+//   time since the previous record (the first: since the capture opened), ns
+//   connection, numbered from 1 in the order connections were recorded
+//   stream index, 0 for the control stream
+//   wire version << 2 | CAPTURE_EVENT
+//   sensor id of the connection, 0 before it has negotiated
+//   body length, then the body
+//
+// so a small reading costs about eight bytes beyond its body.
+//
+// Recording must not slow the connection down, so a callback only copies the
+// record into a pooled INGEST_ITEM and pushes it onto an INGEST_QUEUE. A
+// writer thread of its own stamps the time deltas and writes the records
+// through a buffered file, flushing whenever it runs out of work. If the
+// writer falls CAPTURE_MAX_QUEUED records behind, new records are dropped
+// and counted rather than queued.
+//
+
+// Records waiting for the writer beyond which new ones are dropped
+constexpr int64_t CAPTURE_MAX_QUEUED = 64 * 1024;
+
+// Buffer of the capture file
+constexpr size_t CAPTURE_FILE_BUFFER = 1024 * 1024;
+
+// Longest run of varints before a record's body
+constexpr size_t CAPTURE_HEADER_MAX_LENGTH = 5 * SPOQ_VARINT_MAX_LENGTH;
+
+constexpr char CAPTURE_FILE_MAGIC[8] = {'S', 'P', 'O', 'Q',
+                                        'C', 'A', 'P', '1'};
+
+struct CAPTURE_FILE_HEADER {
+  char Magic[8];
+  uint64_t StartTime;  // ns since the epoch when the capture opened
+};
+
+static_assert(sizeof(CAPTURE_FILE_HEADER) == 16);
+
+enum class CAPTURE_EVENT : uint8_t {
+  TO_SERVER = 0,    // A message the client sent
+  FROM_SERVER = 1,  // A message the server sent
+  OPEN = 2,         // A connection was opened; no body
+  CLOSE = 3         // A connection was shut down; no body
+};
+
+// One record read back from a capture. Body points into the reader's
+// mapping.
+struct CAPTURE_RECORD {
+  uint64_t Time = 0;  // ns since the capture opened
+  uint64_t Connection = 0;
+  uint32_t Stream = 0;
+  CAPTURE_EVENT Event = CAPTURE_EVENT::TO_SERVER;
+  uint32_t Version = 0;
+  uint64_t SensorId = 0;
+  std::string_view Body;
+};
+
+// Body of one framed message as it is sent on a stream: an NDJSON line
+// without its newline, or a binary PDU without its length prefix
+inline std::string_view CaptureBody(uint32_t Version,
+                                    const QUIC_BUFFER& Frame) {
+  std::string_view Bytes((const char*)Frame.Buffer, Frame.Length);
+  if (Version == SPOQ_VERSION_NDJSON) {
+    return Bytes.empty() || Bytes.back() != '\n'
+               ? Bytes
+               : Bytes.substr(0, Bytes.size() - 1);
+  }
+  const uint8_t* P = Frame.Buffer;
+  uint64_t Length;
+  if (!GetVarint(&P, Frame.Buffer + Frame.Length, &Length)) {
+    return {};
+  }
+  return Bytes.substr(P - Frame.Buffer);
+}
+
+class CAPTURE_WRITER {
+ public:
+  ~CAPTURE_WRITER() { Close(); }
+
+  // Creates the capture file at Path and starts the writer
+  bool Open(const char* Path) {
+    File = fopen(Path, "wb");
+    if (File == nullptr) {
+      SPOQ_LOG_ERROR("Capture {} not created, errno {}", Path, errno);
+      return false;
+    }
+    setvbuf(File, nullptr, _IOFBF, CAPTURE_FILE_BUFFER);
+    CAPTURE_FILE_HEADER Header = {};
+    memcpy(Header.Magic, CAPTURE_FILE_MAGIC, sizeof(Header.Magic));
+    Header.StartTime =
+        (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    if (fwrite(&Header, sizeof(Header), 1, File) != 1) {
+      SPOQ_LOG_ERROR("Capture {} not written, errno {}", Path, errno);
+      fclose(File);
+      File = nullptr;
+      return false;
+    }
+    LastTime = MetricNow();
+    Active = true;
+    Writer = std::thread([this] { Run(); });
+    SPOQ_LOG_INFO("Capturing traffic to {}", Path);
+    return true;
+  }
+
+  bool IsOpen() const { return Active; }
+
+  // Numbers a new connection and records its opening. Returns 0, which is
+  // never recorded, when there is no capture.
+  uint64_t Connect() {
+    if (!Active) {
+      return 0;
+    }
+    const uint64_t Connection =
+        NextConnection.fetch_add(1, std::memory_order_relaxed);
+    Record(Connection, 0, 0, CAPTURE_EVENT::OPEN, 0, {});
+    return Connection;
+  }
+
+  // Records the shutdown of Connection
+  void Disconnect(uint64_t Connection, uint64_t SensorId) {
+    Record(Connection, 0, SensorId, CAPTURE_EVENT::CLOSE, 0, {});
+  }
+
+  // Records one message body on stream Stream of Connection. Safe to call
+  // from any thread; never blocks.
+  void Record(uint64_t Connection, uint32_t Stream, uint64_t SensorId,
+              CAPTURE_EVENT Event, uint32_t Version, std::string_view Body) {
+    if (!Active || Connection == 0) {
+      return;
+    }
+    if (Queue.Size() >= CAPTURE_MAX_QUEUED) {
+      SpoqMetrics().CaptureDropped.Add();
+      return;
+    }
+    SEND_BUFFER* Block = SendBufferAlloc((uint32_t)(
+        sizeof(INGEST_ITEM) + CAPTURE_HEADER_MAX_LENGTH + Body.size()));
+    if (Block == nullptr) {
+      SpoqMetrics().CaptureDropped.Add();
+      return;
+    }
+    auto Item = new (Block->Buffer.Buffer) INGEST_ITEM;
+    Item->Block = Block;
+    uint8_t* Start = reinterpret_cast<uint8_t*>(Item + 1);
+    uint8_t* P = Start;
+    P += PutVarint(P, Connection);
+    P += PutVarint(P, Stream);
+    P += PutVarint(P, (uint64_t)Version << 2 | (uint64_t)Event);
+    P += PutVarint(P, SensorId);
+    P += PutVarint(P, Body.size());
+    if (!Body.empty()) {
+      memcpy(P, Body.data(), Body.size());
+    }
+    Item->Length = (uint32_t)(P - Start + Body.size());
+    Item->QueuedTime = MetricNow();
+    Queue.Push(Item);
+    if (Sleeping.load(std::memory_order_seq_cst)) {
+      Wake();
+    }
+  }
+
+  // Writes everything still queued and closes the file. Nothing may be
+  // recorded once it has been called.
+  void Close() {
+    if (!Active) {
+      return;
+    }
+    Stopping.store(true, std::memory_order_seq_cst);
+    Wake();
+    Writer.join();
+    Active = false;
+    if (fclose(File) != 0) {
+      SPOQ_LOG_ERROR("Capture not completed, errno {}", errno);
+    }
+    File = nullptr;
+    SPOQ_LOG_INFO("Captured {} records, {} dropped",
+                  SpoqMetrics().RecordsCaptured.Value(),
+                  SpoqMetrics().CaptureDropped.Value());
+  }
+
+ private:
+  void Wake() {
+    Signal.fetch_add(1, std::memory_order_seq_cst);
+    Signal.notify_one();
+  }
+
+  // Writes Item behind the time since the previous record. Records pushed
+  // concurrently may be stamped slightly out of order, so times are kept
+  // non-decreasing.
+  void Write(INGEST_ITEM* Item) {
+    const uint64_t Time =
+        Item->QueuedTime > LastTime ? Item->QueuedTime : LastTime;
+    uint8_t Delta[SPOQ_VARINT_MAX_LENGTH];
+    const size_t DeltaLength = PutVarint(Delta, Time - LastTime);
+    LastTime = Time;
+    if (!Failed && (fwrite(Delta, 1, DeltaLength, File) != DeltaLength ||
+                    fwrite(Item->Data().data(), 1, Item->Length, File) !=
+                        Item->Length)) {
+      SPOQ_LOG_ERROR("Capture write failed, errno {}; recording stopped",
+                     errno);
+      Failed = true;
+    }
+    (Failed ? SpoqMetrics().CaptureDropped : SpoqMetrics().RecordsCaptured)
+        .Add();
+    IngestItemFree(Item);
+  }
+
+  void Run() {
+    for (;;) {
+      INGEST_ITEM* Item;
+      bool Wrote = false;
+      while ((Item = Queue.Pop()) != nullptr) {
+        Write(Item);
+        Wrote = true;
+      }
+      if (Wrote) {
+        continue;
+      }
+      if (Queue.Size() != 0) {
+        // A push has claimed its place but not linked its item yet
+        std::this_thread::yield();
+        continue;
+      }
+      // Out of work, so hand what has been written to the kernel
+      fflush(File);
+      // Announce the sleep before the last look at the queue, as
+      // INGEST_POOL's workers do
+      const uint32_t Seen = Signal.load(std::memory_order_seq_cst);
+      Sleeping.store(true, std::memory_order_seq_cst);
+      if (Queue.Size() == 0) {
+        if (Stopping.load(std::memory_order_seq_cst)) {
+          Sleeping.store(false, std::memory_order_relaxed);
+          return;
+        }
+        Signal.wait(Seen, std::memory_order_seq_cst);
+      }
+      Sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  INGEST_QUEUE Queue;
+  alignas(64) std::atomic<uint32_t> Signal{0};
+  std::atomic<bool> Sleeping{false};
+  std::atomic<bool> Stopping{false};
+  std::atomic<uint64_t> NextConnection{1};
+  // Set before the first connection and cleared after the last
+  bool Active = false;
+  // Writer state
+  FILE* File = nullptr;
+  uint64_t LastTime = 0;
+  bool Failed = false;
+  std::thread Writer;
+};
+
+// Reads the records of a capture file in order
+class CAPTURE_READER {
+ public:
+  ~CAPTURE_READER() {
+    if (Base != nullptr) {
+      munmap(Base, Size);
+    }
+  }
+
+  // Maps the capture at Path. Returns false if it is not a capture file.
+  bool Open(const char* Path) {
+    int Fd = open(Path, O_RDONLY | O_CLOEXEC);
+    if (Fd < 0) {
+      SPOQ_LOG_ERROR("Capture {} not readable, errno {}", Path, errno);
+      return false;
+    }
+    struct stat Stat;
+    void* Mapping = MAP_FAILED;
+    if (fstat(Fd, &Stat) == 0 &&
+        (uint64_t)Stat.st_size >= sizeof(CAPTURE_FILE_HEADER)) {
+      Mapping = mmap(NULL, Stat.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    }
+    close(Fd);
+    if (Mapping == MAP_FAILED) {
+      SPOQ_LOG_ERROR("Capture {} not mapped", Path);
+      return false;
+    }
+    Base = static_cast<uint8_t*>(Mapping);
+    Size = Stat.st_size;
+    auto Header = reinterpret_cast<const CAPTURE_FILE_HEADER*>(Base);
+    if (memcmp(Header->Magic, CAPTURE_FILE_MAGIC, sizeof(Header->Magic)) !=
+        0) {
+      SPOQ_LOG_ERROR("{} is not a capture file", Path);
+      return false;
+    }
+    StartTime = Header->StartTime;
+    Next = Base + sizeof(CAPTURE_FILE_HEADER);
+    return true;
+  }
+
+  // Reads the next record into Record. Returns false at the end of the
+  // capture, or at a record cut short by the writer stopping abruptly.
+  bool Read(CAPTURE_RECORD* Record) {
+    const uint8_t* P = Next;
+    const uint8_t* End = Base + Size;
+    uint64_t Delta, Connection, Stream, Flags, SensorId, Length;
+    if (P == nullptr || !GetVarint(&P, End, &Delta) ||
+        !GetVarint(&P, End, &Connection) || !GetVarint(&P, End, &Stream) ||
+        !GetVarint(&P, End, &Flags) || !GetVarint(&P, End, &SensorId) ||
+        !GetVarint(&P, End, &Length) || Length > (uint64_t)(End - P) ||
+        Stream > UINT32_MAX || (Flags >> 2) > UINT32_MAX) {
+      Truncated = P != nullptr && Next != End;
+      return false;
+    }
+    Time += Delta;
+    Record->Time = Time;
+    Record->Connection = Connection;
+    Record->Stream = (uint32_t)Stream;
+    Record->Event = (CAPTURE_EVENT)(Flags & 3);
+    Record->Version = (uint32_t)(Flags >> 2);
+    Record->SensorId = SensorId;
+    Record->Body = std::string_view((const char*)P, Length);
+    Next = P + Length;
+    return true;
+  }
+
+  // ns since the epoch when the capture opened
+  uint64_t CaptureStartTime() const { return StartTime; }
+
+  // The capture ended in the middle of a record
+  bool IsTruncated() const { return Truncated; }
+
+ private:
+  uint8_t* Base = nullptr;
+  uint64_t Size = 0;
+  const uint8_t* Next = nullptr;
+  uint64_t StartTime = 0;
+  uint64_t Time = 0;
+  bool Truncated = false;
+};
@@ -0,0 +1,489 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "spoq_pdu.h"
+
+//
+// Columnar batches of readings (wire version 3).
+//
+// A sensor series is regular: sequence numbers and timestamps advance by
+// nearly the same step and values drift slowly, yet every version 2 PDU
+// repeats its field keys and full-width values. A batch PDU carries the data
+// of many readings that share one field layout, transposed into a column per
+// field:
+//
+//   varint reading count | varint column count | column keys | column bodies
+//
+// Keys are field keys as in version 2 (field id << 3 | wire type), and the
+// bodies follow in key order:
+//
+//   VARINT   the delta-of-delta of each value, zig-zag encoded, as varints.
+//            The deltas start from 0, so the first value is written whole
+//            and the second as a delta. A counter or a steady clock costs
+//            about a byte a reading.
+//   FIXED64  the XOR of each value's bits with the previous value's, as a
+//   FIXED32  varint token (XOR >> trailing zeros) << 6 | trailing zeros (<< 5
+//            for FIXED32), or 0 for a repeated value. An XOR of a double too
+//            wide for a token is written as token 1 and its 8 bytes.
+//   BYTES    the length of each value as varints, then the values back to
+//            back.
+//
+// A batch travels as the data of a binary PDU whose header version is 3, so
+// it is framed like any version 2 PDU. The column transforms and varint
+// packing run a whole column at a time, in loops the compiler can
+// vectorise.
+//
+
+// Most readings and columns in one batch
+constexpr uint32_t COLUMNAR_MAX_READINGS = 4096;
+constexpr uint32_t COLUMNAR_MAX_COLUMNS = 16;
+
+namespace columnar_detail {
+
+inline uint64_t ZigZag(uint64_t Value) {
+  return (Value << 1) ^ (uint64_t)((int64_t)Value >> 63);
+}
+
+inline uint64_t UnZigZag(uint64_t Value) {
+  return (Value >> 1) ^ (0 - (Value & 1));
+}
+
+// Integrates unzig-zagged deltas-of-deltas in place
+inline void Integrate(uint64_t* Values, size_t Count) {
+  uint64_t Value = Count == 0 ? 0 : Values[0];
+  uint64_t Delta = 0;
+  for (size_t i = 1; i < Count; ++i) {
+    Delta += Values[i];
+    Value += Delta;
+    Values[i] = Value;
+  }
+}
+
+// Out[i] is the zig-zag delta-of-delta of In[i]
+inline void DeltaEncode(const uint64_t* In, size_t Count, uint64_t* Out) {
+  for (size_t i = 0; i < Count; ++i) {
+    const uint64_t Delta = i == 0 ? In[0] : In[i] - In[i - 1];
+    const uint64_t Previous = i < 2 ? 0 : In[i - 1] - In[i - 2];
+    Out[i] = ZigZag(Delta - Previous);
+  }
+}
+
+// Inverse of DeltaEncode. In and Out may be the same array.
+inline void DeltaDecode(const uint64_t* In, size_t Count, uint64_t* Out) {
+  for (size_t i = 0; i < Count; ++i) {
+    Out[i] = UnZigZag(In[i]);
+  }
+  Integrate(Out, Count);
+}
+
+// Out[i] is In[i] ^ In[i - 1], with Out[0] = In[0]
+inline void XorEncode(const uint64_t* In, size_t Count, uint64_t* Out) {
+  uint64_t Previous = 0;
+  for (size_t i = 0; i < Count; ++i) {
+    Out[i] = In[i] ^ Previous;
+    Previous = In[i];
+  }
+}
+
+// Writes Count varints to Out, which needs room for SPOQ_VARINT_MAX_LENGTH
+// bytes a value, and returns the bytes written
+inline size_t PutVarints(const uint64_t* In, size_t Count, uint8_t* Out) {
+  uint8_t* P = Out;
+  for (size_t i = 0; i < Count; ++i) {
+    P += PutVarint(P, In[i]);
+  }
+  return P - Out;
+}
+
+// Reads Count varints from [P, End) and returns the end of the last, or
+// nullptr on truncated or malformed input. Widens eight single-byte
+// varints at a time.
+inline const uint8_t* GetVarints(const uint8_t* P, const uint8_t* End,
+                                 size_t Count, uint64_t* Out) {
+  size_t i = 0;
+  while (i < Count) {
+    if (Count - i >= 8 && End - P >= 8) {
+      uint64_t Word;
+      memcpy(&Word, P, sizeof(Word));
+      if ((Word & 0x8080808080808080ull) == 0) {
+        for (size_t k = 0; k < 8; ++k) {
+          Out[i + k] = P[k];
+        }
+        P += 8;
+        i += 8;
+        continue;
+      }
+    }
+    if (!GetVarint(&P, End, Out + i)) {
+      return nullptr;
+    }
+    ++i;
+  }
+  return P;
+}
+
+// Writes the XOR of a FIXED value with the previous one as a token, using
+// ShiftBits bits for its trailing zero count
+inline uint8_t* PutXor(uint8_t* P, uint64_t Xor, unsigned ShiftBits) {
+  if (Xor == 0) {
+    *P = 0;
+    return P + 1;
+  }
+  const unsigned Zeros = (unsigned)__builtin_ctzll(Xor);
+  const uint64_t Significant = Xor >> Zeros;
+  if ((Significant >> (64 - ShiftBits)) != 0) {
+    *P = 1;
+    memcpy(P + 1, &Xor, sizeof(Xor));
+    return P + 1 + sizeof(Xor);
+  }
+  return P + PutVarint(P, Significant << ShiftBits | Zeros);
+}
+
+// Reads a token written by PutXor. Fails on truncated input and on the
+// tokens that are never written.
+inline bool GetXor(const uint8_t** P, const uint8_t* End, unsigned ShiftBits,
+                   uint64_t* Xor) {
+  uint64_t Token = 0;
+  if (!GetVarint(P, End, &Token)) {
+    return false;
+  }
+  if (Token == 1 && ShiftBits == 6) {
+    if (End - *P < 8) {
+      return false;
+    }
+    memcpy(Xor, *P, sizeof(*Xor));
+    *P += sizeof(*Xor);
+    return true;
+  }
+  if (Token != 0 && Token < (1ull << ShiftBits)) {
+    return false;
+  }
+  *Xor = (Token >> ShiftBits) << (Token & ((1u << ShiftBits) - 1));
+  return true;
+}
+
+}  // namespace columnar_detail
+
+// Gathers readings into a batch and encodes it, or decodes a batch and
+// hands its readings back one at a time as version 2 data fields. Buffers
+// are kept between batches, so a batch reused on one thread does not
+// allocate once it has seen its largest batch.
+class COLUMNAR_BATCH {
+ public:
+  uint32_t Count() const { return Readings; }
+
+  void Clear() {
+    Readings = 0;
+    ColumnCount = 0;
+  }
+
+  // Appends the data fields of one binary reading. Fails, leaving the batch
+  // as it was, if they are malformed, if the batch is full, or if their
+  // layout differs from that of the readings already in the batch; the
+  // caller then sends the batch and adds the reading to a new one.
+  bool Add(std::string_view Data) {
+    if (Readings == COLUMNAR_MAX_READINGS) {
+      return false;
+    }
+    if (Readings == 0) {
+      ColumnCount = 0;
+    }
+    const uint8_t* P = (const uint8_t*)Data.data();
+    const uint8_t* End = P + Data.size();
+    uint32_t c = 0;
+    bool Ok = true;
+    // Fields go straight into their columns, and are taken out again if a
+    // later one does not fit
+    for (; Ok && P != End; ++c) {
+      uint64_t Key = 0;
+      if (c == COLUMNAR_MAX_COLUMNS || !GetVarint(&P, End, &Key) ||
+          (Key >> 3) > UINT32_MAX ||
+          (Readings != 0 && (c >= ColumnCount || Columns[c].Key != Key))) {
+        Ok = false;
+        break;
+      }
+      if (Readings == 0) {
+        Reset(c + 1);
+        Columns[c].Key = Key;
+      }
+      COLUMN& Column = Columns[c];
+      uint64_t Value = 0;
+      switch (TypeOf(Key)) {
+        case SPOQ_WIRE_TYPE::VARINT:
+          Ok = GetVarint(&P, End, &Value);
+          break;
+        case SPOQ_WIRE_TYPE::FIXED64:
+          if ((Ok = End - P >= 8)) {
+            memcpy(&Value, P, 8);
+            P += 8;
+          }
+          break;
+        case SPOQ_WIRE_TYPE::FIXED32:
+          if ((Ok = End - P >= 4)) {
+            uint32_t Bits;
+            memcpy(&Bits, P, 4);
+            Value = Bits;
+            P += 4;
+          }
+          break;
+        case SPOQ_WIRE_TYPE::BYTES: {
+          uint64_t Length = 0;
+          if ((Ok = GetVarint(&P, End, &Length) &&
+                    Length <= (uint64_t)(End - P))) {
+            Column.Bytes.append((const char*)P, Length);
+            P += Length;
+            Value = Column.Bytes.size();
+          }
+          break;
+        }
+        default:
+          Ok = false;
+          break;
+      }
+      if (Ok) {
+        Column.Values.push_back(Value);
+      }
+    }
+    if (!Ok || (Readings != 0 && c != ColumnCount)) {
+      for (uint32_t k = 0; Readings != 0 && k <= c && k < ColumnCount; ++k) {
+        COLUMN& Column = Columns[k];
+        Column.Values.resize(Readings);
+        Column.Bytes.resize(TypeOf(Column.Key) == SPOQ_WIRE_TYPE::BYTES
+                                ? Column.Values[Readings - 1]
+                                : 0);
+      }
+      if (Readings == 0) {
+        ColumnCount = 0;
+      }
+      return false;
+    }
+    if (Readings == 0) {
+      ColumnCount = c;
+    }
+    ++Readings;
+    return true;
+  }
+
+  // Encodes the batch. The view is valid until the batch next changes.
+  std::string_view Encode() {
+    using namespace columnar_detail;
+    size_t Bound = (2 + ColumnCount) * SPOQ_VARINT_MAX_LENGTH;
+    for (uint32_t c = 0; c < ColumnCount; ++c) {
+      Bound += Readings * SPOQ_VARINT_MAX_LENGTH + Columns[c].Bytes.size();
+    }
+    Encoded.resize(Bound);
+    Scratch.resize(Readings);
+    uint8_t* const Start = (uint8_t*)Encoded.data();
+    uint8_t* P = Start;
+    P += PutVarint(P, Readings);
+    P += PutVarint(P, ColumnCount);
+    for (uint32_t c = 0; c < ColumnCount; ++c) {
+      P += PutVarint(P, Columns[c].Key);
+    }
+
+    uint64_t* const Work = Scratch.data();
+    for (uint32_t c = 0; c < ColumnCount; ++c) {
+      const COLUMN& Column = Columns[c];
+      const uint64_t* Values = Column.Values.data();
+      switch (TypeOf(Column.Key)) {
+        case SPOQ_WIRE_TYPE::VARINT:
+          DeltaEncode(Values, Readings, Work);
+          P += PutVarints(Work, Readings, P);
+          break;
+        case SPOQ_WIRE_TYPE::FIXED64:
+        case SPOQ_WIRE_TYPE::FIXED32: {
+          const unsigned ShiftBits =
+              TypeOf(Column.Key) == SPOQ_WIRE_TYPE::FIXED64 ? 6 : 5;
+          XorEncode(Values, Readings, Work);
+          for (uint32_t i = 0; i < Readings; ++i) {
+            P = PutXor(P, Work[i], ShiftBits);
+          }
+          break;
+        }
+        default:
+          for (uint32_t i = 0; i < Readings; ++i) {
+            Work[i] = Values[i] - (i == 0 ? 0 : Values[i - 1]);
+          }
+          P += PutVarints(Work, Readings, P);
+          memcpy(P, Column.Bytes.data(), Column.Bytes.size());
+          P += Column.Bytes.size();
+          break;
+      }
+    }
+    return std::string_view(Encoded.data(), P - Start);
+  }
+
+  // Replaces the batch with the one encoded in Data. Fails, leaving the
+  // batch empty, on malformed input.
+  bool Decode(std::string_view Data) {
+    Clear();
+    if (!Parse(Data)) {
+      Clear();
+      return false;
+    }
+    return true;
+  }
+
+  // Writes the data fields of reading Index, as a version 2 PDU carries
+  // them. The view is valid until the next call.
+  std::string_view Reading(uint32_t Index) {
+    size_t Bound = 0;
+    for (uint32_t c = 0; c < ColumnCount; ++c) {
+      Bound += 2 * SPOQ_VARINT_MAX_LENGTH + 8 + Length(Columns[c], Index);
+    }
+    if (Written.size() < Bound) {
+      Written.resize(Bound);
+    }
+    SPOQ_FIELD_WRITER Writer(Written.data(), Written.size());
+    for (uint32_t c = 0; c < ColumnCount; ++c) {
+      const COLUMN& Column = Columns[c];
+      const uint32_t Id = (uint32_t)(Column.Key >> 3);
+      const uint64_t Value = Column.Values[Index];
+      switch (TypeOf(Column.Key)) {
+        case SPOQ_WIRE_TYPE::VARINT:
+          Writer.Uint(Id, Value);
+          break;
+        case SPOQ_WIRE_TYPE::FIXED64:
+          Writer.Double(Id, std::bit_cast<double>(Value));
+          break;
+        case SPOQ_WIRE_TYPE::FIXED32:
+          Writer.Float(Id, std::bit_cast<float>((uint32_t)Value));
+          break;
+        default: {
+          const uint64_t Size = Length(Column, Index);
+          Writer.Bytes(Id, std::string_view(Column.Bytes.data() + Value - Size,
+                                            Size));
+          break;
+        }
+      }
+    }
+    return Writer.Data();
+  }
+
+ private:
+  struct COLUMN {
+    uint64_t Key = 0;
+    // VARINT values, FIXED bit patterns, or for BYTES the end of each value
+    // in Bytes
+    std::vector<uint64_t> Values;
+    std::string Bytes;
+  };
+
+  static SPOQ_WIRE_TYPE TypeOf(uint64_t Key) {
+    return (SPOQ_WIRE_TYPE)(Key & 7);
+  }
+
+  // Length of reading Index's value in a BYTES column, 0 for the others
+  static uint64_t Length(const COLUMN& Column, uint32_t Index) {
+    if (TypeOf(Column.Key) != SPOQ_WIRE_TYPE::BYTES) {
+      return 0;
+    }
+    return Column.Values[Index] - (Index == 0 ? 0 : Column.Values[Index - 1]);
+  }
+
+  // Decodes Data into the cleared batch
+  bool Parse(std::string_view Data) {
+    using namespace columnar_detail;
+    const uint8_t* P = (const uint8_t*)Data.data();
+    const uint8_t* End = P + Data.size();
+    uint64_t Count = 0;
+    uint64_t Keys = 0;
+    if (!GetVarint(&P, End, &Count) || !GetVarint(&P, End, &Keys) ||
+        Count == 0 || Count > COLUMNAR_MAX_READINGS ||
+        Keys > COLUMNAR_MAX_COLUMNS) {
+      return false;
+    }
+    Reset((uint32_t)Keys);
+    for (uint32_t c = 0; c < Keys; ++c) {
+      uint64_t Key = 0;
+      if (!GetVarint(&P, End, &Key) || (Key >> 3) > UINT32_MAX) {
+        return false;
+      }
+      const SPOQ_WIRE_TYPE Type = TypeOf(Key);
+      if (Type != SPOQ_WIRE_TYPE::VARINT && Type != SPOQ_WIRE_TYPE::FIXED64 &&
+          Type != SPOQ_WIRE_TYPE::FIXED32 && Type != SPOQ_WIRE_TYPE::BYTES) {
+        return false;
+      }
+      Columns[c].Key = Key;
+    }
+
+    for (uint32_t c = 0; c < Keys; ++c) {
+      COLUMN& Column = Columns[c];
+      Column.Values.resize(Count);
+      uint64_t* Values = Column.Values.data();
+      switch (TypeOf(Column.Key)) {
+        case SPOQ_WIRE_TYPE::VARINT:
+          if ((P = GetVarints(P, End, Count, Values)) == nullptr) {
+            return false;
+          }
+          DeltaDecode(Values, Count, Values);
+          break;
+        case SPOQ_WIRE_TYPE::FIXED64:
+        case SPOQ_WIRE_TYPE::FIXED32: {
+          const unsigned ShiftBits =
+              TypeOf(Column.Key) == SPOQ_WIRE_TYPE::FIXED64 ? 6 : 5;
+          uint64_t Value = 0;
+          for (uint64_t i = 0; i < Count; ++i) {
+            uint64_t Xor = 0;
+            if (!GetXor(&P, End, ShiftBits, &Xor)) {
+              return false;
+            }
+            Value ^= Xor;
+            if (ShiftBits == 5 && Value > UINT32_MAX) {
+              return false;
+            }
+            Values[i] = Value;
+          }
+          break;
+        }
+        default: {
+          if ((P = GetVarints(P, End, Count, Values)) == nullptr) {
+            return false;
+          }
+          uint64_t Total = 0;
+          for (uint64_t i = 0; i < Count; ++i) {
+            if (Values[i] > (uint64_t)(End - P) - Total) {
+              return false;
+            }
+            Total += Values[i];
+            Values[i] = Total;
+          }
+          Column.Bytes.assign((const char*)P, Total);
+          P += Total;
+          break;
+        }
+      }
+    }
+    if (P != End) {
+      return false;
+    }
+    Readings = (uint32_t)Count;
+    return true;
+  }
+
+  // Grows the batch to Count columns, the new ones empty
+  void Reset(uint32_t Count) {
+    if (Columns.size() < Count) {
+      Columns.resize(Count);
+    }
+    for (uint32_t c = ColumnCount; c < Count; ++c) {
+      Columns[c].Values.clear();
+      Columns[c].Bytes.clear();
+    }
+    ColumnCount = Count;
+  }
+
+  uint32_t Readings = 0;
+  uint32_t ColumnCount = 0;
+  std::vector<COLUMN> Columns;
+  std::vector<uint64_t> Scratch;
+  std::string Encoded;
+  std::string Written;
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "msquic.h"
+#include "quic_config.h"
+#include "send_pool.h"
+#include "spoq_log.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+#include "spoq_session.h"
+
+//
+// Publish/subscribe fan-out of ingested readings.
+//
+// A client subscribes to up to SPOQ_MAX_SUBSCRIPTIONS sensor ids when it
+// negotiates, and from then on its control stream carries every reading the
+// server ingests from those sensors rather than generated data. Publish
+// frames a reading once, in the wire version it arrived in, into a single
+// pooled send buffer. Every subscriber's StreamSend takes a share of that
+// buffer, so there is no copy or re-encode per subscriber, and the buffer
+// returns to its pool with the last subscriber's SEND_COMPLETE.
+//
+// Publish never waits for a subscriber. One whose send window is full has
+// fallen behind and misses the reading, which would be stale by the time it
+// could be sent, so a slow subscriber never holds up the others or the
+// ingest path. A subscriber whose wire version cannot carry the reading
+// unchanged, an NDJSON session for a binary reading or the reverse, misses
+// it too. Both are counted.
+//
+// Subscribers are kept under a reader-writer lock. Publish holds it shared
+// while it sends, and Unsubscribe takes it exclusively, so once Unsubscribe
+// returns no publisher is using the stream and it can be closed.
+//
+
+class FANOUT_BROKER {
+ public:
+  // Sends the readings of each of Sensors on Channel from now on
+  void Subscribe(_In_ SPOQ_STREAM* Channel,
+                 std::span<const uint64_t> Sensors) {
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    for (uint64_t SensorId : Sensors) {
+      std::vector<SPOQ_STREAM*>& Channels = Subscribers[SensorId];
+      if (std::find(Channels.begin(), Channels.end(), Channel) ==
+          Channels.end()) {
+        Channels.push_back(Channel);
+        ++Subscriptions;
+      }
+    }
+  }
+
+  // Stops sending the readings of Sensors on Channel
+  void Unsubscribe(_In_ SPOQ_STREAM* Channel,
+                   std::span<const uint64_t> Sensors) {
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    for (uint64_t SensorId : Sensors) {
+      auto It = Subscribers.find(SensorId);
+      if (It == Subscribers.end()) {
+        continue;
+      }
+      std::vector<SPOQ_STREAM*>& Channels = It->second;
+      auto Found = std::find(Channels.begin(), Channels.end(), Channel);
+      if (Found != Channels.end()) {
+        Channels.erase(Found);
+        --Subscriptions;
+      }
+      if (Channels.empty()) {
+        Subscribers.erase(It);
+      }
+    }
+  }
+
+  // Sends one reading of SensorId, encoded in wire version Version (a line
+  // without its newline, or a binary PDU body), to every subscriber of the
+  // sensor. Returns the number of subscribers it was sent to.
+  uint32_t Publish(uint64_t SensorId, uint32_t Version,
+                   std::string_view Reading) {
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    auto It = Subscribers.find(SensorId);
+    if (It == Subscribers.end()) {
+      return 0;
+    }
+    SEND_BUFFER* Frame = nullptr;
+    uint32_t Sent = 0;
+    for (SPOQ_STREAM* Channel : It->second) {
+      if (!Carries(Channel->Session->Version, Version)) {
+        SpoqMetrics().ForwardsSkipped.Add();
+        continue;
+      }
+      if (Frame == nullptr && (Frame = Encode(Version, Reading)) == nullptr) {
+        SPOQ_LOG_ERROR("Send buffer unavailable, reading from sensor {} not "
+                       "forwarded", SensorId);
+        SpoqMetrics().ForwardsDropped.Add();
+        return 0;
+      }
+      const uint32_t Length = Frame->Buffer.Length;
+      if (!Channel->Window.TrySend(Length)) {
+        SpoqMetrics().ForwardsDropped.Add();
+        continue;
+      }
+      SendBufferShare(Frame);
+      QUIC_STATUS Status = MsQuic->StreamSend(
+          Channel->Stream, &Frame->Buffer, 1, QUIC_SEND_FLAG_NONE, Frame);
+      if (QUIC_FAILED(Status)) {
+        SPOQ_LOG_WARN("[{}] Reading from sensor {} not forwarded, {}",
+                      Channel->Stream, SensorId, Status);
+        Channel->Window.Completed(Length);
+        SendBufferFree(Frame);
+        SpoqMetrics().ForwardsDropped.Add();
+        continue;
+      }
+      ++Sent;
+    }
+    if (Frame != nullptr) {
+      SpoqMetrics().ReadingsForwarded.Add(Sent);
+      SpoqMetrics().MessagesSent.Add(Sent);
+      SpoqMetrics().BytesSent.Add((uint64_t)Sent * Frame->Buffer.Length);
+      // Let go of the publisher's own share
+      SendBufferFree(Frame);
+    }
+    return Sent;
+  }
+
+  // Subscriptions of all streams together
+  uint64_t SubscriptionCount() const {
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    return Subscriptions;
+  }
+
+ private:
+  // True if a session of wire version Session receives readings encoded in
+  // Version unchanged. Binary sessions take any PDU up to their version.
+  static bool Carries(uint32_t Session, uint32_t Version) {
+    return Version == SPOQ_VERSION_NDJSON ? Session == SPOQ_VERSION_NDJSON
+                                          : Session >= Version;
+  }
+
+  // Frames Reading as it goes on the wire in a buffer to be shared
+  static SEND_BUFFER* Encode(uint32_t Version, std::string_view Reading) {
+    const bool Line = Version == SPOQ_VERSION_NDJSON;
+    const size_t Length =
+        Reading.size() + (Line ? 1 : VarintLength(Reading.size()));
+    SEND_BUFFER* Frame = SendBufferAlloc((uint32_t)Length);
+    if (Frame == nullptr) {
+      return nullptr;
+    }
+    uint8_t* Out = Frame->Buffer.Buffer;
+    if (!Line) {
+      Out += PutVarint(Out, Reading.size());
+    }
+    memcpy(Out, Reading.data(), Reading.size());
+    if (Line) {
+      Out[Reading.size()] = '\n';
+    }
+    Frame->Buffer.Length = (uint32_t)Length;
+    Frame->SendTime = MetricNow();
+    return Frame;
+  }
+
+  mutable std::shared_mutex Lock;
+  std::unordered_map<uint64_t, std::vector<SPOQ_STREAM*>> Subscribers;
+  uint64_t Subscriptions = 0;
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPOQ_SCAN_X86 1
+#endif
+
+//
+// Vectorized frame boundary scanning.
+//
+// FrameScan reports the offsets of every delimiter byte in a buffer in a
+// single pass, 16 (SSE2) or 32 (AVX2) bytes per compare. The implementation is
+// picked once at runtime from the CPU's features, with a portable 8-byte SWAR
+// fallback for other architectures.
+//
+
+enum class FRAME_SCAN_ISA { PORTABLE, SSE2, AVX2 };
+
+inline const char* ToString(FRAME_SCAN_ISA Isa) {
+  switch (Isa) {
+    case FRAME_SCAN_ISA::AVX2:
+      return "avx2";
+    case FRAME_SCAN_ISA::SSE2:
+      return "sse2";
+    default:
+      return "portable";
+  }
+}
+
+// Writes the offsets of Delimiter within Data[0, Length) to Offsets, stopping
+// early if Capacity offsets have been found. Returns the number of offsets
+// written. *Scanned is set to how many bytes were fully examined, so a caller
+// whose Offsets filled up resumes from there. Capacity must be non-zero.
+typedef size_t (*FRAME_SCAN_FN)(const char* Data, size_t Length,
+                                char Delimiter, uint32_t* Offsets,
+                                size_t Capacity, size_t* Scanned);
+
+namespace frame_scan_detail {
+
+// Emits the set bits of Mask (bit i = byte Base + i) until Offsets fills.
+// Returns false if it stopped early, leaving *Scanned after the last offset.
+inline bool EmitMask(uint64_t Mask, size_t Base, uint32_t* Offsets,
+                     size_t Capacity, size_t* Count, size_t* Scanned) {
+  while (Mask != 0) {
+    if (*Count == Capacity) {
+      *Scanned = Offsets[*Count - 1] + 1;
+      return false;
+    }
+    Offsets[(*Count)++] = (uint32_t)(Base + __builtin_ctzll(Mask));
+    Mask &= Mask - 1;
+  }
+  return true;
+}
+
+inline size_t ScanTail(const char* Data, size_t Start, size_t Length,
+                       char Delimiter, uint32_t* Offsets, size_t Capacity,
+                       size_t Count, size_t* Scanned) {
+  for (size_t i = Start; i < Length; ++i) {
+    if (Data[i] == Delimiter) {
+      if (Count == Capacity) {
+        *Scanned = Offsets[Count - 1] + 1;
+        return Count;
+      }
+      Offsets[Count++] = (uint32_t)i;
+    }
+  }
+  *Scanned = Length;
+  return Count;
+}
+
+// SWAR: flags each byte equal to Delimiter in a 64-bit word
+inline size_t ScanPortable(const char* Data, size_t Length, char Delimiter,
+                           uint32_t* Offsets, size_t Capacity,
+                           size_t* Scanned) {
+  constexpr uint64_t Ones = 0x0101010101010101ull;
+  constexpr uint64_t Highs = 0x8080808080808080ull;
+  const uint64_t Pattern = Ones * (uint8_t)Delimiter;
+  size_t Count = 0;
+  size_t i = 0;
+  for (; i + 8 <= Length; i += 8) {
+    uint64_t Word;
+    memcpy(&Word, Data + i, sizeof(Word));
+    Word ^= Pattern;
+    // Exact zero-byte test (no false positives from borrows)
+    uint64_t Zero = ~(((Word & ~Highs) + ~Highs) | Word) & Highs;
+    if (Zero == 0) {
+      continue;
+    }
+    // Compress one flag per byte down to one bit per byte
+    uint64_t Mask = 0;
+    while (Zero != 0) {
+      Mask |= 1ull << (__builtin_ctzll(Zero) >> 3);
+      Zero &= Zero - 1;
+    }
+    if (!EmitMask(Mask, i, Offsets, Capacity, &Count, Scanned)) {
+      return Count;
+    }
+  }
+  return ScanTail(Data, i, Length, Delimiter, Offsets, Capacity, Count,
+                  Scanned);
+}
+
+#ifdef SPOQ_SCAN_X86
+__attribute__((target("sse2"))) inline size_t ScanSse2(
+    const char* Data, size_t Length, char Delimiter, uint32_t* Offsets,
+    size_t Capacity, size_t* Scanned) {
+  const __m128i Pattern = _mm_set1_epi8(Delimiter);
+  size_t Count = 0;
+  size_t i = 0;
+  // Four vectors per iteration; blocks without a delimiter cost one test
+  for (; i + 64 <= Length; i += 64) {
+    auto Block = reinterpret_cast<const __m128i*>(Data + i);
+    __m128i Eq0 = _mm_cmpeq_epi8(_mm_loadu_si128(Block + 0), Pattern);
+    __m128i Eq1 = _mm_cmpeq_epi8(_mm_loadu_si128(Block + 1), Pattern);
+    __m128i Eq2 = _mm_cmpeq_epi8(_mm_loadu_si128(Block + 2), Pattern);
+    __m128i Eq3 = _mm_cmpeq_epi8(_mm_loadu_si128(Block + 3), Pattern);
+    __m128i Any =
+        _mm_or_si128(_mm_or_si128(Eq0, Eq1), _mm_or_si128(Eq2, Eq3));
+    if (_mm_movemask_epi8(Any) == 0) {
+      continue;
+    }
+    uint64_t Mask = (uint64_t)(uint16_t)_mm_movemask_epi8(Eq0) |
+                    (uint64_t)(uint16_t)_mm_movemask_epi8(Eq1) << 16 |
+                    (uint64_t)(uint16_t)_mm_movemask_epi8(Eq2) << 32 |
+                    (uint64_t)(uint16_t)_mm_movemask_epi8(Eq3) << 48;
+    if (!EmitMask(Mask, i, Offsets, Capacity, &Count, Scanned)) {
+      return Count;
+    }
+  }
+  for (; i + 16 <= Length; i += 16) {
+    __m128i Block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + i));
+    uint32_t Mask =
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(Block, Pattern));
+    if (Mask != 0 &&
+        !EmitMask(Mask, i, Offsets, Capacity, &Count, Scanned)) {
+      return Count;
+    }
+  }
+  return ScanTail(Data, i, Length, Delimiter, Offsets, Capacity, Count,
+                  Scanned);
+}
+
+__attribute__((target("avx2"))) inline size_t ScanAvx2(
+    const char* Data, size_t Length, char Delimiter, uint32_t* Offsets,
+    size_t Capacity, size_t* Scanned) {
+  const __m256i Pattern = _mm256_set1_epi8(Delimiter);
+  size_t Count = 0;
+  size_t i = 0;
+  // Four vectors per iteration; blocks without a delimiter cost one test
+  for (; i + 128 <= Length; i += 128) {
+    auto Block = reinterpret_cast<const __m256i*>(Data + i);
+    __m256i Eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(Block + 0), Pattern);
+    __m256i Eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(Block + 1), Pattern);
+    __m256i Eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256(Block + 2), Pattern);
+    __m256i Eq3 = _mm256_cmpeq_epi8(_mm256_loadu_si256(Block + 3), Pattern);
+    __m256i Any = _mm256_or_si256(_mm256_or_si256(Eq0, Eq1),
+                                  _mm256_or_si256(Eq2, Eq3));
+    if (_mm256_testz_si256(Any, Any)) {
+      continue;
+    }
+    uint64_t Lo = (uint64_t)(uint32_t)_mm256_movemask_epi8(Eq0) |
+                  (uint64_t)(uint32_t)_mm256_movemask_epi8(Eq1) << 32;
+    uint64_t Hi = (uint64_t)(uint32_t)_mm256_movemask_epi8(Eq2) |
+                  (uint64_t)(uint32_t)_mm256_movemask_epi8(Eq3) << 32;
+    if (!EmitMask(Lo, i, Offsets, Capacity, &Count, Scanned) ||
+        !EmitMask(Hi, i + 64, Offsets, Capacity, &Count, Scanned)) {
+      return Count;
+    }
+  }
+  for (; i + 32 <= Length; i += 32) {
+    __m256i Block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Data + i));
+    uint32_t Mask =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(Block, Pattern));
+    if (Mask != 0 &&
+        !EmitMask(Mask, i, Offsets, Capacity, &Count, Scanned)) {
+      return Count;
+    }
+  }
+  return ScanTail(Data, i, Length, Delimiter, Offsets, Capacity, Count,
+                  Scanned);
+}
+#endif
+
+inline FRAME_SCAN_ISA DetectIsa() {
+#ifdef SPOQ_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return FRAME_SCAN_ISA::AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return FRAME_SCAN_ISA::SSE2;
+  }
+#endif
+  return FRAME_SCAN_ISA::PORTABLE;
+}
+
+}  // namespace frame_scan_detail
+
+// Returns the scanner for a specific instruction set. Callers must only ask
+// for one the CPU supports; see FrameScanIsa.
+inline FRAME_SCAN_FN FrameScanFor(FRAME_SCAN_ISA Isa) {
+#ifdef SPOQ_SCAN_X86
+  if (Isa == FRAME_SCAN_ISA::AVX2) {
+    return frame_scan_detail::ScanAvx2;
+  }
+  if (Isa == FRAME_SCAN_ISA::SSE2) {
+    return frame_scan_detail::ScanSse2;
+  }
+#endif
+  return frame_scan_detail::ScanPortable;
+}
+
+// The best instruction set available on this CPU, detected once
+inline FRAME_SCAN_ISA FrameScanIsa() {
+  static const FRAME_SCAN_ISA Isa = frame_scan_detail::DetectIsa();
+  return Isa;
+}
+
+// Scans with the best implementation for this CPU
+inline size_t FrameScan(const char* Data, size_t Length, char Delimiter,
+                        uint32_t* Offsets, size_t Capacity, size_t* Scanned) {
+  static const FRAME_SCAN_FN Scan = FrameScanFor(FrameScanIsa());
+  return Scan(Data, Length, Delimiter, Offsets, Capacity, Scanned);
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "msquic.h"
+#include "numa_placement.h"
+#include "quic_config.h"
+#include "send_pool.h"
+#include "spoq_metrics.h"
+
+//
+// Hand-off of received readings from msquic callbacks to application workers.
+//
+// A stream callback only frames the bytes it receives. Each complete reading
+// is copied into an INGEST_ITEM and pushed onto one of the pool's queues, and
+// the callback returns to msquic. Decoding and storing the reading happen on
+// an INGEST_POOL worker, so slow processing never stalls the QUIC datapath of
+// the other connections on the same msquic partition.
+//
+// Each worker drains its own INGEST_QUEUE, an intrusive multi-producer
+// single-consumer queue (Dmitry Vyukov's): a push is one atomic exchange and
+// one store, and never waits for another producer or the consumer. A
+// connection pushes to one queue at a time, chosen from its msquic partition,
+// so its readings are processed in order and by one worker at a time. Workers
+// take up to INGEST_BATCH_SIZE items per pass and sleep on an atomic wait
+// when their queue is empty.
+//
+// On a multi-node host worker i runs on NUMA node i % nodes, and QueueFor
+// picks a queue whose worker is on the connection's node.
+//
+// Items are carved from the calling thread's send pool, so the callback does
+// not take a heap lock either. The worker returns them through the pool's
+// remote free list.
+//
+
+// Items a worker processes before checking whether it should stop
+constexpr uint32_t INGEST_BATCH_SIZE = 64;
+
+// Most workers, and so queues, in a pool
+constexpr uint32_t INGEST_MAX_WORKERS = 64;
+
+// One reading waiting to be processed. The reading's bytes follow the item.
+struct INGEST_ITEM {
+  std::atomic<INGEST_ITEM*> Next{nullptr};
+  SEND_BUFFER* Block = nullptr;  // The pooled buffer holding the item
+  void* Context = nullptr;       // Owner of the reading, e.g. its session
+  HQUIC Stream = nullptr;        // Stream it arrived on, for logging
+  uint64_t QueuedTime = 0;       // MetricNow() when pushed
+  uint32_t Version = 0;          // Wire version the reading is encoded in
+  uint32_t Length = 0;
+
+  std::string_view Data() const {
+    return std::string_view(reinterpret_cast<const char*>(this + 1), Length);
+  }
+};
+
+// Copies Data into a new item, or returns nullptr if no buffer is free
+inline INGEST_ITEM* IngestItemAlloc(std::string_view Data) {
+  SEND_BUFFER* Block =
+      SendBufferAlloc((uint32_t)(sizeof(INGEST_ITEM) + Data.size()));
+  if (Block == nullptr) {
+    return nullptr;
+  }
+  auto Item = new (Block->Buffer.Buffer) INGEST_ITEM;
+  Item->Block = Block;
+  Item->Length = (uint32_t)Data.size();
+  memcpy(reinterpret_cast<char*>(Item + 1), Data.data(), Data.size());
+  return Item;
+}
+
+// Returns an item to the pool of the thread that allocated it
+inline void IngestItemFree(INGEST_ITEM* Item) {
+  SEND_BUFFER* Block = Item->Block;
+  Item->~INGEST_ITEM();
+  SendBufferFree(Block);
+}
+
+class INGEST_QUEUE {
+ public:
+  INGEST_QUEUE() : Head(&Stub), Tail(&Stub) {}
+
+  // Appends Item. Safe to call from any number of threads at once.
+  void Push(INGEST_ITEM* Item) {
+    Depth.fetch_add(1, std::memory_order_seq_cst);
+    Pushed.Add();
+    Link(Item);
+  }
+
+  // Takes the oldest item, or returns nullptr if there is none or the newest
+  // push has not linked its item yet. Only the queue's worker may call it.
+  INGEST_ITEM* Pop() {
+    INGEST_ITEM* First = Tail;
+    INGEST_ITEM* Next = First->Next.load(std::memory_order_acquire);
+    if (First == &Stub) {
+      if (Next == nullptr) {
+        return nullptr;
+      }
+      Tail = Next;
+      First = Next;
+      Next = Next->Next.load(std::memory_order_acquire);
+    }
+    if (Next == nullptr) {
+      if (First != Head.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      // First is the last item, so the stub goes behind it before it leaves
+      Link(&Stub);
+      Next = First->Next.load(std::memory_order_acquire);
+      if (Next == nullptr) {
+        return nullptr;
+      }
+    }
+    Tail = Next;
+    Depth.fetch_sub(1, std::memory_order_relaxed);
+    return First;
+  }
+
+  // Items pushed and not yet popped, including any still being linked
+  int64_t Size() const { return Depth.load(std::memory_order_seq_cst); }
+
+  uint64_t PushedCount() const { return Pushed.Value(); }
+
+ private:
+  void Link(INGEST_ITEM* Item) {
+    Item->Next.store(nullptr, std::memory_order_relaxed);
+    INGEST_ITEM* Previous = Head.exchange(Item, std::memory_order_acq_rel);
+    Previous->Next.store(Item, std::memory_order_release);
+  }
+
+  alignas(64) std::atomic<INGEST_ITEM*> Head;
+  std::atomic<int64_t> Depth{0};
+  METRIC_COUNTER Pushed;
+  alignas(64) INGEST_ITEM* Tail;
+  INGEST_ITEM Stub;
+};
+
+// Workers that each drain one INGEST_QUEUE through Handler, which owns the
+// item it is given and must free it with IngestItemFree
+class INGEST_POOL {
+ public:
+  using HANDLER = void (*)(INGEST_ITEM* Item);
+
+  ~INGEST_POOL() { Stop(); }
+
+  // Starts Count workers, at most INGEST_MAX_WORKERS. With none, Running()
+  // stays false and callers process readings inline.
+  void Start(uint32_t Count, HANDLER Process) {
+    Handler = Process;
+    Count = Count < INGEST_MAX_WORKERS ? Count : INGEST_MAX_WORKERS;
+    for (uint32_t i = 0; i < Count; ++i) {
+      Workers.push_back(std::make_unique<WORKER>());
+      Workers.back()->Node = (int)(i % (uint32_t)NumaNodeCount());
+    }
+    for (auto& Worker : Workers) {
+      Worker->Thread = std::thread([this, W = Worker.get()] { Run(W); });
+    }
+  }
+
+  // Processes everything still queued, then joins the workers. Nothing may
+  // be pushed once it has been called.
+  void Stop() {
+    for (auto& Worker : Workers) {
+      Worker->Stopping.store(true, std::memory_order_seq_cst);
+      Wake(Worker.get());
+    }
+    for (auto& Worker : Workers) {
+      if (Worker->Thread.joinable()) {
+        Worker->Thread.join();
+      }
+    }
+  }
+
+  bool Running() const { return !Workers.empty(); }
+
+  uint32_t WorkerCount() const { return (uint32_t)Workers.size(); }
+
+  // Picks the queue for a connection on NUMA node Node, spreading the
+  // connections of a node over its workers by Spread
+  uint32_t QueueFor(int Node, uint32_t Spread) const {
+    const uint32_t Count = WorkerCount();
+    const uint32_t Nodes = (uint32_t)NumaNodeCount();
+    if (Count == 0 || Node < 0 || (uint32_t)Node >= Nodes ||
+        (uint32_t)Node >= Count) {
+      return Count == 0 ? 0 : Spread % Count;
+    }
+    const uint32_t OnNode =
+        Count / Nodes + ((uint32_t)Node < Count % Nodes ? 1 : 0);
+    return (uint32_t)Node + (Spread % OnNode) * Nodes;
+  }
+
+  // Queues Item on queue Queue
+  void Push(uint32_t Queue, INGEST_ITEM* Item) {
+    WORKER* Worker = Workers[Queue % Workers.size()].get();
+    Item->QueuedTime = MetricNow();
+    Worker->Queue.Push(Item);
+    if (Worker->Sleeping.load(std::memory_order_seq_cst)) {
+      Wake(Worker);
+    }
+  }
+
+  // Appends the depth, pushes and batches of every queue
+  void Render(std::string& Out) const {
+    using namespace spoq_metrics_detail;
+    struct SERIES {
+      const char* Name;
+      const char* Help;
+      const char* Type;
+      uint64_t (*Value)(const WORKER&);
+    };
+    static const SERIES Series[] = {
+        {"spoq_ingest_queue_depth", "Readings waiting in an ingest queue",
+         "gauge",
+         [](const WORKER& W) {
+           const int64_t Size = W.Queue.Size();
+           return Size > 0 ? (uint64_t)Size : 0;
+         }},
+        {"spoq_ingest_queued_total", "Readings pushed onto an ingest queue",
+         "counter", [](const WORKER& W) { return W.Queue.PushedCount(); }},
+        {"spoq_ingest_batches_total",
+         "Batches of readings an ingest worker processed", "counter",
+         [](const WORKER& W) {
+           return W.Batches.load(std::memory_order_relaxed);
+         }},
+    };
+    for (const SERIES& S : Series) {
+      AppendHeader(Out, S.Name, S.Help, S.Type);
+      for (size_t i = 0; i < Workers.size(); ++i) {
+        char Labels[24];
+        snprintf(Labels, sizeof(Labels), "queue=\"%zu\"", i);
+        AppendSample(Out, S.Name, Labels, S.Value(*Workers[i]));
+      }
+    }
+  }
+
+ private:
+  struct WORKER {
+    INGEST_QUEUE Queue;
+    // Bumped to wake the worker from its atomic wait
+    alignas(64) std::atomic<uint32_t> Signal{0};
+    std::atomic<bool> Sleeping{false};
+    std::atomic<bool> Stopping{false};
+    std::atomic<uint64_t> Batches{0};
+    int Node = 0;
+    std::thread Thread;
+  };
+
+  static void Wake(WORKER* Worker) {
+    Worker->Signal.fetch_add(1, std::memory_order_seq_cst);
+    Worker->Signal.notify_one();
+  }
+
+  void Run(WORKER* Worker) {
+    NumaBindThread(Worker->Node);
+    for (;;) {
+      uint32_t Processed = 0;
+      INGEST_ITEM* Item;
+      while (Processed < INGEST_BATCH_SIZE &&
+             (Item = Worker->Queue.Pop()) != nullptr) {
+        SpoqMetrics().IngestLatency.RecordSince(Item->QueuedTime);
+        Handler(Item);
+        ++Processed;
+      }
+      if (Processed != 0) {
+        Worker->Batches.store(
+            Worker->Batches.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        continue;
+      }
+      if (Worker->Queue.Size() != 0) {
+        // A push has claimed its place but not linked its item yet
+        std::this_thread::yield();
+        continue;
+      }
+      // Announce the sleep before the last look at the queue, so that a
+      // push either is seen here or sees Sleeping and bumps Signal
+      const uint32_t Signal = Worker->Signal.load(std::memory_order_seq_cst);
+      Worker->Sleeping.store(true, std::memory_order_seq_cst);
+      if (Worker->Queue.Size() == 0) {
+        if (Worker->Stopping.load(std::memory_order_seq_cst)) {
+          Worker->Sleeping.store(false, std::memory_order_relaxed);
+          return;
+        }
+        Worker->Signal.wait(Signal, std::memory_order_seq_cst);
+      }
+      Worker->Sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  HANDLER Handler = nullptr;
+  std::vector<std::unique_ptr<WORKER>> Workers;
+};
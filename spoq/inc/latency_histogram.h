@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+//
+// Percentiles of latencies recorded from many threads, for the reports of
+// spoq_bench and spoq_replay. METRIC_HISTOGRAM's power-of-two buckets suit a
+// Prometheus scrape but are too coarse to tell a p99 from a p999.
+//
+
+// Log-linear latency histogram with about 3% resolution, for percentiles
+class LATENCY_HISTOGRAM {
+ public:
+  void Record(uint64_t Ns) {
+    Buckets[Index(Ns)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t Count() const {
+    uint64_t Total = 0;
+    for (const auto& Bucket : Buckets) {
+      Total += Bucket.load(std::memory_order_relaxed);
+    }
+    return Total;
+  }
+
+  // Returns the value below which a fraction Q of samples fall, in ns
+  uint64_t Percentile(double Q) const {
+    const uint64_t Total = Count();
+    if (Total == 0) {
+      return 0;
+    }
+    const uint64_t Rank = (uint64_t)(Q * (double)(Total - 1)) + 1;
+    uint64_t Seen = 0;
+    for (uint32_t i = 0; i < BUCKET_COUNT; ++i) {
+      Seen += Buckets[i].load(std::memory_order_relaxed);
+      if (Seen >= Rank) {
+        return Midpoint(i);
+      }
+    }
+    return Midpoint(BUCKET_COUNT - 1);
+  }
+
+ private:
+  // Values below 64 ns are exact; above that each power of two is split
+  // into 32 buckets
+  static constexpr uint32_t SUB_BUCKETS = 32;
+  static constexpr uint32_t BUCKET_COUNT = SUB_BUCKETS * 60;
+
+  static uint32_t Index(uint64_t Ns) {
+    if (Ns < 2 * SUB_BUCKETS) {
+      return (uint32_t)Ns;
+    }
+    const uint32_t Shift = (uint32_t)std::bit_width(Ns) - 6;
+    return SUB_BUCKETS * Shift + (uint32_t)(Ns >> Shift);
+  }
+
+  static uint64_t Midpoint(uint32_t Index) {
+    if (Index < 2 * SUB_BUCKETS) {
+      return Index;
+    }
+    const uint32_t Shift = Index / SUB_BUCKETS - 1;
+    const uint64_t Base = (uint64_t)(Index - SUB_BUCKETS * Shift) << Shift;
+    return Base + ((1ull << Shift) >> 1);
+  }
+
+  std::atomic<uint64_t> Buckets[BUCKET_COUNT] = {};
+};
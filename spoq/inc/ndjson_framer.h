@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "frame_scan.h"
+#include "msquic.h"
+#include "quic_config.h"
+
+//
+// Per-stream NDJSON reassembly.
+//
+// Complete lines that sit inside one received QUIC_BUFFER are handed out as
+// views straight into msquic's receive buffers, so a burst is never joined or
+// copied. Only a line that straddles two buffers is gathered into the carry
+// buffer. Newlines are located with the vectorized FrameScan, one pass per
+// segment. Because complete frames are emitted as soon as they are seen, the
+// carry never holds more than one partial frame and is reset whenever that
+// frame completes.
+//
+// A trailing partial line is normally left unconsumed inside msquic (partial
+// consume through StreamReceiveComplete), and is delivered again at the front
+// of the next RECEIVE together with the new bytes. To guarantee progress, an
+// event that contains no newline at all is consumed entirely into the carry.
+//
+
+// Longest frame accepted before the stream is considered malformed
+constexpr size_t NDJSON_MAX_FRAME_LENGTH = 1024 * 1024;
+
+// Largest trailing partial line left inside msquic instead of being copied
+constexpr uint64_t NDJSON_MAX_DEFERRED_LENGTH = 64 * 1024;
+
+// Newline offsets collected per FrameScan call
+constexpr size_t NDJSON_SCAN_BATCH = 64;
+
+class NDJSON_FRAMER {
+ public:
+  // Splits the buffers of one RECEIVE event into frames and calls OnFrame
+  // with each one, without its trailing newline. A view is only valid until
+  // the event is completed or the next call. Consumed is set to the number of
+  // bytes to pass to StreamReceiveComplete. Fails if a frame exceeds
+  // NDJSON_MAX_FRAME_LENGTH. An OnFrame that returns bool stops the split by
+  // returning false, e.g. when the bytes after its frame use another
+  // framing; they are then left unconsumed.
+  template <typename FrameHandler>
+  QUIC_STATUS Receive(_In_reads_(BufferCount) const QUIC_BUFFER* Buffers,
+                      uint32_t BufferCount, _Out_ uint64_t* Consumed,
+                      FrameHandler&& OnFrame) {
+    uint64_t Total = 0;
+    bool FoundDelimiter = false;
+    const char* Tail = nullptr;
+    size_t TailLength = 0;
+
+    for (uint32_t i = 0; i < BufferCount; ++i) {
+      const char* Data = reinterpret_cast<const char*>(Buffers[i].Buffer);
+      const char* End = Data + Buffers[i].Length;
+      Total += Buffers[i].Length;
+
+      // The previous segment's trailing partial line continues here
+      if (TailLength != 0) {
+        Carry.append(Tail, TailLength);
+        TailLength = 0;
+      }
+
+      // Find every newline in the segment with one vectorized pass, a batch
+      // of offsets at a time
+      const char* Segment = Data;
+      size_t Scanned = 0;
+      while (Data < End) {
+        const size_t Base = Data - Segment;
+        const size_t Count = FrameScan(Data, End - Data, '\n', Offsets,
+                                       NDJSON_SCAN_BATCH, &Scanned);
+        for (size_t j = 0; j < Count; ++j) {
+          const char* Newline = Segment + Base + Offsets[j];
+          bool Keep;
+          if (Carry.empty()) {
+            Keep = Emit(OnFrame, std::string_view(Data, Newline - Data));
+          } else {
+            Carry.append(Data, Newline - Data);
+            Keep = Emit(OnFrame, std::string_view(Carry));
+            Carry.clear();
+          }
+          Data = Newline + 1;
+          if (!Keep) {
+            // Everything after this frame is indicated again next time
+            *Consumed = Total - (End - Data);
+            return QUIC_STATUS_SUCCESS;
+          }
+        }
+        FoundDelimiter |= Count != 0;
+        if (Segment + Base + Scanned == End) {
+          break;
+        }
+      }
+      if (Data < End) {
+        Tail = Data;
+        TailLength = End - Data;
+      }
+    }
+
+    *Consumed = Total;
+    if (TailLength == 0) {
+      return QUIC_STATUS_SUCCESS;
+    }
+
+    // Leave a short trailing line inside msquic when this event made
+    // progress; otherwise gather it so the next event can complete it.
+    if (Carry.empty() && FoundDelimiter &&
+        TailLength <= NDJSON_MAX_DEFERRED_LENGTH) {
+      *Consumed = Total - TailLength;
+      return QUIC_STATUS_SUCCESS;
+    }
+    if (Carry.size() + TailLength > NDJSON_MAX_FRAME_LENGTH) {
+      Carry.clear();
+      return QUIC_STATUS_BUFFER_TOO_SMALL;
+    }
+    Carry.append(Tail, TailLength);
+    return QUIC_STATUS_SUCCESS;
+  }
+
+  // Bytes of a partial frame currently held in the carry buffer
+  size_t CarriedLength() const { return Carry.size(); }
+
+ private:
+  template <typename FrameHandler>
+  static bool Emit(FrameHandler& OnFrame, std::string_view Frame) {
+    if constexpr (std::is_void_v<decltype(OnFrame(Frame))>) {
+      OnFrame(Frame);
+      return true;
+    } else {
+      return OnFrame(Frame);
+    }
+  }
+
+  std::string Carry = {};
+  uint32_t Offsets[NDJSON_SCAN_BATCH];
+};
+
+// Finishes a RECEIVE event handled by NDJSON_FRAMER and returns the status the
+// stream callback must return. The event is completed through the
+// QUIC_STATUS_PENDING path so that only Consumed bytes are released; any
+// remainder is indicated again with the next RECEIVE.
+inline QUIC_STATUS NdjsonReceiveComplete(_In_ HQUIC Stream, uint64_t Consumed,
+                                         uint64_t TotalBufferLength) {
+  MsQuic->StreamReceiveComplete(Stream, Consumed);
+  if (Consumed < TotalBufferLength) {
+    // Partial acceptance pauses receive indications until re-enabled
+    MsQuic->StreamReceiveSetEnabled(Stream, TRUE);
+  }
+  return QUIC_STATUS_PENDING;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+
+#include <cstdint>
+#include <new>
+#include <string_view>
+
+#include "msquic.h"
+
+//
+// Execution profile selection and NUMA-aware placement.
+//
+// msquic runs each connection on the worker of one partition and reports the
+// partition's processor in QUIC_CONNECTION_EVENT_IDEAL_PROCESSOR_CHANGED.
+// On a multi-socket host, state that the connection's worker or its ingest
+// worker touches should live on that processor's NUMA node, or every access
+// crosses the interconnect. These helpers find a processor's node, allocate
+// on or move memory to a node, and keep a thread on a node's processors.
+//
+// Placement is only done when libnuma reports more than one node. On a
+// single-node host every helper is a no-op and allocation falls back to the
+// heap, so nothing changes there.
+//
+
+// Parses an -execution_profile value
+inline bool ParseExecutionProfile(std::string_view Name,
+                                  QUIC_EXECUTION_PROFILE* Profile) {
+  if (Name == "low_latency") {
+    *Profile = QUIC_EXECUTION_PROFILE_LOW_LATENCY;
+  } else if (Name == "max_throughput") {
+    *Profile = QUIC_EXECUTION_PROFILE_TYPE_MAX_THROUGHPUT;
+  } else if (Name == "scavenger") {
+    *Profile = QUIC_EXECUTION_PROFILE_TYPE_SCAVENGER;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char* ToString(QUIC_EXECUTION_PROFILE Profile) {
+  switch (Profile) {
+    case QUIC_EXECUTION_PROFILE_LOW_LATENCY:
+      return "low_latency";
+    case QUIC_EXECUTION_PROFILE_TYPE_MAX_THROUGHPUT:
+      return "max_throughput";
+    case QUIC_EXECUTION_PROFILE_TYPE_SCAVENGER:
+      return "scavenger";
+    default:
+      return "other";
+  }
+}
+
+// True if the host has more than one NUMA node to place on
+inline bool NumaEnabled() {
+  static const bool Enabled =
+      numa_available() >= 0 && numa_num_configured_nodes() > 1;
+  return Enabled;
+}
+
+inline int NumaNodeCount() {
+  return NumaEnabled() ? numa_num_configured_nodes() : 1;
+}
+
+// Node of Processor, or 0 if it is unknown
+inline int NumaNodeOfProcessor(uint32_t Processor) {
+  if (!NumaEnabled()) {
+    return 0;
+  }
+  const int Node = numa_node_of_cpu((int)Processor);
+  return Node < 0 ? 0 : Node;
+}
+
+// Node of the processor the calling thread runs on
+inline int NumaCurrentNode() {
+  const int Processor = sched_getcpu();
+  return Processor < 0 ? 0 : NumaNodeOfProcessor((uint32_t)Processor);
+}
+
+// Allocates whole pages on the calling thread's node, so that they can be
+// moved on their own later. Returns nullptr on failure.
+inline void* NumaAllocLocal(size_t Bytes) { return numa_alloc_local(Bytes); }
+
+inline void NumaFree(void* Memory, size_t Bytes) { numa_free(Memory, Bytes); }
+
+// Base of objects allocated with new (std::nothrow) that get pages of their
+// own on the allocating thread's node, so that NumaMove can later move each
+// without its neighbours. Falls back to the heap on a single-node host.
+struct NUMA_PAGES {
+  static void* operator new(size_t Bytes, const std::nothrow_t&) noexcept {
+    return NumaEnabled() ? NumaAllocLocal(Bytes)
+                         : ::operator new(Bytes, std::nothrow);
+  }
+
+  static void operator delete(void* Memory, size_t Bytes) noexcept {
+    if (NumaEnabled()) {
+      NumaFree(Memory, Bytes);
+    } else {
+      ::operator delete(Memory);
+    }
+  }
+};
+
+// Migrates the pages of Memory to Node and keeps later faults there
+inline bool NumaMove(void* Memory, size_t Bytes, int Node) {
+  if (!NumaEnabled() || Node < 0 || Node >= (int)(8 * sizeof(unsigned long))) {
+    return false;
+  }
+  const unsigned long Mask = 1ul << Node;
+  return mbind(Memory, Bytes, MPOL_PREFERRED, &Mask, 8 * sizeof(Mask),
+               MPOL_MF_MOVE) == 0;
+}
+
+// Runs the calling thread on Node's processors and takes its new pages from
+// Node
+inline bool NumaBindThread(int Node) {
+  if (!NumaEnabled() || numa_run_on_node(Node) != 0) {
+    return false;
+  }
+  numa_set_preferred(Node);
+  return true;
+}
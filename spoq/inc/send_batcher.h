@@ -0,0 +1,242 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include "msquic.h"
+#include "quic_config.h"
+#include "send_pool.h"
+#include "spoq_metrics.h"
+
+//
+// Coalesces small NDJSON messages into as few StreamSend calls as possible.
+//
+// Messages are written straight into pooled chunks with Reserve/Commit. A
+// batch is handed to msquic once it reaches FlushBytes, once its oldest
+// message is MaxDelayUs old, or when the producer calls Flush. Several chunks
+// go out as one StreamSend using the QUIC_BUFFER array form. There is no
+// timer, so a producer that goes idle must call Flush itself.
+//
+
+enum class SPOQ_SEND_MODE {
+  LOW_LATENCY,  // One StreamSend per message
+  THROUGHPUT    // Coalesce messages up to the batch limits
+};
+
+// Most chunks a single StreamSend will carry
+constexpr uint32_t SEND_BATCH_MAX_BUFFERS = 8;
+
+struct SEND_BATCH_SETTINGS {
+  uint32_t ChunkSize;   // Payload size requested per pooled chunk
+  uint32_t MaxBuffers;  // Chunks per StreamSend, <= SEND_BATCH_MAX_BUFFERS
+  uint32_t FlushBytes;  // Flush once this many bytes are pending
+  uint32_t MaxDelayUs;  // Flush once the oldest message is this old (0 = off)
+  bool DelaySend;       // Hint msquic that more data follows each flush
+};
+
+inline SEND_BATCH_SETTINGS SendBatchSettings(SPOQ_SEND_MODE Mode) {
+  if (Mode == SPOQ_SEND_MODE::LOW_LATENCY) {
+    return {64, 1, 1, 0, false};
+  }
+  return {4096, SEND_BATCH_MAX_BUFFERS, 16 * 1024, 2000, true};
+}
+
+inline const char* ToString(SPOQ_SEND_MODE Mode) {
+  return Mode == SPOQ_SEND_MODE::LOW_LATENCY ? "latency" : "throughput";
+}
+
+// The QUIC_BUFFER array for a multi-chunk send. It lives in a pooled head
+// buffer whose Next chain holds the data chunks, so SendBufferFree on the
+// send context releases the whole batch.
+struct SEND_BATCH {
+  QUIC_BUFFER Buffers[SEND_BATCH_MAX_BUFFERS];
+};
+
+// Bytes of stream data carried by a send context, either a single pooled
+// buffer or the head of a batch from SEND_BATCHER::Flush. Only a batch head
+// has chunks chained to it while in flight.
+inline uint64_t SendContextBytes(const void* ClientContext) {
+  auto Block = static_cast<const SEND_BUFFER*>(ClientContext);
+  if (Block == nullptr) {
+    return 0;
+  }
+  if (Block->Next == nullptr) {
+    return Block->Buffer.Length;
+  }
+  uint64_t Bytes = 0;
+  for (const SEND_BUFFER* Chunk = Block->Next; Chunk != nullptr;
+       Chunk = Chunk->Next) {
+    Bytes += Chunk->Buffer.Length;
+  }
+  return Bytes;
+}
+
+class SEND_BATCHER {
+ public:
+  SEND_BATCHER() : Settings(SendBatchSettings(SPOQ_SEND_MODE::THROUGHPUT)) {}
+  ~SEND_BATCHER() { SendBufferFree(First); }
+
+  void Configure(SPOQ_SEND_MODE NewMode) {
+    Mode = NewMode;
+    Settings = SendBatchSettings(NewMode);
+  }
+
+  SPOQ_SEND_MODE GetMode() const { return Mode; }
+
+  // Returns a pointer with room for MaxLength bytes of the next message. The
+  // pending batch is flushed first if the message would not fit in it.
+  QUIC_STATUS Reserve(_In_ HQUIC Stream, uint32_t MaxLength,
+                      _Out_ uint8_t** Data) {
+    *Data = nullptr;
+    if (Last != nullptr && Last->Capacity - Last->Buffer.Length >= MaxLength) {
+      *Data = Last->Buffer.Buffer + Last->Buffer.Length;
+      return QUIC_STATUS_SUCCESS;
+    }
+
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    if (ChunkCount >= Settings.MaxBuffers &&
+        QUIC_FAILED(Status = Flush(Stream, QUIC_SEND_FLAG_NONE))) {
+      return Status;
+    }
+
+    SEND_BUFFER* Chunk = SendBufferAlloc(
+        MaxLength > Settings.ChunkSize ? MaxLength : Settings.ChunkSize);
+    if (Chunk == nullptr) {
+      return QUIC_STATUS_OUT_OF_MEMORY;
+    }
+    if (Last == nullptr) {
+      First = Chunk;
+    } else {
+      Last->Next = Chunk;
+    }
+    Last = Chunk;
+    ++ChunkCount;
+    *Data = Chunk->Buffer.Buffer;
+    return QUIC_STATUS_SUCCESS;
+  }
+
+  // Accounts for Length bytes written at the pointer from Reserve, and flushes
+  // if the batch limits are reached or Flags carries QUIC_SEND_FLAG_FIN. A
+  // producer that stops after this message sets FlushNow, so that the batch
+  // goes out at once and without the hint that more data follows.
+  QUIC_STATUS Commit(_In_ HQUIC Stream, uint32_t Length,
+                     QUIC_SEND_FLAGS Flags = QUIC_SEND_FLAG_NONE,
+                     bool FlushNow = false) {
+    if (PendingMessages == 0 && Settings.MaxDelayUs != 0) {
+      FirstPendingTime = std::chrono::steady_clock::now();
+    }
+    Last->Buffer.Length += Length;
+    PendingBytes += Length;
+    ++PendingMessages;
+
+    if ((Flags & QUIC_SEND_FLAG_FIN) || FlushNow) {
+      return Flush(Stream, Flags, false);
+    }
+    if (PendingBytes >= Settings.FlushBytes || DeadlineExpired()) {
+      return Flush(Stream, Flags);
+    }
+    return QUIC_STATUS_SUCCESS;
+  }
+
+  // Copies Length bytes in as one message
+  QUIC_STATUS Append(_In_ HQUIC Stream, const void* Message, uint32_t Length,
+                     QUIC_SEND_FLAGS Flags = QUIC_SEND_FLAG_NONE) {
+    uint8_t* Data = nullptr;
+    QUIC_STATUS Status = Reserve(Stream, Length, &Data);
+    if (QUIC_FAILED(Status)) {
+      return Status;
+    }
+    memcpy(Data, Message, Length);
+    return Commit(Stream, Length, Flags);
+  }
+
+  // Sends everything pending in a single StreamSend. On failure the pending
+  // buffers are released and the status is returned to the caller. Unless
+  // MoreFollows is cleared, throughput mode hints msquic that more data
+  // follows; a FIN never carries the hint.
+  QUIC_STATUS Flush(_In_ HQUIC Stream,
+                    QUIC_SEND_FLAGS Flags = QUIC_SEND_FLAG_NONE,
+                    bool MoreFollows = true) {
+    if (ChunkCount == 0) {
+      if (!(Flags & QUIC_SEND_FLAG_FIN)) {
+        return QUIC_STATUS_SUCCESS;
+      }
+      // Nothing buffered, just close our direction of the stream
+      return MsQuic->StreamSend(Stream, NULL, 0, Flags, NULL);
+    }
+
+    if (Settings.DelaySend && MoreFollows && !(Flags & QUIC_SEND_FLAG_FIN)) {
+      Flags |= QUIC_SEND_FLAG_DELAY_SEND;
+    }
+
+    SEND_BUFFER* Context = First;
+    const QUIC_BUFFER* Buffers = &First->Buffer;
+    if (ChunkCount > 1) {
+      // Chunks go out as one vectored send described by a pooled head
+      SEND_BUFFER* Head = SendBufferAlloc(sizeof(SEND_BATCH));
+      if (Head == nullptr) {
+        Reset();
+        return QUIC_STATUS_OUT_OF_MEMORY;
+      }
+      auto Batch = reinterpret_cast<SEND_BATCH*>(Head->Buffer.Buffer);
+      uint32_t i = 0;
+      for (SEND_BUFFER* Chunk = First; Chunk != nullptr; Chunk = Chunk->Next) {
+        Batch->Buffers[i++] = Chunk->Buffer;
+      }
+      Head->Next = First;
+      Context = Head;
+      Buffers = Batch->Buffers;
+    }
+
+    const uint32_t BufferCount = ChunkCount;
+    First = Last = nullptr;
+    ChunkCount = 0;
+    Messages += PendingMessages;
+    PendingBytes = 0;
+    PendingMessages = 0;
+
+    Context->SendTime = MetricNow();
+    QUIC_STATUS Status =
+        MsQuic->StreamSend(Stream, Buffers, BufferCount, Flags, Context);
+    if (QUIC_FAILED(Status)) {
+      SendBufferFree(Context);
+      return Status;
+    }
+    ++Sends;
+    return Status;
+  }
+
+  // Drops anything pending without sending it
+  void Reset() {
+    SendBufferFree(First);
+    First = Last = nullptr;
+    ChunkCount = 0;
+    PendingBytes = 0;
+    PendingMessages = 0;
+  }
+
+  uint64_t SendCount() const { return Sends; }
+  uint64_t MessageCount() const { return Messages; }
+
+ private:
+  bool DeadlineExpired() const {
+    return Settings.MaxDelayUs != 0 &&
+           std::chrono::steady_clock::now() - FirstPendingTime >=
+               std::chrono::microseconds(Settings.MaxDelayUs);
+  }
+
+  SPOQ_SEND_MODE Mode = SPOQ_SEND_MODE::THROUGHPUT;
+  SEND_BATCH_SETTINGS Settings;
+
+  // Pending chunks, linked through SEND_BUFFER::Next
+  SEND_BUFFER* First = nullptr;
+  SEND_BUFFER* Last = nullptr;
+  uint32_t ChunkCount = 0;
+  uint32_t PendingBytes = 0;
+  uint32_t PendingMessages = 0;
+  std::chrono::steady_clock::time_point FirstPendingTime = {};
+
+  uint64_t Sends = 0;
+  uint64_t Messages = 0;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <string_view>
+
+#include "send_pool.h"
+#include "spoq_datagram.h"
+#include "spoq_pdu.h"
+
+//
+// Builders of the messages the server sends, shared with spoq_microbench so
+// that its send buffer cases time the code the server runs.
+//
+// A NEGOTIATE message always goes out as NDJSON in a pooled buffer of its
+// own. A generated reading carries a sequence number, 0 to 19 bytes of
+// padding to vary its size, and its send time, as the JSON object
+//
+//   {"msg":<sequence>,"pad":"<padding>","time":<ns>}
+//
+// in NDJSON, or as the matching data fields in the binary encodings.
+//
+
+// Data field holding a generated reading's padding
+constexpr uint32_t SPOQ_FIELD_PAD = 2;
+
+// Room for the data fields of a generated reading
+constexpr size_t SPOQ_READING_FIELDS_LENGTH = 48;
+
+// Takes a pooled buffer and encodes a NEGOTIATE message into it. Returns
+// nullptr if no buffer is available.
+inline SEND_BUFFER* SpoqNegotiationBuffer(const SPOQ_HEADER_VIEW& Header,
+                                          std::string_view Data) {
+  SEND_BUFFER* PoolBuffer = SendBufferAlloc(SPOQ_NEGOTIATE_MAX_LENGTH);
+  if (PoolBuffer != nullptr) {
+    PoolBuffer->Buffer.Length = (uint32_t)SpoqEncodeNdjson(
+        Header, Data, (char*)PoolBuffer->Buffer.Buffer, PoolBuffer->Capacity);
+  }
+  return PoolBuffer;
+}
+
+// Writes the data fields of a generated reading
+inline void SpoqReadingFields(SPOQ_FIELD_WRITER& Fields, uint64_t Sequence,
+                              std::string_view Pad, uint64_t Time) {
+  Fields.Uint(SPOQ_FIELD_SEQUENCE, Sequence);
+  Fields.Bytes(SPOQ_FIELD_PAD, Pad);
+  Fields.Uint(SPOQ_FIELD_TIME, Time);
+}
+
+// Encodes a generated reading into Out, as a binary PDU if Header's version
+// is SPOQ_VERSION_BINARY and as NDJSON otherwise. Returns the encoded length,
+// or 0 if it does not fit in Capacity bytes.
+inline size_t SpoqEncodeReading(const SPOQ_HEADER_VIEW& Header,
+                                uint64_t Sequence, std::string_view Pad,
+                                uint64_t Time, uint8_t* Out, size_t Capacity) {
+  if (Header.Version == SPOQ_VERSION_BINARY) {
+    uint8_t Data[SPOQ_READING_FIELDS_LENGTH];
+    SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+    SpoqReadingFields(Fields, Sequence, Pad, Time);
+    return SpoqEncodeBinary(Header, Fields.Data(), Out, Capacity);
+  }
+  char Data[80];
+  int DataLength = snprintf(Data, sizeof(Data),
+                            "{\"msg\":%llu,\"pad\":\"%.*s\",\"time\":%llu}",
+                            (unsigned long long)Sequence, (int)Pad.size(),
+                            Pad.data(), (unsigned long long)Time);
+  return SpoqEncodeNdjson(Header, std::string_view(Data, DataLength),
+                          (char*)Out, Capacity);
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "msquic.h"
+
+//
+// Recycling pool of send buffers handed to MsQuic->StreamSend.
+//
+// Every msquic worker thread (one per partition) gets its own SEND_POOL, so
+// the allocation path never takes a lock or touches another core's memory.
+// SEND_COMPLETE is normally delivered on the same worker that sent, in which
+// case the buffer goes straight back onto the local free list. If it is
+// completed elsewhere it is pushed onto the owner's lock-free remote list,
+// which the owner drains the next time its local list runs dry.
+//
+// A buffer may also be shared by several StreamSend calls, on any streams,
+// e.g. one reading fanned out to every subscriber. Each send takes a share
+// with SendBufferShare, and the buffer goes back to its pool once every
+// share has been released through SendBufferFree.
+//
+
+// Payload sizes of the pooled buffer classes. Requests above the largest
+// class fall back to the heap and are counted as misses.
+constexpr uint32_t SendPoolSizeClasses[] = {64, 256, 1024, 4096, 16384};
+constexpr uint32_t SEND_POOL_CLASS_COUNT =
+    sizeof(SendPoolSizeClasses) / sizeof(SendPoolSizeClasses[0]);
+
+// Arenas are carved into buffers on demand. 2 MiB matches the x86-64 huge page
+// size so an arena can be backed by a single TLB entry.
+constexpr size_t SEND_POOL_ARENA_SIZE = 2 * 1024 * 1024;
+
+struct SEND_POOL;
+
+// Header placed in front of every send buffer. The QUIC_BUFFER comes first so
+// the block pointer can be passed to StreamSend as both the buffer array and
+// the send context, and cast back to a QUIC_BUFFER* in SEND_COMPLETE.
+struct SEND_BUFFER {
+  QUIC_BUFFER Buffer;
+  SEND_POOL* Owner;  // nullptr for heap fallbacks
+  SEND_BUFFER* Next;
+  uint32_t Capacity;
+  uint32_t SizeClass;
+  // Holders of a shared buffer, 0 if it has a single owner. A shared buffer
+  // is never chained through Next.
+  uint32_t Shares;
+  uint64_t SendTime;  // MetricNow() when handed to msquic, 0 if not stamped
+};
+
+// Payload starts on a 16 byte boundary after the header
+constexpr size_t SEND_BUFFER_HEADER_SIZE = (sizeof(SEND_BUFFER) + 15) & ~15;
+
+struct SEND_POOL_STATS {
+  uint64_t Hits = 0;
+  uint64_t Misses = 0;
+  uint64_t RemoteFrees = 0;
+  uint64_t Arenas = 0;
+  uint64_t HugePageArenas = 0;
+};
+
+struct alignas(64) SEND_POOL {
+  // Owner-thread-only free lists, one per size class
+  SEND_BUFFER* FreeList[SEND_POOL_CLASS_COUNT] = {};
+
+  // Buffers returned from other threads. Producers push with a CAS; the owner
+  // takes the whole list with a single exchange, so there is no ABA hazard.
+  alignas(64) std::atomic<SEND_BUFFER*> RemoteFree[SEND_POOL_CLASS_COUNT] = {};
+
+  // Unused tail of the current arena
+  uint8_t* ArenaCursor = nullptr;
+  uint8_t* ArenaEnd = nullptr;
+  std::vector<std::pair<void*, size_t>> ArenaList;
+
+  // Counters are written only by the owner (plain load/store, no RMW) and
+  // read by anyone reporting statistics.
+  alignas(64) std::atomic<uint64_t> Hits = 0;
+  std::atomic<uint64_t> Misses = 0;
+  std::atomic<uint64_t> RemoteFrees = 0;
+  std::atomic<uint64_t> Arenas = 0;
+  std::atomic<uint64_t> HugePageArenas = 0;
+
+  ~SEND_POOL() {
+    for (auto& [Base, Size] : ArenaList) {
+      munmap(Base, Size);
+    }
+  }
+
+  static void Bump(std::atomic<uint64_t>& Counter) {
+    Counter.store(Counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  }
+
+  // Maps a new arena, preferring explicit huge pages, then transparent huge
+  // pages, then regular pages.
+  bool Grow() {
+    void* Base = mmap(NULL, SEND_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (Base != MAP_FAILED) {
+      Bump(HugePageArenas);
+    } else {
+      Base = mmap(NULL, SEND_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (Base == MAP_FAILED) {
+        return false;
+      }
+#ifdef MADV_HUGEPAGE
+      madvise(Base, SEND_POOL_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+    ArenaList.emplace_back(Base, SEND_POOL_ARENA_SIZE);
+    Bump(Arenas);
+    ArenaCursor = static_cast<uint8_t*>(Base);
+    ArenaEnd = ArenaCursor + SEND_POOL_ARENA_SIZE;
+    return true;
+  }
+
+  SEND_BUFFER* Carve(uint32_t SizeClass) {
+    const size_t BlockSize =
+        SEND_BUFFER_HEADER_SIZE + SendPoolSizeClasses[SizeClass];
+    if (ArenaCursor == nullptr ||
+        (size_t)(ArenaEnd - ArenaCursor) < BlockSize) {
+      if (!Grow()) {
+        return nullptr;
+      }
+    }
+    auto Block = reinterpret_cast<SEND_BUFFER*>(ArenaCursor);
+    ArenaCursor += BlockSize;
+    Block->Owner = this;
+    Block->Capacity = SendPoolSizeClasses[SizeClass];
+    Block->SizeClass = SizeClass;
+    return Block;
+  }
+
+  SEND_BUFFER* Pop(uint32_t SizeClass) {
+    SEND_BUFFER* Block = FreeList[SizeClass];
+    if (Block == nullptr) {
+      Block =
+          RemoteFree[SizeClass].exchange(nullptr, std::memory_order_acquire);
+    }
+    if (Block != nullptr) {
+      FreeList[SizeClass] = Block->Next;
+      Bump(Hits);
+      return Block;
+    }
+    Bump(Misses);
+    return Carve(SizeClass);
+  }
+
+  void PushLocal(SEND_BUFFER* Block) {
+    Block->Next = FreeList[Block->SizeClass];
+    FreeList[Block->SizeClass] = Block;
+  }
+
+  void PushRemote(SEND_BUFFER* Block) {
+    auto& Head = RemoteFree[Block->SizeClass];
+    Block->Next = Head.load(std::memory_order_relaxed);
+    while (!Head.compare_exchange_weak(Block->Next, Block,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+    RemoteFrees.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+// Owns every pool ever created. Pools outlive their threads so late
+// SEND_COMPLETEs always have somewhere to go; a pool whose thread exited is
+// adopted by the next thread that needs one.
+class SEND_POOL_REGISTRY {
+ public:
+  SEND_POOL* Acquire() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!Orphans.empty()) {
+      SEND_POOL* Pool = Orphans.back();
+      Orphans.pop_back();
+      return Pool;
+    }
+    Pools.push_back(std::make_unique<SEND_POOL>());
+    return Pools.back().get();
+  }
+
+  void Release(SEND_POOL* Pool) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Orphans.push_back(Pool);
+  }
+
+  SEND_POOL_STATS Stats() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    SEND_POOL_STATS Total;
+    for (auto& Pool : Pools) {
+      Total.Hits += Pool->Hits.load(std::memory_order_relaxed);
+      Total.Misses += Pool->Misses.load(std::memory_order_relaxed);
+      Total.RemoteFrees += Pool->RemoteFrees.load(std::memory_order_relaxed);
+      Total.Arenas += Pool->Arenas.load(std::memory_order_relaxed);
+      Total.HugePageArenas +=
+          Pool->HugePageArenas.load(std::memory_order_relaxed);
+    }
+    return Total;
+  }
+
+ private:
+  std::mutex Lock;
+  std::vector<std::unique_ptr<SEND_POOL>> Pools;
+  std::vector<SEND_POOL*> Orphans;
+};
+
+inline SEND_POOL_REGISTRY& SendPoolRegistry() {
+  static SEND_POOL_REGISTRY Registry;
+  return Registry;
+}
+
+// Binds a pool to the calling thread for the thread's lifetime
+struct SEND_POOL_BINDING {
+  SEND_POOL* Pool = nullptr;
+  ~SEND_POOL_BINDING() {
+    if (Pool != nullptr) {
+      SendPoolRegistry().Release(Pool);
+    }
+  }
+};
+
+inline thread_local SEND_POOL_BINDING SendPoolBinding;
+
+inline SEND_POOL* SendPoolForThisThread() {
+  if (SendPoolBinding.Pool == nullptr) {
+    SendPoolBinding.Pool = SendPoolRegistry().Acquire();
+  }
+  return SendPoolBinding.Pool;
+}
+
+// Returns a send buffer able to hold at least Length payload bytes, or NULL.
+// Buffer.Buffer points at the payload and Buffer.Length is zero.
+inline SEND_BUFFER* SendBufferAlloc(uint32_t Length) {
+  SEND_BUFFER* Block = nullptr;
+  uint32_t SizeClass = 0;
+  while (SizeClass < SEND_POOL_CLASS_COUNT &&
+         SendPoolSizeClasses[SizeClass] < Length) {
+    ++SizeClass;
+  }
+
+  if (SizeClass < SEND_POOL_CLASS_COUNT) {
+    Block = SendPoolForThisThread()->Pop(SizeClass);
+  } else {
+    SEND_POOL::Bump(SendPoolForThisThread()->Misses);
+    Block =
+        static_cast<SEND_BUFFER*>(malloc(SEND_BUFFER_HEADER_SIZE + Length));
+    if (Block != nullptr) {
+      Block->Owner = nullptr;
+      Block->Capacity = Length;
+      Block->SizeClass = SEND_POOL_CLASS_COUNT;
+    }
+  }
+
+  if (Block != nullptr) {
+    Block->Buffer.Buffer =
+        reinterpret_cast<uint8_t*>(Block) + SEND_BUFFER_HEADER_SIZE;
+    Block->Buffer.Length = 0;
+    Block->Next = nullptr;
+    Block->Shares = 0;
+    Block->SendTime = 0;
+  }
+  return Block;
+}
+
+// Takes a share of Block for one more holder. The first share makes the
+// caller's own reference a share too, so Block then needs one SendBufferFree
+// per share and one for the caller. Only the caller may take the first share.
+inline void SendBufferShare(SEND_BUFFER* Block) {
+  std::atomic_ref<uint32_t> Shares(Block->Shares);
+  if (Shares.load(std::memory_order_relaxed) == 0) {
+    Shares.store(2, std::memory_order_relaxed);
+  } else {
+    Shares.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// Returns a buffer from SendBufferAlloc to its pool, along with any buffers
+// chained to it through Next while it was in flight. A shared buffer only
+// goes back with its last share. Safe to call from any thread, typically
+// from QUIC_STREAM_EVENT_SEND_COMPLETE.
+inline void SendBufferFree(void* ClientContext) {
+  auto Block = static_cast<SEND_BUFFER*>(ClientContext);
+  while (Block != nullptr) {
+    std::atomic_ref<uint32_t> Shares(Block->Shares);
+    if (Shares.load(std::memory_order_relaxed) != 0 &&
+        Shares.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    SEND_BUFFER* Next = Block->Next;
+    if (Block->Owner == nullptr) {
+      free(Block);
+    } else if (Block->Owner == SendPoolBinding.Pool) {
+      Block->Owner->PushLocal(Block);
+    } else {
+      Block->Owner->PushRemote(Block);
+    }
+    Block = Next;
+  }
+}
+
+inline void SendPoolPrintStats() {
+  SEND_POOL_STATS Stats = SendPoolRegistry().Stats();
+  std::cout << "Send pool: " << Stats.Hits << " hits, " << Stats.Misses
+            << " misses, " << Stats.RemoteFrees << " remote frees, "
+            << Stats.Arenas << " arenas (" << Stats.HugePageArenas
+            << " huge page)\n";
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+//
+// Budget of bytes outstanding on one stream.
+//
+// msquic reports through QUIC_STREAM_EVENT_IDEAL_SEND_BUFFER_SIZE how many
+// bytes a stream should keep queued to fill the connection's congestion
+// window, its estimate of the bandwidth-delay product. A producer sends while
+// the bytes it has outstanding are below that size and waits otherwise, and
+// each SEND_COMPLETE returns its bytes and wakes it. Anything queued beyond
+// the ideal size would only wait inside msquic, adding memory and latency
+// without adding throughput.
+//
+// A producer on its own thread blocks in WaitForRoom. One running on an
+// msquic callback must not block, so it checks HasRoom instead, pauses when
+// the window is full and resumes from the SEND_COMPLETE that makes room.
+//
+// The window starts shut so that a producer can wait on it before
+// negotiation has finished. Open lets it in; Close turns it away for good,
+// e.g. once the stream has shut down.
+//
+
+// Budget used until msquic first reports an ideal size, msquic's own default
+constexpr uint64_t SEND_WINDOW_INITIAL_IDEAL = 128 * 1024;
+
+class SEND_WINDOW {
+ public:
+  // Lets the producer send once the stream can carry data
+  void Open() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Opened = true;
+    Wake.notify_all();
+  }
+
+  // Turns the producer away for good
+  void Close() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Closed = true;
+    Wake.notify_all();
+  }
+
+  // Applies a new ideal size from IDEAL_SEND_BUFFER_SIZE
+  void SetIdeal(uint64_t Bytes) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Ideal = Bytes;
+    Wake.notify_all();
+  }
+
+  // Accounts for Bytes handed to StreamSend. Called before the send, since
+  // its completion may arrive before StreamSend returns.
+  void Sent(uint64_t Bytes) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Outstanding += Bytes;
+  }
+
+  // Returns Bytes from SEND_COMPLETE, or from a StreamSend that failed
+  void Completed(uint64_t Bytes) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Outstanding -= Bytes < Outstanding ? Bytes : Outstanding;
+    if (Outstanding < Ideal) {
+      Wake.notify_all();
+    }
+  }
+
+  // Accounts for Bytes about to be handed to StreamSend if the window is
+  // open with room to send, as Sent does, without blocking. Unlike HasRoom
+  // followed by Sent, it is safe for producers on several threads.
+  bool TrySend(uint64_t Bytes) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Closed || !Opened || Outstanding >= Ideal) {
+      return false;
+    }
+    Outstanding += Bytes;
+    return true;
+  }
+
+  // Returns true if the window is open with room to send, without blocking
+  bool HasRoom() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return !Closed && Opened && Outstanding < Ideal;
+  }
+
+  // Counts a pause of a producer that cannot block
+  void Paused() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    ++Waits;
+  }
+
+  // Blocks until the window is open with room to send. Returns false once
+  // it has been closed.
+  bool WaitForRoom() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    if (!Closed && (!Opened || Outstanding >= Ideal)) {
+      ++Waits;
+      Wake.wait(Guard, [this] {
+        return Closed || (Opened && Outstanding < Ideal);
+      });
+    }
+    return !Closed;
+  }
+
+  uint64_t OutstandingBytes() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return Outstanding;
+  }
+
+  uint64_t IdealBytes() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return Ideal;
+  }
+
+  // Times the producer had to wait or pause, including for the window to
+  // open
+  uint64_t WaitCount() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return Waits;
+  }
+
+ private:
+  mutable std::mutex Lock;
+  std::condition_variable Wake;
+  uint64_t Ideal = SEND_WINDOW_INITIAL_IDEAL;
+  uint64_t Outstanding = 0;
+  uint64_t Waits = 0;
+  bool Opened = false;
+  bool Closed = false;
+};
@@ -0,0 +1,572 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "spoq_log.h"
+
+//
+// Append-only, memory-mapped time-series store of received readings.
+//
+// Every sensor id has a directory of segment files, each named after the
+// time of its first reading:
+//
+//   <store>/<sensor id>/<first time in ns, 20 digits>[-<n>].seg
+//
+// Stamps are pinned when the clock steps back, so two segments can start
+// at the same time; the later ones then take the suffix -1, -2 and so on.
+//
+// A segment is created at its full size and mapped once. An append copies
+// the reading into the mapping and publishes it with a release store of the
+// segment's committed length, so the hot path makes no system call; the
+// kernel writes the dirty pages back in the background. The syscalls to
+// create, map and msync a segment are paid once per segment, when the
+// active one rolls over because it is full or older than the maximum age.
+//
+// A segment is laid out as
+//
+//   SERIES_SEGMENT_HEADER
+//   sparse time index, a SERIES_INDEX_ENTRY for the first record at or
+//   after every SERIES_INDEX_STRIDE bytes of records
+//   records, each a SERIES_RECORD_HEADER and the reading's wire bytes,
+//   padded to 8 bytes
+//
+// Readings are stamped with the wall clock when they are stored, kept
+// non-decreasing per sensor. A range query skips the segments outside the
+// range, binary searches the sparse index of the first one it needs and
+// walks the records from there, handing out views into the mappings rather
+// than copies. Segments stay mapped while the store is open, so the views
+// remain valid until Close.
+//
+// On Open every existing segment is mapped read-only up to its committed
+// length, which also drops a record torn by a crash. New readings always go
+// to a new segment.
+//
+
+// Bytes of records between sparse index entries
+constexpr uint64_t SERIES_INDEX_STRIDE = 4096;
+
+// Segment size and age used unless the server is told otherwise
+constexpr uint64_t SERIES_DEFAULT_SEGMENT_BYTES = 64ull << 20;
+constexpr uint64_t SERIES_DEFAULT_SEGMENT_AGE_NS = 3600ull * 1000000000;
+
+// Most segments of one series that may share a first time
+constexpr uint32_t SERIES_MAX_SAME_TIME = 1000;
+
+// Smallest segment, which must hold the largest reading
+constexpr uint64_t SERIES_MIN_SEGMENT_BYTES = 64 * 1024;
+
+constexpr char SERIES_SEGMENT_MAGIC[8] = {'S', 'P', 'O', 'Q',
+                                          'S', 'E', 'G', '1'};
+
+// Segment header, shared between the writer and readers of the mapping
+struct SERIES_SEGMENT_HEADER {
+  char Magic[8];
+  uint64_t SensorId;
+  uint64_t FirstTime;  // ns since the epoch
+  uint64_t Capacity;   // Bytes of the records area
+  uint32_t IndexCapacity;
+  std::atomic<uint32_t> IndexCount;
+  std::atomic<uint64_t> LastTime;
+  std::atomic<uint64_t> Committed;  // Bytes of records published
+  uint64_t Reserved;
+};
+
+static_assert(sizeof(SERIES_SEGMENT_HEADER) == 64);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+struct SERIES_INDEX_ENTRY {
+  uint64_t Time;
+  uint64_t Offset;  // Of the record in the records area
+};
+
+struct SERIES_RECORD_HEADER {
+  uint32_t Length;  // Of the reading, excluding this header and padding
+  uint16_t Version;  // Wire version the reading is encoded in
+  uint16_t Reserved;
+  uint64_t Time;
+};
+
+// A stored reading handed to a query's visitor. Data points into the
+// segment's mapping.
+struct SERIES_RECORD {
+  uint64_t Time;
+  uint32_t Version;
+  std::string_view Data;
+};
+
+// One mapped segment file
+class SERIES_SEGMENT {
+ public:
+  ~SERIES_SEGMENT() {
+    if (Base != nullptr) {
+      munmap(Base, Size);
+    }
+  }
+
+  // Creates the segment file at Path for the given records capacity and
+  // maps it for writing. Returns nullptr on failure, with errno EEXIST if
+  // there is a file at Path already.
+  static std::unique_ptr<SERIES_SEGMENT> Create(const std::string& Path,
+                                                uint64_t SensorId,
+                                                uint64_t FirstTime,
+                                                uint64_t SegmentBytes) {
+    const uint32_t IndexCapacity =
+        (uint32_t)(SegmentBytes / SERIES_INDEX_STRIDE + 1);
+    const uint64_t Records = RecordsOffset(IndexCapacity);
+    if (SegmentBytes <= Records) {
+      return nullptr;
+    }
+    int Fd = open(Path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (Fd < 0) {
+      if (errno != EEXIST) {
+        SPOQ_LOG_ERROR("Segment {} not created, errno {}", Path, errno);
+      }
+      return nullptr;
+    }
+    // The file is sparse, so only written pages take up disk space
+    void* Base = ftruncate(Fd, (off_t)SegmentBytes) == 0
+                     ? mmap(NULL, SegmentBytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, Fd, 0)
+                     : MAP_FAILED;
+    close(Fd);
+    if (Base == MAP_FAILED) {
+      SPOQ_LOG_ERROR("Segment {} not mapped, errno {}", Path, errno);
+      unlink(Path.c_str());
+      return nullptr;
+    }
+    auto Header = static_cast<SERIES_SEGMENT_HEADER*>(Base);
+    memcpy(Header->Magic, SERIES_SEGMENT_MAGIC, sizeof(Header->Magic));
+    Header->SensorId = SensorId;
+    Header->FirstTime = FirstTime;
+    Header->Capacity = SegmentBytes - Records;
+    Header->IndexCapacity = IndexCapacity;
+    Header->IndexCount.store(0, std::memory_order_relaxed);
+    Header->LastTime.store(FirstTime, std::memory_order_relaxed);
+    Header->Committed.store(0, std::memory_order_release);
+    auto Segment = std::unique_ptr<SERIES_SEGMENT>(new SERIES_SEGMENT);
+    Segment->Attach(Base, SegmentBytes);
+    Segment->Writable = true;
+    return Segment;
+  }
+
+  // Maps an existing segment read-only. Returns nullptr if it is not a
+  // well-formed segment.
+  static std::unique_ptr<SERIES_SEGMENT> Load(const std::string& Path) {
+    int Fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (Fd < 0) {
+      return nullptr;
+    }
+    struct stat Stat;
+    void* Base = MAP_FAILED;
+    if (fstat(Fd, &Stat) == 0 &&
+        (uint64_t)Stat.st_size >= sizeof(SERIES_SEGMENT_HEADER)) {
+      Base = mmap(NULL, Stat.st_size, PROT_READ, MAP_SHARED, Fd, 0);
+    }
+    close(Fd);
+    if (Base == MAP_FAILED) {
+      return nullptr;
+    }
+    auto Segment = std::unique_ptr<SERIES_SEGMENT>(new SERIES_SEGMENT);
+    Segment->Base = static_cast<uint8_t*>(Base);
+    Segment->Size = Stat.st_size;
+    const SERIES_SEGMENT_HEADER* Header =
+        reinterpret_cast<const SERIES_SEGMENT_HEADER*>(Base);
+    if (memcmp(Header->Magic, SERIES_SEGMENT_MAGIC, sizeof(Header->Magic)) !=
+            0 ||
+        RecordsOffset(Header->IndexCapacity) + Header->Capacity !=
+            (uint64_t)Stat.st_size ||
+        Header->Committed.load() > Header->Capacity ||
+        Header->IndexCount.load() > Header->IndexCapacity) {
+      SPOQ_LOG_WARN("Skipped malformed segment {}", Path);
+      return nullptr;
+    }
+    Segment->Attach(Base, Stat.st_size);
+    return Segment;
+  }
+
+  // Appends a record if it fits. Only the series' writer may call it.
+  bool Append(uint64_t Time, uint32_t Version, std::string_view Reading) {
+    const uint64_t Offset = Header->Committed.load(std::memory_order_relaxed);
+    const uint64_t Length = RecordLength(Reading.size());
+    if (!Writable || Offset + Length > Header->Capacity) {
+      return false;
+    }
+    auto Record = reinterpret_cast<SERIES_RECORD_HEADER*>(Records + Offset);
+    Record->Length = (uint32_t)Reading.size();
+    Record->Version = (uint16_t)Version;
+    Record->Reserved = 0;
+    Record->Time = Time;
+    memcpy(Record + 1, Reading.data(), Reading.size());
+    const uint32_t Entries = Header->IndexCount.load(std::memory_order_relaxed);
+    if (Offset >= Entries * SERIES_INDEX_STRIDE &&
+        Entries < Header->IndexCapacity) {
+      Index[Entries] = {Time, Offset};
+      Header->IndexCount.store(Entries + 1, std::memory_order_release);
+    }
+    Header->LastTime.store(Time, std::memory_order_relaxed);
+    Header->Committed.store(Offset + Length, std::memory_order_release);
+    return true;
+  }
+
+  // Stops appends and schedules the dirty pages for write-back
+  void Seal() {
+    if (Writable) {
+      Writable = false;
+      msync(Base, Size, MS_ASYNC);
+    }
+  }
+
+  // Calls Visit with each record stamped From..To inclusive, in order.
+  // Returns the number of records visited. The mapping may be shared with
+  // another process, or torn, so nothing read from it is trusted: the scan
+  // stops at the first record that does not lie within the committed
+  // bytes.
+  template <typename Visitor>
+  uint64_t Query(uint64_t From, uint64_t To, Visitor&& Visit) const {
+    const uint64_t Committed =
+        std::min(Header->Committed.load(std::memory_order_acquire),
+                 Header->Capacity);
+    const uint32_t Entries =
+        std::min(Header->IndexCount.load(std::memory_order_acquire),
+                 Header->IndexCapacity);
+    if (Committed == 0 || From > LastTime() || To < FirstTime()) {
+      return 0;
+    }
+    // Start at the last index entry stamped before From, since records
+    // stamped From itself may begin before the next entry
+    const SERIES_INDEX_ENTRY* Entry = std::lower_bound(
+        Index, Index + Entries, From,
+        [](const SERIES_INDEX_ENTRY& E, uint64_t T) { return E.Time < T; });
+    uint64_t Offset = Entry == Index ? 0 : (Entry - 1)->Offset;
+    if (Offset >= Committed || Offset % 8 != 0) {
+      Offset = 0;
+    }
+    uint64_t Visited = 0;
+    while (Committed - Offset >= sizeof(SERIES_RECORD_HEADER)) {
+      auto Record =
+          reinterpret_cast<const SERIES_RECORD_HEADER*>(Records + Offset);
+      if (RecordLength(Record->Length) > Committed - Offset) {
+        SPOQ_LOG_WARN("Store: stopped at a malformed record at offset {} "
+                      "of a segment of sensor {}", Offset, Header->SensorId);
+        break;
+      }
+      if (Record->Time > To) {
+        break;
+      }
+      if (Record->Time >= From) {
+        Visit(SERIES_RECORD{
+            Record->Time, Record->Version,
+            std::string_view(reinterpret_cast<const char*>(Record + 1),
+                             Record->Length)});
+        ++Visited;
+      }
+      Offset += RecordLength(Record->Length);
+    }
+    return Visited;
+  }
+
+  uint64_t FirstTime() const { return Header->FirstTime; }
+
+  uint64_t LastTime() const {
+    return Header->LastTime.load(std::memory_order_relaxed);
+  }
+
+  uint64_t CommittedBytes() const {
+    return Header->Committed.load(std::memory_order_acquire);
+  }
+
+  static uint64_t RecordLength(size_t Length) {
+    return (sizeof(SERIES_RECORD_HEADER) + Length + 7) & ~7ull;
+  }
+
+ private:
+  SERIES_SEGMENT() = default;
+
+  static uint64_t RecordsOffset(uint32_t IndexCapacity) {
+    return sizeof(SERIES_SEGMENT_HEADER) +
+           (uint64_t)IndexCapacity * sizeof(SERIES_INDEX_ENTRY);
+  }
+
+  void Attach(void* Mapping, uint64_t Bytes) {
+    Base = static_cast<uint8_t*>(Mapping);
+    Size = Bytes;
+    Header = reinterpret_cast<SERIES_SEGMENT_HEADER*>(Base);
+    Index = reinterpret_cast<SERIES_INDEX_ENTRY*>(Header + 1);
+    Records = Base + RecordsOffset(Header->IndexCapacity);
+  }
+
+  uint8_t* Base = nullptr;
+  uint64_t Size = 0;
+  SERIES_SEGMENT_HEADER* Header = nullptr;
+  SERIES_INDEX_ENTRY* Index = nullptr;
+  uint8_t* Records = nullptr;
+  bool Writable = false;
+};
+
+class SERIES_STORE {
+ public:
+  ~SERIES_STORE() { Close(); }
+
+  // Opens the store in Directory, creating it if needed, and maps the
+  // segments already in it. Segments roll over at SegmentBytes or once
+  // their first reading is MaxAgeNs old.
+  bool Open(const char* Directory,
+            uint64_t SegmentBytes = SERIES_DEFAULT_SEGMENT_BYTES,
+            uint64_t MaxAgeNs = SERIES_DEFAULT_SEGMENT_AGE_NS) {
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    Root = Directory;
+    this->SegmentBytes = std::max(SegmentBytes, SERIES_MIN_SEGMENT_BYTES);
+    this->MaxAgeNs = MaxAgeNs;
+    if (mkdir(Directory, 0755) != 0 && errno != EEXIST) {
+      SPOQ_LOG_ERROR("Store {} not created, errno {}", Directory, errno);
+      return false;
+    }
+    DIR* Sensors = opendir(Directory);
+    if (Sensors == nullptr) {
+      SPOQ_LOG_ERROR("Store {} not readable, errno {}", Directory, errno);
+      return false;
+    }
+    uint64_t Loaded = 0;
+    while (dirent* Entry = readdir(Sensors)) {
+      char* End;
+      const uint64_t SensorId = strtoull(Entry->d_name, &End, 10);
+      if (End == Entry->d_name || *End != '\0') {
+        continue;
+      }
+      Loaded += LoadSeries(SensorId);
+    }
+    closedir(Sensors);
+    Opened = true;
+    SPOQ_LOG_INFO("Store {}: {} segment(s) of {} sensor(s)", Directory,
+                  Loaded, Series.size());
+    return true;
+  }
+
+  bool IsOpen() const { return Opened; }
+
+  // Seals the active segments and unmaps everything
+  void Close() {
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    for (auto& [SensorId, Entry] : Series) {
+      std::lock_guard<std::mutex> SeriesGuard(Entry->Lock);
+      if (!Entry->Segments.empty()) {
+        Entry->Segments.back()->Seal();
+      }
+    }
+    Series.clear();
+    Opened = false;
+  }
+
+  // Stores one reading of SensorId, encoded in wire version Version, stamped
+  // with the current time. Safe to call from any thread.
+  bool Append(uint64_t SensorId, uint32_t Version, std::string_view Reading) {
+    SERIES* Entry = Find(SensorId, true);
+    if (Entry == nullptr) {
+      return false;
+    }
+    std::lock_guard<std::mutex> Guard(Entry->Lock);
+    // Stamps never go backwards within a series, even if the clock does
+    const uint64_t Time = std::max(Now(), Entry->LastTime);
+    SERIES_SEGMENT* Active =
+        Entry->Writable ? Entry->Segments.back().get() : nullptr;
+    if (Active == nullptr || Time - Active->FirstTime() >= MaxAgeNs ||
+        !Active->Append(Time, Version, Reading)) {
+      if (SERIES_SEGMENT::RecordLength(Reading.size()) > SegmentBytes / 2) {
+        return false;
+      }
+      Active = Roll(SensorId, *Entry, Time);
+      if (Active == nullptr || !Active->Append(Time, Version, Reading)) {
+        return false;
+      }
+    }
+    Entry->LastTime = Time;
+    return true;
+  }
+
+  // Calls Visit with every reading of SensorId stamped From..To inclusive,
+  // in time order. The records point into the store's mappings. Returns the
+  // number of readings visited.
+  template <typename Visitor>
+  uint64_t Query(uint64_t SensorId, uint64_t From, uint64_t To,
+                 Visitor&& Visit) {
+    SERIES* Entry = Find(SensorId, false);
+    if (Entry == nullptr) {
+      return 0;
+    }
+    std::vector<std::shared_ptr<SERIES_SEGMENT>> Segments;
+    {
+      std::lock_guard<std::mutex> Guard(Entry->Lock);
+      Segments = Entry->Segments;
+    }
+    uint64_t Visited = 0;
+    for (const auto& Segment : Segments) {
+      Visited += Segment->Query(From, To, Visit);
+    }
+    return Visited;
+  }
+
+  // Sensor ids with stored readings
+  std::vector<uint64_t> Sensors() const {
+    std::shared_lock<std::shared_mutex> Guard(Lock);
+    std::vector<uint64_t> Ids;
+    for (const auto& [SensorId, Entry] : Series) {
+      Ids.push_back(SensorId);
+    }
+    return Ids;
+  }
+
+  uint64_t SegmentCount() const {
+    return Segments.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct SERIES {
+    std::mutex Lock;
+    // In time order; only the last one may be writable
+    std::vector<std::shared_ptr<SERIES_SEGMENT>> Segments;
+    bool Writable = false;
+    uint64_t LastTime = 0;
+  };
+
+  static uint64_t Now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  std::string SeriesPath(uint64_t SensorId) const {
+    return Root + "/" + std::to_string(SensorId);
+  }
+
+  // Returns the series of SensorId, adding it if Create
+  SERIES* Find(uint64_t SensorId, bool Create) {
+    {
+      std::shared_lock<std::shared_mutex> Guard(Lock);
+      auto It = Series.find(SensorId);
+      if (It != Series.end()) {
+        return It->second.get();
+      }
+      if (!Opened || !Create) {
+        return nullptr;
+      }
+    }
+    std::unique_lock<std::shared_mutex> Guard(Lock);
+    if (!Opened) {
+      return nullptr;
+    }
+    auto& Entry = Series[SensorId];
+    if (Entry == nullptr) {
+      Entry = std::make_unique<SERIES>();
+    }
+    return Entry.get();
+  }
+
+  // Maps the segments of SensorId, oldest first. Called with Lock held.
+  uint64_t LoadSeries(uint64_t SensorId) {
+    const std::string Directory = SeriesPath(SensorId);
+    DIR* Files = opendir(Directory.c_str());
+    if (Files == nullptr) {
+      return 0;
+    }
+    std::vector<std::string> Names;
+    while (dirent* Entry = readdir(Files)) {
+      std::string_view Name = Entry->d_name;
+      if (Name.size() > 4 && Name.substr(Name.size() - 4) == ".seg") {
+        Names.emplace_back(Name);
+      }
+    }
+    closedir(Files);
+    // In time order, and in the order of their suffixes for the same time
+    std::sort(Names.begin(), Names.end(),
+              [](const std::string& A, const std::string& B) {
+                return NameOrder(A) < NameOrder(B);
+              });
+    auto Entry = std::make_unique<SERIES>();
+    for (const std::string& Name : Names) {
+      std::shared_ptr<SERIES_SEGMENT> Segment =
+          SERIES_SEGMENT::Load(Directory + "/" + Name);
+      if (Segment != nullptr) {
+        Entry->LastTime = std::max(Entry->LastTime, Segment->LastTime());
+        Entry->Segments.push_back(std::move(Segment));
+      }
+    }
+    const uint64_t Loaded = Entry->Segments.size();
+    Segments.fetch_add(Loaded, std::memory_order_relaxed);
+    Series[SensorId] = std::move(Entry);
+    return Loaded;
+  }
+
+  // The first time and suffix a segment file is named after
+  static std::pair<uint64_t, uint64_t> NameOrder(const std::string& Name) {
+    char* End;
+    const uint64_t Time = strtoull(Name.c_str(), &End, 10);
+    const uint64_t Suffix = *End == '-' ? strtoull(End + 1, NULL, 10) : 0;
+    return {Time, Suffix};
+  }
+
+  // Seals the active segment of Entry and starts a new one, named after
+  // Time and, if a segment starting then exists already, the first free
+  // suffix. Called with the series' lock held.
+  SERIES_SEGMENT* Roll(uint64_t SensorId, SERIES& Entry, uint64_t Time) {
+    if (Entry.Writable) {
+      Entry.Segments.back()->Seal();
+      Entry.Writable = false;
+    }
+    const std::string Directory = SeriesPath(SensorId);
+    if (mkdir(Directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      SPOQ_LOG_ERROR("Store {} not created, errno {}", Directory, errno);
+      return nullptr;
+    }
+    char Name[48];
+    std::shared_ptr<SERIES_SEGMENT> Segment;
+    for (uint32_t Suffix = 0; Segment == nullptr; ++Suffix) {
+      if (Suffix == 0) {
+        snprintf(Name, sizeof(Name), "/%020llu.seg", (unsigned long long)Time);
+      } else {
+        snprintf(Name, sizeof(Name), "/%020llu-%u.seg",
+                 (unsigned long long)Time, Suffix);
+      }
+      Segment = SERIES_SEGMENT::Create(Directory + Name, SensorId, Time,
+                                       SegmentBytes);
+      if (Segment == nullptr &&
+          (errno != EEXIST || Suffix + 1 == SERIES_MAX_SAME_TIME)) {
+        SPOQ_LOG_ERROR("Store: no segment created for sensor {}", SensorId);
+        return nullptr;
+      }
+    }
+    SPOQ_LOG_DEBUG("Store: new segment {}{}", Directory, Name);
+    Entry.Segments.push_back(std::move(Segment));
+    Entry.Writable = true;
+    Segments.fetch_add(1, std::memory_order_relaxed);
+    return Entry.Segments.back().get();
+  }
+
+  mutable std::shared_mutex Lock;
+  std::map<uint64_t, std::unique_ptr<SERIES>> Series;
+  std::string Root;
+  uint64_t SegmentBytes = SERIES_DEFAULT_SEGMENT_BYTES;
+  uint64_t MaxAgeNs = SERIES_DEFAULT_SEGMENT_AGE_NS;
+  std::atomic<uint64_t> Segments{0};
+  bool Opened = false;
+};
@@ -1,6 +1,12 @@
+#pragma once
+
+#include <iostream>
 #include <string>
 
-// With a proper JSON parsing setup, we would parse the messages into these PDUs
+#include "spoq_log.h"
+
+// Owning copy of a PDU, filled from a decoded SPOQ_PDU_VIEW with SpoqPduCopy.
+// Data holds the JSON data member, or the binary data fields.
 struct SPOQ_HEADER {
   std::string version = {};
   std::string status = {};
@@ -25,7 +31,7 @@ enum class SPOQ_STATE {
   CLOSED      // Connection intentionally closed (normal or error exit)
 };
 
-inline std::string ToString(SPOQ_STATE state) {
+inline const char* ToString(SPOQ_STATE state) {
     switch (state) {
         case SPOQ_STATE::INIT:        return "[SPOQ] STATE INIT";
         case SPOQ_STATE::NEGOTIATE:   return "[SPOQ] STATE NEGOTIATE";
@@ -41,5 +47,5 @@ inline std::string ToString(SPOQ_STATE state) {
 
 void setSpoqState(SPOQ_STATE& state, const SPOQ_STATE next){
   state = next;
-  std::cout << ToString(next) << "\n";
+  SPOQ_LOG_INFO("{}", ToString(next));
 }
\ No newline at end of file
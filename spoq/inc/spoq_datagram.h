@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "msquic.h"
+#include "quic_config.h"
+#include "send_pool.h"
+#include "spoq_pdu.h"
+
+//
+// Unreliable data path for sensor readings over QUIC DATAGRAM frames.
+//
+// When both peers enable it (-datagram) and agree during NEGOTIATE, each
+// reading travels as one binary PDU in its own datagram while negotiation and
+// stream shutdown stay on the reliable stream. Readings carry a sequence
+// number in field SPOQ_FIELD_SEQUENCE. Lost datagrams are never retransmitted
+// and the receiver drops any reading older than the newest one it has seen,
+// so a lost packet never delays fresher readings.
+//
+
+// Data field holding a reading's sequence number
+constexpr uint32_t SPOQ_FIELD_SEQUENCE = 1;
+
+// Data field holding the time a reading was sent, in steady clock
+// nanoseconds. Only comparable between processes on the same host.
+constexpr uint32_t SPOQ_FIELD_TIME = 3;
+
+// Accepts only readings newer than every reading accepted before
+class SEQUENCE_FILTER {
+ public:
+  bool Accept(uint64_t Sequence) {
+    if (Any && Sequence <= Newest) {
+      ++Stale;
+      return false;
+    }
+    Any = true;
+    Newest = Sequence;
+    ++Accepted;
+    return true;
+  }
+
+  uint64_t AcceptedCount() const { return Accepted; }
+  uint64_t StaleCount() const { return Stale; }
+
+ private:
+  bool Any = false;
+  uint64_t Newest = 0;
+  uint64_t Accepted = 0;
+  uint64_t Stale = 0;
+};
+
+// Encodes a binary PDU into a pooled buffer and sends it as one datagram.
+// Returns QUIC_STATUS_BUFFER_TOO_SMALL, without sending, if the PDU does not
+// fit in MaxLength, so the caller can use the stream instead. The buffer is
+// released by SpoqDatagramSendStateChanged.
+inline QUIC_STATUS SpoqDatagramSend(_In_ HQUIC Connection,
+                                    const SPOQ_HEADER_VIEW& Header,
+                                    std::string_view Fields,
+                                    uint16_t MaxLength) {
+  // Length prefix and three header varints at most
+  size_t Capacity = Fields.size() + 4 * SPOQ_VARINT_MAX_LENGTH;
+  if (Capacity > MaxLength) {
+    Capacity = MaxLength;
+  }
+  SEND_BUFFER* Datagram = SendBufferAlloc((uint32_t)Capacity);
+  if (Datagram == nullptr) {
+    return QUIC_STATUS_OUT_OF_MEMORY;
+  }
+  Datagram->Buffer.Length = (uint32_t)SpoqEncodeBinary(
+      Header, Fields, Datagram->Buffer.Buffer, Capacity);
+  if (Datagram->Buffer.Length == 0) {
+    SendBufferFree(Datagram);
+    return QUIC_STATUS_BUFFER_TOO_SMALL;
+  }
+  QUIC_STATUS Status = MsQuic->DatagramSend(
+      Connection, &Datagram->Buffer, 1, QUIC_SEND_FLAG_NONE, Datagram);
+  if (QUIC_FAILED(Status)) {
+    SendBufferFree(Datagram);
+  }
+  return Status;
+}
+
+// Handles QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED for a datagram
+// sent with SpoqDatagramSend. Returns true if the datagram was lost; it is
+// not sent again.
+inline bool SpoqDatagramSendStateChanged(_In_ QUIC_CONNECTION_EVENT* Event) {
+  const QUIC_DATAGRAM_SEND_STATE State =
+      Event->DATAGRAM_SEND_STATE_CHANGED.State;
+  if (!QUIC_DATAGRAM_SEND_STATE_IS_FINAL(State)) {
+    return false;
+  }
+  SendBufferFree(Event->DATAGRAM_SEND_STATE_CHANGED.ClientContext);
+  return State == QUIC_DATAGRAM_SEND_LOST_DISCARDED ||
+         State == QUIC_DATAGRAM_SEND_CANCELED;
+}
+
+// Decodes a received datagram holding one binary PDU and returns its
+// sequence number in *Sequence
+inline SPOQ_DECODE_STATUS SpoqDatagramDecode(_In_ const QUIC_BUFFER* Buffer,
+                                             _Out_ SPOQ_PDU_VIEW* Pdu,
+                                             _Out_ uint64_t* Sequence) {
+  const uint8_t* P = Buffer->Buffer;
+  const uint8_t* End = P + Buffer->Length;
+  uint64_t Length = 0;
+  *Sequence = 0;
+  if (!GetVarint(&P, End, &Length) || Length != (uint64_t)(End - P)) {
+    return SPOQ_DECODE_STATUS::SYNTAX;
+  }
+  SPOQ_DECODE_STATUS Status =
+      SpoqDecodeBinary(std::string_view((const char*)P, Length), Pdu);
+  if (Status != SPOQ_DECODE_STATUS::SUCCESS) {
+    return Status;
+  }
+  SPOQ_FIELD_READER Reader(Pdu->Data);
+  SPOQ_FIELD Field;
+  while (Reader.Next(&Field)) {
+    if (Field.Id == SPOQ_FIELD_SEQUENCE &&
+        Field.Type == SPOQ_WIRE_TYPE::VARINT) {
+      *Sequence = Field.Uint;
+      return SPOQ_DECODE_STATUS::SUCCESS;
+    }
+  }
+  return SPOQ_DECODE_STATUS::SCHEMA;
+}
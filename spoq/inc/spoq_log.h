@@ -0,0 +1,464 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//
+// Asynchronous, leveled logging for msquic callback threads.
+//
+// SPOQ_LOG_INFO("[{}] Stream event: {}", Stream, Name) does not format or
+// write anything on the calling thread. It captures a timestamp, the format
+// string pointer and the raw argument values into a fixed-size record in the
+// calling thread's own single-producer ring buffer, which costs a few tens of
+// nanoseconds and never takes a lock. A background flusher thread drains all
+// rings every millisecond, formats the records and writes them to stdout. If
+// a ring is full the record is dropped and counted rather than blocking the
+// datapath.
+//
+// Statements below SPOQ_LOG_COMPILED_LEVEL are removed at compile time,
+// arguments included. The remaining ones are filtered at runtime against the
+// level set with SpoqLogSetLevel (-log_level on the command line).
+//
+// Formats must be string literals using {} as the placeholder. Supported
+// arguments are integers, floating point, bool, char, C strings,
+// std::string(_view), pointers (printed as HQUIC handles are) and
+// SpoqLogHex(Value). Strings are copied and truncated to fit the record.
+//
+
+enum class SPOQ_LOG_LEVEL : uint8_t { TRACE, DEBUG, INFO, WARN, ERROR, NONE };
+
+// Lowest level compiled in; 0 = TRACE ... 5 = NONE
+#ifndef SPOQ_LOG_COMPILED_LEVEL
+#define SPOQ_LOG_COMPILED_LEVEL 1
+#endif
+
+#define SPOQ_LOG(Level, ...)                                             \
+  do {                                                                   \
+    if constexpr ((int)SPOQ_LOG_LEVEL::Level >= SPOQ_LOG_COMPILED_LEVEL) { \
+      if (SpoqLogEnabled(SPOQ_LOG_LEVEL::Level)) {                       \
+        SpoqLogWrite(SPOQ_LOG_LEVEL::Level, __VA_ARGS__);                \
+      }                                                                  \
+    }                                                                    \
+  } while (0)
+
+#define SPOQ_LOG_TRACE(...) SPOQ_LOG(TRACE, __VA_ARGS__)
+#define SPOQ_LOG_DEBUG(...) SPOQ_LOG(DEBUG, __VA_ARGS__)
+#define SPOQ_LOG_INFO(...) SPOQ_LOG(INFO, __VA_ARGS__)
+#define SPOQ_LOG_WARN(...) SPOQ_LOG(WARN, __VA_ARGS__)
+#define SPOQ_LOG_ERROR(...) SPOQ_LOG(ERROR, __VA_ARGS__)
+
+// Bytes per record, header included
+constexpr size_t LOG_RECORD_SIZE = 256;
+
+// Records per thread ring, a power of two
+constexpr uint64_t LOG_RING_CAPACITY = 1024;
+
+// How often the flusher drains the rings
+constexpr auto LOG_FLUSH_INTERVAL = std::chrono::milliseconds(1);
+
+inline const char* ToString(SPOQ_LOG_LEVEL Level) {
+  switch (Level) {
+    case SPOQ_LOG_LEVEL::TRACE:
+      return "TRACE";
+    case SPOQ_LOG_LEVEL::DEBUG:
+      return "DEBUG";
+    case SPOQ_LOG_LEVEL::INFO:
+      return "INFO";
+    case SPOQ_LOG_LEVEL::WARN:
+      return "WARN";
+    case SPOQ_LOG_LEVEL::ERROR:
+      return "ERROR";
+    default:
+      return "NONE";
+  }
+}
+
+// Prints an integer argument in hex with a 0x prefix
+struct SPOQ_LOG_HEX {
+  uint64_t Value;
+};
+
+template <typename T>
+inline SPOQ_LOG_HEX SpoqLogHex(T Value) {
+  return {(uint64_t)Value};
+}
+
+namespace spoq_log_detail {
+
+enum class ARG_TYPE : uint8_t {
+  INT,
+  UINT,
+  DOUBLE,
+  BOOL,
+  CHAR,
+  POINTER,
+  HEX,
+  STRING
+};
+
+struct RECORD {
+  uint64_t Timestamp;
+  const char* Format;
+  uint16_t Length;  // Bytes of Args in use
+  uint8_t Level;
+  uint8_t Truncated;
+  uint8_t Args[LOG_RECORD_SIZE - 20];
+};
+static_assert(sizeof(RECORD) == LOG_RECORD_SIZE);
+
+// Single-producer (the owning thread) single-consumer (the flusher) ring
+struct alignas(64) RING {
+  alignas(64) std::atomic<uint64_t> Head{0};
+  alignas(64) std::atomic<uint64_t> Tail{0};
+  std::atomic<uint64_t> Dropped{0};
+  std::atomic<bool> Closed{false};
+  RECORD Records[LOG_RING_CAPACITY];
+};
+
+// Serializes arguments into a record, marking it truncated once full
+struct WRITER {
+  RECORD* Record;
+
+  bool Reserve(size_t Length) {
+    if (Record->Length + Length > sizeof(Record->Args)) {
+      Record->Truncated = 1;
+      return false;
+    }
+    return true;
+  }
+
+  template <typename T>
+  void Put(ARG_TYPE Type, T Value) {
+    if (Reserve(1 + sizeof(T))) {
+      Record->Args[Record->Length] = (uint8_t)Type;
+      memcpy(Record->Args + Record->Length + 1, &Value, sizeof(T));
+      Record->Length += 1 + sizeof(T);
+    }
+  }
+
+  void PutString(std::string_view Value) {
+    if (!Reserve(3)) {
+      return;
+    }
+    const size_t Room = sizeof(Record->Args) - Record->Length - 3;
+    if (Value.size() > Room) {
+      Value = Value.substr(0, Room);
+      Record->Truncated = 1;
+    }
+    const uint16_t Length = (uint16_t)Value.size();
+    Record->Args[Record->Length] = (uint8_t)ARG_TYPE::STRING;
+    memcpy(Record->Args + Record->Length + 1, &Length, 2);
+    memcpy(Record->Args + Record->Length + 3, Value.data(), Length);
+    Record->Length += 3 + Length;
+  }
+
+  template <typename T>
+  void Arg(const T& Value) {
+    using U = std::decay_t<T>;
+    if constexpr (std::is_array_v<T>) {
+      PutString(std::string_view(Value));
+    } else if constexpr (std::is_same_v<U, bool>) {
+      Put(ARG_TYPE::BOOL, (uint8_t)Value);
+    } else if constexpr (std::is_same_v<U, char>) {
+      Put(ARG_TYPE::CHAR, Value);
+    } else if constexpr (std::is_same_v<U, SPOQ_LOG_HEX>) {
+      Put(ARG_TYPE::HEX, Value.Value);
+    } else if constexpr (std::is_enum_v<U>) {
+      Arg((std::underlying_type_t<U>)Value);
+    } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+      Put(ARG_TYPE::INT, (int64_t)Value);
+    } else if constexpr (std::is_integral_v<U>) {
+      Put(ARG_TYPE::UINT, (uint64_t)Value);
+    } else if constexpr (std::is_floating_point_v<U>) {
+      Put(ARG_TYPE::DOUBLE, (double)Value);
+    } else if constexpr (std::is_same_v<U, const char*> ||
+                         std::is_same_v<U, char*>) {
+      PutString(Value != nullptr ? std::string_view(Value) : "(null)");
+    } else if constexpr (std::is_convertible_v<const U&, std::string_view>) {
+      PutString(std::string_view(Value));
+    } else if constexpr (std::is_pointer_v<U>) {
+      Put(ARG_TYPE::POINTER, (const void*)Value);
+    } else {
+      static_assert(sizeof(U) == 0, "Unsupported log argument type");
+    }
+  }
+};
+
+class LOGGER {
+ public:
+  static LOGGER& Instance() {
+    static LOGGER Logger;
+    return Logger;
+  }
+
+  ~LOGGER() {
+    {
+      std::lock_guard<std::mutex> Guard(WakeLock);
+      Stopping = true;
+    }
+    Wake.notify_one();
+    if (Flusher.joinable()) {
+      Flusher.join();
+    }
+    Drain();
+    for (RING* Ring : Rings) {
+      delete Ring;
+    }
+  }
+
+  std::atomic<uint8_t> Level{(uint8_t)SPOQ_LOG_LEVEL::INFO};
+
+  RING* Register() {
+    RING* Ring = new RING;
+    // Fault the ring in now rather than on the datapath
+    memset(Ring->Records, 0, sizeof(Ring->Records));
+    std::lock_guard<std::mutex> Guard(RingsLock);
+    Rings.push_back(Ring);
+    return Ring;
+  }
+
+  // Formats and writes everything currently queued, from any thread
+  void Drain() {
+    std::lock_guard<std::mutex> DrainGuard(DrainLock);
+    std::vector<RING*> Snapshot;
+    {
+      std::lock_guard<std::mutex> Guard(RingsLock);
+      Snapshot = Rings;
+    }
+    bool Wrote = false;
+    for (RING* Ring : Snapshot) {
+      Wrote |= DrainRing(Ring);
+    }
+    if (Wrote) {
+      fflush(stdout);
+    }
+    ReapClosedRings();
+  }
+
+  const std::chrono::steady_clock::time_point Start =
+      std::chrono::steady_clock::now();
+
+ private:
+  LOGGER() : Flusher([this]() { Run(); }) {}
+
+  void Run() {
+    std::unique_lock<std::mutex> Lock(WakeLock);
+    while (!Stopping) {
+      Wake.wait_for(Lock, LOG_FLUSH_INTERVAL);
+      Lock.unlock();
+      Drain();
+      Lock.lock();
+    }
+  }
+
+  bool DrainRing(RING* Ring) {
+    const uint64_t First = Ring->Tail.load(std::memory_order_relaxed);
+    uint64_t Tail = First;
+    const uint64_t Head = Ring->Head.load(std::memory_order_acquire);
+    const uint64_t Dropped =
+        Ring->Dropped.exchange(0, std::memory_order_relaxed);
+    if (Dropped != 0) {
+      fprintf(stdout, "%12s %-5s %llu log records dropped (ring full)\n", "",
+              "WARN", (unsigned long long)Dropped);
+    }
+    for (; Tail != Head; ++Tail) {
+      Format(Ring->Records[Tail & (LOG_RING_CAPACITY - 1)]);
+    }
+    Ring->Tail.store(Tail, std::memory_order_release);
+    return Tail != First || Dropped != 0;
+  }
+
+  void ReapClosedRings() {
+    std::lock_guard<std::mutex> Guard(RingsLock);
+    for (size_t i = 0; i < Rings.size();) {
+      RING* Ring = Rings[i];
+      if (Ring->Closed.load(std::memory_order_acquire) &&
+          Ring->Tail.load(std::memory_order_relaxed) ==
+              Ring->Head.load(std::memory_order_acquire)) {
+        Rings[i] = Rings.back();
+        Rings.pop_back();
+        delete Ring;
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  // Renders one record into Line and writes it
+  void Format(const RECORD& Record) {
+    std::string& Out = Line;
+    Out.clear();
+    char Scratch[64];
+    snprintf(Scratch, sizeof(Scratch), "%12.6f %-5s ",
+             (double)Record.Timestamp / 1e9,
+             ToString((SPOQ_LOG_LEVEL)Record.Level));
+    Out += Scratch;
+
+    size_t Offset = 0;
+    for (const char* P = Record.Format; *P != '\0'; ++P) {
+      if (P[0] != '{' || P[1] != '}') {
+        Out += *P;
+        continue;
+      }
+      ++P;
+      if (Offset >= Record.Length) {
+        Out += "...";
+        continue;
+      }
+      const auto Type = (ARG_TYPE)Record.Args[Offset++];
+      const uint8_t* Value = Record.Args + Offset;
+      switch (Type) {
+        case ARG_TYPE::INT: {
+          int64_t V;
+          memcpy(&V, Value, sizeof(V));
+          snprintf(Scratch, sizeof(Scratch), "%lld", (long long)V);
+          Offset += sizeof(V);
+          break;
+        }
+        case ARG_TYPE::UINT: {
+          uint64_t V;
+          memcpy(&V, Value, sizeof(V));
+          snprintf(Scratch, sizeof(Scratch), "%llu", (unsigned long long)V);
+          Offset += sizeof(V);
+          break;
+        }
+        case ARG_TYPE::HEX: {
+          uint64_t V;
+          memcpy(&V, Value, sizeof(V));
+          snprintf(Scratch, sizeof(Scratch), "0x%llx", (unsigned long long)V);
+          Offset += sizeof(V);
+          break;
+        }
+        case ARG_TYPE::DOUBLE: {
+          double V;
+          memcpy(&V, Value, sizeof(V));
+          snprintf(Scratch, sizeof(Scratch), "%g", V);
+          Offset += sizeof(V);
+          break;
+        }
+        case ARG_TYPE::BOOL:
+          snprintf(Scratch, sizeof(Scratch), "%s", *Value ? "true" : "false");
+          Offset += 1;
+          break;
+        case ARG_TYPE::CHAR:
+          snprintf(Scratch, sizeof(Scratch), "%c", (char)*Value);
+          Offset += 1;
+          break;
+        case ARG_TYPE::POINTER: {
+          const void* V;
+          memcpy(&V, Value, sizeof(V));
+          snprintf(Scratch, sizeof(Scratch), "%p", V);
+          Offset += sizeof(V);
+          break;
+        }
+        case ARG_TYPE::STRING: {
+          uint16_t Length;
+          memcpy(&Length, Value, sizeof(Length));
+          Out.append((const char*)Value + 2, Length);
+          Offset += 2 + Length;
+          continue;
+        }
+      }
+      Out += Scratch;
+    }
+    if (Record.Truncated) {
+      Out += " [truncated]";
+    }
+    Out += '\n';
+    fwrite(Out.data(), 1, Out.size(), stdout);
+  }
+
+  std::mutex RingsLock;
+  std::vector<RING*> Rings;
+  std::mutex DrainLock;
+  std::string Line;
+
+  std::mutex WakeLock;
+  std::condition_variable Wake;
+  bool Stopping = false;
+  std::thread Flusher;
+};
+
+// Owns the calling thread's ring and hands it to the flusher on thread exit
+struct RING_BINDING {
+  RING* Ring = nullptr;
+  ~RING_BINDING() {
+    if (Ring != nullptr) {
+      Ring->Closed.store(true, std::memory_order_release);
+    }
+  }
+};
+
+inline thread_local RING_BINDING RingBinding;
+
+inline RING* RingForThisThread() {
+  if (RingBinding.Ring == nullptr) {
+    RingBinding.Ring = LOGGER::Instance().Register();
+  }
+  return RingBinding.Ring;
+}
+
+}  // namespace spoq_log_detail
+
+inline bool SpoqLogEnabled(SPOQ_LOG_LEVEL Level) {
+  return (uint8_t)Level >= spoq_log_detail::LOGGER::Instance().Level.load(
+                               std::memory_order_relaxed);
+}
+
+// Queues one record on the calling thread's ring. Use the SPOQ_LOG_* macros
+// instead, so that disabled levels are compiled out.
+template <size_t N, typename... Args>
+inline void SpoqLogWrite(SPOQ_LOG_LEVEL Level, const char (&Format)[N],
+                         const Args&... Values) {
+  using namespace spoq_log_detail;
+  RING* Ring = RingForThisThread();
+  const uint64_t Head = Ring->Head.load(std::memory_order_relaxed);
+  if (Head - Ring->Tail.load(std::memory_order_acquire) >= LOG_RING_CAPACITY) {
+    Ring->Dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  RECORD* Record = &Ring->Records[Head & (LOG_RING_CAPACITY - 1)];
+  Record->Timestamp = (uint64_t)std::chrono::duration_cast<
+                          std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() -
+                          LOGGER::Instance().Start)
+                          .count();
+  Record->Format = Format;
+  Record->Length = 0;
+  Record->Level = (uint8_t)Level;
+  Record->Truncated = 0;
+  [[maybe_unused]] WRITER Writer = {Record};
+  (Writer.Arg(Values), ...);
+  Ring->Head.store(Head + 1, std::memory_order_release);
+}
+
+// Sets the runtime level from a name such as "debug". Returns false, leaving
+// the level unchanged, if the name is not recognized.
+inline bool SpoqLogSetLevel(std::string_view Name) {
+  for (uint8_t i = 0; i <= (uint8_t)SPOQ_LOG_LEVEL::NONE; ++i) {
+    if (strncasecmp(Name.data(), ToString((SPOQ_LOG_LEVEL)i), Name.size()) ==
+            0 &&
+        Name.size() == strlen(ToString((SPOQ_LOG_LEVEL)i))) {
+      spoq_log_detail::LOGGER::Instance().Level.store(
+          i, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes out everything logged so far, e.g. before printing to stdout
+// directly or exiting
+inline void SpoqLogFlush() { spoq_log_detail::LOGGER::Instance().Drain(); }
@@ -0,0 +1,586 @@
+#pragma once
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "msquic.h"
+#include "send_pool.h"
+#include "spoq_log.h"
+
+//
+// Lock-free metrics exported in the Prometheus text format.
+//
+// Process-wide counters and latency histograms are sharded: every thread adds
+// to its own cache line with a relaxed atomic, and a scrape sums the shards.
+// Per-connection figures (messages, bytes, and a periodic sample of msquic's
+// QUIC_STATISTICS_V2) have a single writer, the connection's callback thread,
+// and are read by the exporter without locks.
+//
+// METRICS_EXPORTER serves the text on a Unix-domain socket
+// (-metrics_socket:<path>, e.g. curl --unix-socket <path> http://x/metrics)
+// and/or rewrites a file every METRICS_DUMP_INTERVAL (-metrics_file:<path>),
+// which suits node_exporter's textfile collector.
+//
+
+// Shards per counter or histogram, a power of two
+constexpr uint32_t METRIC_SHARD_COUNT = 16;
+
+// Histogram bucket i counts values below 2^i microseconds; the last bucket
+// (about 8.4 s and above) is +Inf
+constexpr uint32_t METRIC_BUCKET_COUNT = 24;
+
+// How often msquic connection statistics are sampled
+constexpr auto METRICS_SAMPLE_INTERVAL = std::chrono::seconds(1);
+
+// How often -metrics_file is rewritten
+constexpr auto METRICS_DUMP_INTERVAL = std::chrono::seconds(1);
+
+namespace spoq_metrics_detail {
+
+// Threads are spread over the shards in the order they first record
+inline uint32_t ShardForThisThread() {
+  static std::atomic<uint32_t> Next{0};
+  thread_local const uint32_t Shard =
+      Next.fetch_add(1, std::memory_order_relaxed) & (METRIC_SHARD_COUNT - 1);
+  return Shard;
+}
+
+inline uint64_t NowNs() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline void AppendUint(std::string& Out, uint64_t Value) {
+  char Text[24];
+  int Length = snprintf(Text, sizeof(Text), "%llu", (unsigned long long)Value);
+  Out.append(Text, Length);
+}
+
+inline void AppendHeader(std::string& Out, std::string_view Name,
+                         std::string_view Help, std::string_view Type) {
+  Out.append("# HELP ").append(Name).append(" ").append(Help).append("\n");
+  Out.append("# TYPE ").append(Name).append(" ").append(Type).append("\n");
+}
+
+inline void AppendSample(std::string& Out, std::string_view Name,
+                         std::string_view Labels, uint64_t Value) {
+  Out.append(Name);
+  if (!Labels.empty()) {
+    Out.append("{").append(Labels).append("}");
+  }
+  Out.append(" ");
+  AppendUint(Out, Value);
+  Out.append("\n");
+}
+
+}  // namespace spoq_metrics_detail
+
+// Current time for METRIC_HISTOGRAM::RecordSince
+inline uint64_t MetricNow() { return spoq_metrics_detail::NowNs(); }
+
+// Monotonic counter safe to bump from any thread
+class METRIC_COUNTER {
+ public:
+  void Add(uint64_t Value = 1) {
+    Shards[spoq_metrics_detail::ShardForThisThread()].Value.fetch_add(
+        Value, std::memory_order_relaxed);
+  }
+
+  uint64_t Value() const {
+    uint64_t Total = 0;
+    for (const SHARD& Shard : Shards) {
+      Total += Shard.Value.load(std::memory_order_relaxed);
+    }
+    return Total;
+  }
+
+ private:
+  struct alignas(64) SHARD {
+    std::atomic<uint64_t> Value{0};
+  };
+  SHARD Shards[METRIC_SHARD_COUNT];
+};
+
+// Value written by a single thread and read by the exporter
+class METRIC_VALUE {
+ public:
+  void Add(uint64_t Delta = 1) {
+    Value.store(Value.load(std::memory_order_relaxed) + Delta,
+                std::memory_order_relaxed);
+  }
+  void Set(uint64_t NewValue) {
+    Value.store(NewValue, std::memory_order_relaxed);
+  }
+  uint64_t Get() const { return Value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> Value{0};
+};
+
+// Latency histogram with power-of-two microsecond buckets
+class METRIC_HISTOGRAM {
+ public:
+  void Record(uint64_t Ns) {
+    uint64_t Us = Ns / 1000;
+    uint32_t Bucket = (uint32_t)std::bit_width(Us);
+    if (Bucket >= METRIC_BUCKET_COUNT) {
+      Bucket = METRIC_BUCKET_COUNT - 1;
+    }
+    SHARD& Shard = Shards[spoq_metrics_detail::ShardForThisThread()];
+    Shard.Buckets[Bucket].fetch_add(1, std::memory_order_relaxed);
+    Shard.SumNs.fetch_add(Ns, std::memory_order_relaxed);
+  }
+
+  // Records the time elapsed since Start, a MetricNow() value
+  void RecordSince(uint64_t Start) { Record(MetricNow() - Start); }
+
+  // Appends the _bucket, _sum and _count series for Name
+  void Render(std::string& Out, std::string_view Name,
+              std::string_view Help) const {
+    using namespace spoq_metrics_detail;
+    uint64_t Counts[METRIC_BUCKET_COUNT] = {};
+    uint64_t SumNs = 0;
+    for (const SHARD& Shard : Shards) {
+      for (uint32_t i = 0; i < METRIC_BUCKET_COUNT; ++i) {
+        Counts[i] += Shard.Buckets[i].load(std::memory_order_relaxed);
+      }
+      SumNs += Shard.SumNs.load(std::memory_order_relaxed);
+    }
+    AppendHeader(Out, Name, Help, "histogram");
+    std::string Series = std::string(Name) + "_bucket";
+    uint64_t Cumulative = 0;
+    char Labels[32];
+    for (uint32_t i = 0; i < METRIC_BUCKET_COUNT - 1; ++i) {
+      Cumulative += Counts[i];
+      snprintf(Labels, sizeof(Labels), "le=\"%g\"", (double)(1ull << i) / 1e6);
+      AppendSample(Out, Series, Labels, Cumulative);
+    }
+    Cumulative += Counts[METRIC_BUCKET_COUNT - 1];
+    AppendSample(Out, Series, "le=\"+Inf\"", Cumulative);
+    char Sum[32];
+    snprintf(Sum, sizeof(Sum), "%.9f", (double)SumNs / 1e9);
+    Out.append(Name).append("_sum ").append(Sum).append("\n");
+    AppendSample(Out, std::string(Name) + "_count", {}, Cumulative);
+  }
+
+ private:
+  struct alignas(64) SHARD {
+    std::atomic<uint64_t> Buckets[METRIC_BUCKET_COUNT] = {};
+    std::atomic<uint64_t> SumNs{0};
+  };
+  SHARD Shards[METRIC_SHARD_COUNT];
+};
+
+// Process-wide SPOQ metrics. Each executable fills in the ones that apply to
+// its role.
+struct SPOQ_METRICS {
+  METRIC_COUNTER ConnectionsAccepted;
+  METRIC_COUNTER HandshakesCompleted;
+  METRIC_COUNTER HandshakesFailed;
+  METRIC_COUNTER HandshakesResumed;
+  METRIC_COUNTER NegotiationsSucceeded;
+  METRIC_COUNTER NegotiationsFailed;
+  METRIC_COUNTER MessagesSent;
+  METRIC_COUNTER BytesSent;
+  METRIC_COUNTER MessagesReceived;
+  METRIC_COUNTER BytesReceived;
+  METRIC_COUNTER MessagesDropped;
+  METRIC_COUNTER ReadingsIngested;
+  METRIC_COUNTER ReadingsStored;
+  METRIC_COUNTER ReadingsForwarded;
+  METRIC_COUNTER ForwardsDropped;
+  METRIC_COUNTER ForwardsSkipped;
+  METRIC_COUNTER DatagramsSent;
+  METRIC_COUNTER DatagramsLost;
+  METRIC_COUNTER SendPauses;
+  METRIC_COUNTER AutotuneIncreases;
+  METRIC_COUNTER AutotuneDecreases;
+  METRIC_COUNTER AutotuneFailures;
+  METRIC_COUNTER RecordsCaptured;
+  METRIC_COUNTER CaptureDropped;
+  METRIC_COUNTER ConnectionsRefused;
+  METRIC_COUNTER ReceivePauses;
+  METRIC_COUNTER RateLimitedClosed;
+  // StreamSend to its SEND_COMPLETE
+  METRIC_HISTOGRAM SendLatency;
+  // Time spent handling a RECEIVE event
+  METRIC_HISTOGRAM ReceiveLatency;
+  // Time a reading waited in an ingest queue
+  METRIC_HISTOGRAM IngestLatency;
+
+  void Render(std::string& Out) const {
+    Counter(Out, "spoq_connections_accepted_total",
+            "Connections accepted by the listener", ConnectionsAccepted);
+    Counter(Out, "spoq_handshakes_completed_total",
+            "QUIC handshakes that completed", HandshakesCompleted);
+    Counter(Out, "spoq_handshakes_failed_total",
+            "Connections shut down before the handshake completed",
+            HandshakesFailed);
+    Counter(Out, "spoq_handshakes_resumed_total",
+            "Handshakes that resumed an earlier TLS session",
+            HandshakesResumed);
+    Counter(Out, "spoq_negotiations_succeeded_total",
+            "SPOQ negotiations that reached ESTABLISHED",
+            NegotiationsSucceeded);
+    Counter(Out, "spoq_negotiations_failed_total",
+            "SPOQ negotiations that were rejected or malformed",
+            NegotiationsFailed);
+    Counter(Out, "spoq_messages_sent_total", "Data messages sent",
+            MessagesSent);
+    Counter(Out, "spoq_bytes_sent_total", "Data message bytes sent on streams",
+            BytesSent);
+    Counter(Out, "spoq_messages_received_total", "Data messages received",
+            MessagesReceived);
+    Counter(Out, "spoq_bytes_received_total", "Data message bytes received",
+            BytesReceived);
+    Counter(Out, "spoq_messages_dropped_total",
+            "Received messages dropped as malformed, stale or of another "
+            "sensor",
+            MessagesDropped);
+    Counter(Out, "spoq_readings_ingested_total",
+            "Readings received from producing clients", ReadingsIngested);
+    Counter(Out, "spoq_readings_stored_total",
+            "Readings persisted in the reading store", ReadingsStored);
+    Counter(Out, "spoq_readings_forwarded_total",
+            "Readings sent on to a subscriber", ReadingsForwarded);
+    Counter(Out, "spoq_forwards_dropped_total",
+            "Readings not sent on to a subscriber that was behind",
+            ForwardsDropped);
+    Counter(Out, "spoq_forwards_skipped_total",
+            "Readings not sent on to a subscriber of another wire version",
+            ForwardsSkipped);
+    Counter(Out, "spoq_datagrams_sent_total", "Readings sent as datagrams",
+            DatagramsSent);
+    Counter(Out, "spoq_datagrams_lost_total",
+            "Datagrams lost or canceled before delivery", DatagramsLost);
+    Counter(Out, "spoq_send_pauses_total",
+            "Times a data stream paused with its send window full",
+            SendPauses);
+    Counter(Out, "spoq_autotune_window_increases_total",
+            "Flow control windows the autotuner raised", AutotuneIncreases);
+    Counter(Out, "spoq_autotune_window_decreases_total",
+            "Flow control windows the autotuner lowered", AutotuneDecreases);
+    Counter(Out, "spoq_autotune_failures_total",
+            "Flow control window changes msquic refused", AutotuneFailures);
+    Counter(Out, "spoq_capture_records_total",
+            "Records written to the -capture file", RecordsCaptured);
+    Counter(Out, "spoq_capture_dropped_total",
+            "Records not captured because the writer was behind",
+            CaptureDropped);
+    Counter(Out, "spoq_connections_refused_total",
+            "Connections refused by admission control", ConnectionsRefused);
+    Counter(Out, "spoq_receive_pauses_total",
+            "Times a stream paused receiving, over its sensor's rate",
+            ReceivePauses);
+    Counter(Out, "spoq_rate_limited_closed_total",
+            "Connections closed for exceeding their sensor's rate",
+            RateLimitedClosed);
+    SendLatency.Render(Out, "spoq_send_complete_seconds",
+                       "Time from StreamSend to SEND_COMPLETE");
+    ReceiveLatency.Render(Out, "spoq_receive_callback_seconds",
+                          "Time spent handling a stream RECEIVE event");
+    IngestLatency.Render(Out, "spoq_ingest_queue_seconds",
+                         "Time a reading waited in an ingest queue");
+  }
+
+ private:
+  static void Counter(std::string& Out, std::string_view Name,
+                      std::string_view Help, const METRIC_COUNTER& Value) {
+    spoq_metrics_detail::AppendHeader(Out, Name, Help, "counter");
+    spoq_metrics_detail::AppendSample(Out, Name, {}, Value.Value());
+  }
+};
+
+inline SPOQ_METRICS& SpoqMetrics() {
+  static SPOQ_METRICS Metrics;
+  return Metrics;
+}
+
+// Records the StreamSend to SEND_COMPLETE latency of a send context stamped
+// by SEND_BATCHER::Flush or by the sender. Call before SendBufferFree.
+inline void SendBufferRecordLatency(void* ClientContext) {
+  auto Block = static_cast<SEND_BUFFER*>(ClientContext);
+  if (Block != nullptr && Block->SendTime != 0) {
+    SpoqMetrics().SendLatency.RecordSince(Block->SendTime);
+  }
+}
+
+// Per-connection figures, written on the connection's callback thread
+struct CONNECTION_METRICS {
+  // Sensor id learned during NEGOTIATE, used as a label
+  METRIC_VALUE SensorId;
+  METRIC_VALUE MessagesSent;
+  METRIC_VALUE BytesSent;
+  METRIC_VALUE MessagesReceived;
+  METRIC_VALUE BytesReceived;
+  // Latest QUIC_STATISTICS_V2 sample
+  METRIC_VALUE RttUs;
+  METRIC_VALUE MinRttUs;
+  METRIC_VALUE CongestionWindow;
+  METRIC_VALUE CongestionEvents;
+  METRIC_VALUE PacketsSent;
+  METRIC_VALUE PacketsLost;
+  METRIC_VALUE PacketsSpuriouslyLost;
+  METRIC_VALUE PacketsReceived;
+  METRIC_VALUE PacketsDropped;
+  // Flow control window set by the autotuner, the bandwidth-delay product it
+  // measured and how often it changed the window
+  METRIC_VALUE FlowControlWindow;
+  METRIC_VALUE BdpBytes;
+  METRIC_VALUE WindowChanges;
+  uint64_t LastSampleNs = 0;
+
+  // Samples the connection's transport statistics if the last sample is
+  // older than METRICS_SAMPLE_INTERVAL, or always if Force is set. Call from
+  // the connection's callbacks. Returns true, with the statistics in Out if
+  // given, when a sample was taken.
+  bool Sample(_In_ HQUIC Connection, bool Force = false,
+              QUIC_STATISTICS_V2* Out = nullptr) {
+    const uint64_t Now = MetricNow();
+    if (!Force && Now - LastSampleNs <
+                      (uint64_t)std::chrono::nanoseconds(
+                          METRICS_SAMPLE_INTERVAL)
+                          .count()) {
+      return false;
+    }
+    LastSampleNs = Now;
+    QUIC_STATISTICS_V2 Stats;
+    uint32_t Size = sizeof(Stats);
+    if (QUIC_FAILED(MsQuic->GetParam(Connection, QUIC_PARAM_CONN_STATISTICS_V2,
+                                     &Size, &Stats))) {
+      return false;
+    }
+    RttUs.Set(Stats.Rtt);
+    MinRttUs.Set(Stats.MinRtt);
+    CongestionWindow.Set(Stats.SendCongestionWindow);
+    CongestionEvents.Set(Stats.SendCongestionCount);
+    PacketsSent.Set(Stats.SendTotalPackets);
+    PacketsLost.Set(Stats.SendSuspectedLostPackets);
+    PacketsSpuriouslyLost.Set(Stats.SendSpuriousLostPackets);
+    PacketsReceived.Set(Stats.RecvTotalPackets);
+    PacketsDropped.Set(Stats.RecvDroppedPackets);
+    if (Out != nullptr) {
+      *Out = Stats;
+    }
+    return true;
+  }
+};
+
+// Renders the per-connection series of every connection that Each visits.
+// Each(Visit) must call Visit(Labels, Metrics) once per live connection,
+// with Labels such as connection="0x...",sensor="1".
+template <typename ForEachConnection>
+inline void RenderConnectionMetrics(std::string& Out,
+                                    ForEachConnection&& Each) {
+  using namespace spoq_metrics_detail;
+  struct SERIES {
+    const char* Name;
+    const char* Help;
+    const char* Type;
+    METRIC_VALUE CONNECTION_METRICS::*Field;
+  };
+  static const SERIES Series[] = {
+      {"spoq_connection_messages_sent_total", "Data messages sent", "counter",
+       &CONNECTION_METRICS::MessagesSent},
+      {"spoq_connection_bytes_sent_total", "Data message bytes sent",
+       "counter", &CONNECTION_METRICS::BytesSent},
+      {"spoq_connection_messages_received_total", "Data messages received",
+       "counter", &CONNECTION_METRICS::MessagesReceived},
+      {"spoq_connection_bytes_received_total", "Data message bytes received",
+       "counter", &CONNECTION_METRICS::BytesReceived},
+      {"spoq_connection_rtt_microseconds", "Smoothed RTT", "gauge",
+       &CONNECTION_METRICS::RttUs},
+      {"spoq_connection_min_rtt_microseconds", "Minimum RTT", "gauge",
+       &CONNECTION_METRICS::MinRttUs},
+      {"spoq_connection_congestion_window_bytes", "Congestion window",
+       "gauge", &CONNECTION_METRICS::CongestionWindow},
+      {"spoq_connection_congestion_events_total", "Congestion events",
+       "counter", &CONNECTION_METRICS::CongestionEvents},
+      {"spoq_connection_packets_sent_total", "QUIC packets sent", "counter",
+       &CONNECTION_METRICS::PacketsSent},
+      {"spoq_connection_packets_lost_total",
+       "QUIC packets suspected lost", "counter",
+       &CONNECTION_METRICS::PacketsLost},
+      {"spoq_connection_packets_spuriously_lost_total",
+       "QUIC packets wrongly declared lost", "counter",
+       &CONNECTION_METRICS::PacketsSpuriouslyLost},
+      {"spoq_connection_packets_received_total", "QUIC packets received",
+       "counter", &CONNECTION_METRICS::PacketsReceived},
+      {"spoq_connection_packets_dropped_total", "QUIC packets dropped",
+       "counter", &CONNECTION_METRICS::PacketsDropped},
+      {"spoq_connection_flow_control_window_bytes",
+       "Flow control window set by the autotuner", "gauge",
+       &CONNECTION_METRICS::FlowControlWindow},
+      {"spoq_connection_bdp_bytes",
+       "Bandwidth-delay product the autotuner measured", "gauge",
+       &CONNECTION_METRICS::BdpBytes},
+      {"spoq_connection_window_changes_total",
+       "Flow control window changes made by the autotuner", "counter",
+       &CONNECTION_METRICS::WindowChanges},
+  };
+  for (const SERIES& S : Series) {
+    AppendHeader(Out, S.Name, S.Help, S.Type);
+    Each([&](std::string_view Labels, const CONNECTION_METRICS& Metrics) {
+      AppendSample(Out, S.Name, Labels, (Metrics.*S.Field).Get());
+    });
+  }
+}
+
+// Serves rendered metrics on a Unix-domain socket and/or dumps them to a file
+// from a background thread
+class METRICS_EXPORTER {
+ public:
+  using RENDER = std::function<void(std::string& Out)>;
+
+  ~METRICS_EXPORTER() { Stop(); }
+
+  // Either path may be null. Returns false if the socket cannot be opened.
+  bool Start(const char* SocketPath, const char* FilePath, RENDER Renderer) {
+    if (SocketPath == nullptr && FilePath == nullptr) {
+      return true;
+    }
+    Render = std::move(Renderer);
+    if (SocketPath != nullptr && !Listen(SocketPath)) {
+      return false;
+    }
+    if (FilePath != nullptr) {
+      File = FilePath;
+    }
+    Stopping = false;
+    Worker = std::thread([this]() { Run(); });
+    return true;
+  }
+
+  // Stops the thread, writing the file one last time
+  void Stop() {
+    if (!Worker.joinable()) {
+      return;
+    }
+    Stopping = true;
+    Worker.join();
+    if (!File.empty()) {
+      Dump();
+    }
+    if (ListenSocket >= 0) {
+      close(ListenSocket);
+      unlink(SocketName.c_str());
+      ListenSocket = -1;
+    }
+  }
+
+ private:
+  bool Listen(const char* Path) {
+    sockaddr_un Address = {};
+    Address.sun_family = AF_UNIX;
+    if (strlen(Path) >= sizeof(Address.sun_path)) {
+      SPOQ_LOG_ERROR("Metrics socket path too long: {}", Path);
+      return false;
+    }
+    strcpy(Address.sun_path, Path);
+    ListenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ListenSocket < 0) {
+      SPOQ_LOG_ERROR("Metrics socket failed, errno {}", errno);
+      return false;
+    }
+    // Replace a socket left behind by an earlier run
+    unlink(Path);
+    if (bind(ListenSocket, (sockaddr*)&Address, sizeof(Address)) != 0 ||
+        listen(ListenSocket, 8) != 0) {
+      SPOQ_LOG_ERROR("Metrics socket {} unavailable, errno {}", Path, errno);
+      close(ListenSocket);
+      ListenSocket = -1;
+      return false;
+    }
+    SocketName = Path;
+    SPOQ_LOG_INFO("Serving metrics on unix:{}", Path);
+    return true;
+  }
+
+  void Run() {
+    auto NextDump = std::chrono::steady_clock::now();
+    while (!Stopping) {
+      if (!File.empty() && std::chrono::steady_clock::now() >= NextDump) {
+        Dump();
+        NextDump += METRICS_DUMP_INTERVAL;
+      }
+      // Wake up regularly to notice Stop
+      pollfd Poll = {ListenSocket, POLLIN, 0};
+      if (ListenSocket < 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      } else if (poll(&Poll, 1, 100) == 1) {
+        Serve();
+      }
+    }
+  }
+
+  // Answers one scrape. HTTP requests get an HTTP response so curl and
+  // Prometheus can read the socket; anything else gets the bare text.
+  void Serve() {
+    int Client = accept4(ListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (Client < 0) {
+      return;
+    }
+    char Request[512];
+    ssize_t Length = 0;
+    pollfd Poll = {Client, POLLIN, 0};
+    if (poll(&Poll, 1, 100) == 1) {
+      Length = recv(Client, Request, sizeof(Request), 0);
+    }
+    std::string Out;
+    if (Length >= 4 && memcmp(Request, "GET ", 4) == 0) {
+      Out = "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    }
+    Render(Out);
+    for (size_t Sent = 0; Sent < Out.size();) {
+      ssize_t n = send(Client, Out.data() + Sent, Out.size() - Sent,
+                       MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      Sent += n;
+    }
+    close(Client);
+  }
+
+  // Writes a temporary file and renames it so readers never see a partial
+  // dump
+  void Dump() {
+    std::string Out;
+    Render(Out);
+    std::string Temporary = File + ".tmp";
+    FILE* Handle = fopen(Temporary.c_str(), "w");
+    if (Handle == nullptr) {
+      SPOQ_LOG_ERROR("Metrics file {} unavailable, errno {}", Temporary,
+                     errno);
+      return;
+    }
+    bool Ok = fwrite(Out.data(), 1, Out.size(), Handle) == Out.size();
+    Ok = fclose(Handle) == 0 && Ok;
+    if (!Ok || rename(Temporary.c_str(), File.c_str()) != 0) {
+      SPOQ_LOG_ERROR("Metrics file {} not written, errno {}", File, errno);
+    }
+  }
+
+  RENDER Render;
+  std::thread Worker;
+  std::atomic<bool> Stopping{false};
+  int ListenSocket = -1;
+  std::string SocketName;
+  std::string File;
+};
@@ -0,0 +1,882 @@
+#pragma once
+
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "spoq.h"
+
+//
+// Zero-allocation codecs for SPOQ PDUs: NDJSON and compact binary.
+//
+// SpoqDecodeNdjson validates one NDJSON line against the SPOQ schema
+//
+//   {"header":{"sensor_id":<id>,"version":<n>,"status":<n>},"data":<any>}
+//
+// and fills a SPOQ_PDU_VIEW whose fields are either typed integers or views
+// into the line itself, so nothing is copied or allocated. Header values may
+// be JSON numbers or digit strings ("1"), which is what the protocol has
+// always sent. The data member is only validated and sliced; its contents are
+// decoded on demand with JsonObjectFind/JsonUnescape.
+//
+// The binary encoding (version 2) carries the same PDU as
+//
+//   varint body length | varint sensor_id | varint version | varint status |
+//   data fields
+//
+// where each data field is a varint key (field id << 3 | wire type) followed
+// by a varint, a little-endian 64 or 32 bit float, or a varint length and
+// that many bytes. Integers are LEB128 varints, so small readings cost one
+// byte instead of several characters of text.
+//
+// Version 3 frames PDUs the same way, but a PDU whose header version is 3
+// carries a columnar batch of readings as its data; see columnar_batch.h.
+//
+
+// Wire versions, offered by the server and picked by the client during
+// NEGOTIATE. Negotiation itself is always NDJSON.
+constexpr uint32_t SPOQ_VERSION_NDJSON = 1;
+constexpr uint32_t SPOQ_VERSION_BINARY = 2;
+constexpr uint32_t SPOQ_VERSION_COLUMNAR = 3;
+
+// Room for any NEGOTIATE message, newline included
+constexpr uint32_t SPOQ_NEGOTIATE_MAX_LENGTH = 384;
+
+// Room for the data member of a NEGOTIATE message
+constexpr size_t SPOQ_OFFER_DATA_LENGTH = 256;
+
+// Most data streams a connection may negotiate besides its control stream
+constexpr uint32_t SPOQ_MAX_DATA_STREAMS = 16;
+
+// Most sensors a client may subscribe to in its NEGOTIATE message
+constexpr uint32_t SPOQ_MAX_SUBSCRIPTIONS = 8;
+
+// Status codes carried in the SPOQ header
+constexpr uint32_t SPOQ_STATUS_SUCCESS = 0;
+constexpr uint32_t SPOQ_STATUS_FAILURE = 1;
+
+// Optimistic negotiation: the client's first message is a hello listing the
+// versions it speaks, like an offer. The server answers it with SUCCESS and
+// the version it picked, followed directly by data, or declines it with
+// FALLBACK, after which the client answers the offer as usual.
+constexpr uint32_t SPOQ_STATUS_HELLO = 2;
+constexpr uint32_t SPOQ_STATUS_FALLBACK = 3;
+
+// Application error codes the server closes a connection with when its
+// admission control refuses it. A client may retry a refused connection
+// later, the sooner the further its limits are.
+constexpr uint64_t SPOQ_ERROR_TOO_MANY_CONNECTIONS = 0x5301;
+constexpr uint64_t SPOQ_ERROR_TOO_MANY_HANDSHAKES = 0x5302;
+// The client sent faster than its sensor's message or byte rate
+constexpr uint64_t SPOQ_ERROR_RATE_LIMITED = 0x5303;
+
+inline const char* SpoqErrorName(uint64_t Error) {
+  switch (Error) {
+    case 0:
+      return "no error";
+    case SPOQ_ERROR_TOO_MANY_CONNECTIONS:
+      return "too many connections";
+    case SPOQ_ERROR_TOO_MANY_HANDSHAKES:
+      return "too many handshakes";
+    case SPOQ_ERROR_RATE_LIMITED:
+      return "rate limited";
+    default:
+      return "unknown error";
+  }
+}
+
+// Deepest nesting accepted inside the data member
+constexpr int SPOQ_JSON_MAX_DEPTH = 32;
+
+enum class SPOQ_DECODE_STATUS {
+  SUCCESS,
+  SYNTAX,  // Not well formed JSON
+  SCHEMA,  // Valid JSON, but not a SPOQ PDU
+  RANGE    // A header value does not fit its type
+};
+
+inline const char* ToString(SPOQ_DECODE_STATUS Status) {
+  switch (Status) {
+    case SPOQ_DECODE_STATUS::SUCCESS:
+      return "success";
+    case SPOQ_DECODE_STATUS::SYNTAX:
+      return "syntax error";
+    case SPOQ_DECODE_STATUS::SCHEMA:
+      return "schema error";
+    default:
+      return "value out of range";
+  }
+}
+
+struct SPOQ_HEADER_VIEW {
+  uint64_t SensorId = 0;
+  uint32_t Version = 0;
+  uint32_t Status = 0;
+};
+
+struct SPOQ_PDU_VIEW {
+  SPOQ_HEADER_VIEW Header = {};
+  // Raw JSON text of the data member, empty if the PDU has none
+  std::string_view Data = {};
+};
+
+namespace spoq_json {
+
+// Minimal validating JSON reader over a byte range
+struct CURSOR {
+  const char* P;
+  const char* End;
+
+  void SkipWhitespace() {
+    while (P < End && (*P == ' ' || *P == '\t' || *P == '\r' || *P == '\n')) {
+      ++P;
+    }
+  }
+
+  bool Consume(char C) {
+    SkipWhitespace();
+    if (P < End && *P == C) {
+      ++P;
+      return true;
+    }
+    return false;
+  }
+
+  // Reads a string and returns its raw (still escaped) contents
+  bool String(std::string_view* Raw) {
+    SkipWhitespace();
+    if (P >= End || *P != '"') {
+      return false;
+    }
+    const char* Start = ++P;
+    while (P < End) {
+      const unsigned char C = (unsigned char)*P;
+      if (C == '"') {
+        *Raw = std::string_view(Start, P - Start);
+        ++P;
+        return true;
+      }
+      if (C < 0x20) {
+        return false;
+      }
+      if (C == '\\') {
+        if (++P >= End) {
+          return false;
+        }
+        switch (*P) {
+          case '"': case '\\': case '/': case 'b':
+          case 'f': case 'n': case 'r': case 't':
+            break;
+          case 'u':
+            for (int i = 0; i < 4; ++i) {
+              if (++P >= End || !isxdigit((unsigned char)*P)) {
+                return false;
+              }
+            }
+            break;
+          default:
+            return false;
+        }
+      }
+      ++P;
+    }
+    return false;
+  }
+
+  bool Number() {
+    SkipWhitespace();
+    const char* Start = P;
+    if (P < End && *P == '-') {
+      ++P;
+    }
+    if (P >= End || !isdigit((unsigned char)*P)) {
+      return false;
+    }
+    if (*P == '0') {
+      ++P;
+    } else {
+      while (P < End && isdigit((unsigned char)*P)) ++P;
+    }
+    if (P < End && *P == '.') {
+      if (++P >= End || !isdigit((unsigned char)*P)) return false;
+      while (P < End && isdigit((unsigned char)*P)) ++P;
+    }
+    if (P < End && (*P == 'e' || *P == 'E')) {
+      ++P;
+      if (P < End && (*P == '+' || *P == '-')) ++P;
+      if (P >= End || !isdigit((unsigned char)*P)) return false;
+      while (P < End && isdigit((unsigned char)*P)) ++P;
+    }
+    return P > Start;
+  }
+
+  bool Literal(std::string_view Word) {
+    if ((size_t)(End - P) < Word.size() ||
+        memcmp(P, Word.data(), Word.size()) != 0) {
+      return false;
+    }
+    P += Word.size();
+    return true;
+  }
+
+  // Validates any value, returning its exact text in Raw
+  bool Value(std::string_view* Raw, int Depth = 0) {
+    SkipWhitespace();
+    if (P >= End || Depth > SPOQ_JSON_MAX_DEPTH) {
+      return false;
+    }
+    const char* Start = P;
+    std::string_view Ignored;
+    bool Ok = false;
+    switch (*P) {
+      case '"':
+        Ok = String(&Ignored);
+        break;
+      case '{':
+        ++P;
+        if (Consume('}')) {
+          Ok = true;
+          break;
+        }
+        do {
+          if (!String(&Ignored) || !Consume(':') ||
+              !Value(&Ignored, Depth + 1)) {
+            return false;
+          }
+        } while (Consume(','));
+        Ok = Consume('}');
+        break;
+      case '[':
+        ++P;
+        if (Consume(']')) {
+          Ok = true;
+          break;
+        }
+        do {
+          if (!Value(&Ignored, Depth + 1)) {
+            return false;
+          }
+        } while (Consume(','));
+        Ok = Consume(']');
+        break;
+      case 't':
+        Ok = Literal("true");
+        break;
+      case 'f':
+        Ok = Literal("false");
+        break;
+      case 'n':
+        Ok = Literal("null");
+        break;
+      default:
+        Ok = Number();
+        break;
+    }
+    if (Ok) {
+      *Raw = std::string_view(Start, P - Start);
+    }
+    return Ok;
+  }
+};
+
+// Reads a non-negative integer given either as a JSON number or as a string of
+// digits
+inline SPOQ_DECODE_STATUS Unsigned(CURSOR& Cursor, uint64_t Max,
+                                   uint64_t* Out) {
+  std::string_view Text;
+  Cursor.SkipWhitespace();
+  if (Cursor.P < Cursor.End && *Cursor.P == '"') {
+    if (!Cursor.String(&Text)) {
+      return SPOQ_DECODE_STATUS::SYNTAX;
+    }
+  } else if (!Cursor.Value(&Text)) {
+    return SPOQ_DECODE_STATUS::SYNTAX;
+  }
+  uint64_t Value = 0;
+  auto [End, Error] =
+      std::from_chars(Text.data(), Text.data() + Text.size(), Value);
+  if (Text.empty() || End != Text.data() + Text.size()) {
+    return SPOQ_DECODE_STATUS::SCHEMA;
+  }
+  if (Error != std::errc() || Value > Max) {
+    return SPOQ_DECODE_STATUS::RANGE;
+  }
+  *Out = Value;
+  return SPOQ_DECODE_STATUS::SUCCESS;
+}
+
+inline SPOQ_DECODE_STATUS Header(CURSOR& Cursor, SPOQ_HEADER_VIEW* Header) {
+  enum { SENSOR_ID = 1, VERSION = 2, STATUS = 4, ALL = 7 };
+  unsigned Seen = 0;
+  if (!Cursor.Consume('{')) {
+    return SPOQ_DECODE_STATUS::SCHEMA;
+  }
+  if (!Cursor.Consume('}')) {
+    do {
+      std::string_view Key;
+      if (!Cursor.String(&Key) || !Cursor.Consume(':')) {
+        return SPOQ_DECODE_STATUS::SYNTAX;
+      }
+      SPOQ_DECODE_STATUS Status = SPOQ_DECODE_STATUS::SUCCESS;
+      uint64_t Value = 0;
+      unsigned Field = 0;
+      if (Key == "sensor_id") {
+        Field = SENSOR_ID;
+        Status = Unsigned(Cursor, UINT64_MAX, &Header->SensorId);
+      } else if (Key == "version") {
+        Field = VERSION;
+        Status = Unsigned(Cursor, UINT32_MAX, &Value);
+        Header->Version = (uint32_t)Value;
+      } else if (Key == "status") {
+        Field = STATUS;
+        Status = Unsigned(Cursor, UINT32_MAX, &Value);
+        Header->Status = (uint32_t)Value;
+      } else {
+        std::string_view Ignored;
+        if (!Cursor.Value(&Ignored)) {
+          return SPOQ_DECODE_STATUS::SYNTAX;
+        }
+      }
+      if (Status != SPOQ_DECODE_STATUS::SUCCESS) {
+        return Status;
+      }
+      if (Seen & Field) {
+        return SPOQ_DECODE_STATUS::SCHEMA;  // Duplicate header field
+      }
+      Seen |= Field;
+    } while (Cursor.Consume(','));
+    if (!Cursor.Consume('}')) {
+      return SPOQ_DECODE_STATUS::SYNTAX;
+    }
+  }
+  return Seen == ALL ? SPOQ_DECODE_STATUS::SUCCESS
+                     : SPOQ_DECODE_STATUS::SCHEMA;
+}
+
+}  // namespace spoq_json
+
+// Decodes one NDJSON line (without its newline) into Pdu. Views in Pdu point
+// into Line and are only valid as long as it is.
+inline SPOQ_DECODE_STATUS SpoqDecodeNdjson(std::string_view Line,
+                                           SPOQ_PDU_VIEW* Pdu) {
+  spoq_json::CURSOR Cursor = {Line.data(), Line.data() + Line.size()};
+  bool HasHeader = false;
+  bool HasData = false;
+  *Pdu = {};
+
+  if (!Cursor.Consume('{')) {
+    return SPOQ_DECODE_STATUS::SYNTAX;
+  }
+  if (!Cursor.Consume('}')) {
+    do {
+      std::string_view Key;
+      if (!Cursor.String(&Key) || !Cursor.Consume(':')) {
+        return SPOQ_DECODE_STATUS::SYNTAX;
+      }
+      if (Key == "header") {
+        if (HasHeader) {
+          return SPOQ_DECODE_STATUS::SCHEMA;
+        }
+        SPOQ_DECODE_STATUS Status = spoq_json::Header(Cursor, &Pdu->Header);
+        if (Status != SPOQ_DECODE_STATUS::SUCCESS) {
+          return Status;
+        }
+        HasHeader = true;
+      } else {
+        std::string_view Value;
+        if (!Cursor.Value(&Value)) {
+          return SPOQ_DECODE_STATUS::SYNTAX;
+        }
+        if (Key == "data") {
+          if (HasData) {
+            return SPOQ_DECODE_STATUS::SCHEMA;
+          }
+          Pdu->Data = Value;
+          HasData = true;
+        }
+      }
+    } while (Cursor.Consume(','));
+    if (!Cursor.Consume('}')) {
+      return SPOQ_DECODE_STATUS::SYNTAX;
+    }
+  }
+
+  Cursor.SkipWhitespace();
+  if (Cursor.P != Cursor.End) {
+    return SPOQ_DECODE_STATUS::SYNTAX;  // Trailing bytes after the object
+  }
+  return HasHeader ? SPOQ_DECODE_STATUS::SUCCESS : SPOQ_DECODE_STATUS::SCHEMA;
+}
+
+// Finds Key in a JSON object (such as SPOQ_PDU_VIEW::Data) and returns the raw
+// text of its value. The object must already have been validated.
+inline bool JsonObjectFind(std::string_view Object, std::string_view Key,
+                           std::string_view* Value) {
+  spoq_json::CURSOR Cursor = {Object.data(), Object.data() + Object.size()};
+  if (!Cursor.Consume('{') || Cursor.Consume('}')) {
+    return false;
+  }
+  do {
+    std::string_view Name;
+    if (!Cursor.String(&Name) || !Cursor.Consume(':') ||
+        !Cursor.Value(Value)) {
+      return false;
+    }
+    if (Name == Key) {
+      return true;
+    }
+  } while (Cursor.Consume(','));
+  return false;
+}
+
+// Decodes the escapes in the raw contents of a JSON string into Out. Returns
+// the decoded length, or 0 if it does not fit. \u escapes are emitted as UTF-8.
+inline size_t JsonUnescape(std::string_view Raw, char* Out, size_t Capacity) {
+  size_t Length = 0;
+  for (size_t i = 0; i < Raw.size(); ++i) {
+    char C = Raw[i];
+    if (C == '\\' && ++i < Raw.size()) {
+      switch (Raw[i]) {
+        case 'b': C = '\b'; break;
+        case 'f': C = '\f'; break;
+        case 'n': C = '\n'; break;
+        case 'r': C = '\r'; break;
+        case 't': C = '\t'; break;
+        case 'u': {
+          uint32_t Code = 0;
+          std::from_chars(Raw.data() + i + 1, Raw.data() + i + 5, Code, 16);
+          i += 4;
+          char Utf8[3];
+          size_t Bytes = 1;
+          if (Code < 0x80) {
+            Utf8[0] = (char)Code;
+          } else if (Code < 0x800) {
+            Utf8[0] = (char)(0xC0 | (Code >> 6));
+            Utf8[1] = (char)(0x80 | (Code & 0x3F));
+            Bytes = 2;
+          } else {
+            Utf8[0] = (char)(0xE0 | (Code >> 12));
+            Utf8[1] = (char)(0x80 | ((Code >> 6) & 0x3F));
+            Utf8[2] = (char)(0x80 | (Code & 0x3F));
+            Bytes = 3;
+          }
+          if (Length + Bytes > Capacity) {
+            return 0;
+          }
+          memcpy(Out + Length, Utf8, Bytes);
+          Length += Bytes;
+          continue;
+        }
+        default: C = Raw[i]; break;
+      }
+    }
+    if (Length == Capacity) {
+      return 0;
+    }
+    Out[Length++] = C;
+  }
+  return Length;
+}
+
+// Encodes a PDU as one NDJSON line, newline included, into Out. Data must be
+// a complete JSON value, or empty to omit the member. Header values are
+// written as digit strings for compatibility with existing peers. Returns the
+// encoded length, or 0 if Capacity is too small.
+inline size_t SpoqEncodeNdjson(const SPOQ_HEADER_VIEW& Header,
+                               std::string_view Data, char* Out,
+                               size_t Capacity) {
+  char* P = Out;
+  char* End = Out + Capacity;
+  auto Put = [&](std::string_view Text) {
+    if ((size_t)(End - P) < Text.size()) {
+      return false;
+    }
+    memcpy(P, Text.data(), Text.size());
+    P += Text.size();
+    return true;
+  };
+  auto PutNumber = [&](uint64_t Value) {
+    auto [Next, Error] = std::to_chars(P, End, Value);
+    if (Error != std::errc()) {
+      return false;
+    }
+    P = Next;
+    return true;
+  };
+
+  bool Ok = Put("{\"header\":{\"sensor_id\":\"") &&
+            PutNumber(Header.SensorId) && Put("\",\"version\":\"") &&
+            PutNumber(Header.Version) && Put("\",\"status\":\"") &&
+            PutNumber(Header.Status) && Put("\"}");
+  if (Ok && !Data.empty()) {
+    Ok = Put(",\"data\":") && Put(Data);
+  }
+  Ok = Ok && Put("}\n");
+  return Ok ? (size_t)(P - Out) : 0;
+}
+
+// Writes the data member of a NEGOTIATE message to Out: the versions up to
+// MaxVersion, the datagram path if Datagram, the number of data streams
+// unless Streams is 0, and the sensors a client subscribes to, at most
+// SPOQ_MAX_SUBSCRIPTIONS of them. Empty when there is nothing beyond NDJSON.
+inline std::string_view SpoqOfferData(char (&Out)[SPOQ_OFFER_DATA_LENGTH],
+                                      uint32_t MaxVersion, bool Datagram,
+                                      uint32_t Streams = 0,
+                                      std::span<const uint64_t> Sensors = {}) {
+  // The members together take at most 239 bytes
+  size_t Length = 0;
+  auto Member = [&](std::string_view Text) {
+    const char Separator = Length == 0 ? '{' : ',';
+    Out[Length++] = Separator;
+    memcpy(Out + Length, Text.data(), Text.size());
+    Length += Text.size();
+  };
+  if (MaxVersion >= SPOQ_VERSION_COLUMNAR) {
+    Member("\"versions\":[1,2,3]");
+  } else if (MaxVersion >= SPOQ_VERSION_BINARY) {
+    Member("\"versions\":[1,2]");
+  }
+  if (Datagram) {
+    Member("\"datagram\":true");
+  }
+  if (Streams != 0) {
+    char Text[24] = "\"streams\":";
+    char* End = std::to_chars(Text + 10, Text + sizeof(Text), Streams).ptr;
+    Member(std::string_view(Text, End - Text));
+  }
+  if (!Sensors.empty()) {
+    char Text[SPOQ_OFFER_DATA_LENGTH] = "\"subscribe\":[";
+    char* End = Text + 13;
+    for (size_t i = 0; i < Sensors.size() && i < SPOQ_MAX_SUBSCRIPTIONS; ++i) {
+      if (i != 0) {
+        *End++ = ',';
+      }
+      End = std::to_chars(End, Text + sizeof(Text), Sensors[i]).ptr;
+    }
+    *End++ = ']';
+    Member(std::string_view(Text, End - Text));
+  }
+  if (Length == 0) {
+    return {};
+  }
+  Out[Length++] = '}';
+  return std::string_view(Out, Length);
+}
+
+// Number of data streams a NEGOTIATE message asks for or grants, 0 if it
+// names none, at most SPOQ_MAX_DATA_STREAMS
+inline uint32_t SpoqDataStreams(const SPOQ_PDU_VIEW& Pdu) {
+  std::string_view Value;
+  uint32_t Streams = 0;
+  if (Pdu.Data.empty() || !JsonObjectFind(Pdu.Data, "streams", &Value) ||
+      std::from_chars(Value.data(), Value.data() + Value.size(), Streams).ec !=
+          std::errc()) {
+    return 0;
+  }
+  return Streams < SPOQ_MAX_DATA_STREAMS ? Streams : SPOQ_MAX_DATA_STREAMS;
+}
+
+// Reads the sensors a NEGOTIATE message subscribes to, as
+// {"subscribe":[...]}, into Sensors. Returns how many there are, 0 if it
+// names none or the list is malformed; any beyond SPOQ_MAX_SUBSCRIPTIONS are
+// ignored.
+inline uint32_t SpoqSubscriptions(const SPOQ_PDU_VIEW& Pdu,
+                                  uint64_t (&Sensors)[SPOQ_MAX_SUBSCRIPTIONS]) {
+  std::string_view List;
+  if (Pdu.Data.empty() || !JsonObjectFind(Pdu.Data, "subscribe", &List)) {
+    return 0;
+  }
+  spoq_json::CURSOR Cursor = {List.data(), List.data() + List.size()};
+  if (!Cursor.Consume('[') || Cursor.Consume(']')) {
+    return 0;
+  }
+  uint32_t Count = 0;
+  do {
+    uint64_t Value = 0;
+    if (spoq_json::Unsigned(Cursor, UINT64_MAX, &Value) !=
+        SPOQ_DECODE_STATUS::SUCCESS) {
+      return 0;
+    }
+    if (Count < SPOQ_MAX_SUBSCRIPTIONS) {
+      Sensors[Count++] = Value;
+    }
+  } while (Cursor.Consume(','));
+  return Count;
+}
+
+// Returns true if the negotiation offer supports Version. NDJSON is the base
+// version in the header; additional versions are listed in the offer's data
+// as {"versions":[...]}.
+inline bool SpoqOfferIncludes(const SPOQ_PDU_VIEW& Offer, uint32_t Version) {
+  if (Offer.Header.Version == Version) {
+    return true;
+  }
+  std::string_view Versions;
+  if (Offer.Data.empty() ||
+      !JsonObjectFind(Offer.Data, "versions", &Versions)) {
+    return false;
+  }
+  spoq_json::CURSOR Cursor = {Versions.data(),
+                              Versions.data() + Versions.size()};
+  if (!Cursor.Consume('[') || Cursor.Consume(']')) {
+    return false;
+  }
+  do {
+    uint64_t Value = 0;
+    if (spoq_json::Unsigned(Cursor, UINT32_MAX, &Value) !=
+        SPOQ_DECODE_STATUS::SUCCESS) {
+      return false;
+    }
+    if (Value == Version) {
+      return true;
+    }
+  } while (Cursor.Consume(','));
+  return false;
+}
+
+//
+// Binary encoding
+//
+
+enum class SPOQ_WIRE_TYPE : uint8_t {
+  VARINT = 0,
+  FIXED64 = 1,  // double
+  BYTES = 2,
+  FIXED32 = 5   // float
+};
+
+// Longest binary PDU body accepted
+constexpr size_t SPOQ_BINARY_MAX_LENGTH = 1024 * 1024;
+
+// Longest encoding of a 64-bit varint
+constexpr size_t SPOQ_VARINT_MAX_LENGTH = 10;
+
+inline size_t VarintLength(uint64_t Value) {
+  size_t Length = 1;
+  while (Value >= 0x80) {
+    Value >>= 7;
+    ++Length;
+  }
+  return Length;
+}
+
+// Writes Value as a LEB128 varint and returns the bytes written. Out must
+// have room for VarintLength(Value) bytes.
+inline size_t PutVarint(uint8_t* Out, uint64_t Value) {
+  size_t i = 0;
+  while (Value >= 0x80) {
+    Out[i++] = (uint8_t)(Value | 0x80);
+    Value >>= 7;
+  }
+  Out[i++] = (uint8_t)Value;
+  return i;
+}
+
+// Reads a varint from [*P, End), advancing *P. Fails on truncated or
+// overlong input.
+inline bool GetVarint(const uint8_t** P, const uint8_t* End, uint64_t* Value) {
+  uint64_t Result = 0;
+  const uint8_t* Q = *P;
+  for (unsigned Shift = 0; Shift < 64 && Q < End; Shift += 7) {
+    const uint8_t Byte = *Q++;
+    Result |= (uint64_t)(Byte & 0x7F) << Shift;
+    if (!(Byte & 0x80)) {
+      if (Shift == 63 && Byte > 1) {
+        return false;
+      }
+      *Value = Result;
+      *P = Q;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct SPOQ_FIELD {
+  uint32_t Id = 0;
+  SPOQ_WIRE_TYPE Type = SPOQ_WIRE_TYPE::VARINT;
+  uint64_t Uint = 0;            // VARINT
+  double Double = 0;            // FIXED64 and FIXED32
+  std::string_view Bytes = {};  // BYTES
+};
+
+// Iterates the data fields of a binary PDU
+struct SPOQ_FIELD_READER {
+  const uint8_t* P;
+  const uint8_t* End;
+
+  explicit SPOQ_FIELD_READER(std::string_view Data)
+      : P((const uint8_t*)Data.data()),
+        End((const uint8_t*)Data.data() + Data.size()) {}
+
+  bool Done() const { return P == End; }
+
+  // Reads the next field. Fails on malformed input.
+  bool Next(SPOQ_FIELD* Field) {
+    uint64_t Key = 0;
+    if (!GetVarint(&P, End, &Key) || (Key >> 3) > UINT32_MAX) {
+      return false;
+    }
+    Field->Id = (uint32_t)(Key >> 3);
+    Field->Type = (SPOQ_WIRE_TYPE)(Key & 7);
+    switch (Field->Type) {
+      case SPOQ_WIRE_TYPE::VARINT:
+        return GetVarint(&P, End, &Field->Uint);
+      case SPOQ_WIRE_TYPE::FIXED64:
+        if (End - P < 8) {
+          return false;
+        }
+        memcpy(&Field->Double, P, 8);
+        P += 8;
+        return true;
+      case SPOQ_WIRE_TYPE::FIXED32: {
+        float Value;
+        if (End - P < 4) {
+          return false;
+        }
+        memcpy(&Value, P, 4);
+        Field->Double = Value;
+        P += 4;
+        return true;
+      }
+      case SPOQ_WIRE_TYPE::BYTES: {
+        uint64_t Length = 0;
+        if (!GetVarint(&P, End, &Length) || Length > (uint64_t)(End - P)) {
+          return false;
+        }
+        Field->Bytes = std::string_view((const char*)P, Length);
+        P += Length;
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+};
+
+// Appends data fields to a caller-provided buffer. Ok turns false, and stays
+// false, once the buffer is too small.
+struct SPOQ_FIELD_WRITER {
+  uint8_t* Start;
+  uint8_t* P;
+  uint8_t* End;
+  bool Ok = true;
+
+  SPOQ_FIELD_WRITER(void* Out, size_t Capacity)
+      : Start((uint8_t*)Out), P((uint8_t*)Out), End((uint8_t*)Out + Capacity) {}
+
+  std::string_view Data() const {
+    return std::string_view((const char*)Start, P - Start);
+  }
+
+  void Uint(uint32_t Id, uint64_t Value) {
+    if (Key(Id, SPOQ_WIRE_TYPE::VARINT, SPOQ_VARINT_MAX_LENGTH)) {
+      P += PutVarint(P, Value);
+    }
+  }
+
+  void Double(uint32_t Id, double Value) {
+    if (Key(Id, SPOQ_WIRE_TYPE::FIXED64, 8)) {
+      memcpy(P, &Value, 8);
+      P += 8;
+    }
+  }
+
+  void Float(uint32_t Id, float Value) {
+    if (Key(Id, SPOQ_WIRE_TYPE::FIXED32, 4)) {
+      memcpy(P, &Value, 4);
+      P += 4;
+    }
+  }
+
+  void Bytes(uint32_t Id, std::string_view Value) {
+    if (Key(Id, SPOQ_WIRE_TYPE::BYTES,
+            VarintLength(Value.size()) + Value.size())) {
+      P += PutVarint(P, Value.size());
+      memcpy(P, Value.data(), Value.size());
+      P += Value.size();
+    }
+  }
+
+ private:
+  // Writes a field key if the key and Length more bytes fit
+  bool Key(uint32_t Id, SPOQ_WIRE_TYPE Type, size_t Length) {
+    const uint64_t Value = (uint64_t)Id << 3 | (uint64_t)Type;
+    Ok = Ok && (size_t)(End - P) >= VarintLength(Value) + Length;
+    if (Ok) {
+      P += PutVarint(P, Value);
+    }
+    return Ok;
+  }
+};
+
+// Decodes the body of one binary PDU (without its length prefix) into Pdu.
+// Data is validated and left as a view for SPOQ_FIELD_READER, except that of
+// a columnar batch, which COLUMNAR_BATCH::Decode validates.
+inline SPOQ_DECODE_STATUS SpoqDecodeBinary(std::string_view Body,
+                                           SPOQ_PDU_VIEW* Pdu) {
+  const uint8_t* P = (const uint8_t*)Body.data();
+  const uint8_t* End = P + Body.size();
+  uint64_t Version = 0;
+  uint64_t Status = 0;
+  *Pdu = {};
+  if (!GetVarint(&P, End, &Pdu->Header.SensorId) ||
+      !GetVarint(&P, End, &Version) || !GetVarint(&P, End, &Status)) {
+    return SPOQ_DECODE_STATUS::SYNTAX;
+  }
+  if (Version > UINT32_MAX || Status > UINT32_MAX) {
+    return SPOQ_DECODE_STATUS::RANGE;
+  }
+  Pdu->Header.Version = (uint32_t)Version;
+  Pdu->Header.Status = (uint32_t)Status;
+  Pdu->Data = std::string_view((const char*)P, End - P);
+  if (Pdu->Header.Version == SPOQ_VERSION_COLUMNAR) {
+    return SPOQ_DECODE_STATUS::SUCCESS;
+  }
+
+  SPOQ_FIELD_READER Reader(Pdu->Data);
+  SPOQ_FIELD Field;
+  while (!Reader.Done()) {
+    if (!Reader.Next(&Field)) {
+      return SPOQ_DECODE_STATUS::SYNTAX;
+    }
+  }
+  return SPOQ_DECODE_STATUS::SUCCESS;
+}
+
+// Encodes a PDU in the binary format, length prefix included, into Out. Data
+// holds fields written with SPOQ_FIELD_WRITER. Returns the encoded length, or
+// 0 if Capacity is too small.
+inline size_t SpoqEncodeBinary(const SPOQ_HEADER_VIEW& Header,
+                               std::string_view Data, uint8_t* Out,
+                               size_t Capacity) {
+  const size_t BodyLength = VarintLength(Header.SensorId) +
+                            VarintLength(Header.Version) +
+                            VarintLength(Header.Status) + Data.size();
+  const size_t Length = VarintLength(BodyLength) + BodyLength;
+  if (Length > Capacity) {
+    return 0;
+  }
+  uint8_t* P = Out;
+  P += PutVarint(P, BodyLength);
+  P += PutVarint(P, Header.SensorId);
+  P += PutVarint(P, Header.Version);
+  P += PutVarint(P, Header.Status);
+  if (!Data.empty()) {
+    memcpy(P, Data.data(), Data.size());
+  }
+  return Length;
+}
+
+// Copies a decoded PDU into an owning SPOQ_PDU, so that it can outlive the
+// RECEIVE event whose buffers Pdu points into. Out's data capacity is reused.
+inline void SpoqPduCopy(const SPOQ_PDU_VIEW& Pdu, SPOQ_PDU* Out) {
+  Out->header.sensor_id = Pdu.Header.SensorId;
+  Out->header.version = std::to_string(Pdu.Header.Version);
+  Out->header.status = std::to_string(Pdu.Header.Status);
+  Out->data.assign(Pdu.Data.data(), Pdu.Data.size());
+}
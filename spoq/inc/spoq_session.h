@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+#include "admission.h"
+#include "autotune.h"
+#include "binary_framer.h"
+#include "columnar_batch.h"
+#include "msquic.h"
+#include "ndjson_framer.h"
+#include "numa_placement.h"
+#include "send_batcher.h"
+#include "send_window.h"
+#include "spoq.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+
+struct SPOQ_SESSION;
+
+// One stream of a session, handed to msquic as the Context of its stream
+// callback. Index 0 is the control stream, which negotiates and, unless data
+// streams were agreed, carries the readings too. Data streams are numbered
+// from 1 by the order the client opened them, so each is an independent
+// sensor channel that a loss on another never holds up. A data stream has
+// pages of its own, like its session.
+struct SPOQ_STREAM : NUMA_PAGES {
+  SPOQ_SESSION* Session = nullptr;
+  HQUIC Stream = nullptr;
+  uint32_t Index = 0;
+  uint32_t MessageCount = 0;
+  // Reassembles NDJSON lines received on Stream
+  NDJSON_FRAMER Framer = {};
+  // Reassembles binary PDUs once that encoding has been negotiated
+  BINARY_FRAMER BinaryFramer = {};
+  // Coalesces outgoing messages on Stream
+  SEND_BATCHER Batcher = {};
+  // Budget of bytes queued on Stream, committed to the batcher or in flight
+  SEND_WINDOW Window = {};
+  // ServerSend stopped with Window full and resumes on SEND_COMPLETE
+  bool SendPaused = false;
+  // Readings gathered for the next batch PDU of a columnar session
+  COLUMNAR_BATCH Columns;
+};
+
+// Per-connection SPOQ state. The server allocates one of these for every
+// accepted connection and hands it to msquic as the Context of the
+// connection callback, and its streams as the Context of theirs, so
+// concurrent sensors never share protocol state. It is released on
+// QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE and freed once no reading queued
+// for ingest refers to it. On a multi-node host each session, and each of its
+// data streams, has pages of its own on the accepting worker's NUMA node, so
+// that it can follow the connection to another node. The buffers that its
+// framers and batches grow on the heap are not moved with it.
+struct SPOQ_SESSION : NUMA_PAGES {
+  HQUIC Connection = nullptr;
+  SPOQ_STATE State = SPOQ_STATE::UNKNOWN;
+  size_t SensorId = {};
+  // Wire version agreed during NEGOTIATE, used for data PDUs
+  uint32_t Version = SPOQ_VERSION_NDJSON;
+  // Both peers agreed to send readings as datagrams
+  bool DatagramsAgreed = false;
+  // Largest datagram msquic currently accepts, 0 while sending is disabled
+  uint16_t DatagramMaxLength = 0;
+  uint64_t DatagramsSent = 0;
+  uint64_t DatagramsLost = 0;
+  // The control stream
+  SPOQ_STREAM Control = {};
+  // Data streams agreed during NEGOTIATE, 0 to use the control stream
+  uint32_t DataStreamCount = 0;
+  // Data streams by Index - 1, allocated as the client opens them
+  std::unique_ptr<SPOQ_STREAM> Data[SPOQ_MAX_DATA_STREAMS];
+  // Sensors whose readings the control stream carries instead of generated
+  // data, agreed during NEGOTIATE
+  uint64_t Subscriptions[SPOQ_MAX_SUBSCRIPTIONS] = {};
+  uint32_t SubscriptionCount = 0;
+  // Latest reading the client sent upstream
+  SPOQ_PDU LastReading = {};
+  // Throughput and transport statistics read by the metrics exporter
+  CONNECTION_METRICS Metrics = {};
+  // Adjusts the connection's flow control window from Metrics' samples
+  CONNECTION_TUNER Tuner = {};
+  // Hash of the client's certificate, from the certificate or the
+  // resumption ticket, and the admission entries of it and of the sensor
+  // the client negotiated. Each is held until SHUTDOWN_COMPLETE.
+  uint64_t Identity = 0;
+  ADMISSION_ENTRY* IdentityEntry = nullptr;
+  ADMISSION_ENTRY* SensorEntry = nullptr;
+  // The handshake has completed
+  bool Connected = false;
+  // Application error the connection is closed with once its handshake
+  // completes, when admission control refused it before then
+  uint64_t Refusal = 0;
+  // The connection's number in the -capture file, 0 when not capturing
+  uint64_t CaptureId = 0;
+  // NUMA node the session's pages are on
+  int Node = 0;
+  // Ingest queue the connection's readings go to, and the one they move to
+  // once those already queued have been processed
+  uint32_t Queue = 0;
+  uint32_t NextQueue = 0;
+  // Held by the connection until SHUTDOWN_COMPLETE and by every reading
+  // queued for ingest. The session is freed with the last one.
+  std::atomic<uint32_t> References{1};
+};
+
+// Drops a reference to Session, freeing it if that was the last one
+inline void SpoqSessionRelease(SPOQ_SESSION* Session) {
+  if (Session->References.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete Session;
+  }
+}
+
+// The set of live sessions. Only touched on connect/disconnect and by metrics
+// scrapes, never on the data path, so a plain mutex is sufficient.
+class SPOQ_SESSION_TABLE {
+ public:
+  void Insert(SPOQ_SESSION* Session) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Sessions.insert(Session);
+  }
+
+  void Remove(SPOQ_SESSION* Session) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Sessions.erase(Session);
+  }
+
+  size_t Size() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return Sessions.size();
+  }
+
+  // Calls Visit with every live session. Sessions are removed under the same
+  // lock before they are freed, so each one stays valid during its visit.
+  template <typename Visitor>
+  void ForEach(Visitor&& Visit) const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    for (const SPOQ_SESSION* Session : Sessions) {
+      Visit(Session);
+    }
+  }
+
+ private:
+  mutable std::mutex Lock;
+  std::unordered_set<SPOQ_SESSION*> Sessions;
+};
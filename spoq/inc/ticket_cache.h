@@ -0,0 +1,135 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "spoq_log.h"
+#include "utils.h"
+
+//
+// Persistent cache of TLS session resumption tickets, keyed by target.
+//
+// Each entry holds the last ticket the server issued for a target. A
+// reconnect sets it on its connection to resume the TLS session, which lets
+// the client's first stream bytes (its SPOQ hello) travel as 0-RTT early
+// data.
+//
+// The cache is a text file with one line per target:
+//
+//   <target> <ticket as hex>
+//
+// It is rewritten through a temporary file and a rename whenever an entry
+// changes, so a crash never leaves it half written.
+//
+
+// Longest ticket kept, well above what msquic issues
+constexpr uint32_t TICKET_CACHE_MAX_TICKET_LENGTH = 4096;
+
+class TICKET_CACHE {
+ public:
+  // Reads the cache file at Path, if there is one. Malformed lines are
+  // skipped.
+  void Load(const char* Path) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    File = Path;
+    FILE* Handle = fopen(Path, "r");
+    if (Handle == nullptr) {
+      return;
+    }
+    std::vector<char> Line(2 * TICKET_CACHE_MAX_TICKET_LENGTH + 512);
+    char Target[256];
+    std::vector<char> Hex(2 * TICKET_CACHE_MAX_TICKET_LENGTH + 1);
+    while (fgets(Line.data(), (int)Line.size(), Handle) != nullptr) {
+      // The widths match Target and Hex
+      if (sscanf(Line.data(), "%255s %8192s", Target, Hex.data()) != 2) {
+        continue;
+      }
+      std::vector<uint8_t> Ticket(TICKET_CACHE_MAX_TICKET_LENGTH);
+      uint32_t Length = DecodeHexBuffer(
+          Hex.data(), TICKET_CACHE_MAX_TICKET_LENGTH, Ticket.data());
+      if (Length == 0) {
+        continue;
+      }
+      Ticket.resize(Length);
+      Entries[Target] = std::move(Ticket);
+    }
+    fclose(Handle);
+    SPOQ_LOG_DEBUG("Loaded {} resumption ticket(s) from {}", Entries.size(),
+                   Path);
+  }
+
+  // Copies the ticket for Target into Ticket. Returns false if there is none.
+  bool Lookup(const std::string& Target, std::vector<uint8_t>* Ticket) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Entries.find(Target);
+    if (It == Entries.end()) {
+      return false;
+    }
+    *Ticket = It->second;
+    return true;
+  }
+
+  // Replaces the ticket for Target
+  void Store(const std::string& Target, const uint8_t* Ticket,
+             uint32_t Length) {
+    if (Length == 0 || Length > TICKET_CACHE_MAX_TICKET_LENGTH) {
+      return;
+    }
+    std::lock_guard<std::mutex> Guard(Lock);
+    Entries[Target].assign(Ticket, Ticket + Length);
+    Save();
+  }
+
+  // Forgets Target, e.g. after the server refused its ticket
+  void Remove(const std::string& Target) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Entries.erase(Target) != 0) {
+      Save();
+    }
+  }
+
+ private:
+  // Rewrites the file from Entries. Called with Lock held.
+  void Save() {
+    if (File.empty()) {
+      return;
+    }
+    // A ticket resumes our TLS session, so only its owner may read the file
+    std::string Temporary = File + ".tmp";
+    int Fd = open(Temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    FILE* Handle = Fd >= 0 ? fdopen(Fd, "w") : nullptr;
+    if (Handle == nullptr) {
+      if (Fd >= 0) {
+        close(Fd);
+      }
+      SPOQ_LOG_WARN("Ticket cache {} unavailable, errno {}", Temporary, errno);
+      return;
+    }
+    std::string Hex;
+    bool Ok = true;
+    for (const auto& [Target, Ticket] : Entries) {
+      Hex.resize(2 * Ticket.size());
+      for (size_t i = 0; i < Ticket.size(); ++i) {
+        snprintf(&Hex[2 * i], 3, "%02x", Ticket[i]);
+      }
+      Ok = fprintf(Handle, "%s %s\n", Target.c_str(), Hex.c_str()) > 0 && Ok;
+    }
+    Ok = fclose(Handle) == 0 && Ok;
+    if (!Ok || rename(Temporary.c_str(), File.c_str()) != 0) {
+      SPOQ_LOG_WARN("Ticket cache {} not written, errno {}", File, errno);
+    }
+  }
+
+  std::mutex Lock;
+  std::string File;
+  std::map<std::string, std::vector<uint8_t>> Entries;
+};
@@ -13,6 +13,7 @@
 #include <iostream>
 
 #include "msquic.h"
+#include "spoq_log.h"
 
 //
 // Helper functions to look up a command line arguments.
@@ -211,67 +212,64 @@ const char* QuicConnectionEventTypeToString(QUIC_CONNECTION_EVENT_TYPE type) {
 }
 
 void PrintQuicErrorCodeInfo(uint64_t errorCode) {
-  std::cout << "QUIC Error Code: 0x" << std::hex << errorCode << std::dec
-            << std::endl;
+  SPOQ_LOG_WARN("QUIC Error Code: {}", SpoqLogHex(errorCode));
 
   if (errorCode >= 0x100 && errorCode < 0x200) {
     uint8_t tlsAlert = static_cast<uint8_t>(errorCode - 0x100);
-    std::cout << "TLS Alert Code: " << static_cast<int>(tlsAlert)
-              << std::endl;
+    SPOQ_LOG_WARN("TLS Alert Code: {}", static_cast<int>(tlsAlert));
 
     switch (tlsAlert) {
       case 40:
-        std::cout << "     handshake_failure\n";
+        SPOQ_LOG_WARN("     handshake_failure");
         break;
       case 42:
-        std::cout << "     bad_certificate\n";
+        SPOQ_LOG_WARN("     bad_certificate");
         break;
       case 43:
-        std::cout << "     unsupported_certificate\n";
+        SPOQ_LOG_WARN("     unsupported_certificate");
         break;
       case 44:
-        std::cout << "     certificate_revoked\n";
+        SPOQ_LOG_WARN("     certificate_revoked");
         break;
       case 45:
-        std::cout << "     certificate_expired\n";
+        SPOQ_LOG_WARN("     certificate_expired");
         break;
       case 46:
-        std::cout << "     certificate_unknown\n";
+        SPOQ_LOG_WARN("     certificate_unknown");
         break;
       case 48:
-        std::cout << "     unknown_ca\n";
+        SPOQ_LOG_WARN("     unknown_ca");
         break;
       case 51:
-        std::cout << "     decode_error\n";
+        SPOQ_LOG_WARN("     decode_error");
         break;
       case 70:
-        std::cout << "     protocol_version\n";
+        SPOQ_LOG_WARN("     protocol_version");
         break;
       default:
-        std::cout << "     (Unknown TLS alert code)\n";
+        SPOQ_LOG_WARN("     (Unknown TLS alert code)");
         break;
     }
 
   } else if (errorCode <= 0x1f) {
-    std::cout << "QUIC Transport Error Code: ";
     switch (errorCode) {
       case 0x00:
-        std::cout << "NO_ERROR\n";
+        SPOQ_LOG_WARN("QUIC Transport Error Code: NO_ERROR");
         break;
       case 0x01:
-        std::cout << "INTERNAL_ERROR\n";
+        SPOQ_LOG_WARN("QUIC Transport Error Code: INTERNAL_ERROR");
         break;
       case 0x06:
-        std::cout << "CRYPTO_ERROR\n";
+        SPOQ_LOG_WARN("QUIC Transport Error Code: CRYPTO_ERROR");
         break;
       case 0x0D:
-        std::cout << "PROTOCOL_VIOLATION\n";
+        SPOQ_LOG_WARN("QUIC Transport Error Code: PROTOCOL_VIOLATION");
         break;
       default:
-        std::cout << "(Other transport error)\n";
+        SPOQ_LOG_WARN("QUIC Transport Error Code: (Other transport error)");
         break;
     }
   } else {
-    std::cout << "Possibly application-defined error\n";
+    SPOQ_LOG_WARN("Possibly application-defined error");
   }
 }
\ No newline at end of file
@@ -0,0 +1,870 @@
+/*++
+
+    Copyright (c) Microsoft Corporation.
+    Licensed under the MIT License.
+
+Abstract:
+
+    Load generator for the Sensor Protocol Over QUIC (SPOQ). Simulates many
+sensors from one process: opens mTLS connections to a spoq_server at a fixed
+rate, negotiates SPOQ on each one, then streams readings upstream at a fixed
+rate per sensor while receiving the server's readings. Reports handshake and
+negotiation latency, message and byte rates, and end-to-end latency as text
+or JSON.
+
+    Built upon the SPOQ client. Meant for loopback runs: end-to-end latency
+compares the server's steady clock send time with our own, which is only
+meaningful on the same host.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "binary_framer.h"
+#include "columnar_batch.h"
+#include "latency_histogram.h"
+#include "msquic.h"
+#include "ndjson_framer.h"
+#include "numa_placement.h"
+#include "quic_config.h"
+#include "send_pool.h"
+#include "spoq.h"
+#include "spoq_datagram.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+#include "utils.h"
+
+// The (optional) registration configuration for the app. This sets a name for
+// the app (used for persistent storage and for debugging). It also configures
+// the execution profile, "low latency" unless -execution_profile picks
+// another.
+QUIC_REGISTRATION_CONFIG RegConfig = {"spoq_bench",
+                                      QUIC_EXECUTION_PROFILE_LOW_LATENCY};
+
+// The protocol name used in the Application Layer Protocol Negotiation (ALPN).
+const QUIC_BUFFER Alpn = {sizeof("sample") - 1, (uint8_t*)"sample"};
+
+// The QUIC handle to the registration object.
+HQUIC Registration;
+
+// The QUIC handle to the configuration object shared by every connection.
+HQUIC Configuration;
+
+// The bench lifecycle state. Protocol state is tracked per BENCH_SESSION.
+SPOQ_STATE state = SPOQ_STATE::UNKNOWN;
+
+// Largest reading payload accepted by -payload
+constexpr uint32_t MAX_PAYLOAD_LENGTH = 1024;
+
+// Header, sequence number and send time around a reading's payload
+constexpr uint32_t READING_OVERHEAD = 128;
+
+// How long the producer sleeps when nothing is due
+constexpr auto PRODUCER_TICK = std::chrono::microseconds(500);
+
+// Binary data field ids of the readings, the same as the server's
+constexpr uint32_t FIELD_SEQUENCE = SPOQ_FIELD_SEQUENCE;
+constexpr uint32_t FIELD_PAD = 2;
+constexpr uint32_t FIELD_TIME = SPOQ_FIELD_TIME;
+
+// Keep-alive for connections whose readings are slower than the idle timeout
+constexpr uint32_t KEEP_ALIVE_INTERVAL_MS = IdleTimeoutMs / 2;
+
+struct BENCH_OPTIONS {
+  uint32_t Connections = 100;
+  double ConnectRate = 1000;  // Connections opened per second
+  double MessageRate = 10;    // Readings per second per connection
+  uint32_t PayloadMin = 16;   // Reading payload bytes, uniform in [min, max]
+  uint32_t PayloadMax = 64;
+  double Duration = 10;  // Seconds, connect phase included
+  uint32_t MaxWireVersion = SPOQ_VERSION_COLUMNAR;
+  uint32_t BatchReadings = 8;  // Readings per batch in a columnar session
+  bool Json = false;
+  const char* Target = "127.0.0.1";
+};
+
+BENCH_OPTIONS Options;
+
+// Run-wide results, updated from every msquic worker
+struct BENCH_TOTALS {
+  METRIC_COUNTER ConnectionsStarted;
+  METRIC_COUNTER HandshakesCompleted;
+  METRIC_COUNTER HandshakesFailed;
+  METRIC_COUNTER NegotiationsSucceeded;
+  METRIC_COUNTER NegotiationsFailed;
+  METRIC_COUNTER MessagesSent;
+  METRIC_COUNTER BytesSent;
+  METRIC_COUNTER SendFailures;
+  METRIC_COUNTER MessagesReceived;
+  METRIC_COUNTER BytesReceived;
+  METRIC_COUNTER MessagesDropped;
+  std::atomic<uint64_t> LastConnectedNs{0};
+  // ConnectionStart to CONNECTED
+  LATENCY_HISTOGRAM Handshake;
+  // CONNECTED to our negotiation reply
+  LATENCY_HISTOGRAM Negotiation;
+  // StreamSend of a reading to its SEND_COMPLETE (acknowledged by the server)
+  LATENCY_HISTOGRAM SendAck;
+  // Server send time of a reading to its arrival here
+  LATENCY_HISTOGRAM EndToEnd;
+};
+
+BENCH_TOTALS Totals;
+
+// One simulated sensor: a connection and its stream
+struct BENCH_SESSION {
+  // Guards the handles against being closed while the producer sends
+  std::mutex Lock;
+  HQUIC Connection = nullptr;
+  HQUIC Stream = nullptr;
+  uint64_t SensorId = 0;
+  uint64_t StartNs = 0;
+  uint64_t ConnectedNs = 0;
+  // Set by the callbacks once negotiation succeeds, read by the producer
+  std::atomic<bool> Established{false};
+  uint32_t WireVersion = SPOQ_VERSION_NDJSON;
+  NDJSON_FRAMER Framer = {};
+  BINARY_FRAMER BinaryFramer = {};
+  // Producer state, only touched by the main thread
+  uint64_t NextSendNs = 0;
+  uint64_t Sequence = 0;
+  // Readings gathered for the next batch PDU of a columnar session
+  COLUMNAR_BATCH Columns;
+};
+
+void PrintUsage() {
+  std::cout << "\n"
+               "spoq_bench simulates many SPOQ sensors against a spoq_server.\n"
+               "\n"
+               "Usage:\n"
+               "\n"
+               " spoq_bench -cert_file:<...> -key_file:<...> -ca_file:<...>\n"
+               "            [-target:{IPAddress|Hostname}] (127.0.0.1)\n"
+               "            [-connections:<count>] (100)\n"
+               "            [-connect_rate:<per second>] (1000)\n"
+               "            [-message_rate:<per second per connection>] (10)\n"
+               "            [-payload:<bytes>|<min>-<max>] (16-64)\n"
+               "            [-duration:<seconds>] (10)\n"
+               "            [-encoding:{ndjson|binary|columnar}] (columnar)\n"
+               "            [-batch_readings:<n>] (8) [-json]\n"
+               "            [-execution_profile:{low_latency|max_throughput|\n"
+               "                                 scavenger}] (low_latency)\n"
+               "            [-log_level:{trace|debug|info|warn|error|none}]\n";
+}
+
+// Records an end-to-end latency from a reading's send time field
+void BenchRecordSendTime(uint64_t SendTime) {
+  const uint64_t Now = MetricNow();
+  if (SendTime != 0 && SendTime <= Now) {
+    Totals.EndToEnd.Record(Now - SendTime);
+  }
+}
+
+// Replies to the server's offer like spoq_client does
+void BenchSendNegotiate(_In_ BENCH_SESSION* Session, HQUIC Stream,
+                        bool Success) {
+  SEND_BUFFER* PoolBuffer = SendBufferAlloc(SPOQ_NEGOTIATE_MAX_LENGTH);
+  if (PoolBuffer == NULL) {
+    SPOQ_LOG_ERROR("SendBuffer allocation failed for negotiation!");
+    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+    return;
+  }
+  SPOQ_HEADER_VIEW Header = {
+      Session->SensorId, Session->WireVersion,
+      Success ? SPOQ_STATUS_SUCCESS : SPOQ_STATUS_FAILURE};
+  PoolBuffer->Buffer.Length = (uint32_t)SpoqEncodeNdjson(
+      Header, {}, (char*)PoolBuffer->Buffer.Buffer, PoolBuffer->Capacity);
+  QUIC_STATUS Status = MsQuic->StreamSend(Stream, &PoolBuffer->Buffer, 1,
+                                          QUIC_SEND_FLAG_NONE, PoolBuffer);
+  if (QUIC_FAILED(Status)) {
+    SPOQ_LOG_ERROR("[{}] StreamSend failed to send negotation message - {}!",
+                   Stream, Status);
+    SendBufferFree(PoolBuffer);
+    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+  }
+}
+
+// Handles one complete NDJSON message from the server: the offer while
+// negotiating, readings afterwards
+void BenchProcessMessage(_In_ BENCH_SESSION* Session, HQUIC Stream,
+                         std::string_view Message) {
+  SPOQ_PDU_VIEW Pdu;
+  SPOQ_DECODE_STATUS Decode = SpoqDecodeNdjson(Message, &Pdu);
+  if (!Session->Established.load(std::memory_order_relaxed)) {
+    bool Success = Decode == SPOQ_DECODE_STATUS::SUCCESS &&
+                   Pdu.Header.Version == SPOQ_VERSION_NDJSON;
+    if (Success && Options.MaxWireVersion >= SPOQ_VERSION_COLUMNAR &&
+        SpoqOfferIncludes(Pdu, SPOQ_VERSION_COLUMNAR)) {
+      Session->WireVersion = SPOQ_VERSION_COLUMNAR;
+    } else if (Success && Options.MaxWireVersion >= SPOQ_VERSION_BINARY &&
+               SpoqOfferIncludes(Pdu, SPOQ_VERSION_BINARY)) {
+      Session->WireVersion = SPOQ_VERSION_BINARY;
+    }
+    BenchSendNegotiate(Session, Stream, Success);
+    if (!Success) {
+      SPOQ_LOG_WARN("[{}] Negotiation event: FAILED!", Stream);
+      Totals.NegotiationsFailed.Add();
+      return;
+    }
+    Totals.Negotiation.Record(MetricNow() - Session->ConnectedNs);
+    Totals.NegotiationsSucceeded.Add();
+    Session->Established.store(true, std::memory_order_release);
+    return;
+  }
+
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    Totals.MessagesDropped.Add();
+    return;
+  }
+  Totals.MessagesReceived.Add();
+  Totals.BytesReceived.Add(Message.size());
+  std::string_view Time;
+  uint64_t SendTime = 0;
+  if (JsonObjectFind(Pdu.Data, "time", &Time)) {
+    std::from_chars(Time.data(), Time.data() + Time.size(), SendTime);
+    BenchRecordSendTime(SendTime);
+  }
+}
+
+// Records the end-to-end latency of one binary reading's data fields
+void BenchRecordFields(std::string_view Data) {
+  SPOQ_FIELD_READER Reader(Data);
+  SPOQ_FIELD Field;
+  while (Reader.Next(&Field)) {
+    if (Field.Id == FIELD_TIME && Field.Type == SPOQ_WIRE_TYPE::VARINT) {
+      BenchRecordSendTime(Field.Uint);
+    }
+  }
+}
+
+// Handles one complete binary PDU from the server, a single reading or a
+// columnar batch of them
+void BenchProcessBinary(std::string_view Body) {
+  SPOQ_PDU_VIEW Pdu;
+  if (SpoqDecodeBinary(Body, &Pdu) != SPOQ_DECODE_STATUS::SUCCESS) {
+    Totals.MessagesDropped.Add();
+    return;
+  }
+  Totals.BytesReceived.Add(Body.size());
+  if (Pdu.Header.Version != SPOQ_VERSION_COLUMNAR) {
+    Totals.MessagesReceived.Add();
+    BenchRecordFields(Pdu.Data);
+    return;
+  }
+  // Msquic workers each decode into their own batch
+  thread_local COLUMNAR_BATCH Columns;
+  if (!Columns.Decode(Pdu.Data)) {
+    Totals.MessagesDropped.Add();
+    return;
+  }
+  Totals.MessagesReceived.Add(Columns.Count());
+  for (uint32_t i = 0; i < Columns.Count(); ++i) {
+    BenchRecordFields(Columns.Reading(i));
+  }
+}
+
+// The bench's callback for stream events from MsQuic.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+    _Function_class_(QUIC_STREAM_CALLBACK) QUIC_STATUS QUIC_API
+    BenchStreamCallback(_In_ HQUIC Stream, _In_opt_ void* Context,
+                        _Inout_ QUIC_STREAM_EVENT* Event) {
+  auto Session = static_cast<BENCH_SESSION*>(Context);
+  SPOQ_LOG_DEBUG("[{}] Stream event: {}", Stream,
+                 QuicStreamEventTypeToString(Event->Type));
+  switch (Event->Type) {
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
+      // Readings carry their send time; the negotiation reply does not
+      auto Sent = static_cast<SEND_BUFFER*>(Event->SEND_COMPLETE.ClientContext);
+      if (Sent != nullptr && Sent->SendTime != 0 &&
+          !Event->SEND_COMPLETE.Canceled) {
+        Totals.SendAck.Record(MetricNow() - Sent->SendTime);
+      }
+      SendBufferFree(Sent);
+      break;
+    }
+    case QUIC_STREAM_EVENT_RECEIVE: {
+      // The server only sends binary PDUs after our negotiation reply, so
+      // the framing never changes within one event.
+      uint64_t Consumed = 0;
+      QUIC_STATUS Status;
+      if (Session->WireVersion >= SPOQ_VERSION_BINARY) {
+        Status = Session->BinaryFramer.Receive(
+            Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &Consumed,
+            [](std::string_view Body) { BenchProcessBinary(Body); });
+      } else {
+        Status = Session->Framer.Receive(
+            Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &Consumed,
+            [Session, Stream](std::string_view Message) {
+              BenchProcessMessage(Session, Stream, Message);
+            });
+      }
+      if (QUIC_FAILED(Status)) {
+        SPOQ_LOG_ERROR("[{}] Stream event: Malformed framing!", Stream);
+        MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+        break;
+      }
+      return NdjsonReceiveComplete(Stream, Consumed,
+                                   Event->RECEIVE.TotalBufferLength);
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+      // Stop the producer from using the stream before closing it
+      {
+        std::lock_guard<std::mutex> Guard(Session->Lock);
+        Session->Established.store(false, std::memory_order_relaxed);
+        Session->Stream = nullptr;
+      }
+      if (!Event->SHUTDOWN_COMPLETE.AppCloseInProgress) {
+        MsQuic->StreamClose(Stream);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return QUIC_STATUS_SUCCESS;
+}
+
+void BenchOpenStream(_In_ BENCH_SESSION* Session, _In_ HQUIC Connection) {
+  HQUIC Stream = NULL;
+  QUIC_STATUS Status;
+  if (QUIC_FAILED(Status = MsQuic->StreamOpen(Connection,
+                                              QUIC_STREAM_OPEN_FLAG_NONE,
+                                              BenchStreamCallback, Session,
+                                              &Stream))) {
+    SPOQ_LOG_ERROR("StreamOpen failed, {}!", SpoqLogHex(Status));
+    MsQuic->ConnectionShutdown(Connection, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE,
+                               0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> Guard(Session->Lock);
+    Session->Stream = Stream;
+  }
+  // Start immediately so the server sends its offer
+  if (QUIC_FAILED(Status = MsQuic->StreamStart(
+                      Stream, QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+    SPOQ_LOG_ERROR("StreamStart failed, {}!", SpoqLogHex(Status));
+    {
+      std::lock_guard<std::mutex> Guard(Session->Lock);
+      Session->Stream = nullptr;
+    }
+    MsQuic->StreamClose(Stream);
+    MsQuic->ConnectionShutdown(Connection, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE,
+                               0);
+  }
+}
+
+// The bench's callback for connection events from MsQuic.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+    _Function_class_(QUIC_CONNECTION_CALLBACK) QUIC_STATUS QUIC_API
+    BenchConnectionCallback(_In_ HQUIC Connection, _In_opt_ void* Context,
+                            _Inout_ QUIC_CONNECTION_EVENT* Event) {
+  auto Session = static_cast<BENCH_SESSION*>(Context);
+  SPOQ_LOG_DEBUG("[{}] Connection event: {}", Connection,
+                 QuicConnectionEventTypeToString(Event->Type));
+  switch (Event->Type) {
+    case QUIC_CONNECTION_EVENT_CONNECTED: {
+      // The handshake has completed for the connection.
+      const uint64_t Now = MetricNow();
+      Session->ConnectedNs = Now;
+      Totals.Handshake.Record(Now - Session->StartNs);
+      Totals.HandshakesCompleted.Add();
+      uint64_t Last = Totals.LastConnectedNs.load(std::memory_order_relaxed);
+      while (Last < Now && !Totals.LastConnectedNs.compare_exchange_weak(
+                               Last, Now, std::memory_order_relaxed)) {
+      }
+      BenchOpenStream(Session, Connection);
+      break;
+    }
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
+      if (Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status !=
+          QUIC_STATUS_CONNECTION_IDLE) {
+        SPOQ_LOG_WARN(
+            "[{}] Connection event: Shut down by transport, {}", Connection,
+            SpoqLogHex(Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status));
+      }
+      break;
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+      // The connection is done; keep the session for the report
+      if (!Event->SHUTDOWN_COMPLETE.HandshakeCompleted) {
+        Totals.HandshakesFailed.Add();
+      }
+      {
+        std::lock_guard<std::mutex> Guard(Session->Lock);
+        Session->Connection = nullptr;
+      }
+      if (!Event->SHUTDOWN_COMPLETE.AppCloseInProgress) {
+        MsQuic->ConnectionClose(Connection);
+      }
+      break;
+    default:
+      break;
+  }
+  return QUIC_STATUS_SUCCESS;
+}
+
+// Opens and starts the connection of one simulated sensor
+void BenchConnect(_In_ BENCH_SESSION* Session) {
+  HQUIC Connection = NULL;
+  QUIC_STATUS Status;
+  Session->StartNs = MetricNow();
+  Totals.ConnectionsStarted.Add();
+  if (QUIC_FAILED(Status = MsQuic->ConnectionOpen(
+                      Registration, BenchConnectionCallback, Session,
+                      &Connection))) {
+    SPOQ_LOG_ERROR("ConnectionOpen failed, {}!", SpoqLogHex(Status));
+    Totals.HandshakesFailed.Add();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> Guard(Session->Lock);
+    Session->Connection = Connection;
+  }
+  if (QUIC_FAILED(Status = MsQuic->ConnectionStart(
+                      Connection, Configuration, QUIC_ADDRESS_FAMILY_UNSPEC,
+                      Options.Target, UdpPort))) {
+    SPOQ_LOG_ERROR("ConnectionStart failed, {}!", SpoqLogHex(Status));
+    Totals.HandshakesFailed.Add();
+    {
+      std::lock_guard<std::mutex> Guard(Session->Lock);
+      Session->Connection = nullptr;
+    }
+    MsQuic->ConnectionClose(Connection);
+  }
+}
+
+// Sends an encoded PDU that carries Readings readings upstream. The buffer
+// is handed over.
+void BenchSendPdu(_In_ BENCH_SESSION* Session, _In_ SEND_BUFFER* Pdu,
+                  uint32_t Readings) {
+  Pdu->SendTime = MetricNow();
+  // The buffer may be freed by SEND_COMPLETE as soon as it is sent
+  const uint32_t PduLength = Pdu->Buffer.Length;
+
+  QUIC_STATUS Status = QUIC_STATUS_INVALID_STATE;
+  {
+    std::lock_guard<std::mutex> Guard(Session->Lock);
+    if (Session->Stream != nullptr) {
+      Status = MsQuic->StreamSend(Session->Stream, &Pdu->Buffer, 1,
+                                  QUIC_SEND_FLAG_NONE, Pdu);
+    }
+  }
+  if (QUIC_FAILED(Status)) {
+    SendBufferFree(Pdu);
+    Totals.SendFailures.Add(Readings);
+    return;
+  }
+  Totals.MessagesSent.Add(Readings);
+  Totals.BytesSent.Add(PduLength);
+}
+
+// Encodes the readings gathered in a columnar session as one batch PDU and
+// sends it
+void BenchSendBatch(_In_ BENCH_SESSION* Session) {
+  const uint32_t Readings = Session->Columns.Count();
+  if (Readings == 0) {
+    return;
+  }
+  const std::string_view Batch = Session->Columns.Encode();
+  SEND_BUFFER* Pdu = SendBufferAlloc((uint32_t)Batch.size() + READING_OVERHEAD);
+  if (Pdu == nullptr) {
+    Session->Columns.Clear();
+    Totals.SendFailures.Add(Readings);
+    return;
+  }
+  Pdu->Buffer.Length = (uint32_t)SpoqEncodeBinary(
+      {Session->SensorId, SPOQ_VERSION_COLUMNAR, SPOQ_STATUS_SUCCESS}, Batch,
+      Pdu->Buffer.Buffer, Pdu->Capacity);
+  Session->Columns.Clear();
+  BenchSendPdu(Session, Pdu, Readings);
+}
+
+// Sends one reading with a random payload length upstream in the
+// negotiated wire version. In a columnar session it is added to the
+// session's batch, which is sent once it holds -batch_readings readings.
+void BenchSendReading(_In_ BENCH_SESSION* Session, std::mt19937& Random) {
+  static const std::string Pad(MAX_PAYLOAD_LENGTH, 'x');
+  std::uniform_int_distribution<uint32_t> PayloadLength(Options.PayloadMin,
+                                                        Options.PayloadMax);
+  const uint32_t Length = PayloadLength(Random);
+  const uint64_t Sequence = Session->Sequence++;
+  const uint64_t Now = MetricNow();
+  const uint32_t Version = Session->WireVersion;
+
+  uint8_t Fields[MAX_PAYLOAD_LENGTH + 64];
+  SPOQ_FIELD_WRITER Writer(Fields, sizeof(Fields));
+  if (Version >= SPOQ_VERSION_BINARY) {
+    Writer.Uint(FIELD_SEQUENCE, Sequence);
+    Writer.Bytes(FIELD_PAD, std::string_view(Pad.data(), Length));
+    Writer.Uint(FIELD_TIME, Now);
+  }
+  if (Version == SPOQ_VERSION_COLUMNAR) {
+    // A batch full of readings laid out like this one always takes it
+    if (!Session->Columns.Add(Writer.Data())) {
+      BenchSendBatch(Session);
+      Session->Columns.Add(Writer.Data());
+    }
+    if (Session->Columns.Count() >= Options.BatchReadings) {
+      BenchSendBatch(Session);
+    }
+    return;
+  }
+
+  SEND_BUFFER* Reading = SendBufferAlloc(Length + READING_OVERHEAD);
+  if (Reading == nullptr) {
+    Totals.SendFailures.Add();
+    return;
+  }
+  SPOQ_HEADER_VIEW Header = {Session->SensorId, Version, SPOQ_STATUS_SUCCESS};
+  if (Version == SPOQ_VERSION_BINARY) {
+    Reading->Buffer.Length = (uint32_t)SpoqEncodeBinary(
+        Header, Writer.Data(), Reading->Buffer.Buffer, Reading->Capacity);
+  } else {
+    char Data[MAX_PAYLOAD_LENGTH + 64];
+    int DataLength = snprintf(
+        Data, sizeof(Data), "{\"seq\":%llu,\"pad\":\"%.*s\",\"time\":%llu}",
+        (unsigned long long)Sequence, (int)Length, Pad.data(),
+        (unsigned long long)Now);
+    Reading->Buffer.Length = (uint32_t)SpoqEncodeNdjson(
+        Header, std::string_view(Data, DataLength),
+        (char*)Reading->Buffer.Buffer, Reading->Capacity);
+  }
+  BenchSendPdu(Session, Reading, 1);
+}
+
+// Opens connections at the connect rate and sends every reading that is
+// due until the run is over
+void BenchProduce(std::vector<std::unique_ptr<BENCH_SESSION>>& Sessions,
+                  uint64_t StartNs, uint64_t EndNs) {
+  const uint64_t ConnectIntervalNs = (uint64_t)(1e9 / Options.ConnectRate);
+  const uint64_t SendIntervalNs = (uint64_t)(1e9 / Options.MessageRate);
+  std::mt19937 Random(12345);
+  size_t Opened = 0;
+
+  for (uint64_t Now = MetricNow(); Now < EndNs; Now = MetricNow()) {
+    while (Opened < Sessions.size() &&
+           StartNs + Opened * ConnectIntervalNs <= Now) {
+      BenchConnect(Sessions[Opened++].get());
+    }
+    for (size_t i = 0; i < Opened; ++i) {
+      BENCH_SESSION* Session = Sessions[i].get();
+      if (!Session->Established.load(std::memory_order_acquire)) {
+        continue;
+      }
+      // Readings missed by more than a second are skipped, not bunched up
+      if (Session->NextSendNs == 0 || Now - Session->NextSendNs > 1000000000) {
+        Session->NextSendNs = Now;
+      }
+      while (Session->NextSendNs <= Now) {
+        BenchSendReading(Session, Random);
+        Session->NextSendNs += SendIntervalNs;
+      }
+    }
+    std::this_thread::sleep_for(PRODUCER_TICK);
+  }
+}
+
+double Milliseconds(uint64_t Ns) { return (double)Ns / 1e6; }
+
+// Prints the results as text, or as one JSON object with -json
+void BenchReport(double Seconds, uint64_t StartNs) {
+  const uint64_t Handshakes = Totals.HandshakesCompleted.Value();
+  const uint64_t LastConnected =
+      Totals.LastConnectedNs.load(std::memory_order_relaxed);
+  const double HandshakeSeconds =
+      LastConnected > StartNs ? (double)(LastConnected - StartNs) / 1e9 : 0;
+  const double HandshakeRate =
+      HandshakeSeconds > 0 ? (double)Handshakes / HandshakeSeconds : 0;
+  const LATENCY_HISTOGRAM* Latencies[] = {&Totals.Handshake,
+                                          &Totals.Negotiation,
+                                          &Totals.SendAck, &Totals.EndToEnd};
+  const char* Names[] = {"handshake", "negotiation", "send_ack",
+                         "end_to_end"};
+
+  if (Options.Json) {
+    printf("{\"connections\":%u,\"duration_s\":%.3f,"
+           "\"message_rate\":%.3f,\"payload_min\":%u,\"payload_max\":%u,\n",
+           Options.Connections, Seconds, Options.MessageRate,
+           Options.PayloadMin, Options.PayloadMax);
+    printf(" \"handshakes\":%llu,\"handshakes_failed\":%llu,"
+           "\"handshakes_per_s\":%.1f,\"negotiations\":%llu,"
+           "\"negotiations_failed\":%llu,\n",
+           (unsigned long long)Handshakes,
+           (unsigned long long)Totals.HandshakesFailed.Value(), HandshakeRate,
+           (unsigned long long)Totals.NegotiationsSucceeded.Value(),
+           (unsigned long long)Totals.NegotiationsFailed.Value());
+    printf(" \"messages_sent\":%llu,\"bytes_sent\":%llu,"
+           "\"send_failures\":%llu,\"messages_per_s\":%.1f,"
+           "\"bytes_per_s\":%.1f,\n",
+           (unsigned long long)Totals.MessagesSent.Value(),
+           (unsigned long long)Totals.BytesSent.Value(),
+           (unsigned long long)Totals.SendFailures.Value(),
+           (double)Totals.MessagesSent.Value() / Seconds,
+           (double)Totals.BytesSent.Value() / Seconds);
+    printf(" \"messages_received\":%llu,\"bytes_received\":%llu,"
+           "\"messages_dropped\":%llu,\"received_messages_per_s\":%.1f,"
+           "\"received_bytes_per_s\":%.1f",
+           (unsigned long long)Totals.MessagesReceived.Value(),
+           (unsigned long long)Totals.BytesReceived.Value(),
+           (unsigned long long)Totals.MessagesDropped.Value(),
+           (double)Totals.MessagesReceived.Value() / Seconds,
+           (double)Totals.BytesReceived.Value() / Seconds);
+    for (int i = 0; i < 4; ++i) {
+      printf(",\n \"%s_ms\":{\"count\":%llu,\"p50\":%.3f,\"p99\":%.3f,"
+             "\"p999\":%.3f}",
+             Names[i], (unsigned long long)Latencies[i]->Count(),
+             Milliseconds(Latencies[i]->Percentile(0.5)),
+             Milliseconds(Latencies[i]->Percentile(0.99)),
+             Milliseconds(Latencies[i]->Percentile(0.999)));
+    }
+    printf("}\n");
+    return;
+  }
+
+  printf("spoq_bench: %u connections to %s for %.1f s, %.1f readings/s each, "
+         "payload %u-%u B\n\n",
+         Options.Connections, Options.Target, Seconds, Options.MessageRate,
+         Options.PayloadMin, Options.PayloadMax);
+  printf("%-12s %10llu ok %10llu failed %12.1f /s\n", "handshakes",
+         (unsigned long long)Handshakes,
+         (unsigned long long)Totals.HandshakesFailed.Value(), HandshakeRate);
+  printf("%-12s %10llu ok %10llu failed\n", "negotiations",
+         (unsigned long long)Totals.NegotiationsSucceeded.Value(),
+         (unsigned long long)Totals.NegotiationsFailed.Value());
+  printf("%-12s %10llu msgs %12.1f msg/s %12.3f MB/s %8llu failed\n", "sent",
+         (unsigned long long)Totals.MessagesSent.Value(),
+         (double)Totals.MessagesSent.Value() / Seconds,
+         (double)Totals.BytesSent.Value() / Seconds / 1e6,
+         (unsigned long long)Totals.SendFailures.Value());
+  printf("%-12s %10llu msgs %12.1f msg/s %12.3f MB/s %8llu dropped\n\n",
+         "received", (unsigned long long)Totals.MessagesReceived.Value(),
+         (double)Totals.MessagesReceived.Value() / Seconds,
+         (double)Totals.BytesReceived.Value() / Seconds / 1e6,
+         (unsigned long long)Totals.MessagesDropped.Value());
+  printf("%-12s %10s %10s %10s %10s\n", "latency (ms)", "count", "p50", "p99",
+         "p999");
+  for (int i = 0; i < 4; ++i) {
+    printf("%-12s %10llu %10.3f %10.3f %10.3f\n", Names[i],
+           (unsigned long long)Latencies[i]->Count(),
+           Milliseconds(Latencies[i]->Percentile(0.5)),
+           Milliseconds(Latencies[i]->Percentile(0.99)),
+           Milliseconds(Latencies[i]->Percentile(0.999)));
+  }
+}
+
+// Helper function to load the client configuration shared by all sessions.
+BOOLEAN
+BenchLoadConfiguration(_In_ int argc,
+                       _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  QUIC_SETTINGS Settings = {0};
+  Settings.IdleTimeoutMs = IdleTimeoutMs;
+  Settings.IsSet.IdleTimeoutMs = TRUE;
+  // Keep slow sensors from idling out between readings
+  Settings.KeepAliveIntervalMs = KEEP_ALIVE_INTERVAL_MS;
+  Settings.IsSet.KeepAliveIntervalMs = TRUE;
+
+  QUIC_CREDENTIAL_CONFIG_HELPER Config;
+  memset(&Config, 0, sizeof(Config));
+  Config.CredConfig.Type = QUIC_CREDENTIAL_TYPE_NONE;
+  Config.CredConfig.Flags = QUIC_CREDENTIAL_FLAG_CLIENT;
+
+  const char* Cert;
+  const char* KeyFile;
+  const char* CaFile;
+  if ((Cert = GetValue(argc, argv, "cert_file")) != NULL &&
+      (KeyFile = GetValue(argc, argv, "key_file")) != NULL &&
+      (CaFile = GetValue(argc, argv, "ca_file")) != NULL) {
+    Config.CertFile.CertificateFile = (char*)Cert;
+    Config.CertFile.PrivateKeyFile = (char*)KeyFile;
+    Config.CredConfig.Type = QUIC_CREDENTIAL_TYPE_CERTIFICATE_FILE;
+    Config.CredConfig.CertificateFile = &Config.CertFile;
+    Config.CredConfig.CaCertificateFile = (char*)CaFile;
+    Config.CredConfig.Flags |=
+        QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED;
+    Config.CredConfig.Flags |= QUIC_CREDENTIAL_FLAG_SET_CA_CERTIFICATE_FILE;
+  } else {
+    SPOQ_LOG_ERROR("Must specify ['cert_file', 'key_file', and 'ca_file']!");
+    return FALSE;
+  }
+
+  QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+  if (QUIC_FAILED(Status = MsQuic->ConfigurationOpen(
+                      Registration, &Alpn, 1, &Settings, sizeof(Settings), NULL,
+                      &Configuration))) {
+    SPOQ_LOG_ERROR("ConfigurationOpen failed, {}!", SpoqLogHex(Status));
+    return FALSE;
+  }
+  if (QUIC_FAILED(Status = MsQuic->ConfigurationLoadCredential(
+                      Configuration, &Config.CredConfig))) {
+    SPOQ_LOG_ERROR("ConfigurationLoadCredential failed, {}!",
+                   SpoqLogHex(Status));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Reads the bench options. Returns false on an invalid value.
+bool BenchParseOptions(_In_ int argc,
+                       _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  const char* Value;
+  if ((Value = GetValue(argc, argv, "target")) != NULL) {
+    Options.Target = Value;
+  }
+  if ((Value = GetValue(argc, argv, "connections")) != NULL) {
+    Options.Connections = (uint32_t)strtoul(Value, NULL, 10);
+  }
+  if ((Value = GetValue(argc, argv, "connect_rate")) != NULL) {
+    Options.ConnectRate = strtod(Value, NULL);
+  }
+  if ((Value = GetValue(argc, argv, "message_rate")) != NULL) {
+    Options.MessageRate = strtod(Value, NULL);
+  }
+  if ((Value = GetValue(argc, argv, "duration")) != NULL) {
+    Options.Duration = strtod(Value, NULL);
+  }
+  if ((Value = GetValue(argc, argv, "payload")) != NULL) {
+    char* End;
+    Options.PayloadMin = (uint32_t)strtoul(Value, &End, 10);
+    Options.PayloadMax = Options.PayloadMin;
+    if (*End == '-') {
+      Options.PayloadMax = (uint32_t)strtoul(End + 1, NULL, 10);
+    }
+  }
+  if ((Value = GetValue(argc, argv, "encoding")) != NULL) {
+    Options.MaxWireVersion =
+        strcmp(Value, "ndjson") == 0   ? SPOQ_VERSION_NDJSON
+        : strcmp(Value, "binary") == 0 ? SPOQ_VERSION_BINARY
+                                       : SPOQ_VERSION_COLUMNAR;
+  }
+  if ((Value = GetValue(argc, argv, "batch_readings")) != NULL) {
+    Options.BatchReadings = std::clamp<uint32_t>(
+        (uint32_t)strtoul(Value, NULL, 10), 1, COLUMNAR_MAX_READINGS);
+  }
+  Options.Json = GetFlag(argc, argv, "json");
+
+  if (Options.Connections == 0 || Options.ConnectRate <= 0 ||
+      Options.MessageRate <= 0 || Options.Duration <= 0 ||
+      Options.PayloadMin > Options.PayloadMax ||
+      Options.PayloadMax > MAX_PAYLOAD_LENGTH) {
+    std::cout << "Invalid bench options, payload is at most "
+              << MAX_PAYLOAD_LENGTH << " B!\n";
+    return false;
+  }
+  return true;
+}
+
+// Runs the bench
+void RunBench(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  if (!BenchParseOptions(argc, argv) ||
+      !BenchLoadConfiguration(argc, argv)) {
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    return;
+  }
+
+  // Sessions outlive their connections so the report can read them; they are
+  // freed once the registration has closed every connection
+  std::vector<std::unique_ptr<BENCH_SESSION>> Sessions;
+  Sessions.reserve(Options.Connections);
+  for (uint32_t i = 0; i < Options.Connections; ++i) {
+    Sessions.push_back(std::make_unique<BENCH_SESSION>());
+    Sessions.back()->SensorId = i + 1;
+  }
+
+  setSpoqState(state, SPOQ_STATE::SENDING);
+  const uint64_t StartNs = MetricNow();
+  const uint64_t EndNs = StartNs + (uint64_t)(Options.Duration * 1e9);
+  BenchProduce(Sessions, StartNs, EndNs);
+  const double Seconds = (double)(MetricNow() - StartNs) / 1e9;
+
+  // Shut everything down; RegistrationClose waits for the connections
+  for (auto& Session : Sessions) {
+    std::lock_guard<std::mutex> Guard(Session->Lock);
+    if (Session->Connection != nullptr) {
+      MsQuic->ConnectionShutdown(Session->Connection,
+                                 QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
+    }
+  }
+  MsQuic->ConfigurationClose(Configuration);
+  Configuration = NULL;
+  MsQuic->RegistrationClose(Registration);
+  Registration = NULL;
+  SpoqLogFlush();
+
+  BenchReport(Seconds, StartNs);
+}
+
+int QUIC_MAIN_EXPORT main(_In_ int argc,
+                          _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  // Per-event logging would distort the results, so only warnings by default
+  SpoqLogSetLevel("warn");
+  const char* LogLevel;
+  if ((LogLevel = GetValue(argc, argv, "log_level")) != NULL &&
+      !SpoqLogSetLevel(LogLevel)) {
+    std::cout << "Unknown log level '" << LogLevel << "'!\n";
+    return -1;
+  }
+  setSpoqState(state, SPOQ_STATE::INIT);
+  QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+
+  auto shutdown = [&]() {
+    if (MsQuic != NULL) {
+      if (Configuration != NULL) {
+        MsQuic->ConfigurationClose(Configuration);
+      }
+      if (Registration != NULL) {
+        MsQuic->RegistrationClose(Registration);
+      }
+      MsQuicClose(MsQuic);
+      setSpoqState(state, SPOQ_STATE::CLOSED);
+    }
+  };
+
+  // Open a handle to the library and get the API function table.
+  if (QUIC_FAILED(Status = MsQuicOpen2(&MsQuic))) {
+    SPOQ_LOG_ERROR("MsQuicOpen2 failed, {}!", SpoqLogHex(Status));
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return (int)Status;
+  }
+
+  const char* Profile;
+  if ((Profile = GetValue(argc, argv, "execution_profile")) != NULL &&
+      !ParseExecutionProfile(Profile, &RegConfig.ExecutionProfile)) {
+    SPOQ_LOG_ERROR("Unknown execution profile '{}'!", Profile);
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return -1;
+  }
+
+  // Create a registration for the bench's connections.
+  if (QUIC_FAILED(Status =
+                      MsQuic->RegistrationOpen(&RegConfig, &Registration))) {
+    SPOQ_LOG_ERROR("RegistrationOpen failed, {}!", SpoqLogHex(Status));
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return (int)Status;
+  }
+
+  if (argc == 1 || GetFlag(argc, argv, "help") || GetFlag(argc, argv, "?")) {
+    PrintUsage();
+  } else {
+    RunBench(argc, argv);
+  }
+
+  shutdown();
+  return (int)Status;
+}
@@ -15,20 +15,39 @@ README.MD at the top level for build and run instructions.
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 
+#include "autotune.h"
+#include "binary_framer.h"
+#include "capture.h"
+#include "columnar_batch.h"
 #include "msquic.h"
+#include "ndjson_framer.h"
+#include "numa_placement.h"
 #include "quic_config.h"
+#include "send_message.h"
+#include "send_pool.h"
+#include "send_window.h"
 #include "spoq.h"
+#include "spoq_datagram.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+#include "ticket_cache.h"
 #include "utils.h"
 
 // The (optional) registration configuration for the app. This sets a name for
 // the app (used for persistent storage and for debugging). It also configures
-// the execution profile, using the default "low latency" profile.
-const QUIC_REGISTRATION_CONFIG RegConfig = {"spoq_client",
-                                            QUIC_EXECUTION_PROFILE_LOW_LATENCY};
+// the execution profile, "low latency" unless -execution_profile picks
+// another.
+QUIC_REGISTRATION_CONFIG RegConfig = {"spoq_client",
+                                      QUIC_EXECUTION_PROFILE_LOW_LATENCY};
 
 // The protocol name used in the Application Layer Protocol Negotiation (ALPN).
 const QUIC_BUFFER Alpn = {sizeof("sample") - 1, (uint8_t*)"sample"};
@@ -50,6 +69,141 @@ QUIC_TLS_SECRETS ClientSecrets = {0};
 // The client SPOQ state
 SPOQ_STATE state = SPOQ_STATE::UNKNOWN;
 
+// Highest wire version the client accepts, set with -encoding
+uint32_t MaxWireVersion = SPOQ_VERSION_COLUMNAR;
+
+// Wire version picked from the server's offer
+uint32_t WireVersion = SPOQ_VERSION_NDJSON;
+
+// Accept readings as datagrams, set with -datagram
+bool DatagramsEnabled = false;
+
+// The server offered datagrams and we accepted
+bool DatagramsAgreed = false;
+
+// Drops datagram readings older than the newest one received
+SEQUENCE_FILTER DatagramFilter;
+
+// The sensor id the client reports in the PDUs it sends, set with
+// -sensor_id
+uint64_t ClientSensorId = 1;
+
+// Sensors whose readings the server forwards to us rather than sending
+// generated data, set with -subscribe
+uint64_t Subscriptions[SPOQ_MAX_SUBSCRIPTIONS] = {};
+uint32_t SubscriptionCount = 0;
+
+// Binary data field ids of the readings the client produces
+constexpr uint32_t FIELD_SEQUENCE = SPOQ_FIELD_SEQUENCE;
+constexpr uint32_t FIELD_VALUE = 2;
+constexpr uint32_t FIELD_TIME = SPOQ_FIELD_TIME;
+constexpr uint32_t FIELD_JSON = 4;  // A reading read from -input, verbatim
+
+// Longest -input line sent as a reading; longer ones are skipped
+constexpr size_t PRODUCE_MAX_LINE_LENGTH = 4096;
+
+// Room for the header and fields around a reading's data
+constexpr uint32_t READING_OVERHEAD = 128;
+
+// Stream readings upstream to the server, set with -produce
+bool Producing = false;
+
+// Readings produced per second, set with -rate. At 0 they are sent as fast
+// as the send window allows.
+double ProduceRate = 10;
+
+// Readings generated when not reading them from -input, set with -count
+uint64_t ProduceCount = 100;
+
+// Readings a columnar batch holds before it is sent, set with -batch_readings
+uint32_t BatchReadings = 64;
+
+// Longest a reading waits in a columnar batch before the batch is sent, set
+// with -batch_ms
+uint64_t BatchBudgetNs = 250 * 1000000ull;
+
+// NUMA node of the connection's ideal processor, which the producer follows
+std::atomic<int> ProducerNode{-1};
+
+// One of the client's streams, handed to msquic as the Context of its
+// stream callback. Index 0 is the control stream; data streams follow it.
+struct CLIENT_STREAM {
+  HQUIC Stream = nullptr;
+  uint32_t Index = 0;
+  // Reassembles NDJSON lines received on Stream
+  NDJSON_FRAMER Framer;
+  // Reassembles binary PDUs once that encoding has been negotiated
+  BINARY_FRAMER BinaryFramer;
+  // Budget of bytes outstanding on Stream, sized by msquic's
+  // IDEAL_SEND_BUFFER_SIZE events
+  SEND_WINDOW Window;
+  // Readings produced for the next batch PDU of a columnar session, and
+  // when the first of them was
+  COLUMNAR_BATCH Columns;
+  uint64_t BatchStart = 0;
+};
+
+// The control stream and the data streams. The producer sends on them from
+// the main thread, so their handles are guarded against being cleared by
+// the stream callback meanwhile.
+std::mutex StreamLock;
+CLIENT_STREAM Streams[1 + SPOQ_MAX_DATA_STREAMS];
+
+// Data streams asked for in negotiation, set with -streams
+uint32_t RequestedStreams = 0;
+
+// Data streams agreed with the server, 0 to use the control stream alone
+uint32_t DataStreamCount = 0;
+
+// The connection to the server, on which data streams are opened once
+// negotiation has agreed on them. The handshake may still be under way.
+HQUIC ServerConnection = nullptr;
+
+// The connection to the server once its handshake completes, used to sample
+// transport statistics from the stream callback
+HQUIC ClientConnection = nullptr;
+
+// Throughput and transport statistics of the connection to the server
+CONNECTION_METRICS ConnectionMetrics;
+
+// Initial transport settings and autotuning bounds, loaded from -tuning, and
+// the state of the connection's autotuner
+TUNING_PROFILE Tuning;
+CONNECTION_TUNER Tuner;
+
+// Serves -metrics_socket and writes -metrics_file
+METRICS_EXPORTER Exporter;
+
+// Resumption tickets kept across runs, stored in -ticket_cache
+TICKET_CACHE TicketCache;
+
+// Records the messages sent and received for spoq_replay when -capture names
+// a file, and the connection's number in it
+CAPTURE_WRITER Capture;
+uint64_t CaptureConnection = 0;
+
+// Default file of the ticket cache
+const char* DefaultTicketCache = ".spoq_tickets";
+
+// The server's key in TicketCache, its -target
+std::string TicketKey;
+
+// The connection was given a resumption ticket
+bool Resuming = false;
+
+// Open with a hello instead of waiting for the offer, set with -negotiate
+bool Optimistic = true;
+
+// Our hello is out and the server has not answered it yet
+bool HelloPending = false;
+
+// What we would pick from the server's offer, kept while the hello is
+// pending in case the server asks us to fall back to it
+bool OfferAcceptable = false;
+uint32_t OfferVersion = SPOQ_VERSION_NDJSON;
+bool OfferDatagram = false;
+uint32_t OfferStreams = 0;
+
 // The name of the environment variable being
 // used to get the path to the ssl key log file.
 const char* SslKeyLogEnvVar = "SSLKEYLOGFILE";
@@ -60,108 +214,422 @@ void PrintUsage() {
                "\n"
                "Usage:\n"
                "\n"
-               " spoq_server -cert_file:<...> -key_file:<...> -ca_file:<...> -target:{IPAddress|Hostname}\n";
+               " spoq_server -cert_file:<...> -key_file:<...> -ca_file:<...> -target:{IPAddress|Hostname}\n"
+               "             [-encoding:{ndjson|binary|columnar}] (columnar)\n"
+               "             [-datagram]\n"
+               "             [-negotiate:{optimistic|classic}] (optimistic)\n"
+               "             [-streams:<0-16>] (0)\n"
+               "             [-sensor_id:<n>] (1)\n"
+               "             [-subscribe:<sensor id>[,<sensor id>...]]\n"
+               "             [-produce [-rate:<n/s>] (10) [-count:<n>] (100)\n"
+               "                       [-input:{<path>|-}]\n"
+               "                       [-batch_readings:<n>] (64)\n"
+               "                       [-batch_ms:<n>] (250)]\n"
+               "             [-ticket_cache:<path>] (.spoq_tickets)\n"
+               "             [-ticket:<hex>] [-no_resume]\n"
+               "             [-capture:<path>]\n"
+               "             [-execution_profile:{low_latency|max_throughput|\n"
+               "                                  scavenger}] (low_latency)\n"
+               "             [-tuning:<path>]\n"
+               "             [-metrics_socket:<path>] [-metrics_file:<path>]\n"
+               "             [-log_level:{trace|debug|info|warn|error|none}]\n";
 }
 
-// Send the response to the server
-void SendNegotiate(_In_ HQUIC Stream, const bool success) {
-  // Allocate buffer: QUIC_BUFFER + payload
-  void* SendBufferRaw = malloc(sizeof(QUIC_BUFFER) + 64);
-  if (SendBufferRaw == NULL) {
-    std::cout << "SendBuffer allocation failed for client negotiation!\n";
+// Sends one NEGOTIATE message to the server. Flags are added to
+// QUIC_SEND_FLAG_START.
+void SendNegotiation(_In_ HQUIC Stream, _In_ const SPOQ_HEADER_VIEW& Header,
+                     _In_ std::string_view Data,
+                     QUIC_SEND_FLAGS Flags = QUIC_SEND_FLAG_NONE) {
+  // Take a pooled buffer: QUIC_BUFFER header + payload
+  SEND_BUFFER* PoolBuffer = SpoqNegotiationBuffer(Header, Data);
+  if (PoolBuffer == NULL) {
+    SPOQ_LOG_ERROR("SendBuffer allocation failed for client negotiation!");
     MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
     return;
   }
 
-  QUIC_BUFFER* SendBuffer = (QUIC_BUFFER*)SendBufferRaw;
-  SendBuffer->Buffer = (uint8_t*)SendBufferRaw + sizeof(QUIC_BUFFER);
+  QUIC_BUFFER* SendBuffer = &PoolBuffer->Buffer;
 
-  // Write a sample version negotitation message
-  std::string success_str = success ? "0" : "1";
-  std::string neg_msg =
-      "{\"header\":{\"sensor_id\":\"1\",\"version\":\"1\",\"status\":\"" +
-      success_str + "\"}}";
-  int len = snprintf((char*)SendBuffer->Buffer, 64, "%s\n", neg_msg.c_str());
-  SendBuffer->Length = (uint32_t)len;
-
-  QUIC_SEND_FLAGS flags = QUIC_SEND_FLAG_START;
+  QUIC_SEND_FLAGS flags = QUIC_SEND_FLAG_START | Flags;
 
+  PoolBuffer->SendTime = MetricNow();
+  Capture.Record(CaptureConnection, 0, ClientSensorId,
+                 CAPTURE_EVENT::TO_SERVER, SPOQ_VERSION_NDJSON,
+                 CaptureBody(SPOQ_VERSION_NDJSON, *SendBuffer));
+  Streams[0].Window.Sent(SendBuffer->Length);
   QUIC_STATUS Status =
-      MsQuic->StreamSend(Stream, SendBuffer, 1, flags, SendBufferRaw);
-  // Note SendBufferRaw is freed in QUIC_STREAM_EVENT_SEND_COMPLETE case
+      MsQuic->StreamSend(Stream, SendBuffer, 1, flags, PoolBuffer);
+  // Note PoolBuffer is returned to its pool in the SEND_COMPLETE case
 
   if (QUIC_FAILED(Status)) {
-    std::cout << "[" << Stream
-              << "] StreamSend failed to send negotation message - " << Status
-              << "!\n ";
-    free(SendBufferRaw);
+    SPOQ_LOG_ERROR("[{}] StreamSend failed to send negotation message - {}!",
+                   Stream, Status);
+    Streams[0].Window.Completed(SendBuffer->Length);
+    SendBufferFree(PoolBuffer);
     setSpoqState(state, SPOQ_STATE::ERROR);
     MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
     return;
   }
 }
 
-// The clients's callback for stream events from MsQuic.
+// Send the response to the server
+void SendNegotiate(_In_ HQUIC Stream, const bool success) {
+  // Accept the server's offer with the picked version, data streams and
+  // subscriptions, or refuse it
+  SPOQ_HEADER_VIEW Header = {
+      ClientSensorId, WireVersion,
+      success ? SPOQ_STATUS_SUCCESS : SPOQ_STATUS_FAILURE};
+  const bool Datagram = success && DatagramsAgreed;
+  char Reply[SPOQ_OFFER_DATA_LENGTH];
+  SendNegotiation(
+      Stream, Header,
+      SpoqOfferData(Reply, SPOQ_VERSION_NDJSON, Datagram,
+                    success ? DataStreamCount : 0,
+                    {Subscriptions, success ? SubscriptionCount : 0}));
+}
+
+// Opens negotiation with the versions we speak, as the first bytes on the
+// stream, so that the server can answer with its pick and start sending
+// without waiting for our reply to its offer. On a resumed connection the
+// hello goes out as 0-RTT data.
+void SendHello(_In_ HQUIC Stream) {
+  SPOQ_HEADER_VIEW Header = {ClientSensorId, SPOQ_VERSION_NDJSON,
+                             SPOQ_STATUS_HELLO};
+  HelloPending = true;
+  char Hello[SPOQ_OFFER_DATA_LENGTH];
+  SendNegotiation(Stream, Header,
+                  SpoqOfferData(Hello, MaxWireVersion, DatagramsEnabled,
+                                RequestedStreams,
+                                {Subscriptions, SubscriptionCount}),
+                  QUIC_SEND_FLAG_ALLOW_0_RTT);
+}
+
+// Prints a data PDU received from the server
+void ClientProcessPdu(_In_ HQUIC Stream, size_t Size,
+                      _In_ const SPOQ_PDU_VIEW& Pdu) {
+  if (state != SPOQ_STATE::RECEIVING) {
+    setSpoqState(state, SPOQ_STATE::RECEIVING);
+  }
+  SpoqMetrics().MessagesReceived.Add();
+  SpoqMetrics().BytesReceived.Add(Size);
+  ConnectionMetrics.SensorId.Set(Pdu.Header.SensorId);
+  ConnectionMetrics.MessagesReceived.Add();
+  ConnectionMetrics.BytesReceived.Add(Size);
+  // Print size in bytes, the sensor and its data
+  if (Pdu.Header.Version == SPOQ_VERSION_NDJSON) {
+    SPOQ_LOG_INFO("[{}] Stream event: Received message ({} bytes) from sensor "
+                  "{}: {}", Stream, Size, Pdu.Header.SensorId, Pdu.Data);
+    return;
+  }
+  if (!SpoqLogEnabled(SPOQ_LOG_LEVEL::INFO)) {
+    return;
+  }
+  // Render the fields as id=value pairs, cut short to leave room in the log
+  // record for the other arguments
+  char Text[160];
+  size_t Length = 0;
+  SPOQ_FIELD_READER Reader(Pdu.Data);
+  SPOQ_FIELD Field;
+  while (Reader.Next(&Field) && Length < sizeof(Text)) {
+    char* Out = Text + Length;
+    size_t Room = sizeof(Text) - Length;
+    int Written;
+    switch (Field.Type) {
+      case SPOQ_WIRE_TYPE::VARINT:
+        Written = snprintf(Out, Room, "%u=%llu ", Field.Id,
+                           (unsigned long long)Field.Uint);
+        break;
+      case SPOQ_WIRE_TYPE::BYTES:
+        Written = snprintf(Out, Room, "%u=\"%.*s\" ", Field.Id,
+                           (int)Field.Bytes.size(), Field.Bytes.data());
+        break;
+      default:
+        Written = snprintf(Out, Room, "%u=%g ", Field.Id, Field.Double);
+        break;
+    }
+    Length += Written < 0 ? Room : (size_t)Written;
+  }
+  if (Length > sizeof(Text) - 1) {
+    Length = sizeof(Text) - 1;
+  }
+  SPOQ_LOG_INFO("[{}] Stream event: Received message ({} bytes) from sensor "
+                "{}: {}", Stream, Size, Pdu.Header.SensorId,
+                std::string_view(Text, Length));
+}
+
+// Picks the most compact encoding both sides speak from the server's offer,
+// falling back to NDJSON, and as many of the data streams asked for as it
+// allows. Returns false if the offer is unacceptable.
+bool ClientPickFromOffer(_In_ const SPOQ_PDU_VIEW& Pdu, uint32_t* Version,
+                         bool* Datagram, uint32_t* DataStreams) {
+  std::string_view Value;
+  *Version = SPOQ_VERSION_NDJSON;
+  *Datagram = false;
+  *DataStreams = 0;
+  if (Pdu.Header.Version != SPOQ_VERSION_NDJSON) {
+    return false;
+  }
+  if (MaxWireVersion >= SPOQ_VERSION_COLUMNAR &&
+      SpoqOfferIncludes(Pdu, SPOQ_VERSION_COLUMNAR)) {
+    *Version = SPOQ_VERSION_COLUMNAR;
+  } else if (MaxWireVersion >= SPOQ_VERSION_BINARY &&
+             SpoqOfferIncludes(Pdu, SPOQ_VERSION_BINARY)) {
+    *Version = SPOQ_VERSION_BINARY;
+  }
+  *Datagram = DatagramsEnabled && !Pdu.Data.empty() &&
+              JsonObjectFind(Pdu.Data, "datagram", &Value) && Value == "true";
+  // Datagram readings share one sequence, so they need no data streams
+  *DataStreams =
+      *Datagram ? 0 : std::min(RequestedStreams, SpoqDataStreams(Pdu));
+  return true;
+}
+
+// Opens and starts data stream Index once negotiation has agreed on it.
+// Streams are numbered by the order they start, which is the order the
+// server knows them by.
+void ClientOpenDataStream(_In_ HQUIC Connection, uint32_t Index);
+
+// Records the outcome of negotiation
+void ClientNegotiated(_In_ HQUIC Stream, const bool success) {
+  HelloPending = false;
+  if (success) {
+    SPOQ_LOG_INFO("[{}] Negotiation event: SUCCESS, wire version {}!", Stream,
+                  WireVersion);
+    SpoqMetrics().NegotiationsSucceeded.Add();
+    setSpoqState(state, SPOQ_STATE::ESTABLISHED);
+    Streams[0].Window.Open();
+    if (DataStreamCount != 0) {
+      SPOQ_LOG_INFO("[{}] Negotiation event: opening {} data streams",
+                    Stream, DataStreamCount);
+    }
+    for (uint32_t Index = 1; Index <= DataStreamCount; ++Index) {
+      ClientOpenDataStream(ServerConnection, Index);
+    }
+  } else {
+    SPOQ_LOG_ERROR("[{}] Negotiation event: FAILED!", Stream);
+    SpoqMetrics().NegotiationsFailed.Add();
+    setSpoqState(state, SPOQ_STATE::ERROR);
+  }
+}
+
+// Handles a NEGOTIATE message from the server. Without a hello that is the
+// offer, answered with our pick. With a hello pending, the server also sends
+// the offer first, for clients that open without one, and then answers the
+// hello: with its pick, after which data follows at once, or by asking us
+// to fall back to the offer.
+void ClientNegotiate(_In_ HQUIC Stream, SPOQ_DECODE_STATUS Decode,
+                     _In_ const SPOQ_PDU_VIEW& Pdu) {
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    SPOQ_LOG_ERROR("[{}] Negotiation event: malformed offer, {}", Stream,
+                   ToString(Decode));
+    ClientNegotiated(Stream, false);
+    SendNegotiate(Stream, false);
+    return;
+  }
+  SPOQ_LOG_INFO("[{}] Negotiation event: status = {}, version = {}", Stream,
+                Pdu.Header.Status, Pdu.Header.Version);
+
+  if (HelloPending && Pdu.Header.Status == SPOQ_STATUS_SUCCESS) {
+    // The server picked from our hello; anything it picked we offered
+    const bool success = Pdu.Header.Version >= SPOQ_VERSION_NDJSON &&
+                         Pdu.Header.Version <= MaxWireVersion;
+    std::string_view Datagram;
+    WireVersion = success ? Pdu.Header.Version : SPOQ_VERSION_NDJSON;
+    DatagramsAgreed = success && DatagramsEnabled && !Pdu.Data.empty() &&
+                      JsonObjectFind(Pdu.Data, "datagram", &Datagram) &&
+                      Datagram == "true";
+    DataStreamCount =
+        success ? std::min(RequestedStreams, SpoqDataStreams(Pdu)) : 0;
+    ClientNegotiated(Stream, success);
+    if (!success) {
+      MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+    }
+    return;
+  }
+
+  if (HelloPending && Pdu.Header.Status == SPOQ_STATUS_FALLBACK) {
+    // Negotiate from the offer after all
+    SPOQ_LOG_INFO("[{}] Negotiation event: hello refused, falling back to "
+                  "the offer", Stream);
+    WireVersion = OfferVersion;
+    DatagramsAgreed = OfferAcceptable && OfferDatagram;
+    DataStreamCount = OfferAcceptable ? OfferStreams : 0;
+    ClientNegotiated(Stream, OfferAcceptable);
+    SendNegotiate(Stream, OfferAcceptable);
+    return;
+  }
+
+  uint32_t Version;
+  bool Datagram;
+  uint32_t DataStreams;
+  const bool success =
+      ClientPickFromOffer(Pdu, &Version, &Datagram, &DataStreams);
+  if (HelloPending) {
+    // Kept until the server answers the hello
+    OfferAcceptable = success;
+    OfferVersion = Version;
+    OfferDatagram = Datagram;
+    OfferStreams = DataStreams;
+    return;
+  }
+  WireVersion = Version;
+  DatagramsAgreed = success && Datagram;
+  DataStreamCount = success ? DataStreams : 0;
+  ClientNegotiated(Stream, success);
+  SendNegotiate(Stream, success);
+}
+
+// Handles one complete NDJSON message received from the server.
+void ClientProcessMessage(_In_ HQUIC Stream, _In_ std::string_view message) {
+  SPOQ_PDU_VIEW Pdu;
+  SPOQ_DECODE_STATUS Decode = SpoqDecodeNdjson(message, &Pdu);
+
+  if (state == SPOQ_STATE::NEGOTIATE) {
+    ClientNegotiate(Stream, Decode, Pdu);
+    return;
+  }
+
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    SPOQ_LOG_ERROR("[{}] Stream event: Dropped malformed message ({}): {}",
+                   Stream, ToString(Decode), message);
+    SpoqMetrics().MessagesDropped.Add();
+    return;
+  }
+  ClientProcessPdu(Stream, message.size(), Pdu);
+}
+
+// Samples the connection's transport statistics, at most once a sample
+// interval unless Force is set, and retunes its flow control window from them
+void ClientSample(_In_ HQUIC Connection, bool Force = false) {
+  QUIC_STATISTICS_V2 Stats;
+  if (ConnectionMetrics.Sample(Connection, Force, &Stats) && Tuning.Adaptive) {
+    Tuner.Update(Connection, Tuning, Stats, MetricNow(), ConnectionMetrics);
+  }
+}
+
+// Handles one reading received as a datagram. Readings older than the newest
+// one seen are stale and dropped.
+void ClientProcessDatagram(_In_ HQUIC Connection,
+                           _In_ const QUIC_BUFFER* Buffer) {
+  SPOQ_PDU_VIEW Pdu;
+  uint64_t Sequence = 0;
+  if (!DatagramsAgreed) {
+    return;
+  }
+  SPOQ_DECODE_STATUS Decode = SpoqDatagramDecode(Buffer, &Pdu, &Sequence);
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    SPOQ_LOG_ERROR("[{}] Datagram event: Dropped malformed reading ({})",
+                   Connection, ToString(Decode));
+    SpoqMetrics().MessagesDropped.Add();
+    return;
+  }
+  if (!DatagramFilter.Accept(Sequence)) {
+    SPOQ_LOG_WARN("[{}] Datagram event: Dropped stale reading {}", Connection,
+                  Sequence);
+    SpoqMetrics().MessagesDropped.Add();
+    return;
+  }
+  ClientProcessPdu(Connection, Buffer->Length, Pdu);
+}
+
+// Handles one complete binary PDU received from the server.
+void ClientProcessBinary(_In_ HQUIC Stream, _In_ std::string_view body) {
+  SPOQ_PDU_VIEW Pdu;
+  SPOQ_DECODE_STATUS Decode = SpoqDecodeBinary(body, &Pdu);
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    SPOQ_LOG_ERROR("[{}] Stream event: Dropped malformed message ({})", Stream,
+                   ToString(Decode));
+    SpoqMetrics().MessagesDropped.Add();
+    return;
+  }
+  if (Pdu.Header.Version != SPOQ_VERSION_COLUMNAR) {
+    ClientProcessPdu(Stream, body.size(), Pdu);
+    return;
+  }
+  // A batch is handled as its readings, which share its bytes
+  thread_local COLUMNAR_BATCH Columns;
+  if (!Columns.Decode(Pdu.Data)) {
+    SPOQ_LOG_ERROR("[{}] Stream event: Dropped malformed batch", Stream);
+    SpoqMetrics().MessagesDropped.Add();
+    return;
+  }
+  const uint32_t Count = Columns.Count();
+  for (uint32_t i = 0; i < Count; ++i) {
+    ClientProcessPdu(Stream,
+                     body.size() * (i + 1) / Count - body.size() * i / Count,
+                     {Pdu.Header, Columns.Reading(i)});
+  }
+}
+
+// The clients's callback for stream events from MsQuic. Its context is the
+// CLIENT_STREAM of the stream.
 _IRQL_requires_max_(DISPATCH_LEVEL)
     _Function_class_(QUIC_STREAM_CALLBACK) QUIC_STATUS QUIC_API
     ClientStreamCallback(_In_ HQUIC Stream, _In_opt_ void* Context,
                          _Inout_ QUIC_STREAM_EVENT* Event) {
-  UNREFERENCED_PARAMETER(Context);
+  auto Channel = static_cast<CLIENT_STREAM*>(Context);
 
-  std::cout << "[" << Stream
-            << "] Stream event: " << QuicStreamEventTypeToString(Event->Type)
-            << "\n";
+  SPOQ_LOG_DEBUG("[{}] Stream event: {}", Stream,
+                 QuicStreamEventTypeToString(Event->Type));
   switch (Event->Type) {
     case QUIC_STREAM_EVENT_SEND_COMPLETE:
       // A previous StreamSend call has completed, and the context is being
-      // returned back to the app.
-      free(Event->SEND_COMPLETE.ClientContext);
+      // returned back to the app. Its bytes leave the send window.
+      Channel->Window.Completed(
+          static_cast<SEND_BUFFER*>(Event->SEND_COMPLETE.ClientContext)
+              ->Buffer.Length);
+      SendBufferRecordLatency(Event->SEND_COMPLETE.ClientContext);
+      SendBufferFree(Event->SEND_COMPLETE.ClientContext);
+      break;
+    case QUIC_STREAM_EVENT_IDEAL_SEND_BUFFER_SIZE:
+      // msquic's estimate of the bytes to keep outstanding to fill the pipe
+      SPOQ_LOG_DEBUG("[{}] Stream event: Ideal send buffer size is {} bytes",
+                     Stream, Event->IDEAL_SEND_BUFFER_SIZE.ByteCount);
+      Channel->Window.SetIdeal(Event->IDEAL_SEND_BUFFER_SIZE.ByteCount);
       break;
     case QUIC_STREAM_EVENT_RECEIVE: {
-      // Data was received from the peer on the stream.
-      std::string buffer;
-
-      // Append incoming data to the string buffer
-      for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
-        buffer.append(
-            reinterpret_cast<const char*>(Event->RECEIVE.Buffers[i].Buffer),
-            Event->RECEIVE.Buffers[i].Length);
-      }
-
-      if (state == SPOQ_STATE::NEGOTIATE) {
-        // lazy parsing of the message to negotiate
-        // should integrate a proper json parsing library
-        size_t pos = 0;
-        std::string vstr = "\"version\":\"";
-        bool success = false;
-        if ((pos = buffer.find(vstr)) != std::string::npos) {
-          std::string version = buffer.substr(pos + vstr.length(), 1);
-          std::cout << "[" << Stream
-                    << "] Negotiation event: version = " << version << "\n";
-          success = (version == "1");
-          if (success) {
-            std::cout << "[" << Stream << "] Negotiation event: SUCCESS!\n";
-            setSpoqState(state, SPOQ_STATE::ESTABLISHED);
-          } else {
-            std::cout << "[" << Stream << "] Negotiation event: FAILED!\n";
-            setSpoqState(state, SPOQ_STATE::ERROR);
-          }
-        }
-        SendNegotiate(Stream, success);
+      // Data was received from the peer on the stream. Complete messages are
+      // handled in place; a trailing partial one is kept for the next event.
+      // Negotiation is always NDJSON. Binary PDUs may follow the offer or
+      // the answer to our hello in the same event once binary is agreed, so
+      // the split stops there and leaves them to the next event.
+      const uint64_t ReceiveStart = MetricNow();
+      uint64_t Consumed = 0;
+      QUIC_STATUS Status;
+      if (WireVersion >= SPOQ_VERSION_BINARY &&
+          state != SPOQ_STATE::NEGOTIATE) {
+        Status = Channel->BinaryFramer.Receive(
+            Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &Consumed,
+            [Channel, Stream](std::string_view body) {
+              Capture.Record(CaptureConnection, Channel->Index,
+                             ClientSensorId, CAPTURE_EVENT::FROM_SERVER,
+                             WireVersion, body);
+              ClientProcessBinary(Stream, body);
+            });
       } else {
-        setSpoqState(state, SPOQ_STATE::RECEIVING);
-
-        // Process full newline-delimited messages
-        size_t pos = 0;
-        while ((pos = buffer.find('\n')) != std::string::npos) {
-          std::string message = buffer.substr(0, pos);
-          buffer.erase(0, pos + 1);
-          // Print size in bytes and the message
-          std::cout << "[" << Stream << "] Stream event: Received message ("
-                    << message.size() << " bytes): " << message << '\n';
-        }
+        Status = Channel->Framer.Receive(
+            Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &Consumed,
+            [Channel, Stream](std::string_view message) {
+              Capture.Record(CaptureConnection, Channel->Index,
+                             ClientSensorId, CAPTURE_EVENT::FROM_SERVER,
+                             SPOQ_VERSION_NDJSON, message);
+              ClientProcessMessage(Stream, message);
+              return WireVersion == SPOQ_VERSION_NDJSON;
+            });
       }
-      break;
+      if (QUIC_FAILED(Status)) {
+        SPOQ_LOG_ERROR("[{}] Stream event: Malformed framing!", Stream);
+        setSpoqState(state, SPOQ_STATE::ERROR);
+        MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+        break;
+      }
+      Status = NdjsonReceiveComplete(Stream, Consumed,
+                                     Event->RECEIVE.TotalBufferLength);
+      SpoqMetrics().ReceiveLatency.RecordSince(ReceiveStart);
+      if (ClientConnection != nullptr) {
+        ClientSample(ClientConnection);
+      }
+      return Status;
     }
     case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
       // The peer gracefully shut down its send direction of the stream.
@@ -171,7 +639,13 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
       break;
     case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
       // Both directions of the stream have been shut down and MsQuic is done
-      // with the stream. It can now be safely cleaned up.
+      // with the stream. It can now be safely cleaned up, once the producer
+      // can no longer reach it.
+      {
+        std::lock_guard<std::mutex> Guard(StreamLock);
+        Channel->Stream = nullptr;
+      }
+      Channel->Window.Close();
       if (!Event->SHUTDOWN_COMPLETE.AppCloseInProgress) {
         MsQuic->StreamClose(Stream);
       }
@@ -182,35 +656,59 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
   return QUIC_STATUS_SUCCESS;
 }
 
-void ClientOpenStream(_In_ HQUIC Connection) {
+// Opens and starts the client's stream Index, returning NULL on failure.
+// The control stream is opened before the handshake completes when opening
+// with a hello, so that a resumed connection can send it as 0-RTT data.
+HQUIC ClientOpenStream(_In_ HQUIC Connection, uint32_t Index) {
   QUIC_STATUS Status;
   HQUIC Stream = NULL;
+  CLIENT_STREAM* Channel = &Streams[Index];
+  Channel->Index = Index;
 
   // Create/allocate a new bidirectional stream. The stream is just allocated
   // and no QUIC stream identifier is assigned until it's started.
   if (QUIC_FAILED(
           Status = MsQuic->StreamOpen(Connection, QUIC_STREAM_OPEN_FLAG_NONE,
-                                      ClientStreamCallback, NULL, &Stream))) {
-    std::cout << "StreamOpen failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+                                      ClientStreamCallback, Channel,
+                                      &Stream))) {
+    SPOQ_LOG_ERROR("StreamOpen failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
     MsQuic->ConnectionShutdown(Connection, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE,
                                0);
+    return NULL;
+  }
+  {
+    std::lock_guard<std::mutex> Guard(StreamLock);
+    Channel->Stream = Stream;
   }
 
   // Starts the bidirectional stream. By default, the peer is not notified of
   // the stream being started until data is sent on the stream.
   if (QUIC_FAILED(Status = MsQuic->StreamStart(
                       Stream, QUIC_STREAM_START_FLAG_IMMEDIATE))) {
-    std::cout << "StreamStart failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("StreamStart failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
+    {
+      std::lock_guard<std::mutex> Guard(StreamLock);
+      Channel->Stream = nullptr;
+    }
+    Channel->Window.Close();
     MsQuic->StreamClose(Stream);
     MsQuic->ConnectionShutdown(Connection, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE,
                                0);
+    return NULL;
   }
 
-  setSpoqState(state, SPOQ_STATE::NEGOTIATE);
+  if (Index == 0) {
+    setSpoqState(state, SPOQ_STATE::NEGOTIATE);
+  }
+  return Stream;
+}
+
+void ClientOpenDataStream(_In_ HQUIC Connection, uint32_t Index) {
+  if (ClientOpenStream(Connection, Index) != NULL) {
+    Streams[Index].Window.Open();
+  }
 }
 
 // The clients's callback for connection events from MsQuic.
@@ -219,8 +717,8 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
     ClientConnectionCallback(_In_ HQUIC Connection, _In_opt_ void* Context,
                              _Inout_ QUIC_CONNECTION_EVENT* Event) {
   UNREFERENCED_PARAMETER(Context);
-  std::cout << "[" << Connection << "] Connection event: "
-            << QuicConnectionEventTypeToString(Event->Type) << "\n";
+  SPOQ_LOG_DEBUG("[{}] Connection event: {}", Connection,
+                 QuicConnectionEventTypeToString(Event->Type));
   if (Event->Type == QUIC_CONNECTION_EVENT_CONNECTED) {
     const char* SslKeyLogFile = getenv(SslKeyLogEnvVar);
     if (SslKeyLogFile != NULL) {
@@ -230,8 +728,22 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 
   switch (Event->Type) {
     case QUIC_CONNECTION_EVENT_CONNECTED:
-      // The handshake has completed for the connection.
-      ClientOpenStream(Connection);
+      // The handshake has completed for the connection. When opening with a
+      // hello the stream is open already.
+      SpoqMetrics().HandshakesCompleted.Add();
+      if (Event->CONNECTED.SessionResumed) {
+        SPOQ_LOG_INFO("[{}] Connection event: TLS session resumed",
+                      Connection);
+        SpoqMetrics().HandshakesResumed.Add();
+      } else if (Resuming) {
+        // The server refused the ticket, so it is of no further use
+        TicketCache.Remove(TicketKey);
+      }
+      ClientConnection = Connection;
+      ClientSample(Connection, true);
+      if (!Optimistic) {
+        ClientOpenStream(Connection, 0);
+      }
       break;
     case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
       // The connection has been shut down by the transport. Generally, this
@@ -239,52 +751,80 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
       // protocol, since we let idle timeout kill the connection.
       if (Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status ==
           QUIC_STATUS_CONNECTION_IDLE) {
-        std::cout << "[" << Connection
-                  << "] Connection event: Successfully shut down on idle.\n";
+        SPOQ_LOG_INFO("[{}] Connection event: Successfully shut down on idle.",
+                      Connection);
       } else {
-        std::cout << "[" << Connection
-                  << "] Connection event: Shut down by transport, 0x"
-                  << std::hex << Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status
-                  << std::dec << "\n";
+        SPOQ_LOG_WARN(
+            "[{}] Connection event: Shut down by transport, {}", Connection,
+            SpoqLogHex(Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status));
       }
       break;
     case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_PEER:
-      // The connection was explicitly shut down by the peer.
-      std::cout << "[" << Connection
-                << "] Connection event: Shut down by peer, 0x" << std::hex
-                << (unsigned long long)
-                       Event->SHUTDOWN_INITIATED_BY_PEER.ErrorCode
-                << std::dec << "\n";
+      // The connection was explicitly shut down by the peer, for one with an
+      // application error when the server's admission control refused it.
+      SPOQ_LOG_WARN("[{}] Connection event: Shut down by peer, {} ({})",
+                    Connection,
+                    SpoqLogHex(Event->SHUTDOWN_INITIATED_BY_PEER.ErrorCode),
+                    SpoqErrorName(Event->SHUTDOWN_INITIATED_BY_PEER.ErrorCode));
+      break;
+    case QUIC_CONNECTION_EVENT_DATAGRAM_RECEIVED:
+      // A reading arrived on the unreliable datagram path.
+      ClientProcessDatagram(Connection, Event->DATAGRAM_RECEIVED.Buffer);
+      ClientSample(Connection);
       break;
     case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
       // The connection has completed the shutdown process and is ready to be
       // safely cleaned up.
+      if (!Event->SHUTDOWN_COMPLETE.HandshakeCompleted) {
+        SpoqMetrics().HandshakesFailed.Add();
+      }
+      ClientConnection = nullptr;
+      Capture.Disconnect(CaptureConnection, ClientSensorId);
+      for (auto& Channel : Streams) {
+        Channel.Window.Close();
+      }
+      if (DatagramsAgreed) {
+        SPOQ_LOG_INFO("[{}] Connection event: {} datagram readings accepted, "
+                      "{} stale", Connection, DatagramFilter.AcceptedCount(),
+                      DatagramFilter.StaleCount());
+      }
       if (!Event->SHUTDOWN_COMPLETE.AppCloseInProgress) {
         MsQuic->ConnectionClose(Connection);
       }
       break;
     case QUIC_CONNECTION_EVENT_RESUMPTION_TICKET_RECEIVED:
       // A resumption ticket (also called New Session Ticket or NST) was
-      // received from the server.
-      std::cout << "[" << Connection
-                << "] Connection event: Resumption ticket received ("
-                << Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength
-                << " bytes):\n";
-      for (uint32_t i = 0;
-           i < Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength; i++) {
-        std::cout << std::hex << std::setw(2) << std::setfill('0')
-                  << static_cast<int>(
-                         Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicket[i])
-                  << std::dec;
+      // received from the server. Keep it for the next run.
+      SPOQ_LOG_INFO("[{}] Connection event: Resumption ticket received ({} "
+                    "bytes)", Connection,
+                    Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength);
+      TicketCache.Store(
+          TicketKey, Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicket,
+          Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength);
+      if (SpoqLogEnabled(SPOQ_LOG_LEVEL::TRACE)) {
+        // Dump the ticket a row at a time so no record is truncated
+        const uint32_t Length =
+            Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength;
+        for (uint32_t Row = 0; Row < Length; Row += 32) {
+          char Hex[65];
+          uint32_t End = Row + 32 < Length ? Row + 32 : Length;
+          for (uint32_t i = Row; i < End; i++) {
+            snprintf(Hex + 2 * (i - Row), 3, "%02x",
+                     Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicket[i]);
+          }
+          SPOQ_LOG_TRACE("[{}] {}", Connection,
+                         std::string_view(Hex, 2 * (End - Row)));
+        }
       }
-      std::cout << "\n";
       break;
     case QUIC_CONNECTION_EVENT_IDEAL_PROCESSOR_CHANGED:
-      std::cout << "[" << Connection
-                << "] Connection event: Ideal Processor is:"
-                << Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor
-                << ", Partition Index "
-                << Event->IDEAL_PROCESSOR_CHANGED.PartitionIndex << "\n";
+      SPOQ_LOG_INFO("[{}] Connection event: Ideal Processor is:{}, Partition "
+                    "Index {}", Connection,
+                    Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor,
+                    Event->IDEAL_PROCESSOR_CHANGED.PartitionIndex);
+      ProducerNode.store(
+          NumaNodeOfProcessor(Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor),
+          std::memory_order_relaxed);
       break;
     default:
       break;
@@ -292,6 +832,262 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
   return QUIC_STATUS_SUCCESS;
 }
 
+// A slowly drifting temperature stands in for a real sensor
+double SimulatedValue(uint64_t Sequence) {
+  return 20.0 + 5.0 * std::sin((double)Sequence / 50.0);
+}
+
+// Writes the binary data fields of a reading. Line is a JSON data object
+// read from -input, or empty for a generated reading.
+void ClientReadingFields(SPOQ_FIELD_WRITER& Fields, uint64_t Sequence,
+                         std::string_view Line, uint64_t Now) {
+  Fields.Uint(FIELD_SEQUENCE, Sequence);
+  if (Line.empty()) {
+    Fields.Double(FIELD_VALUE, SimulatedValue(Sequence));
+  } else {
+    Fields.Bytes(FIELD_JSON, Line);
+  }
+  Fields.Uint(FIELD_TIME, Now);
+}
+
+// Sends an encoded PDU that carries Readings readings upstream on Channel.
+// The buffer is handed over. Returns false if the stream is gone.
+bool ClientSendPdu(_In_ CLIENT_STREAM* Channel, _In_ SEND_BUFFER* Pdu,
+                   uint32_t Readings) {
+  Pdu->SendTime = MetricNow();
+  // The buffer may be freed by SEND_COMPLETE as soon as it is sent
+  const uint32_t PduLength = Pdu->Buffer.Length;
+  Capture.Record(CaptureConnection, Channel->Index, ClientSensorId,
+                 CAPTURE_EVENT::TO_SERVER, WireVersion,
+                 CaptureBody(WireVersion, Pdu->Buffer));
+
+  Channel->Window.Sent(PduLength);
+  QUIC_STATUS Status = QUIC_STATUS_INVALID_STATE;
+  {
+    std::lock_guard<std::mutex> Guard(StreamLock);
+    if (Channel->Stream != nullptr) {
+      Status = MsQuic->StreamSend(Channel->Stream, &Pdu->Buffer, 1,
+                                  QUIC_SEND_FLAG_NONE, Pdu);
+    }
+  }
+  if (QUIC_FAILED(Status)) {
+    SPOQ_LOG_ERROR("StreamSend failed for {} reading(s), {}!", Readings,
+                   SpoqLogHex(Status));
+    Channel->Window.Completed(PduLength);
+    SendBufferFree(Pdu);
+    return false;
+  }
+  SpoqMetrics().MessagesSent.Add(Readings);
+  SpoqMetrics().BytesSent.Add(PduLength);
+  ConnectionMetrics.MessagesSent.Add(Readings);
+  ConnectionMetrics.BytesSent.Add(PduLength);
+  return true;
+}
+
+// Encodes the readings gathered on Channel as one batch PDU and sends it.
+// Returns false if the stream is gone.
+bool ClientSendBatch(_In_ CLIENT_STREAM* Channel) {
+  const uint32_t Readings = Channel->Columns.Count();
+  if (Readings == 0) {
+    return true;
+  }
+  const std::string_view Batch = Channel->Columns.Encode();
+  SEND_BUFFER* Pdu = SendBufferAlloc((uint32_t)Batch.size() + READING_OVERHEAD);
+  if (Pdu == nullptr) {
+    SPOQ_LOG_ERROR("SendBuffer allocation failed for a batch of {} readings!",
+                   Readings);
+    return false;
+  }
+  Pdu->Buffer.Length = (uint32_t)SpoqEncodeBinary(
+      {ClientSensorId, SPOQ_VERSION_COLUMNAR, SPOQ_STATUS_SUCCESS}, Batch,
+      Pdu->Buffer.Buffer, Pdu->Capacity);
+  Channel->Columns.Clear();
+  return ClientSendPdu(Channel, Pdu, Readings);
+}
+
+// Adds a reading to the batch gathered on Channel in a columnar session,
+// sending the batch once it holds BatchReadings readings. Returns false if
+// the stream is gone.
+bool ClientBatchReading(_In_ CLIENT_STREAM* Channel, uint64_t Sequence,
+                        std::string_view Line) {
+  uint8_t Data[PRODUCE_MAX_LINE_LENGTH + 64];
+  SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+  const uint64_t Now = MetricNow();
+  ClientReadingFields(Fields, Sequence, Line, Now);
+  // A reading laid out unlike those gathered so far starts a new batch
+  if (!Channel->Columns.Add(Fields.Data()) &&
+      (!ClientSendBatch(Channel) || !Channel->Columns.Add(Fields.Data()))) {
+    return false;
+  }
+  if (Channel->Columns.Count() == 1) {
+    Channel->BatchStart = Now;
+  }
+  return Channel->Columns.Count() < BatchReadings || ClientSendBatch(Channel);
+}
+
+// Sends the batches on the first Channels data streams (or the control
+// stream) whose readings would wait longer than BatchBudgetNs by Until.
+// Returns false if a stream is gone.
+bool ClientFlushBatches(uint32_t Channels, uint64_t Until) {
+  for (uint32_t Index = Channels == 0 ? 0 : 1; Index <= Channels; ++Index) {
+    CLIENT_STREAM* Channel = &Streams[Index];
+    if (Channel->Columns.Count() != 0 &&
+        Channel->BatchStart + BatchBudgetNs <= Until &&
+        !ClientSendBatch(Channel)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Encodes one reading into a pooled buffer and sends it upstream on Channel
+// in the negotiated wire version, or adds it to Channel's batch in a
+// columnar session. Line is a JSON data object read from -input, or empty
+// for a generated reading. Returns false if the stream is gone.
+bool ClientSendReading(_In_ CLIENT_STREAM* Channel, uint64_t Sequence,
+                       std::string_view Line) {
+  if (WireVersion == SPOQ_VERSION_COLUMNAR) {
+    return ClientBatchReading(Channel, Sequence, Line);
+  }
+  SEND_BUFFER* Reading =
+      SendBufferAlloc((uint32_t)Line.size() + READING_OVERHEAD);
+  if (Reading == nullptr) {
+    SPOQ_LOG_ERROR("SendBuffer allocation failed for reading {}!", Sequence);
+    return false;
+  }
+  const uint64_t Now = MetricNow();
+  SPOQ_HEADER_VIEW Header = {ClientSensorId, WireVersion,
+                             SPOQ_STATUS_SUCCESS};
+  if (WireVersion == SPOQ_VERSION_BINARY) {
+    uint8_t Data[PRODUCE_MAX_LINE_LENGTH + 64];
+    SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+    ClientReadingFields(Fields, Sequence, Line, Now);
+    Reading->Buffer.Length = (uint32_t)SpoqEncodeBinary(
+        Header, Fields.Data(), Reading->Buffer.Buffer, Reading->Capacity);
+  } else {
+    char Data[96];
+    if (Line.empty()) {
+      int DataLength = snprintf(
+          Data, sizeof(Data), "{\"seq\":%llu,\"value\":%.3f,\"time\":%llu}",
+          (unsigned long long)Sequence, SimulatedValue(Sequence),
+          (unsigned long long)Now);
+      Line = std::string_view(Data, DataLength);
+    }
+    Reading->Buffer.Length = (uint32_t)SpoqEncodeNdjson(
+        Header, Line, (char*)Reading->Buffer.Buffer, Reading->Capacity);
+  }
+  return ClientSendPdu(Channel, Reading, 1);
+}
+
+// Streams readings upstream at ProduceRate, ProduceCount generated ones or
+// every line of Input, then finishes the stream. Runs on the main thread and
+// waits for negotiation through the control stream's send window. Readings
+// go round-robin over the data streams when there are any, each held back
+// by its own window whenever its bytes outstanding reach msquic's ideal
+// send buffer size. The thread moves to the NUMA node of the connection's
+// ideal processor, so readings are built where msquic sends them. In a
+// columnar session readings are sent in batches, each once it is full or
+// before its first reading would wait longer than BatchBudgetNs.
+void ClientProduce(_In_opt_ FILE* Input) {
+  const uint64_t IntervalNs =
+      ProduceRate > 0 ? (uint64_t)(1e9 / ProduceRate) : 0;
+  uint64_t Sequence = 0;
+  uint64_t NextSendNs = 0;
+  int Node = -1;
+  char* Line = nullptr;
+  size_t LineCapacity = 0;
+
+  if (!Streams[0].Window.WaitForRoom()) {
+    return;
+  }
+  // Fixed once negotiation has finished
+  const uint32_t Channels = DataStreamCount;
+  uint64_t Waits = Streams[0].Window.WaitCount();
+
+  while (Input != nullptr || Sequence < ProduceCount) {
+    std::string_view Data;
+    if (Input != nullptr) {
+      ssize_t Length = getline(&Line, &LineCapacity, Input);
+      if (Length < 0) {
+        break;
+      }
+      Data = std::string_view(Line, Length);
+      while (!Data.empty() && (Data.back() == '\n' || Data.back() == '\r')) {
+        Data.remove_suffix(1);
+      }
+      if (Data.empty()) {
+        continue;
+      }
+      if (Data.size() > PRODUCE_MAX_LINE_LENGTH) {
+        SPOQ_LOG_WARN("Skipped a {} byte input line, longer than {}",
+                      Data.size(), PRODUCE_MAX_LINE_LENGTH);
+        continue;
+      }
+    }
+    const int IdealNode = ProducerNode.load(std::memory_order_relaxed);
+    if (IdealNode != Node && IdealNode >= 0) {
+      if (NumaBindThread(IdealNode)) {
+        SPOQ_LOG_DEBUG("Producer moved to NUMA node {}", IdealNode);
+      }
+      Node = IdealNode;
+    }
+    CLIENT_STREAM* Channel =
+        &Streams[Channels == 0 ? 0 : 1 + Sequence % Channels];
+    if (!Channel->Window.WaitForRoom()) {
+      break;
+    }
+    if (IntervalNs != 0) {
+      // After falling more than a second behind, e.g. while the window was
+      // full, resume at the rate instead of bursting to catch up
+      const uint64_t Now = MetricNow();
+      if (NextSendNs == 0 || Now > NextSendNs + 1000000000) {
+        NextSendNs = Now;
+      }
+      if (NextSendNs > Now) {
+        if (!ClientFlushBatches(Channels, NextSendNs)) {
+          break;
+        }
+        std::this_thread::sleep_for(
+            std::chrono::nanoseconds(NextSendNs - Now));
+      }
+      NextSendNs += IntervalNs;
+    }
+    if (!ClientSendReading(Channel, Sequence, Data)) {
+      break;
+    }
+    ++Sequence;
+  }
+  free(Line);
+  ClientFlushBatches(Channels, UINT64_MAX);
+
+  {
+    std::lock_guard<std::mutex> Guard(StreamLock);
+    for (uint32_t Index = Channels == 0 ? 0 : 1; Index <= Channels; ++Index) {
+      if (Streams[Index].Stream != nullptr) {
+        MsQuic->StreamShutdown(Streams[Index].Stream,
+                               QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+      }
+      if (Index != 0) {
+        Waits += Streams[Index].Window.WaitCount();
+      }
+    }
+  }
+  SPOQ_LOG_INFO("Produced {} readings on {} stream(s), held back by the send "
+                "window {} times", Sequence, Channels == 0 ? 1 : Channels,
+                Waits);
+}
+
+// Renders the process-wide metrics and those of the server connection
+void RenderMetrics(std::string& Out) {
+  SpoqMetrics().Render(Out);
+  RenderConnectionMetrics(Out, [](auto&& Visit) {
+    char Labels[32];
+    snprintf(Labels, sizeof(Labels), "sensor=\"%llu\"",
+             (unsigned long long)ConnectionMetrics.SensorId.Get());
+    Visit(Labels, ConnectionMetrics);
+  });
+}
+
 // Helper function to load a client configuration.
 BOOLEAN
 ClientLoadConfiguration(_In_ int argc,
@@ -300,6 +1096,30 @@ ClientLoadConfiguration(_In_ int argc,
   // Configures the client's idle timeout.
   Settings.IdleTimeoutMs = IdleTimeoutMs;
   Settings.IsSet.IdleTimeoutMs = TRUE;
+  // Optionally allows the server to send readings as QUIC datagrams.
+  if (GetFlag(argc, argv, "datagram")) {
+    DatagramsEnabled = true;
+    Settings.DatagramReceiveEnabled = TRUE;
+    Settings.IsSet.DatagramReceiveEnabled = TRUE;
+  }
+  // A producer keeps its own buffers outstanding, bounded by the send
+  // window, so msquic need not copy them into its send buffer.
+  if (GetFlag(argc, argv, "produce")) {
+    Producing = true;
+    Settings.SendBufferingEnabled = FALSE;
+    Settings.IsSet.SendBufferingEnabled = TRUE;
+  }
+  // Applies the tuning profile's windows, buffering and pacing last, so
+  // that it can override the choices above.
+  const char* TuningPath;
+  if ((TuningPath = GetValue(argc, argv, "tuning")) != NULL) {
+    if (!Tuning.Load(TuningPath)) {
+      return FALSE;
+    }
+    Tuning.Apply(&Settings);
+    SPOQ_LOG_INFO("Tuning profile {} loaded, autotuning {}", TuningPath,
+                  Tuning.Adaptive ? "on" : "off");
+  }
 
   // Configures a default client configuration
   QUIC_CREDENTIAL_CONFIG_HELPER Config;
@@ -323,12 +1143,12 @@ ClientLoadConfiguration(_In_ int argc,
         QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED;
     Config.CredConfig.Flags |= QUIC_CREDENTIAL_FLAG_SET_CA_CERTIFICATE_FILE;
 
-    std::cout << "Cert: " << Cert << "\n";
-    std::cout << "Key : " << KeyFile << "\n";
-    std::cout << "CA  : " << (CaFile ? CaFile : "none") << "\n";
+    SPOQ_LOG_INFO("Cert: {}", Cert);
+    SPOQ_LOG_INFO("Key : {}", KeyFile);
+    SPOQ_LOG_INFO("CA  : {}", CaFile ? CaFile : "none");
   } else {
-    std::cout << "Must specify ['cert_file' and 'key_file' (and "
-                 "optionally 'password')]!\n";
+    SPOQ_LOG_ERROR("Must specify ['cert_file' and 'key_file' (and optionally "
+                   "'password')]!");
     return FALSE;
   }
 
@@ -338,8 +1158,7 @@ ClientLoadConfiguration(_In_ int argc,
   if (QUIC_FAILED(Status = MsQuic->ConfigurationOpen(
                       Registration, &Alpn, 1, &Settings, sizeof(Settings), NULL,
                       &Configuration))) {
-    std::cout << "ConfigurationOpen failed, 0x" << std::hex << Status
-              << std::dec << " !\n ";
+    SPOQ_LOG_ERROR("ConfigurationOpen failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
     return FALSE;
   }
@@ -348,8 +1167,8 @@ ClientLoadConfiguration(_In_ int argc,
   // on client side, to indicate if a certificate is required or not.
   if (QUIC_FAILED(Status = MsQuic->ConfigurationLoadCredential(
                       Configuration, &Config.CredConfig))) {
-    std::cout << "ConfigurationLoadCredential failed, 0x" << std::hex << Status
-              << std::dec << "!\n";
+    SPOQ_LOG_ERROR("ConfigurationLoadCredential failed, {}!",
+                   SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
     return FALSE;
   }
@@ -364,6 +1183,60 @@ void RunClient(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
     return;
   }
 
+  const char* Encoding;
+  if ((Encoding = GetValue(argc, argv, "encoding")) != NULL) {
+    MaxWireVersion = strcmp(Encoding, "ndjson") == 0   ? SPOQ_VERSION_NDJSON
+                     : strcmp(Encoding, "binary") == 0 ? SPOQ_VERSION_BINARY
+                                                       : SPOQ_VERSION_COLUMNAR;
+  }
+  const char* Negotiate;
+  if ((Negotiate = GetValue(argc, argv, "negotiate")) != NULL) {
+    Optimistic = strcmp(Negotiate, "classic") != 0;
+  }
+  const char* Value;
+  if ((Value = GetValue(argc, argv, "rate")) != NULL) {
+    ProduceRate = atof(Value);
+  }
+  if ((Value = GetValue(argc, argv, "count")) != NULL) {
+    ProduceCount = strtoull(Value, NULL, 10);
+  }
+  if ((Value = GetValue(argc, argv, "batch_readings")) != NULL) {
+    BatchReadings = std::clamp<uint32_t>((uint32_t)strtoul(Value, NULL, 10),
+                                         1, COLUMNAR_MAX_READINGS);
+  }
+  if ((Value = GetValue(argc, argv, "batch_ms")) != NULL) {
+    BatchBudgetNs = strtoull(Value, NULL, 10) * 1000000;
+  }
+  if ((Value = GetValue(argc, argv, "streams")) != NULL) {
+    RequestedStreams = std::min<uint32_t>(
+        (uint32_t)strtoul(Value, NULL, 10), SPOQ_MAX_DATA_STREAMS);
+  }
+  if ((Value = GetValue(argc, argv, "sensor_id")) != NULL) {
+    ClientSensorId = strtoull(Value, NULL, 10);
+  }
+  if ((Value = GetValue(argc, argv, "subscribe")) != NULL) {
+    char* End = (char*)Value;
+    do {
+      const char* Start = *End == ',' ? End + 1 : End;
+      const uint64_t SensorId = strtoull(Start, &End, 10);
+      if (End != Start && SubscriptionCount < SPOQ_MAX_SUBSCRIPTIONS) {
+        Subscriptions[SubscriptionCount++] = SensorId;
+      }
+    } while (*End == ',');
+    // The server forwards the readings on the control stream alone
+    if (SubscriptionCount != 0) {
+      SPOQ_LOG_INFO("Subscribing to {} sensor(s)", SubscriptionCount);
+      RequestedStreams = 0;
+    }
+  }
+
+  // Publish metrics if asked to
+  if (!Exporter.Start(GetValue(argc, argv, "metrics_socket"),
+                      GetValue(argc, argv, "metrics_file"), RenderMetrics)) {
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    return;
+  }
+
   QUIC_STATUS Status;
   const char* ResumptionTicketString = NULL;
   const char* SslKeyLogFile = getenv(SslKeyLogEnvVar);
@@ -379,53 +1252,116 @@ void RunClient(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
   if (QUIC_FAILED(Status = MsQuic->ConnectionOpen(Registration,
                                                   ClientConnectionCallback,
                                                   NULL, &Connection))) {
-    std::cout << "ConnectionOpen failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("ConnectionOpen failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
   }
+  ServerConnection = Connection;
+
+  // Get the target / server name or IP from the command line.
+  const char* Target;
+  if ((Target = GetValue(argc, argv, "target")) == NULL) {
+    SPOQ_LOG_ERROR("Must specify '-target' argument!");
+    Status = QUIC_STATUS_INVALID_PARAMETER;
+    shutdown();
+    return;
+  }
+  TicketKey = Target;
 
+  // Resume the last session with this server unless told not to. The cache
+  // is still kept up to date with the tickets this run receives.
+  const char* TicketCachePath = GetValue(argc, argv, "ticket_cache");
+  TicketCache.Load(TicketCachePath != NULL ? TicketCachePath
+                                           : DefaultTicketCache);
+  std::vector<uint8_t> Ticket;
   if ((ResumptionTicketString = GetValue(argc, argv, "ticket")) != NULL) {
     // If provided at the command line, set the resumption ticket that can
     // be used to resume a previous session.
-    uint8_t ResumptionTicket[10240];
-    uint16_t TicketLength = (uint16_t)DecodeHexBuffer(
-        ResumptionTicketString, sizeof(ResumptionTicket), ResumptionTicket);
+    Ticket.resize(10240);
+    Ticket.resize(DecodeHexBuffer(ResumptionTicketString,
+                                  (uint32_t)Ticket.size(), Ticket.data()));
+    Resuming = true;
+  } else if (!GetFlag(argc, argv, "no_resume")) {
+    Resuming = TicketCache.Lookup(TicketKey, &Ticket);
+  }
+  if (Resuming) {
     if (QUIC_FAILED(Status = MsQuic->SetParam(
                         Connection, QUIC_PARAM_CONN_RESUMPTION_TICKET,
-                        TicketLength, ResumptionTicket))) {
-      std::cout << "SetParam(QUIC_PARAM_CONN_RESUMPTION_TICKET) failed, 0x"
-                << std::hex << Status << std::dec << "!\n";
+                        (uint32_t)Ticket.size(), Ticket.data()))) {
+      SPOQ_LOG_ERROR("SetParam(QUIC_PARAM_CONN_RESUMPTION_TICKET) failed, {}!",
+                     SpoqLogHex(Status));
       setSpoqState(state, SPOQ_STATE::ERROR);
       shutdown();
+      return;
     }
+    SPOQ_LOG_INFO("Resuming with a {} byte ticket", Ticket.size());
   }
 
   if (SslKeyLogFile != NULL) {
     if (QUIC_FAILED(
             Status = MsQuic->SetParam(Connection, QUIC_PARAM_CONN_TLS_SECRETS,
                                       sizeof(ClientSecrets), &ClientSecrets))) {
-      std::cout << "SetParam(QUIC_PARAM_CONN_TLS_SECRETS) failed, 0x"
-                << std::hex << Status << std::dec << "!\n";
+      SPOQ_LOG_ERROR("SetParam(QUIC_PARAM_CONN_TLS_SECRETS) failed, {}!",
+                     SpoqLogHex(Status));
       shutdown();
     }
   }
 
-  // Get the target / server name or IP from the command line.
-  const char* Target;
-  if ((Target = GetValue(argc, argv, "target")) == NULL) {
-    std::cout << "Must specify '-target' argument!\n";
-    Status = QUIC_STATUS_INVALID_PARAMETER;
-    shutdown();
+  // Readings to stream upstream in -produce mode, generated unless -input
+  // names a file of JSON data objects, one per line
+  FILE* Input = NULL;
+  const char* InputPath = GetValue(argc, argv, "input");
+  if (Producing && InputPath != NULL) {
+    Input = strcmp(InputPath, "-") == 0 ? stdin : fopen(InputPath, "r");
+    if (Input == NULL) {
+      SPOQ_LOG_ERROR("Cannot open input {}!", InputPath);
+      setSpoqState(state, SPOQ_STATE::ERROR);
+      Status = QUIC_STATUS_INVALID_PARAMETER;
+      shutdown();
+      return;
+    }
+  }
+
+  // Record the connection's traffic from its start, if asked to
+  const char* CapturePath = GetValue(argc, argv, "capture");
+  if (CapturePath != NULL) {
+    if (!Capture.Open(CapturePath)) {
+      setSpoqState(state, SPOQ_STATE::ERROR);
+      Status = QUIC_STATUS_INVALID_PARAMETER;
+      if (Input != NULL && Input != stdin) {
+        fclose(Input);
+      }
+      shutdown();
+      return;
+    }
+    CaptureConnection = Capture.Connect();
   }
 
   // Start the connection to the server.
   if (QUIC_FAILED(Status = MsQuic->ConnectionStart(Connection, Configuration,
                                                    QUIC_ADDRESS_FAMILY_UNSPEC,
                                                    Target, UdpPort))) {
-    std::cout << "ConnectionStart failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("ConnectionStart failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
+    if (Input != NULL && Input != stdin) {
+      fclose(Input);
+    }
     shutdown();
+    return;
+  }
+
+  // The hello is queued straight away rather than after the handshake
+  if (Optimistic) {
+    HQUIC Stream = ClientOpenStream(Connection, 0);
+    if (Stream != NULL) {
+      SendHello(Stream);
+    }
+  }
+
+  if (Producing) {
+    ClientProduce(Input);
+  }
+  if (Input != NULL && Input != stdin) {
+    fclose(Input);
   }
 
   shutdown();
@@ -433,6 +1369,12 @@ void RunClient(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
 
 int QUIC_MAIN_EXPORT main(_In_ int argc,
                           _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  const char* LogLevel;
+  if ((LogLevel = GetValue(argc, argv, "log_level")) != NULL &&
+      !SpoqLogSetLevel(LogLevel)) {
+    std::cout << "Unknown log level '" << LogLevel << "'!\n";
+    return -1;
+  }
   setSpoqState(state, SPOQ_STATE::INIT);
   QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
 
@@ -445,6 +1387,10 @@ int QUIC_MAIN_EXPORT main(_In_ int argc,
         // This will block until all outstanding child objects have been
         // closed.
         MsQuic->RegistrationClose(Registration);
+        Capture.Close();
+        Exporter.Stop();
+        SpoqLogFlush();
+        SendPoolPrintStats();
         setSpoqState(state, SPOQ_STATE::CLOSED);
       }
       MsQuicClose(MsQuic);
@@ -453,18 +1399,25 @@ int QUIC_MAIN_EXPORT main(_In_ int argc,
 
   // Open a handle to the library and get the API function table.
   if (QUIC_FAILED(Status = MsQuicOpen2(&MsQuic))) {
-    std::cout << "MsQuicOpen2 failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("MsQuicOpen2 failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
     shutdown();
     return (int)Status;
   }
 
+  const char* Profile;
+  if ((Profile = GetValue(argc, argv, "execution_profile")) != NULL &&
+      !ParseExecutionProfile(Profile, &RegConfig.ExecutionProfile)) {
+    SPOQ_LOG_ERROR("Unknown execution profile '{}'!", Profile);
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return -1;
+  }
+
   // Create a registration for the app's connections.
   if (QUIC_FAILED(Status =
                       MsQuic->RegistrationOpen(&RegConfig, &Registration))) {
-    std::cout << "RegistrationOpen failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("RegistrationOpen failed, {}!", SpoqLogHex(Status));
     setSpoqState(state, SPOQ_STATE::ERROR);
     shutdown();
     return (int)Status;
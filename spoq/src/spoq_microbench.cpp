@@ -0,0 +1,723 @@
+/*++
+
+Abstract:
+
+    Microbenchmarks for the Sensor Protocol Over QUIC (SPOQ) application layer:
+frame boundary scanning, NDJSON framing of fragmented receives, PDU encoding
+and decoding, columnar batches, the negotiation messages, hex encoding, send
+buffer allocation, the ingest queue hand-off and state transitions. No
+sockets or msquic objects are involved, so results reflect only the
+application layer code under test.
+
+    Every case runs a few untimed warmup passes, then a fixed number of timed
+samples of a fixed number of passes each. The median sample is reported along
+with the fastest one and the median absolute deviation, so that regressions
+stand out from run-to-run noise.
+
+    Before the columnar batch cases are timed, batches of edge-case values
+are encoded, decoded and checked to round-trip exactly; the run fails if one
+does not.
+
+--*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "columnar_batch.h"
+#include "frame_scan.h"
+#include "ingest_queue.h"
+#include "msquic.h"
+#include "ndjson_framer.h"
+#include "quic_config.h"
+#include "send_message.h"
+#include "send_pool.h"
+#include "spoq.h"
+#include "spoq_pdu.h"
+#include "utils.h"
+
+// Bytes of NDJSON scanned per timed iteration
+constexpr size_t CorpusBytes = 1 << 20;
+
+// Untimed passes before each case is measured
+constexpr int WarmupPasses = 3;
+
+// Timed samples per case; the median is reported
+constexpr int Samples = 15;
+
+// Passes over the case's input per timed sample
+constexpr int Iterations = 20;
+
+// Message sizes to benchmark, newline included
+constexpr size_t MessageSizes[] = {16, 64, 256, 1024, 4096};
+
+// Prevents the optimizer from discarding benchmark results
+volatile size_t Sink;
+
+// Only cases whose name contains this are run, set with -filter
+const char* Filter = "";
+
+// Where results are printed; stdout unless a case redirects it
+FILE* Report = stdout;
+
+// Builds a buffer of newline-delimited messages of exactly MessageSize bytes
+std::string BuildCorpus(size_t MessageSize) {
+  std::string Corpus;
+  Corpus.reserve(CorpusBytes);
+  while (Corpus.size() + MessageSize <= CorpusBytes) {
+    std::string Message = "{\"msg\": " + std::to_string(Corpus.size()) + "}";
+    Message.resize(MessageSize - 1, ' ');
+    Corpus += Message;
+    Corpus += '\n';
+  }
+  return Corpus;
+}
+
+// The receive path before FrameScan: std::string::find per message
+size_t CountWithStringFind(const std::string& Corpus) {
+  size_t Frames = 0;
+  size_t Pos = 0;
+  size_t Next = 0;
+  while ((Next = Corpus.find('\n', Pos)) != std::string::npos) {
+    ++Frames;
+    Pos = Next + 1;
+  }
+  return Frames;
+}
+
+size_t CountWithScanner(const std::string& Corpus, FRAME_SCAN_FN Scan) {
+  uint32_t Offsets[64];
+  size_t Frames = 0;
+  size_t Pos = 0;
+  while (Pos < Corpus.size()) {
+    size_t Scanned = 0;
+    Frames += Scan(Corpus.data() + Pos, Corpus.size() - Pos, '\n', Offsets,
+                   64, &Scanned);
+    Pos += Scanned;
+  }
+  return Frames;
+}
+
+// Encodes MessageCount data PDUs the way spoq_server does, one per line
+std::vector<std::string> BuildPdus(size_t MessageCount) {
+  std::vector<std::string> Pdus;
+  char Line[128];
+  for (size_t i = 0; i < MessageCount; ++i) {
+    std::string Data = "{\"msg\":" + std::to_string(i) + ",\"pad\":\"" +
+                       std::string(i % 20, 'x') + "\"}";
+    size_t Length = SpoqEncodeNdjson({1, SPOQ_VERSION_NDJSON, 0}, Data, Line,
+                                     sizeof(Line));
+    Pdus.emplace_back(Line, Length - 1);
+  }
+  return Pdus;
+}
+
+// The negotiation parsing before SpoqDecodeNdjson: a substring search
+size_t ParseWithFind(const std::vector<std::string>& Pdus) {
+  size_t Sum = 0;
+  for (const std::string& Pdu : Pdus) {
+    std::string_view Message = Pdu;
+    std::string_view Key = "\"status\":\"";
+    size_t Pos = Message.find(Key);
+    if (Pos != std::string_view::npos) {
+      Sum += Message[Pos + Key.size()] == '0';
+    }
+  }
+  return Sum;
+}
+
+size_t ParseWithDecoder(const std::vector<std::string>& Pdus) {
+  size_t Sum = 0;
+  SPOQ_PDU_VIEW View;
+  for (const std::string& Pdu : Pdus) {
+    if (SpoqDecodeNdjson(Pdu, &View) == SPOQ_DECODE_STATUS::SUCCESS) {
+      Sum += View.Header.Status == SPOQ_STATUS_SUCCESS;
+    }
+  }
+  return Sum;
+}
+
+// A sensor reading as carried in a data PDU
+struct READING {
+  uint32_t Seq;
+  double Value;
+};
+
+std::vector<READING> BuildReadings(size_t Count) {
+  std::vector<READING> Readings;
+  for (size_t i = 0; i < Count; ++i) {
+    Readings.push_back({(uint32_t)i, 20.0 + (double)(rand() % 1000) / 100});
+  }
+  return Readings;
+}
+
+size_t EncodeNdjson(const std::vector<READING>& Readings, std::string& Wire) {
+  Wire.resize(Readings.size() * 128);
+  char* Out = Wire.data();
+  size_t Length = 0;
+  for (const READING& Reading : Readings) {
+    char Data[64];
+    int DataLength =
+        snprintf(Data, sizeof(Data), "{\"seq\":%u,\"value\":%.6g}",
+                 Reading.Seq, Reading.Value);
+    Length += SpoqEncodeNdjson({1, SPOQ_VERSION_NDJSON, 0},
+                               std::string_view(Data, DataLength),
+                               Out + Length, 128);
+  }
+  Wire.resize(Length);
+  return Length;
+}
+
+size_t EncodeBinary(const std::vector<READING>& Readings, std::string& Wire) {
+  Wire.resize(Readings.size() * 64);
+  uint8_t* Out = (uint8_t*)Wire.data();
+  size_t Length = 0;
+  for (const READING& Reading : Readings) {
+    uint8_t Data[32];
+    SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+    Fields.Uint(1, Reading.Seq);
+    Fields.Double(2, Reading.Value);
+    Length += SpoqEncodeBinary({1, SPOQ_VERSION_BINARY, 0}, Fields.Data(),
+                               Out + Length, 64);
+  }
+  Wire.resize(Length);
+  return Length;
+}
+
+// Decodes every PDU and pulls the reading's value out of its data
+double DecodeNdjson(const std::string& Wire) {
+  double Sum = 0;
+  const char* P = Wire.data();
+  const char* End = P + Wire.size();
+  SPOQ_PDU_VIEW Pdu;
+  while (P < End) {
+    const char* Newline = (const char*)memchr(P, '\n', End - P);
+    std::string_view Value;
+    if (SpoqDecodeNdjson(std::string_view(P, Newline - P), &Pdu) ==
+            SPOQ_DECODE_STATUS::SUCCESS &&
+        JsonObjectFind(Pdu.Data, "value", &Value)) {
+      double Reading = 0;
+      std::from_chars(Value.data(), Value.data() + Value.size(), Reading);
+      Sum += Reading;
+    }
+    P = Newline + 1;
+  }
+  return Sum;
+}
+
+double DecodeBinary(const std::string& Wire) {
+  double Sum = 0;
+  const uint8_t* P = (const uint8_t*)Wire.data();
+  const uint8_t* End = P + Wire.size();
+  SPOQ_PDU_VIEW Pdu;
+  uint64_t Length = 0;
+  while (P < End && GetVarint(&P, End, &Length)) {
+    if (SpoqDecodeBinary(std::string_view((const char*)P, Length), &Pdu) ==
+        SPOQ_DECODE_STATUS::SUCCESS) {
+      SPOQ_FIELD_READER Reader(Pdu.Data);
+      SPOQ_FIELD Field;
+      while (Reader.Next(&Field)) {
+        if (Field.Id == 2) {
+          Sum += Field.Double;
+        }
+      }
+    }
+    P += Length;
+  }
+  return Sum;
+}
+
+// Readings of one sensor at 10 Hz with some clock jitter, as the client
+// produces them. Stepped values move in 0.5 degree steps, as from a sensor
+// of that resolution, rather than drifting at full precision.
+std::vector<std::string> BuildSeries(size_t Count, bool Stepped) {
+  std::vector<std::string> Series;
+  uint64_t Time = 1000000000000;
+  for (size_t i = 0; i < Count; ++i) {
+    double Value = 20.0 + 5.0 * std::sin((double)i / 50.0);
+    if (Stepped) {
+      Value = std::round(Value * 2) / 2;
+    }
+    Time += 100000000 + rand() % 100000;
+    uint8_t Data[32];
+    SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+    Fields.Uint(1, i);
+    Fields.Double(2, Value);
+    Fields.Uint(3, Time);
+    Series.emplace_back(Fields.Data());
+  }
+  return Series;
+}
+
+// Bytes of the series as one version 2 PDU per reading
+size_t SeriesBinaryBytes(const std::vector<std::string>& Series) {
+  size_t Bytes = 0;
+  for (const std::string& Data : Series) {
+    uint8_t Pdu[64];
+    Bytes += SpoqEncodeBinary({1, SPOQ_VERSION_BINARY, 0}, Data, Pdu,
+                              sizeof(Pdu));
+  }
+  return Bytes;
+}
+
+// Encodes the series as PDUs of BatchReadings readings each and returns the
+// bytes sent
+size_t EncodeColumnar(COLUMNAR_BATCH& Batch,
+                      const std::vector<std::string>& Series,
+                      uint32_t BatchReadings, std::vector<std::string>* Out) {
+  size_t Bytes = 0;
+  for (size_t i = 0; i < Series.size(); i += BatchReadings) {
+    Batch.Clear();
+    for (size_t k = i; k < Series.size() && k < i + BatchReadings; ++k) {
+      Batch.Add(Series[k]);
+    }
+    const std::string_view Data = Batch.Encode();
+    Bytes += VarintLength(Data.size() + 3) + Data.size() + 3;
+    if (Out != nullptr) {
+      Out->emplace_back(Data);
+    }
+  }
+  return Bytes;
+}
+
+// Decodes every batch and hands each reading back as its data fields
+size_t DecodeColumnar(COLUMNAR_BATCH& Batch,
+                      const std::vector<std::string>& Batches) {
+  size_t Bytes = 0;
+  for (const std::string& Data : Batches) {
+    if (Batch.Decode(Data)) {
+      for (uint32_t i = 0; i < Batch.Count(); ++i) {
+        Bytes += Batch.Reading(i).size();
+      }
+    }
+  }
+  return Bytes;
+}
+
+// Checks that batches of Count readings with awkward values round-trip
+// through Encoder and Decoder, and that a truncated batch is refused.
+// Returns false and reports the first mismatch.
+bool ColumnarRoundTrip(COLUMNAR_BATCH& Encoder, COLUMNAR_BATCH& Decoder,
+                       uint32_t Count) {
+  static const uint64_t Edges[] = {0, 1, 127, 128, UINT32_MAX, INT64_MAX,
+                                   (uint64_t)INT64_MAX + 1, UINT64_MAX};
+  static const double Doubles[] = {0.0, -0.0, 1.5, -1.5, 1e308, -1e-308,
+                                   INFINITY, -INFINITY, NAN};
+  std::vector<std::string> Readings;
+  Encoder.Clear();
+  for (uint32_t i = 0; i < Count; ++i) {
+    const uint64_t Wide = ((uint64_t)rand() << 33) ^ (uint64_t)rand();
+    uint8_t Data[128];
+    SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+    Fields.Uint(1, i % 3 == 0 ? Edges[rand() % 8] : Wide);
+    Fields.Uint(3, 1000000000000ull + 100000000ull * i + rand() % 7);
+    Fields.Double(2, i % 4 == 0 ? Doubles[rand() % 9]
+                                : std::bit_cast<double>(Wide));
+    Fields.Float(5, (float)(rand() % 1000) / 8);
+    Fields.Bytes(4, std::string_view("0123456789abcdefghijklmnopqrst",
+                                     rand() % 31));
+    Readings.emplace_back(Fields.Data());
+    if (!Encoder.Add(Readings.back())) {
+      fprintf(stderr, "columnar: reading %u of %u not added\n", i, Count);
+      return false;
+    }
+  }
+  const std::string Encoded(Encoder.Encode());
+  if (!Decoder.Decode(Encoded) || Decoder.Count() != Count) {
+    fprintf(stderr, "columnar: batch of %u not decoded\n", Count);
+    return false;
+  }
+  for (uint32_t i = 0; i < Count; ++i) {
+    if (Decoder.Reading(i) != Readings[i]) {
+      fprintf(stderr, "columnar: reading %u of %u differs\n", i, Count);
+      return false;
+    }
+  }
+  // Every truncation of a small batch, and a sample of those of a large one
+  const size_t Step = Count <= 64 ? 1 : Encoded.size() / 64 + 1;
+  for (size_t Length = 0; Length < Encoded.size(); Length += Step) {
+    if (Decoder.Decode(std::string_view(Encoded.data(), Length))) {
+      fprintf(stderr, "columnar: batch of %u truncated to %zu decoded\n",
+              Count, Length);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Feeds the corpus to an NDJSON_FRAMER the way msquic delivers a stream:
+// RECEIVE events of up to EventBuffers buffers of FragmentSize bytes each,
+// with anything left unconsumed delivered again at the front of the next one
+size_t FrameFragmented(const std::string& Corpus, size_t FragmentSize,
+                       uint32_t EventBuffers) {
+  NDJSON_FRAMER Framer;
+  QUIC_BUFFER Buffers[8];
+  size_t Frames = 0;
+  size_t Pos = 0;
+  while (Pos < Corpus.size()) {
+    uint32_t BufferCount = 0;
+    for (size_t Offset = Pos;
+         BufferCount < EventBuffers && Offset < Corpus.size();
+         Offset += FragmentSize) {
+      Buffers[BufferCount].Buffer = (uint8_t*)Corpus.data() + Offset;
+      Buffers[BufferCount].Length =
+          (uint32_t)std::min(FragmentSize, Corpus.size() - Offset);
+      ++BufferCount;
+    }
+    uint64_t Consumed = 0;
+    if (QUIC_FAILED(Framer.Receive(Buffers, BufferCount, &Consumed,
+                                   [&Frames](std::string_view Frame) {
+                                     Frames += !Frame.empty();
+                                   }))) {
+      break;
+    }
+    Pos += Consumed;
+  }
+  return Frames;
+}
+
+// Builds the server's offer and the client's reply the way SendNegotiate
+// does on each side, in pooled buffers released as on SEND_COMPLETE
+size_t BuildNegotiation(size_t Count) {
+  size_t Bytes = 0;
+  for (size_t i = 0; i < Count; ++i) {
+    char Data[SPOQ_OFFER_DATA_LENGTH];
+    SEND_BUFFER* Offer = SpoqNegotiationBuffer(
+        {1, SPOQ_VERSION_NDJSON, SPOQ_STATUS_FAILURE},
+        SpoqOfferData(Data, SPOQ_VERSION_BINARY, true));
+    SEND_BUFFER* Reply = SpoqNegotiationBuffer(
+        {i + 1, SPOQ_VERSION_BINARY, SPOQ_STATUS_SUCCESS},
+        SpoqOfferData(Data, SPOQ_VERSION_NDJSON, true));
+    Bytes += Offer->Buffer.Length + Reply->Buffer.Length;
+    SendBufferFree(Offer);
+    SendBufferFree(Reply);
+  }
+  return Bytes;
+}
+
+// Messages written by one ServerSend call, and the longest of them
+constexpr uint32_t SendMessageCount = 100;
+constexpr uint32_t SendMessageLength = 160;
+
+// Writes one NDJSON reading with ServerSend's encoder
+uint32_t WriteReading(uint32_t Seq, char* Out, uint32_t Capacity) {
+  return (uint32_t)SpoqEncodeReading(
+      {1, SPOQ_VERSION_NDJSON, 0}, Seq,
+      std::string_view("xxxxxxxxxxxxxxxxxxx", Seq % 20), (uint64_t)Seq * 1000,
+      (uint8_t*)Out, Capacity);
+}
+
+// ServerSend with pooled buffers: one buffer per message, chained into a
+// batch and released by a single SendBufferFree as on SEND_COMPLETE
+size_t SendWithPool() {
+  SEND_BUFFER* Batch = nullptr;
+  size_t Bytes = 0;
+  for (uint32_t i = 0; i < SendMessageCount; ++i) {
+    SEND_BUFFER* Message = SendBufferAlloc(SendMessageLength);
+    Message->Buffer.Length = WriteReading(i, (char*)Message->Buffer.Buffer,
+                                          Message->Capacity);
+    Bytes += Message->Buffer.Length;
+    Message->Next = Batch;
+    Batch = Message;
+  }
+  SendBufferFree(Batch);
+  return Bytes;
+}
+
+// ServerSend before the send pool: a malloc per message, freed one by one
+size_t SendWithMalloc() {
+  QUIC_BUFFER* Messages[SendMessageCount];
+  size_t Bytes = 0;
+  for (uint32_t i = 0; i < SendMessageCount; ++i) {
+    void* Raw = malloc(sizeof(QUIC_BUFFER) + SendMessageLength);
+    Messages[i] = (QUIC_BUFFER*)Raw;
+    Messages[i]->Buffer = (uint8_t*)Raw + sizeof(QUIC_BUFFER);
+    Messages[i]->Length = WriteReading(i, (char*)Messages[i]->Buffer,
+                                       SendMessageLength);
+    Bytes += Messages[i]->Length;
+  }
+  for (QUIC_BUFFER* Message : Messages) {
+    free(Message);
+  }
+  return Bytes;
+}
+
+// Readings handed to the ingest queue per pass
+constexpr uint32_t IngestCount = 256;
+
+// The stream callback's side of the ingest hand-off, copying each reading
+// into a pooled item and pushing it, then the worker's side, popping and
+// freeing them. Both run on this thread, so this is the uncontended cost.
+size_t IngestHandOff(INGEST_QUEUE& Queue) {
+  char Reading[SendMessageLength];
+  size_t Bytes = 0;
+  for (uint32_t i = 0; i < IngestCount; ++i) {
+    const uint32_t Length = WriteReading(i, Reading, sizeof(Reading));
+    Queue.Push(IngestItemAlloc(std::string_view(Reading, Length)));
+    Bytes += Length;
+  }
+  INGEST_ITEM* Item;
+  while ((Item = Queue.Pop()) != nullptr) {
+    IngestItemFree(Item);
+  }
+  return Bytes;
+}
+
+// Resumption ticket sized buffers, hex encoded as when they are stored
+constexpr uint8_t HexBufferLength = 128;
+constexpr size_t HexBufferCount = 1024;
+
+size_t EncodeHex(std::vector<uint8_t>& Binary, std::string& Hex) {
+  for (size_t i = 0; i < HexBufferCount; ++i) {
+    EncodeHexBuffer(Binary.data() + i * HexBufferLength, HexBufferLength,
+                    Hex.data() + i * (2 * HexBufferLength + 1));
+  }
+  return Hex[0];
+}
+
+size_t DecodeHex(const std::string& Hex, std::vector<uint8_t>& Binary) {
+  size_t Bytes = 0;
+  for (size_t i = 0; i < HexBufferCount; ++i) {
+    Bytes += DecodeHexBuffer(Hex.data() + i * (2 * HexBufferLength + 1),
+                             HexBufferLength,
+                             Binary.data() + i * HexBufferLength);
+  }
+  return Bytes;
+}
+
+// State transitions per pass, cycling through the nominal path
+constexpr size_t TransitionCount = 256;
+
+size_t Transition() {
+  static const SPOQ_STATE Path[] = {SPOQ_STATE::INIT, SPOQ_STATE::NEGOTIATE,
+                                    SPOQ_STATE::ESTABLISHED,
+                                    SPOQ_STATE::SENDING, SPOQ_STATE::CLOSED};
+  SPOQ_STATE State = SPOQ_STATE::UNKNOWN;
+  for (size_t i = 0; i < TransitionCount; ++i) {
+    setSpoqState(State, Path[i % 5]);
+  }
+  return (size_t)State;
+}
+
+// Logged transitions, including formatting and writing their lines, which
+// normally happens on the logger's thread. Output goes to /dev/null.
+size_t TransitionLogged() {
+  size_t State = Transition();
+  SpoqLogFlush();
+  return State;
+}
+
+// Runs Pass WarmupPasses times untimed, then Samples timed samples of
+// Iterations passes each. Each pass handles Ops operations over Bytes bytes
+// of input. Prints the median and fastest sample per operation and the
+// median absolute deviation as a percentage of the median.
+template <typename Fn>
+void RunCase(const char* Name, size_t MessageSize, size_t Bytes, size_t Ops,
+             Fn&& Pass) {
+  if (strstr(Name, Filter) == nullptr) {
+    return;
+  }
+  for (int i = 0; i < WarmupPasses; ++i) {
+    Sink = Pass();
+  }
+  double PerOp[Samples];
+  for (int s = 0; s < Samples; ++s) {
+    auto Start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Iterations; ++i) {
+      Sink = Pass();
+    }
+    PerOp[s] = std::chrono::duration<double, std::nano>(
+                   std::chrono::steady_clock::now() - Start)
+                   .count() /
+               ((double)Iterations * Ops);
+  }
+  std::sort(PerOp, PerOp + Samples);
+  const double Median = PerOp[Samples / 2];
+  double Deviations[Samples];
+  for (int s = 0; s < Samples; ++s) {
+    Deviations[s] = std::fabs(PerOp[s] - Median);
+  }
+  std::sort(Deviations, Deviations + Samples);
+  const double Spread = 100 * Deviations[Samples / 2] / Median;
+
+  if (Bytes != 0) {
+    fprintf(Report,
+            "%-16s %6zu B %8.2f GB/s %10.2f ns/op (min %10.2f, +-%4.1f%%)\n",
+            Name, MessageSize, Bytes / (Median * Ops), Median, PerOp[0],
+            Spread);
+  } else {
+    fprintf(Report,
+            "%-16s %6s   %8s      %10.2f ns/op (min %10.2f, +-%4.1f%%)\n",
+            Name, "", "", Median, PerOp[0], Spread);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const char* Value;
+  if ((Value = GetValue(argc, argv, "filter")) != NULL) {
+    Filter = Value;
+  }
+  std::cout << "spoq_microbench: frame boundary scanning, best ISA = "
+            << ToString(FrameScanIsa()) << "\n\n";
+
+  std::vector<FRAME_SCAN_ISA> Isas = {FRAME_SCAN_ISA::PORTABLE};
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse2")) {
+    Isas.push_back(FRAME_SCAN_ISA::SSE2);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    Isas.push_back(FRAME_SCAN_ISA::AVX2);
+  }
+#endif
+
+  for (size_t MessageSize : MessageSizes) {
+    const std::string Corpus = BuildCorpus(MessageSize);
+    const size_t Frames = Corpus.size() / MessageSize;
+    RunCase("string::find", MessageSize, Corpus.size(), Frames,
+            [&]() { return CountWithStringFind(Corpus); });
+    for (FRAME_SCAN_ISA Isa : Isas) {
+      FRAME_SCAN_FN Scan = FrameScanFor(Isa);
+      RunCase(ToString(Isa), MessageSize, Corpus.size(), Frames,
+              [&]() { return CountWithScanner(Corpus, Scan); });
+    }
+    printf("\n");
+  }
+
+  std::cout << "spoq_microbench: PDU decoding\n\n";
+  const std::vector<std::string> Pdus = BuildPdus(16 * 1024);
+  size_t PduBytes = 0;
+  for (const std::string& Pdu : Pdus) {
+    PduBytes += Pdu.size();
+  }
+  const size_t AverageSize = PduBytes / Pdus.size();
+  RunCase("string::find", AverageSize, PduBytes, Pdus.size(),
+          [&]() { return ParseWithFind(Pdus); });
+  RunCase("decode", AverageSize, PduBytes, Pdus.size(),
+          [&]() { return ParseWithDecoder(Pdus); });
+
+  std::cout << "\nspoq_microbench: wire encodings, B = bytes per reading\n\n";
+  const std::vector<READING> Readings = BuildReadings(16 * 1024);
+  std::string NdjsonWire;
+  std::string BinaryWire;
+  const size_t NdjsonBytes = EncodeNdjson(Readings, NdjsonWire);
+  const size_t BinaryBytes = EncodeBinary(Readings, BinaryWire);
+  std::string Scratch;
+  RunCase("ndjson enc", NdjsonBytes / Readings.size(), NdjsonBytes,
+          Readings.size(), [&]() { return EncodeNdjson(Readings, Scratch); });
+  RunCase("binary enc", BinaryBytes / Readings.size(), BinaryBytes,
+          Readings.size(), [&]() { return EncodeBinary(Readings, Scratch); });
+  RunCase("ndjson dec", NdjsonBytes / Readings.size(), NdjsonBytes,
+          Readings.size(), [&]() { return (size_t)DecodeNdjson(NdjsonWire); });
+  RunCase("binary dec", BinaryBytes / Readings.size(), BinaryBytes,
+          Readings.size(), [&]() { return (size_t)DecodeBinary(BinaryWire); });
+
+  COLUMNAR_BATCH Encoder;
+  COLUMNAR_BATCH Decoder;
+  for (uint32_t Count : {1u, 2u, 3u, 5u, 8u, 9u, 31u, 32u, 33u, 64u, 100u,
+                         1000u, COLUMNAR_MAX_READINGS}) {
+    if (!ColumnarRoundTrip(Encoder, Decoder, Count)) {
+      fprintf(stderr, "columnar: round trip of %u readings failed\n", Count);
+      return 1;
+    }
+  }
+  std::cout << "\nspoq_microbench: columnar batches, B = bytes per reading, "
+               "round trip ok\n\n";
+  for (bool Stepped : {false, true}) {
+    const std::vector<std::string> Series = BuildSeries(16 * 1024, Stepped);
+    const std::string Kind = Stepped ? "step " : "drift ";
+    const size_t SeriesBytes = SeriesBinaryBytes(Series);
+    RunCase((Kind + "binary").c_str(), SeriesBytes / Series.size(),
+            SeriesBytes, Series.size(),
+            [&]() { return SeriesBinaryBytes(Series); });
+    COLUMNAR_BATCH Batch;
+    for (uint32_t BatchReadings : {16, 64, 256}) {
+      const size_t Bytes =
+          EncodeColumnar(Batch, Series, BatchReadings, nullptr);
+      const std::string Name = Kind + "col " + std::to_string(BatchReadings);
+      RunCase(Name.c_str(), Bytes / Series.size(), Bytes, Series.size(),
+              [&]() {
+                return EncodeColumnar(Batch, Series, BatchReadings, nullptr);
+              });
+    }
+    // Decode cost, 64 readings a batch
+    std::vector<std::string> Batches;
+    const size_t Bytes = EncodeColumnar(Batch, Series, 64, &Batches);
+    RunCase((Kind + "dec 64").c_str(), Bytes / Series.size(), Bytes,
+            Series.size(), [&]() { return DecodeColumnar(Batch, Batches); });
+  }
+
+  std::cout << "\nspoq_microbench: NDJSON framing of fragmented receives, "
+               "fragment bytes x buffers per event\n\n";
+  for (size_t MessageSize : {64, 1024}) {
+    const std::string Corpus = BuildCorpus(MessageSize);
+    const size_t Frames = Corpus.size() / MessageSize;
+    for (auto [FragmentSize, EventBuffers] :
+         {std::pair<size_t, uint32_t>{1200, 1}, {1200, 4}, {37, 8}}) {
+      const std::string Name = "frame " + std::to_string(FragmentSize) + "x" +
+                               std::to_string(EventBuffers);
+      RunCase(Name.c_str(), MessageSize, Corpus.size(), Frames, [&]() {
+        return FrameFragmented(Corpus, FragmentSize, EventBuffers);
+      });
+    }
+  }
+
+  std::cout << "\nspoq_microbench: send buffers, B = bytes per message\n\n";
+  const size_t NegotiationBytes = BuildNegotiation(1);
+  RunCase("negotiate build", NegotiationBytes / 2, NegotiationBytes * 1024,
+          2 * 1024, []() { return BuildNegotiation(1024); });
+  const size_t SendBytes = SendWithPool();
+  RunCase("send malloc", SendBytes / SendMessageCount, SendBytes,
+          SendMessageCount, []() { return SendWithMalloc(); });
+  RunCase("send pool", SendBytes / SendMessageCount, SendBytes,
+          SendMessageCount, []() { return SendWithPool(); });
+
+  std::cout << "\nspoq_microbench: ingest hand-off, B = bytes per reading\n\n";
+  INGEST_QUEUE IngestQueue;
+  const size_t IngestBytes = IngestHandOff(IngestQueue);
+  RunCase("ingest queue", IngestBytes / IngestCount, IngestBytes, IngestCount,
+          [&]() { return IngestHandOff(IngestQueue); });
+
+  std::cout << "\nspoq_microbench: hex encoding, B = binary bytes\n\n";
+  std::vector<uint8_t> Binary(HexBufferCount * HexBufferLength);
+  for (size_t i = 0; i < Binary.size(); ++i) {
+    Binary[i] = (uint8_t)rand();
+  }
+  std::string Hex(HexBufferCount * (2 * HexBufferLength + 1), '\0');
+  RunCase("hex enc", HexBufferLength, Binary.size(), HexBufferCount,
+          [&]() { return EncodeHex(Binary, Hex); });
+  RunCase("hex dec", HexBufferLength, Binary.size(), HexBufferCount,
+          [&]() { return DecodeHex(Hex, Binary); });
+
+  std::cout << "\nspoq_microbench: state transitions\n\n";
+  SpoqLogSetLevel("warn");
+  RunCase("state filtered", 0, 0, TransitionCount,
+          []() { return Transition(); });
+  // Logged lines would swamp the results, so stdout goes to /dev/null and
+  // the result is printed through a duplicate of it
+  fflush(stdout);
+  Report = fdopen(dup(STDOUT_FILENO), "w");
+  const int Null = open("/dev/null", O_WRONLY);
+  dup2(Null, STDOUT_FILENO);
+  close(Null);
+  SpoqLogSetLevel("info");
+  RunCase("state logged", 0, 0, TransitionCount,
+          []() { return TransitionLogged(); });
+  SpoqLogSetLevel("warn");
+  SpoqLogFlush();
+  fflush(stdout);
+  dup2(fileno(Report), STDOUT_FILENO);
+  fclose(Report);
+  Report = stdout;
+  return 0;
+}
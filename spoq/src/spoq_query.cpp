@@ -0,0 +1,162 @@
+/*++
+
+Abstract:
+
+    Reads the readings a Sensor Protocol Over QUIC (SPOQ) server persisted
+with -store. Prints every reading of one sensor within a time range, one per
+line, as its receive time in nanoseconds since the epoch followed by the
+reading. NDJSON readings are printed as they arrived; binary readings have
+their header and data fields rendered as text, and a columnar batch is
+printed as its readings, which share its receive time. Without -sensor it
+lists the sensors in the store.
+
+    The store is only read, so it is safe to query while the server is
+writing to it; readings stored after the query started are not seen.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "columnar_batch.h"
+#include "series_store.h"
+#include "spoq_log.h"
+#include "spoq_pdu.h"
+#include "utils.h"
+
+void PrintUsage() {
+  std::cout << "\nspoq_query prints readings persisted by spoq_server.\n\n"
+               "Usage:\n\n"
+               "  spoq_query -store:<dir> [-sensor:<id>] [-from:<ns>] "
+               "[-to:<ns>]\n"
+               "             [-last:<s>] [-count]\n";
+}
+
+// Renders the data fields of a binary reading as "id:value" pairs
+void AppendFields(std::string_view Data, std::string& Out) {
+  SPOQ_FIELD_READER Reader(Data);
+  SPOQ_FIELD Field;
+  while (!Reader.Done() && Reader.Next(&Field)) {
+    Out.append(" ").append(std::to_string(Field.Id)).append(":");
+    switch (Field.Type) {
+      case SPOQ_WIRE_TYPE::VARINT:
+        Out.append(std::to_string(Field.Uint));
+        break;
+      case SPOQ_WIRE_TYPE::BYTES:
+        Out.append(std::to_string(Field.Bytes.size())).append("B");
+        break;
+      default: {
+        char Value[32];
+        snprintf(Value, sizeof(Value), "%g", Field.Double);
+        Out.append(Value);
+        break;
+      }
+    }
+  }
+}
+
+// Renders the header and data fields of one binary reading
+void AppendReading(const SPOQ_HEADER_VIEW& Header, std::string_view Data,
+                   std::string& Out) {
+  Out.append(" sensor_id:").append(std::to_string(Header.SensorId));
+  Out.append(" version:").append(std::to_string(Header.Version));
+  Out.append(" status:").append(std::to_string(Header.Status));
+  AppendFields(Data, Out);
+}
+
+// Formats one stored reading as a line of output, or a batch of them as a
+// line per reading. *Readings is set to the number of lines.
+std::string FormatRecord(const SERIES_RECORD& Record, uint32_t* Readings) {
+  std::string Line = std::to_string(Record.Time);
+  *Readings = 1;
+  if (Record.Version == SPOQ_VERSION_NDJSON) {
+    Line.append(" ").append(Record.Data);
+    return Line;
+  }
+  SPOQ_PDU_VIEW Pdu;
+  if (SpoqDecodeBinary(Record.Data, &Pdu) != SPOQ_DECODE_STATUS::SUCCESS) {
+    Line.append(" malformed binary reading");
+    return Line;
+  }
+  if (Pdu.Header.Version != SPOQ_VERSION_COLUMNAR) {
+    AppendReading(Pdu.Header, Pdu.Data, Line);
+    return Line;
+  }
+  static COLUMNAR_BATCH Columns;
+  if (!Columns.Decode(Pdu.Data)) {
+    Line.append(" malformed batch");
+    return Line;
+  }
+  *Readings = Columns.Count();
+  for (uint32_t i = 0; i < Columns.Count(); ++i) {
+    if (i != 0) {
+      Line.append("\n").append(std::to_string(Record.Time));
+    }
+    AppendReading(Pdu.Header, Columns.Reading(i), Line);
+  }
+  return Line;
+}
+
+int main(int argc, char* argv[]) {
+  const char* Value;
+  if (GetFlag(argc, argv, "help") || GetFlag(argc, argv, "?") ||
+      (Value = GetValue(argc, argv, "store")) == NULL) {
+    PrintUsage();
+    return 1;
+  }
+  SpoqLogSetLevel("warn");
+  SERIES_STORE Store;
+  if (!Store.Open(Value)) {
+    SpoqLogFlush();
+    return 1;
+  }
+
+  const char* Sensor = GetValue(argc, argv, "sensor");
+  if (Sensor == NULL) {
+    for (uint64_t SensorId : Store.Sensors()) {
+      printf("%llu\n", (unsigned long long)SensorId);
+    }
+    SpoqLogFlush();
+    return 0;
+  }
+
+  uint64_t From = 0;
+  uint64_t To = UINT64_MAX;
+  if ((Value = GetValue(argc, argv, "from")) != NULL) {
+    From = strtoull(Value, NULL, 10);
+  }
+  if ((Value = GetValue(argc, argv, "to")) != NULL) {
+    To = strtoull(Value, NULL, 10);
+  }
+  if ((Value = GetValue(argc, argv, "last")) != NULL) {
+    const uint64_t Now =
+        (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    const uint64_t Span = strtoull(Value, NULL, 10) * 1000000000;
+    From = Span < Now ? Now - Span : 0;
+  }
+
+  const bool CountOnly = GetFlag(argc, argv, "count");
+  uint64_t Count = 0;
+  Store.Query(strtoull(Sensor, NULL, 10), From, To,
+              [&](const SERIES_RECORD& Record) {
+                uint32_t Readings;
+                const std::string Line = FormatRecord(Record, &Readings);
+                Count += Readings;
+                if (!CountOnly) {
+                  fwrite(Line.data(), 1, Line.size(), stdout);
+                  fputc('\n', stdout);
+                }
+              });
+  if (CountOnly) {
+    printf("%llu\n", (unsigned long long)Count);
+  }
+  SpoqLogFlush();
+  return 0;
+}
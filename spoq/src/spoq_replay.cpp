@@ -0,0 +1,775 @@
+/*++
+
+    Copyright (c) Microsoft Corporation.
+    Licensed under the MIT License.
+
+Abstract:
+
+    Replays a traffic capture against a Sensor Protocol Over QUIC (SPOQ)
+server. The capture is recorded by spoq_server or spoq_client with
+-capture:<path>. Every captured connection gets a connection of its own. It
+is opened when the capture recorded it opening and shut down when the
+capture recorded it closing, so the same connections overlap as they did
+when captured. Each message a client sent is sent again, verbatim and on the
+same stream, at its captured time scaled by -speed, or as fast as possible
+with -speed:max. Negotiation messages are part of the capture, so the server
+negotiates each connection as it did then. Messages the server sent are not
+replayed.
+
+    Reports how far behind schedule messages went out, send-to-acknowledgement
+latency, and message and byte rates, as text or JSON.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "capture.h"
+#include "latency_histogram.h"
+#include "msquic.h"
+#include "numa_placement.h"
+#include "quic_config.h"
+#include "send_pool.h"
+#include "spoq.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+#include "utils.h"
+
+// The (optional) registration configuration for the app. This sets a name for
+// the app (used for persistent storage and for debugging). It also configures
+// the execution profile, "low latency" unless -execution_profile picks
+// another.
+QUIC_REGISTRATION_CONFIG RegConfig = {"spoq_replay",
+                                      QUIC_EXECUTION_PROFILE_LOW_LATENCY};
+
+// The protocol name used in the Application Layer Protocol Negotiation (ALPN).
+const QUIC_BUFFER Alpn = {sizeof("sample") - 1, (uint8_t*)"sample"};
+
+// The QUIC handle to the registration object.
+HQUIC Registration;
+
+// The QUIC handle to the configuration object shared by every connection.
+HQUIC Configuration;
+
+// The replay lifecycle state. Protocol state is tracked per REPLAY_SESSION.
+SPOQ_STATE state = SPOQ_STATE::UNKNOWN;
+
+// How long the scheduler sleeps at most between looks at the clock
+constexpr auto REPLAY_TICK = std::chrono::microseconds(500);
+
+// Keep-alive for connections whose captured gaps exceed the idle timeout
+constexpr uint32_t KEEP_ALIVE_INTERVAL_MS = IdleTimeoutMs / 2;
+
+struct REPLAY_OPTIONS {
+  const char* Capture = nullptr;
+  double Speed = 1;  // Captured time divided by replay time, 0 for max
+  double Linger = 5;  // Seconds to wait for sends once the capture is done
+  bool Json = false;
+  const char* Target = "127.0.0.1";
+};
+
+REPLAY_OPTIONS Options;
+
+// Run-wide results, updated from every msquic worker
+struct REPLAY_TOTALS {
+  METRIC_COUNTER ConnectionsStarted;
+  METRIC_COUNTER HandshakesCompleted;
+  METRIC_COUNTER HandshakesFailed;
+  METRIC_COUNTER MessagesSent;
+  METRIC_COUNTER BytesSent;
+  METRIC_COUNTER SendFailures;
+  METRIC_COUNTER BytesReceived;
+  std::atomic<uint32_t> Active{0};
+  std::atomic<uint32_t> PeakActive{0};
+  // Scheduled send time of a message to its StreamSend
+  LATENCY_HISTOGRAM Lag;
+  // StreamSend of a message to its SEND_COMPLETE (acknowledged by the server)
+  LATENCY_HISTOGRAM SendAck;
+};
+
+REPLAY_TOTALS Totals;
+
+struct REPLAY_SESSION;
+
+// One stream of a replayed connection, the Context of its stream callback
+struct REPLAY_STREAM {
+  REPLAY_SESSION* Session = nullptr;
+  uint32_t Index = 0;
+  HQUIC Stream = nullptr;
+};
+
+// One captured connection. Its handle is only closed once the replay is
+// over, so the scheduler may use it at any time.
+struct REPLAY_SESSION {
+  HQUIC Connection = nullptr;
+  // Guards the stream handles against being cleared by the callbacks while
+  // the scheduler sends
+  std::mutex Lock;
+  REPLAY_STREAM Streams[1 + SPOQ_MAX_DATA_STREAMS];
+  // Messages handed to StreamSend and not yet complete
+  std::atomic<uint32_t> Outstanding{0};
+  // The server has acknowledged the first message on the control stream,
+  // the negotiation message
+  std::atomic<bool> Negotiated{false};
+  // No more messages follow; shut down once Outstanding drains
+  std::atomic<bool> Closing{false};
+  std::atomic<bool> ShutDown{false};
+  // The connection has shut down
+  std::atomic<bool> Done{false};
+  // Scheduler state, only touched by the main thread
+  bool Started = false;
+  uint32_t StreamCount = 0;
+  bool CloseHeld = false;
+  // Data stream messages held until negotiation, with their due times
+  std::vector<std::pair<const CAPTURE_RECORD*, uint64_t>> Held;
+};
+
+// One captured event to replay, in capture order
+struct REPLAY_STEP {
+  const CAPTURE_RECORD* Record;
+  REPLAY_SESSION* Session;
+};
+
+void PrintUsage() {
+  std::cout << "\n"
+               "spoq_replay replays a SPOQ traffic capture against a "
+               "spoq_server.\n"
+               "\n"
+               "Usage:\n"
+               "\n"
+               " spoq_replay -cert_file:<...> -key_file:<...> -ca_file:<...>\n"
+               "             -capture:<path>\n"
+               "             [-target:{IPAddress|Hostname}] (127.0.0.1)\n"
+               "             [-speed:{<factor>|max}] (1)\n"
+               "             [-linger:<seconds>] (5) [-json]\n"
+               "             [-execution_profile:{low_latency|max_throughput|\n"
+               "                                  scavenger}] (low_latency)\n"
+               "             [-log_level:{trace|debug|info|warn|error|none}]\n";
+}
+
+// Shuts the connection of Session down, once
+void ReplayShutdown(_In_ REPLAY_SESSION* Session) {
+  if (Session->ShutDown.exchange(true)) {
+    return;
+  }
+  if (Session->Connection != nullptr) {
+    MsQuic->ConnectionShutdown(Session->Connection,
+                               QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
+  }
+}
+
+// Shuts Session down as soon as its messages have been acknowledged. A
+// connection shutdown discards whatever is still queued on its streams.
+void ReplayClose(_In_ REPLAY_SESSION* Session) {
+  Session->Closing.store(true, std::memory_order_seq_cst);
+  if (Session->Outstanding.load(std::memory_order_seq_cst) == 0) {
+    ReplayShutdown(Session);
+  }
+}
+
+// The replay's callback for stream events from MsQuic.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+    _Function_class_(QUIC_STREAM_CALLBACK) QUIC_STATUS QUIC_API
+    ReplayStreamCallback(_In_ HQUIC Stream, _In_opt_ void* Context,
+                         _Inout_ QUIC_STREAM_EVENT* Event) {
+  auto Channel = static_cast<REPLAY_STREAM*>(Context);
+  REPLAY_SESSION* Session = Channel->Session;
+  SPOQ_LOG_DEBUG("[{}] Stream event: {}", Stream,
+                 QuicStreamEventTypeToString(Event->Type));
+  switch (Event->Type) {
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
+      auto Sent = static_cast<SEND_BUFFER*>(Event->SEND_COMPLETE.ClientContext);
+      if (!Event->SEND_COMPLETE.Canceled) {
+        Totals.SendAck.Record(MetricNow() - Sent->SendTime);
+        if (Channel->Index == 0) {
+          Session->Negotiated.store(true, std::memory_order_release);
+        }
+      }
+      SendBufferFree(Sent);
+      if (Session->Outstanding.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+          Session->Closing.load(std::memory_order_seq_cst)) {
+        ReplayShutdown(Session);
+      }
+      break;
+    }
+    case QUIC_STREAM_EVENT_RECEIVE:
+      // The server's messages are only counted; all of them are consumed
+      Totals.BytesReceived.Add(Event->RECEIVE.TotalBufferLength);
+      break;
+    case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+      MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+      break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+      // Stop the scheduler from using the stream before closing it
+      {
+        std::lock_guard<std::mutex> Guard(Session->Lock);
+        Channel->Stream = nullptr;
+      }
+      if (!Event->SHUTDOWN_COMPLETE.AppCloseInProgress) {
+        MsQuic->StreamClose(Stream);
+      }
+      break;
+    default:
+      break;
+  }
+  return QUIC_STATUS_SUCCESS;
+}
+
+// The replay's callback for connection events from MsQuic.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+    _Function_class_(QUIC_CONNECTION_CALLBACK) QUIC_STATUS QUIC_API
+    ReplayConnectionCallback(_In_ HQUIC Connection, _In_opt_ void* Context,
+                             _Inout_ QUIC_CONNECTION_EVENT* Event) {
+  auto Session = static_cast<REPLAY_SESSION*>(Context);
+  SPOQ_LOG_DEBUG("[{}] Connection event: {}", Connection,
+                 QuicConnectionEventTypeToString(Event->Type));
+  switch (Event->Type) {
+    case QUIC_CONNECTION_EVENT_CONNECTED: {
+      Totals.HandshakesCompleted.Add();
+      const uint32_t Active =
+          Totals.Active.fetch_add(1, std::memory_order_relaxed) + 1;
+      uint32_t Peak = Totals.PeakActive.load(std::memory_order_relaxed);
+      while (Peak < Active && !Totals.PeakActive.compare_exchange_weak(
+                                 Peak, Active, std::memory_order_relaxed)) {
+      }
+      break;
+    }
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
+      if (Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status !=
+          QUIC_STATUS_CONNECTION_IDLE) {
+        SPOQ_LOG_WARN(
+            "[{}] Connection event: Shut down by transport, {}", Connection,
+            SpoqLogHex(Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status));
+      }
+      break;
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+      if (Event->SHUTDOWN_COMPLETE.HandshakeCompleted) {
+        Totals.Active.fetch_sub(1, std::memory_order_relaxed);
+      } else {
+        Totals.HandshakesFailed.Add();
+      }
+      // The handle is closed by RunReplay
+      Session->Done.store(true, std::memory_order_release);
+      break;
+    default:
+      break;
+  }
+  return QUIC_STATUS_SUCCESS;
+}
+
+// Opens and starts stream Index of Session. Streams get their ids in the
+// order they start, so those below Index are started first.
+void ReplayOpenStreams(_In_ REPLAY_SESSION* Session, uint32_t Index) {
+  while (Session->StreamCount <= Index) {
+    REPLAY_STREAM* Channel = &Session->Streams[Session->StreamCount];
+    Channel->Session = Session;
+    Channel->Index = Session->StreamCount++;
+    HQUIC Stream = NULL;
+    QUIC_STATUS Status;
+    if (Session->Connection == nullptr ||
+        QUIC_FAILED(Status = MsQuic->StreamOpen(
+                        Session->Connection, QUIC_STREAM_OPEN_FLAG_NONE,
+                        ReplayStreamCallback, Channel, &Stream))) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> Guard(Session->Lock);
+      Channel->Stream = Stream;
+    }
+    if (QUIC_FAILED(Status = MsQuic->StreamStart(
+                        Stream, QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+      SPOQ_LOG_ERROR("StreamStart failed, {}!", SpoqLogHex(Status));
+      {
+        std::lock_guard<std::mutex> Guard(Session->Lock);
+        Channel->Stream = nullptr;
+      }
+      MsQuic->StreamClose(Stream);
+    }
+  }
+}
+
+// Opens and starts the connection of Session. Its streams may be started
+// and sent on before the handshake completes; msquic holds the data until
+// then.
+void ReplayConnect(_In_ REPLAY_SESSION* Session) {
+  HQUIC Connection = NULL;
+  QUIC_STATUS Status;
+  Session->Started = true;
+  Totals.ConnectionsStarted.Add();
+  if (QUIC_FAILED(Status = MsQuic->ConnectionOpen(
+                      Registration, ReplayConnectionCallback, Session,
+                      &Connection))) {
+    SPOQ_LOG_ERROR("ConnectionOpen failed, {}!", SpoqLogHex(Status));
+    Totals.HandshakesFailed.Add();
+    Session->Done.store(true, std::memory_order_release);
+    return;
+  }
+  if (QUIC_FAILED(Status = MsQuic->ConnectionStart(
+                      Connection, Configuration, QUIC_ADDRESS_FAMILY_UNSPEC,
+                      Options.Target, UdpPort))) {
+    SPOQ_LOG_ERROR("ConnectionStart failed, {}!", SpoqLogHex(Status));
+    Totals.HandshakesFailed.Add();
+    Session->Done.store(true, std::memory_order_release);
+    MsQuic->ConnectionClose(Connection);
+    return;
+  }
+  Session->Connection = Connection;
+  ReplayOpenStreams(Session, 0);
+}
+
+// Frames a captured message body again and sends it on its stream
+void ReplaySend(_In_ REPLAY_SESSION* Session, const CAPTURE_RECORD& Record,
+                uint64_t DueNs) {
+  const bool Line = Record.Version == SPOQ_VERSION_NDJSON;
+  const size_t Length =
+      Record.Body.size() + (Line ? 1 : VarintLength(Record.Body.size()));
+  SEND_BUFFER* Frame = SendBufferAlloc((uint32_t)Length);
+  if (Frame == nullptr) {
+    Totals.SendFailures.Add();
+    return;
+  }
+  uint8_t* Out = Frame->Buffer.Buffer;
+  if (!Line) {
+    Out += PutVarint(Out, Record.Body.size());
+  }
+  memcpy(Out, Record.Body.data(), Record.Body.size());
+  if (Line) {
+    Out[Record.Body.size()] = '\n';
+  }
+  Frame->Buffer.Length = (uint32_t)Length;
+
+  ReplayOpenStreams(Session, Record.Stream);
+  const uint64_t Now = MetricNow();
+  Frame->SendTime = Now;
+  Session->Outstanding.fetch_add(1, std::memory_order_seq_cst);
+  QUIC_STATUS Status = QUIC_STATUS_INVALID_STATE;
+  {
+    std::lock_guard<std::mutex> Guard(Session->Lock);
+    HQUIC Stream = Session->Streams[Record.Stream].Stream;
+    if (Stream != nullptr) {
+      Status = MsQuic->StreamSend(Stream, &Frame->Buffer, 1,
+                                  QUIC_SEND_FLAG_NONE, Frame);
+    }
+  }
+  if (QUIC_FAILED(Status)) {
+    SendBufferFree(Frame);
+    Session->Outstanding.fetch_sub(1, std::memory_order_seq_cst);
+    Totals.SendFailures.Add();
+    return;
+  }
+  // At max speed there is no schedule to fall behind
+  if (Options.Speed != 0) {
+    Totals.Lag.Record(Now > DueNs ? Now - DueNs : 0);
+  }
+  Totals.MessagesSent.Add();
+  Totals.BytesSent.Add(Length);
+}
+
+// Carries out one captured event that is due. A message for a data stream
+// is held until the server has the negotiation message, which a message on
+// another stream could otherwise overtake.
+void ReplayStep(const REPLAY_STEP& Step, uint64_t DueNs,
+                std::vector<REPLAY_SESSION*>& Waiting) {
+  REPLAY_SESSION* Session = Step.Session;
+  const CAPTURE_RECORD& Record = *Step.Record;
+  if (!Session->Started) {
+    ReplayConnect(Session);
+  }
+  if (Record.Event == CAPTURE_EVENT::OPEN) {
+    return;
+  }
+  const bool Hold = Record.Event == CAPTURE_EVENT::CLOSE
+                        ? !Session->Held.empty()
+                        : !Session->Held.empty() ||
+                              (Record.Stream != 0 &&
+                               !Session->Negotiated.load(
+                                   std::memory_order_acquire));
+  if (Hold) {
+    if (Record.Event == CAPTURE_EVENT::CLOSE) {
+      Session->CloseHeld = true;
+      return;
+    }
+    if (Session->Held.empty()) {
+      Waiting.push_back(Session);
+    }
+    Session->Held.emplace_back(Step.Record, DueNs);
+    return;
+  }
+  if (Record.Event == CAPTURE_EVENT::CLOSE) {
+    ReplayClose(Session);
+  } else {
+    ReplaySend(Session, Record, DueNs);
+  }
+}
+
+// Sends the held messages of the sessions that have negotiated since, or
+// drops them if their connection is gone
+void ReplayRelease(std::vector<REPLAY_SESSION*>& Waiting) {
+  auto Released = [](REPLAY_SESSION* Session) {
+    const bool Done = Session->Done.load(std::memory_order_acquire);
+    if (!Done && !Session->Negotiated.load(std::memory_order_acquire)) {
+      return false;
+    }
+    for (auto& [Record, DueNs] : Session->Held) {
+      if (Done) {
+        Totals.SendFailures.Add();
+      } else {
+        ReplaySend(Session, *Record, DueNs);
+      }
+    }
+    Session->Held.clear();
+    if (Session->CloseHeld) {
+      ReplayClose(Session);
+    }
+    return true;
+  };
+  Waiting.erase(std::remove_if(Waiting.begin(), Waiting.end(), Released),
+                Waiting.end());
+}
+
+// Replays the steps at their captured times scaled by the speed, then
+// closes the connections the capture left open
+void ReplayRun(const std::vector<REPLAY_STEP>& Steps,
+               std::vector<std::unique_ptr<REPLAY_SESSION>>& Sessions,
+               uint64_t StartNs) {
+  std::vector<REPLAY_SESSION*> Waiting;
+  size_t Next = 0;
+  auto Due = [&](size_t i) {
+    return Options.Speed == 0
+               ? StartNs
+               : StartNs + (uint64_t)((double)Steps[i].Record->Time /
+                                      Options.Speed);
+  };
+  while (Next < Steps.size() || !Waiting.empty()) {
+    const uint64_t Now = MetricNow();
+    while (Next < Steps.size() && Due(Next) <= Now) {
+      ReplayStep(Steps[Next], Due(Next), Waiting);
+      ++Next;
+    }
+    if (!Waiting.empty()) {
+      ReplayRelease(Waiting);
+    }
+    // Sleep until the next step is due, but look again within a tick if
+    // messages are held
+    std::chrono::nanoseconds Wait = REPLAY_TICK;
+    if (Next < Steps.size() && Waiting.empty()) {
+      const uint64_t NextNs = Due(Next);
+      const uint64_t Now = MetricNow();
+      Wait = std::min(Wait, std::chrono::nanoseconds(
+                                NextNs > Now ? NextNs - Now : 0));
+    }
+    std::this_thread::sleep_for(Wait);
+  }
+  for (auto& Session : Sessions) {
+    if (Session->Started && !Session->Closing.load()) {
+      ReplayClose(Session.get());
+    }
+  }
+}
+
+double Milliseconds(uint64_t Ns) { return (double)Ns / 1e6; }
+
+// Prints the results as text, or as one JSON object with -json
+void ReplayReport(size_t Connections, uint32_t CapturedPeak,
+                  uint64_t CapturedNs, double Seconds) {
+  const LATENCY_HISTOGRAM* Latencies[] = {&Totals.Lag, &Totals.SendAck};
+  const char* Names[] = {"lag", "send_ack"};
+  const double CapturedSeconds = (double)CapturedNs / 1e9;
+
+  if (Options.Json) {
+    printf("{\"connections\":%zu,\"speed\":%.3f,\"captured_s\":%.3f,"
+           "\"duration_s\":%.3f,\n",
+           Connections, Options.Speed, CapturedSeconds, Seconds);
+    printf(" \"handshakes\":%llu,\"handshakes_failed\":%llu,"
+           "\"peak_connections\":%u,\"captured_peak_connections\":%u,\n",
+           (unsigned long long)Totals.HandshakesCompleted.Value(),
+           (unsigned long long)Totals.HandshakesFailed.Value(),
+           Totals.PeakActive.load(), CapturedPeak);
+    printf(" \"messages_sent\":%llu,\"bytes_sent\":%llu,"
+           "\"send_failures\":%llu,\"messages_per_s\":%.1f,"
+           "\"bytes_per_s\":%.1f,\"bytes_received\":%llu",
+           (unsigned long long)Totals.MessagesSent.Value(),
+           (unsigned long long)Totals.BytesSent.Value(),
+           (unsigned long long)Totals.SendFailures.Value(),
+           (double)Totals.MessagesSent.Value() / Seconds,
+           (double)Totals.BytesSent.Value() / Seconds,
+           (unsigned long long)Totals.BytesReceived.Value());
+    for (int i = 0; i < 2; ++i) {
+      printf(",\n \"%s_ms\":{\"count\":%llu,\"p50\":%.3f,\"p99\":%.3f,"
+             "\"p999\":%.3f}",
+             Names[i], (unsigned long long)Latencies[i]->Count(),
+             Milliseconds(Latencies[i]->Percentile(0.5)),
+             Milliseconds(Latencies[i]->Percentile(0.99)),
+             Milliseconds(Latencies[i]->Percentile(0.999)));
+    }
+    printf("}\n");
+    return;
+  }
+
+  if (Options.Speed == 0) {
+    printf("spoq_replay: %s to %s at max speed, %.1f s captured in %.1f s\n\n",
+           Options.Capture, Options.Target, CapturedSeconds, Seconds);
+  } else {
+    printf("spoq_replay: %s to %s at %gx, %.1f s captured in %.1f s\n\n",
+           Options.Capture, Options.Target, Options.Speed, CapturedSeconds,
+           Seconds);
+  }
+  printf("%-12s %10zu captured %10llu started %6u peak (%u captured)\n",
+         "connections", Connections,
+         (unsigned long long)Totals.ConnectionsStarted.Value(),
+         Totals.PeakActive.load(), CapturedPeak);
+  printf("%-12s %10llu ok %10llu failed\n", "handshakes",
+         (unsigned long long)Totals.HandshakesCompleted.Value(),
+         (unsigned long long)Totals.HandshakesFailed.Value());
+  printf("%-12s %10llu msgs %12.1f msg/s %12.3f MB/s %8llu failed\n", "sent",
+         (unsigned long long)Totals.MessagesSent.Value(),
+         (double)Totals.MessagesSent.Value() / Seconds,
+         (double)Totals.BytesSent.Value() / Seconds / 1e6,
+         (unsigned long long)Totals.SendFailures.Value());
+  printf("%-12s %10llu bytes\n\n", "received",
+         (unsigned long long)Totals.BytesReceived.Value());
+  printf("%-12s %10s %10s %10s %10s\n", "latency (ms)", "count", "p50", "p99",
+         "p999");
+  for (int i = 0; i < 2; ++i) {
+    printf("%-12s %10llu %10.3f %10.3f %10.3f\n", Names[i],
+           (unsigned long long)Latencies[i]->Count(),
+           Milliseconds(Latencies[i]->Percentile(0.5)),
+           Milliseconds(Latencies[i]->Percentile(0.99)),
+           Milliseconds(Latencies[i]->Percentile(0.999)));
+  }
+}
+
+// Helper function to load the client configuration shared by all sessions.
+BOOLEAN
+ReplayLoadConfiguration(_In_ int argc,
+                        _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  QUIC_SETTINGS Settings = {0};
+  Settings.IdleTimeoutMs = IdleTimeoutMs;
+  Settings.IsSet.IdleTimeoutMs = TRUE;
+  // Keep connections from idling out between captured messages
+  Settings.KeepAliveIntervalMs = KEEP_ALIVE_INTERVAL_MS;
+  Settings.IsSet.KeepAliveIntervalMs = TRUE;
+
+  QUIC_CREDENTIAL_CONFIG_HELPER Config;
+  memset(&Config, 0, sizeof(Config));
+  Config.CredConfig.Type = QUIC_CREDENTIAL_TYPE_NONE;
+  Config.CredConfig.Flags = QUIC_CREDENTIAL_FLAG_CLIENT;
+
+  const char* Cert;
+  const char* KeyFile;
+  const char* CaFile;
+  if ((Cert = GetValue(argc, argv, "cert_file")) != NULL &&
+      (KeyFile = GetValue(argc, argv, "key_file")) != NULL &&
+      (CaFile = GetValue(argc, argv, "ca_file")) != NULL) {
+    Config.CertFile.CertificateFile = (char*)Cert;
+    Config.CertFile.PrivateKeyFile = (char*)KeyFile;
+    Config.CredConfig.Type = QUIC_CREDENTIAL_TYPE_CERTIFICATE_FILE;
+    Config.CredConfig.CertificateFile = &Config.CertFile;
+    Config.CredConfig.CaCertificateFile = (char*)CaFile;
+    Config.CredConfig.Flags |=
+        QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED;
+    Config.CredConfig.Flags |= QUIC_CREDENTIAL_FLAG_SET_CA_CERTIFICATE_FILE;
+  } else {
+    SPOQ_LOG_ERROR("Must specify ['cert_file', 'key_file', and 'ca_file']!");
+    return FALSE;
+  }
+
+  QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+  if (QUIC_FAILED(Status = MsQuic->ConfigurationOpen(
+                      Registration, &Alpn, 1, &Settings, sizeof(Settings), NULL,
+                      &Configuration))) {
+    SPOQ_LOG_ERROR("ConfigurationOpen failed, {}!", SpoqLogHex(Status));
+    return FALSE;
+  }
+  if (QUIC_FAILED(Status = MsQuic->ConfigurationLoadCredential(
+                      Configuration, &Config.CredConfig))) {
+    SPOQ_LOG_ERROR("ConfigurationLoadCredential failed, {}!",
+                   SpoqLogHex(Status));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Reads the replay options. Returns false on an invalid value.
+bool ReplayParseOptions(_In_ int argc,
+                        _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  const char* Value;
+  Options.Capture = GetValue(argc, argv, "capture");
+  if ((Value = GetValue(argc, argv, "target")) != NULL) {
+    Options.Target = Value;
+  }
+  bool SpeedValid = true;
+  if ((Value = GetValue(argc, argv, "speed")) != NULL) {
+    if (strcmp(Value, "max") == 0) {
+      Options.Speed = 0;
+    } else {
+      Options.Speed = strtod(Value, NULL);
+      SpeedValid = Options.Speed > 0;
+    }
+  }
+  if ((Value = GetValue(argc, argv, "linger")) != NULL) {
+    Options.Linger = strtod(Value, NULL);
+  }
+  Options.Json = GetFlag(argc, argv, "json");
+
+  if (Options.Capture == nullptr || !SpeedValid || Options.Linger < 0) {
+    std::cout << "Invalid replay options, -capture is required and -speed "
+                 "is a positive factor or max!\n";
+    return false;
+  }
+  return true;
+}
+
+// Runs the replay
+void RunReplay(_In_ int argc,
+               _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  CAPTURE_READER Reader;
+  if (!ReplayParseOptions(argc, argv) || !Reader.Open(Options.Capture) ||
+      !ReplayLoadConfiguration(argc, argv)) {
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    return;
+  }
+
+  // Read the whole capture up front, so that the scheduler only sends.
+  // Bodies stay in the reader's mapping. The concurrency reached while
+  // capturing is worked out on the way, for comparison.
+  std::vector<CAPTURE_RECORD> Records;
+  CAPTURE_RECORD Record;
+  while (Reader.Read(&Record)) {
+    if (Record.Event == CAPTURE_EVENT::FROM_SERVER) {
+      continue;
+    }
+    if (Record.Stream > SPOQ_MAX_DATA_STREAMS) {
+      SPOQ_LOG_WARN("Skipped a message on stream {} of connection {}",
+                    Record.Stream, Record.Connection);
+      continue;
+    }
+    Records.push_back(Record);
+  }
+  if (Reader.IsTruncated()) {
+    SPOQ_LOG_WARN("{} ends in a partial record", Options.Capture);
+  }
+  std::unordered_map<uint64_t, REPLAY_SESSION*> ByConnection;
+  std::vector<std::unique_ptr<REPLAY_SESSION>> Sessions;
+  std::vector<REPLAY_STEP> Steps;
+  Steps.reserve(Records.size());
+  uint32_t Open = 0;
+  uint32_t CapturedPeak = 0;
+  for (const CAPTURE_RECORD& R : Records) {
+    REPLAY_SESSION*& Session = ByConnection[R.Connection];
+    if (Session == nullptr) {
+      Sessions.push_back(std::make_unique<REPLAY_SESSION>());
+      Session = Sessions.back().get();
+      CapturedPeak = std::max(CapturedPeak, ++Open);
+    }
+    if (R.Event == CAPTURE_EVENT::CLOSE) {
+      --Open;
+    }
+    Steps.push_back({&R, Session});
+  }
+  const uint64_t CapturedNs = Records.empty() ? 0 : Records.back().Time;
+  SPOQ_LOG_INFO("Replaying {} records of {} connections", Records.size(),
+                Sessions.size());
+
+  setSpoqState(state, SPOQ_STATE::SENDING);
+  const uint64_t StartNs = MetricNow();
+  ReplayRun(Steps, Sessions, StartNs);
+
+  // Give the last messages time to be acknowledged, then shut everything
+  // down; RegistrationClose waits for the connections
+  const uint64_t LingerEndNs = MetricNow() + (uint64_t)(Options.Linger * 1e9);
+  for (auto& Session : Sessions) {
+    while (Session->Started && !Session->Done.load() &&
+           MetricNow() < LingerEndNs) {
+      std::this_thread::sleep_for(REPLAY_TICK);
+    }
+    ReplayShutdown(Session.get());
+  }
+  const double Seconds = (double)(MetricNow() - StartNs) / 1e9;
+  for (auto& Session : Sessions) {
+    if (Session->Connection != nullptr) {
+      MsQuic->ConnectionClose(Session->Connection);
+    }
+  }
+  MsQuic->ConfigurationClose(Configuration);
+  Configuration = NULL;
+  MsQuic->RegistrationClose(Registration);
+  Registration = NULL;
+  SpoqLogFlush();
+
+  ReplayReport(Sessions.size(), CapturedPeak, CapturedNs, Seconds);
+}
+
+int QUIC_MAIN_EXPORT main(_In_ int argc,
+                          _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  // Per-event logging would distort the timing, so only warnings by default
+  SpoqLogSetLevel("warn");
+  const char* LogLevel;
+  if ((LogLevel = GetValue(argc, argv, "log_level")) != NULL &&
+      !SpoqLogSetLevel(LogLevel)) {
+    std::cout << "Unknown log level '" << LogLevel << "'!\n";
+    return -1;
+  }
+  setSpoqState(state, SPOQ_STATE::INIT);
+  QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+
+  auto shutdown = [&]() {
+    if (MsQuic != NULL) {
+      if (Configuration != NULL) {
+        MsQuic->ConfigurationClose(Configuration);
+      }
+      if (Registration != NULL) {
+        MsQuic->RegistrationClose(Registration);
+      }
+      MsQuicClose(MsQuic);
+      setSpoqState(state, SPOQ_STATE::CLOSED);
+    }
+  };
+
+  // Open a handle to the library and get the API function table.
+  if (QUIC_FAILED(Status = MsQuicOpen2(&MsQuic))) {
+    SPOQ_LOG_ERROR("MsQuicOpen2 failed, {}!", SpoqLogHex(Status));
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return (int)Status;
+  }
+
+  const char* Profile;
+  if ((Profile = GetValue(argc, argv, "execution_profile")) != NULL &&
+      !ParseExecutionProfile(Profile, &RegConfig.ExecutionProfile)) {
+    SPOQ_LOG_ERROR("Unknown execution profile '{}'!", Profile);
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return -1;
+  }
+
+  // Create a registration for the replay's connections.
+  if (QUIC_FAILED(Status =
+                      MsQuic->RegistrationOpen(&RegConfig, &Registration))) {
+    SPOQ_LOG_ERROR("RegistrationOpen failed, {}!", SpoqLogHex(Status));
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return (int)Status;
+  }
+
+  if (argc == 1 || GetFlag(argc, argv, "help") || GetFlag(argc, argv, "?")) {
+    PrintUsage();
+  } else {
+    RunReplay(argc, argv);
+  }
+
+  shutdown();
+  return (int)Status;
+}
@@ -15,19 +15,38 @@ README.MD at the top level for build and run instructions.
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <iostream>
+#include <new>
 #include <string>
+#include <string_view>
 
+#include "admission.h"
+#include "autotune.h"
+#include "binary_framer.h"
+#include "capture.h"
+#include "fanout.h"
+#include "ingest_queue.h"
 #include "msquic.h"
+#include "ndjson_framer.h"
+#include "numa_placement.h"
 #include "quic_config.h"
+#include "send_message.h"
+#include "send_pool.h"
+#include "series_store.h"
 #include "spoq.h"
+#include "spoq_datagram.h"
+#include "spoq_metrics.h"
+#include "spoq_pdu.h"
+#include "spoq_session.h"
 #include "utils.h"
 
 // The (optional) registration configuration for the app. This sets a name for
 // the app (used for persistent storage and for debugging). It also configures
-// the execution profile, using the default "low latency" profile.
-const QUIC_REGISTRATION_CONFIG RegConfig = {"spoq_server",
-                                            QUIC_EXECUTION_PROFILE_LOW_LATENCY};
+// the execution profile, "low latency" unless -execution_profile picks
+// another.
+QUIC_REGISTRATION_CONFIG RegConfig = {"spoq_server",
+                                      QUIC_EXECUTION_PROFILE_LOW_LATENCY};
 
 // The protocol name used in the Application Layer Protocol Negotiation (ALPN).
 const QUIC_BUFFER Alpn = {sizeof("sample") - 1, (uint8_t*)"sample"};
@@ -42,161 +61,838 @@ HQUIC Registration;
 // QUIC layer settings.
 HQUIC Configuration;
 
-// The server SPOQ state
+// The server lifecycle state. Protocol state is tracked per connection in
+// SPOQ_SESSION.
 SPOQ_STATE state = SPOQ_STATE::UNKNOWN;
 
-uint32_t MessageCount = 0;
+// All sessions currently attached to a connection
+SPOQ_SESSION_TABLE Sessions;
+
 constexpr uint32_t MAX_MESSAGE_COUNT = 100;
 
+// Largest NDJSON line written by ServerSend
+constexpr uint32_t MAX_MESSAGE_LENGTH = 160;
+
+// Readings in each batch PDU ServerSend writes in a columnar session
+constexpr uint32_t COLUMNAR_SEND_READINGS = 64;
+
+// The sensor id the server reports in the PDUs it sends
+constexpr uint64_t SERVER_SENSOR_ID = 1;
+
+// Batching mode applied to each new data stream, set with -send_mode
+SPOQ_SEND_MODE SendMode = SPOQ_SEND_MODE::THROUGHPUT;
+
+// Highest wire version offered to clients, set with -encoding
+uint32_t MaxWireVersion = SPOQ_VERSION_COLUMNAR;
+
+// Offer the unreliable datagram data path, set with -datagram
+bool DatagramsEnabled = false;
+
+// Data streams a client may open beside its control stream, set with
+// -max_streams
+uint32_t MaxDataStreams = 4;
+
+// Ingest workers that process the readings producing clients send, set
+// with -ingest_workers. With none they are processed in the stream callback.
+uint32_t IngestWorkers = 2;
+INGEST_POOL Ingest;
+
+// Persists ingested readings when -store names a directory
+SERIES_STORE Store;
+
+// Forwards ingested readings to the sessions subscribed to their sensor
+FANOUT_BROKER Broker;
+
+// Records received messages for spoq_replay when -capture names a file
+CAPTURE_WRITER Capture;
+
+// Admission control of client certificate identities and of sensors, set
+// with -max_connections and -handshake_rate, and for sensors also
+// -sensor_message_rate and -sensor_byte_rate
+ADMISSION_TABLE Identities;
+ADMISSION_TABLE Sensors;
+
+// Close a connection over its sensor's rate rather than pause its stream,
+// set with -rate_action:reject
+bool RateReject = false;
+
+// Resumes the streams paused over their sensor's rate
+RECEIVE_RESUMER Resumer;
+
+// Spreads connections over the ingest queues of their node until msquic
+// reports their partition
+std::atomic<uint32_t> NextPartition{0};
+
+// Initial transport settings and autotuning bounds, loaded from -tuning
+TUNING_PROFILE Tuning;
+
+// Serves -metrics_socket and writes -metrics_file
+METRICS_EXPORTER Exporter;
+
 void PrintUsage() {
   std::cout << "\n"
                "spoq_server runs a simple SPOQ server.\n"
                "\n"
                "Usage:\n"
                "\n"
-               " spoq_server -cert_file:<...> -key_file:<...> -ca_file:<...>\n";
+               " spoq_server -cert_file:<...> -key_file:<...> -ca_file:<...>\n"
+               "             [-send_mode:{latency|throughput}]\n"
+               "             [-encoding:{ndjson|binary|columnar}] (columnar)\n"
+               "             [-datagram]\n"
+               "             [-max_streams:<0-16>] [-ingest_workers:<n>] (2)\n"
+               "             [-store:<dir> [-segment_mb:<n>] (64)\n"
+               "                           [-segment_age:<s>] (3600)]\n"
+               "             [-capture:<path>]\n"
+               "             [-max_connections:<n>] [-handshake_rate:<per s>]\n"
+               "             [-sensor_message_rate:<per s>]\n"
+               "             [-sensor_byte_rate:<per s>]\n"
+               "             [-rate_action:{delay|reject}] (delay)\n"
+               "             [-execution_profile:{low_latency|max_throughput|\n"
+               "                                  scavenger}] (low_latency)\n"
+               "             [-tuning:<path>]\n"
+               "             [-metrics_socket:<path>] [-metrics_file:<path>]\n"
+               "             [-log_level:{trace|debug|info|warn|error|none}]\n";
 }
 
-// Allocates and sends some NDJSON data over a QUIC stream.
-void ServerSend(_In_ HQUIC Stream) {
-  setSpoqState(state, SPOQ_STATE::SENDING);
-  while (MessageCount < MAX_MESSAGE_COUNT) {
-    // Variable-size JSON: simulate size variation with random padding
-    const int padding = rand() % 20;  // random 0–19 extra spaces
-
-    // Allocate buffer: QUIC_BUFFER + payload
-    void* SendBufferRaw = malloc(sizeof(QUIC_BUFFER) + 64);
-    if (SendBufferRaw == NULL) {
-      std::cout << "SendBuffer allocation failed for message" << MessageCount
-                << "!\n";
+// Generates and sends some NDJSON data over a QUIC stream. Messages are
+// written directly into pooled send buffers and coalesced by the session's
+// batcher according to its send mode. Each reading carries its steady clock
+// send time so a peer on the same host can measure end-to-end latency.
+//
+// Bytes queued on the stream are bounded by its send window. Once it is
+// full the pending batch is flushed and sending pauses; the stream callback
+// calls ServerSend again when SEND_COMPLETE or a larger ideal send buffer
+// size makes room, so a slow reader never makes the server queue more than
+// the window.
+//
+// Each data stream carries the readings of its own sensor channel. A
+// columnar session sends them COLUMNAR_SEND_READINGS to a batch PDU.
+void ServerSend(_In_ SPOQ_STREAM* Channel) {
+  SPOQ_SESSION* Session = Channel->Session;
+  HQUIC Stream = Channel->Stream;
+  SEND_BATCHER& Batcher = Channel->Batcher;
+  const uint64_t SensorId = SERVER_SENSOR_ID + Channel->Index;
+  // Readings go out as datagrams when agreed and msquic allows sending them;
+  // the stream then only carries the closing FIN.
+  const bool UseDatagrams =
+      Session->DatagramsAgreed && Session->DatagramMaxLength != 0;
+  if (Session->State != SPOQ_STATE::SENDING) {
+    setSpoqState(Session->State, SPOQ_STATE::SENDING);
+  }
+  Channel->SendPaused = false;
+  while (Channel->MessageCount < MAX_MESSAGE_COUNT) {
+    if (!Channel->Window.HasRoom()) {
+      QUIC_STATUS Status = Batcher.Flush(Stream, QUIC_SEND_FLAG_NONE, false);
+      if (QUIC_FAILED(Status)) {
+        SPOQ_LOG_ERROR("[{}] StreamSend failed at message {}, {}!", Stream,
+                       Channel->MessageCount, Status);
+        setSpoqState(Session->State, SPOQ_STATE::ERROR);
+        MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+        return;
+      }
+      SPOQ_LOG_DEBUG("[{}] Send window full at message {} ({} of {} bytes "
+                     "queued), pausing", Stream, Channel->MessageCount,
+                     Channel->Window.OutstandingBytes(),
+                     Channel->Window.IdealBytes());
+      Channel->SendPaused = true;
+      Channel->Window.Paused();
+      SpoqMetrics().SendPauses.Add();
+      return;
+    }
+
+    // Variable-size readings: simulate size variation with random padding
+    const int padding = rand() % 20;  // random 0–19 extra characters
+    const std::string_view Pad("xxxxxxxxxxxxxxxxxxx", padding);
+
+    if (UseDatagrams) {
+      uint8_t Data[SPOQ_READING_FIELDS_LENGTH];
+      SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+      SpoqReadingFields(Fields, Channel->MessageCount, Pad, MetricNow());
+      QUIC_STATUS Status = SpoqDatagramSend(
+          Session->Connection,
+          {SensorId, SPOQ_VERSION_BINARY, SPOQ_STATUS_SUCCESS},
+          Fields.Data(), Session->DatagramMaxLength);
+      if (Status != QUIC_STATUS_BUFFER_TOO_SMALL) {
+        // A reading that cannot be sent now is stale later, so it is
+        // dropped rather than retried
+        if (QUIC_FAILED(Status)) {
+          ++Session->DatagramsLost;
+          SpoqMetrics().DatagramsLost.Add();
+        } else {
+          ++Session->DatagramsSent;
+          SpoqMetrics().DatagramsSent.Add();
+          SpoqMetrics().MessagesSent.Add();
+          Session->Metrics.MessagesSent.Add();
+        }
+        ++Channel->MessageCount;
+        continue;
+      }
+      // Too large for a datagram, so send this reading on the stream
+    }
+
+    // A columnar session gathers readings until its batch is full or the
+    // last reading is in, and only then encodes a PDU
+    uint32_t MessageLength = MAX_MESSAGE_LENGTH;
+    std::string_view Batch;
+    if (Session->Version == SPOQ_VERSION_COLUMNAR) {
+      uint8_t Data[SPOQ_READING_FIELDS_LENGTH];
+      SPOQ_FIELD_WRITER Fields(Data, sizeof(Data));
+      SpoqReadingFields(Fields, Channel->MessageCount, Pad, MetricNow());
+      Channel->Columns.Add(Fields.Data());
+      if (Channel->Columns.Count() < COLUMNAR_SEND_READINGS &&
+          Channel->MessageCount < MAX_MESSAGE_COUNT - 1) {
+        SpoqMetrics().MessagesSent.Add();
+        Session->Metrics.MessagesSent.Add();
+        ++Channel->MessageCount;
+        continue;
+      }
+      Batch = Channel->Columns.Encode();
+      MessageLength = (uint32_t)(Batch.size() + 4 * SPOQ_VARINT_MAX_LENGTH);
+    }
+
+    // Reserve room for the message in the pending batch
+    uint8_t* Message = nullptr;
+    QUIC_STATUS Status = Batcher.Reserve(Stream, MessageLength, &Message);
+    if (QUIC_FAILED(Status)) {
+      SPOQ_LOG_ERROR("[{}] Send buffer unavailable for message {}, {}!", Stream,
+                     Channel->MessageCount, Status);
+      setSpoqState(Session->State, SPOQ_STATE::ERROR);
       MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
       return;
     }
 
-    QUIC_BUFFER* SendBuffer = (QUIC_BUFFER*)SendBufferRaw;
-    SendBuffer->Buffer = (uint8_t*)SendBufferRaw + sizeof(QUIC_BUFFER);
+    // Encode the PDU straight into the batch buffer in the negotiated format
+    SPOQ_HEADER_VIEW Header = {SensorId, Session->Version,
+                               SPOQ_STATUS_SUCCESS};
+    size_t len = 0;
+    if (Session->Version == SPOQ_VERSION_COLUMNAR) {
+      len = SpoqEncodeBinary(Header, Batch, Message, MessageLength);
+      Channel->Columns.Clear();
+    } else {
+      len = SpoqEncodeReading(Header, Channel->MessageCount, Pad, MetricNow(),
+                              Message, MAX_MESSAGE_LENGTH);
+    }
 
-    // Write variable length NDJSON message to the buffer
-    int len = snprintf((char*)SendBuffer->Buffer, 64, "{\"msg\": %u}%*s\n",
-                       MessageCount, padding, "x");
-    SendBuffer->Length = (uint32_t)len;
+    // Queue the message, but only set QUIC_SEND_FLAG_FIN on the last one.
+    // The batcher sends whenever a batch fills up, and always on FIN.
+    QUIC_SEND_FLAGS flags =
+        (!UseDatagrams && Channel->MessageCount == MAX_MESSAGE_COUNT - 1)
+            ? QUIC_SEND_FLAG_FIN
+            : QUIC_SEND_FLAG_NONE;
 
-    // Send the message, but only set QUIC_SEND_FLAG_FIN on the last one
-    QUIC_SEND_FLAGS flags = (MessageCount == MessageCount - 1)
-                                ? QUIC_SEND_FLAG_FIN
-                                : QUIC_SEND_FLAG_NONE;
+    // Note batch buffers are returned to their pool in the SEND_COMPLETE case.
+    // A message that fills the window is flushed at once, since sending
+    // pauses after it.
+    Channel->Window.Sent(len);
+    if (QUIC_FAILED(Status = Batcher.Commit(Stream, (uint32_t)len, flags,
+                                            !Channel->Window.HasRoom()))) {
+      SPOQ_LOG_ERROR("[{}] StreamSend failed at message {}, {}!", Stream,
+                     Channel->MessageCount, Status);
+      setSpoqState(Session->State, SPOQ_STATE::ERROR);
+      MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+      return;
+    }
 
-    QUIC_STATUS Status =
-        MsQuic->StreamSend(Stream, SendBuffer, 1, flags, SendBufferRaw);
-    // Note SendBufferRaw is freed in QUIC_STREAM_EVENT_SEND_COMPLETE case
+    SpoqMetrics().MessagesSent.Add();
+    SpoqMetrics().BytesSent.Add(len);
+    Session->Metrics.MessagesSent.Add();
+    Session->Metrics.BytesSent.Add(len);
+    ++Channel->MessageCount;
+  }
 
+  if (UseDatagrams) {
+    QUIC_STATUS Status = Batcher.Flush(Stream, QUIC_SEND_FLAG_FIN);
     if (QUIC_FAILED(Status)) {
-      std::cout << "[" << Stream << "] StreamSend failed at message "
-                << MessageCount << ", " << Status << "!\n ";
-      free(SendBufferRaw);
-      setSpoqState(state, SPOQ_STATE::ERROR);
+      SPOQ_LOG_ERROR("[{}] StreamSend failed to finish stream, {}!", Stream,
+                     Status);
+      setSpoqState(Session->State, SPOQ_STATE::ERROR);
       MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
       return;
     }
-
-    ++MessageCount;
+    SPOQ_LOG_INFO("[{}] Queued {} readings as datagrams, {} dropped so far",
+                  Stream, Session->DatagramsSent, Session->DatagramsLost);
   }
+
+  SPOQ_LOG_INFO("[{}] Sent {} messages in {} StreamSend calls ({} mode, wire "
+                "version {}, paused {} times)", Stream, Batcher.MessageCount(),
+                Batcher.SendCount(), ToString(Batcher.GetMode()),
+                Session->Version, Channel->Window.WaitCount());
 }
 
-// Send the handshake to the client
-void SendNegotiate(_In_ HQUIC Stream) {
-  // Allocate buffer: QUIC_BUFFER + payload
-  void* SendBufferRaw = malloc(sizeof(QUIC_BUFFER) + 64);
-  if (SendBufferRaw == NULL) {
-    std::cout << "SendBuffer allocation failed for client negotiation!\n";
+// Sends one NEGOTIATE message on the session's control stream, failing the
+// session if it cannot be sent
+bool SendNegotiation(_In_ SPOQ_SESSION* Session,
+                     _In_ const SPOQ_HEADER_VIEW& Header,
+                     _In_ std::string_view Data) {
+  HQUIC Stream = Session->Control.Stream;
+  // Take a pooled buffer: QUIC_BUFFER header + payload
+  SEND_BUFFER* PoolBuffer = SpoqNegotiationBuffer(Header, Data);
+  if (PoolBuffer == NULL) {
+    SPOQ_LOG_ERROR("SendBuffer allocation failed for client negotiation!");
     MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
-    return;
+    return false;
   }
 
-  QUIC_BUFFER* SendBuffer = (QUIC_BUFFER*)SendBufferRaw;
-  SendBuffer->Buffer = (uint8_t*)SendBufferRaw + sizeof(QUIC_BUFFER);
-
-  // Write a sample version negotitation message
-  std::string neg_msg =
-      "{\"header\":{\"sensor_id\":\"1\",\"version\":\"1\",\"status\":\"1\"}}";
-  int len = snprintf((char*)SendBuffer->Buffer, 64, "%s\n", neg_msg.c_str());
-  SendBuffer->Length = (uint32_t)len;
+  QUIC_BUFFER* SendBuffer = &PoolBuffer->Buffer;
 
   QUIC_SEND_FLAGS flags = QUIC_SEND_FLAG_START;
 
+  PoolBuffer->SendTime = MetricNow();
+  Session->Control.Window.Sent(SendBuffer->Length);
   QUIC_STATUS Status =
-      MsQuic->StreamSend(Stream, SendBuffer, 1, flags, SendBufferRaw);
-  // Note SendBufferRaw is freed in QUIC_STREAM_EVENT_SEND_COMPLETE case
+      MsQuic->StreamSend(Stream, SendBuffer, 1, flags, PoolBuffer);
+  // Note PoolBuffer is returned to its pool in the SEND_COMPLETE case
 
   if (QUIC_FAILED(Status)) {
-    std::cout << "[" << Stream
-              << "] StreamSend failed to send negotation message - " << Status
-              << "!\n ";
-    free(SendBufferRaw);
-    setSpoqState(state, SPOQ_STATE::ERROR);
+    SPOQ_LOG_ERROR("[{}] StreamSend failed to send negotation message - {}!",
+                   Stream, Status);
+    Session->Control.Window.Completed(SendBuffer->Length);
+    SendBufferFree(PoolBuffer);
+    setSpoqState(Session->State, SPOQ_STATE::ERROR);
     MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+    return false;
+  }
+  return true;
+}
+
+// Send the handshake to the client
+void SendNegotiate(_In_ SPOQ_SESSION* Session) {
+  // Offer NDJSON as the base version, and list any others this server
+  // speaks so that the client can pick one. The datagram path is offered
+  // when enabled here and msquic reports the peer can receive datagrams,
+  // and data streams up to -max_streams.
+  SPOQ_HEADER_VIEW Header = {SERVER_SENSOR_ID, SPOQ_VERSION_NDJSON,
+                             SPOQ_STATUS_FAILURE};
+  const bool Datagram = DatagramsEnabled && Session->DatagramMaxLength != 0;
+  char Offer[SPOQ_OFFER_DATA_LENGTH];
+  SendNegotiation(Session, Header,
+                  SpoqOfferData(Offer, MaxWireVersion, Datagram,
+                                MaxDataStreams));
+}
+
+// Returns true once negotiation has succeeded
+bool ServerEstablished(_In_ const SPOQ_SESSION* Session) {
+  return Session->State == SPOQ_STATE::ESTABLISHED ||
+         Session->State == SPOQ_STATE::SENDING;
+}
+
+// Closes the session's connection with application error Error. Before the
+// handshake completes the error could not reach the client, so it is kept
+// until then, and nothing the client sends meanwhile is processed.
+void ServerRefuse(_In_ SPOQ_SESSION* Session, uint64_t Error) {
+  setSpoqState(Session->State, SPOQ_STATE::ERROR);
+  if (Session->Connected) {
+    MsQuic->ConnectionShutdown(Session->Connection,
+                               QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, Error);
+  } else {
+    Session->Refusal = Error;
+  }
+}
+
+// Counts the session's connection against the limits of Key, an identity
+// or a sensor, in Table. Returns true if it was admitted, holding *Entry,
+// or refuses the connection.
+bool ServerAdmit(_In_ SPOQ_SESSION* Session, ADMISSION_TABLE& Table,
+                 uint64_t Key, _Out_ ADMISSION_ENTRY** Entry,
+                 const char* What) {
+  if (!Table.Limited()) {
+    return true;
+  }
+  ADMISSION_RESULT Result = Table.Admit(Key, MetricNow(), Entry);
+  if (Result == ADMISSION_RESULT::ADMITTED) {
+    return true;
+  }
+  SPOQ_LOG_WARN("[{}] Admission event: {} {} refused, {}", Session->Connection,
+                What, SpoqLogHex(Key), ToString(Result));
+  SpoqMetrics().ConnectionsRefused.Add();
+  ServerRefuse(Session, Result == ADMISSION_RESULT::TOO_MANY_HANDSHAKES
+                            ? SPOQ_ERROR_TOO_MANY_HANDSHAKES
+                            : SPOQ_ERROR_TOO_MANY_CONNECTIONS);
+  return false;
+}
+
+// Starts sending on a data stream of an established session, or refuses it
+// if the client opened more than were agreed
+void ServerStartDataStream(_In_ SPOQ_STREAM* Channel) {
+  if (Channel->Index > Channel->Session->DataStreamCount) {
+    SPOQ_LOG_WARN("[{}] Stream event: Data stream {} was not negotiated",
+                  Channel->Stream, Channel->Index);
+    MsQuic->StreamShutdown(Channel->Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT,
+                           0);
+    return;
+  }
+  Channel->Window.Open();
+  ServerSend(Channel);
+}
+
+// Completes negotiation with the client's choices and starts sending data,
+// on the control stream or on every data stream the client has opened so
+// far. A subscriber is sent the readings of the sensors it subscribed to
+// on its control stream instead.
+void ServerEstablish(_In_ SPOQ_SESSION* Session, uint64_t SensorId,
+                     uint32_t Version, bool Datagram, uint32_t Streams) {
+  HQUIC Stream = Session->Control.Stream;
+  SpoqMetrics().NegotiationsSucceeded.Add();
+  Session->SensorId = SensorId;
+  Session->Metrics.SensorId.Set(SensorId);
+  Session->Version = Version;
+  Session->DatagramsAgreed =
+      DatagramsEnabled && Datagram && Session->SubscriptionCount == 0;
+  if (Session->DatagramsAgreed) {
+    SPOQ_LOG_INFO("[{}] Negotiation event: readings will be sent as "
+                  "datagrams", Stream);
+  }
+  // Datagram readings share one sequence, so they are never split across
+  // data streams, and a subscriber's readings all go on its control stream
+  if (Session->DatagramsAgreed || Session->SubscriptionCount != 0) {
+    Streams = 0;
+  }
+  Session->DataStreamCount = Streams;
+  if (Streams != 0) {
+    SPOQ_LOG_INFO("[{}] Negotiation event: readings will be sent on {} data "
+                  "streams", Stream, Streams);
+  }
+  setSpoqState(Session->State, SPOQ_STATE::ESTABLISHED);
+  Session->Control.Window.Open();
+  if (Session->SubscriptionCount != 0) {
+    SPOQ_LOG_INFO("[{}] Negotiation event: subscribed to {} sensor(s)",
+                  Stream, Session->SubscriptionCount);
+    Broker.Subscribe(&Session->Control,
+                     {Session->Subscriptions, Session->SubscriptionCount});
+    return;
+  }
+  if (Streams == 0) {
+    ServerSend(&Session->Control);
+    return;
+  }
+  for (auto& Channel : Session->Data) {
+    if (Channel != nullptr && Channel->Stream != nullptr) {
+      ServerStartDataStream(Channel.get());
+    }
+  }
+}
+
+// Returns true if a negotiation message asks for the datagram path
+bool WantsDatagrams(_In_ const SPOQ_PDU_VIEW& Pdu) {
+  std::string_view Datagram;
+  return !Pdu.Data.empty() &&
+         JsonObjectFind(Pdu.Data, "datagram", &Datagram) && Datagram == "true";
+}
+
+// Answers a client's optimistic hello. When it lists a version this server
+// speaks, the answer carries the pick and data follows straight away, a
+// round trip sooner than through the offer. Otherwise the client is told to
+// fall back to the offer it has already been sent.
+void ServerAnswerHello(_In_ SPOQ_SESSION* Session,
+                       _In_ const SPOQ_PDU_VIEW& Hello) {
+  HQUIC Stream = Session->Control.Stream;
+  uint32_t Version = 0;
+  if (MaxWireVersion >= SPOQ_VERSION_COLUMNAR &&
+      SpoqOfferIncludes(Hello, SPOQ_VERSION_COLUMNAR)) {
+    Version = SPOQ_VERSION_COLUMNAR;
+  } else if (MaxWireVersion >= SPOQ_VERSION_BINARY &&
+             SpoqOfferIncludes(Hello, SPOQ_VERSION_BINARY)) {
+    Version = SPOQ_VERSION_BINARY;
+  } else if (SpoqOfferIncludes(Hello, SPOQ_VERSION_NDJSON)) {
+    Version = SPOQ_VERSION_NDJSON;
+  }
+  if (Version == 0) {
+    SPOQ_LOG_INFO("[{}] Negotiation event: no common version in hello, "
+                  "falling back to the offer", Stream);
+    SendNegotiation(Session,
+                    {SERVER_SENSOR_ID, SPOQ_VERSION_NDJSON,
+                     SPOQ_STATUS_FALLBACK},
+                    {});
+    return;
+  }
+  if (!ServerAdmit(Session, Sensors, Hello.Header.SensorId,
+                   &Session->SensorEntry, "sensor")) {
+    return;
+  }
+
+  // As with the offer, only agree to datagrams the peer can receive. A
+  // subscriber is sent readings on its control stream alone.
+  Session->SubscriptionCount =
+      SpoqSubscriptions(Hello, Session->Subscriptions);
+  const bool Subscriber = Session->SubscriptionCount != 0;
+  const bool Datagram = DatagramsEnabled && !Subscriber &&
+                        Session->DatagramMaxLength != 0 &&
+                        WantsDatagrams(Hello);
+  // Datagram readings share one sequence, so they need no data streams
+  const uint32_t Streams =
+      Datagram || Subscriber
+          ? 0
+          : std::min(SpoqDataStreams(Hello), MaxDataStreams);
+  char Answer[SPOQ_OFFER_DATA_LENGTH];
+  if (!SendNegotiation(
+          Session, {SERVER_SENSOR_ID, Version, SPOQ_STATUS_SUCCESS},
+          SpoqOfferData(Answer, SPOQ_VERSION_NDJSON, Datagram, Streams))) {
+    return;
+  }
+  SPOQ_LOG_INFO("[{}] Negotiation event: SUCCESS from hello, wire version "
+                "{}!", Stream, Version);
+  ServerEstablish(Session, Hello.Header.SensorId, Version, Datagram, Streams);
+}
+
+// Samples the session's transport statistics, at most once a sample
+// interval unless Force is set, and retunes its flow control window from them
+void ServerSample(_In_ SPOQ_SESSION* Session, bool Force = false) {
+  QUIC_STATISTICS_V2 Stats;
+  if (Session->Metrics.Sample(Session->Connection, Force, &Stats) &&
+      Tuning.Adaptive) {
+    Session->Tuner.Update(Session->Connection, Tuning, Stats, MetricNow(),
+                          Session->Metrics);
+  }
+}
+
+// Ingests one reading a producing client sent upstream, in the negotiated
+// wire version. The view points into a receive or ingest buffer, so the
+// reading is copied into the session's owning SPOQ_PDU. A reading must be
+// of the sensor the session negotiated as, the one admission control
+// counted, so that no client can feed another sensor's subscribers. Returns
+// false if the reading was dropped.
+bool ServerIngest(_In_ SPOQ_SESSION* Session, _In_ HQUIC Stream,
+                  SPOQ_DECODE_STATUS Decode, _In_ const SPOQ_PDU_VIEW& Pdu) {
+  if (Decode == SPOQ_DECODE_STATUS::SUCCESS &&
+      Pdu.Header.Version != Session->Version) {
+    Decode = SPOQ_DECODE_STATUS::RANGE;
+  }
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    SPOQ_LOG_ERROR("[{}] Stream event: Dropped malformed reading ({})", Stream,
+                   ToString(Decode));
+    SpoqMetrics().MessagesDropped.Add();
+    return false;
+  }
+  if (Pdu.Header.SensorId != Session->SensorId) {
+    SPOQ_LOG_WARN("[{}] Stream event: Dropped a reading of sensor {} sent "
+                  "by sensor {}", Stream, Pdu.Header.SensorId,
+                  Session->SensorId);
+    SpoqMetrics().MessagesDropped.Add();
+    return false;
+  }
+  SpoqPduCopy(Pdu, &Session->LastReading);
+  SpoqMetrics().ReadingsIngested.Add();
+  SPOQ_LOG_DEBUG("[{}] Ingested reading from sensor {} ({} data bytes)",
+                 Stream, Pdu.Header.SensorId, Pdu.Data.size());
+  return true;
+}
+
+// Ingests each reading of a columnar batch PDU as if it had arrived on its
+// own. Returns the number ingested.
+uint32_t ServerIngestBatch(_In_ SPOQ_SESSION* Session, _In_ HQUIC Stream,
+                           _In_ const SPOQ_PDU_VIEW& Pdu) {
+  // Ingest workers and stream callbacks each decode into their own batch
+  thread_local COLUMNAR_BATCH Columns;
+  if (!Columns.Decode(Pdu.Data)) {
+    ServerIngest(Session, Stream, SPOQ_DECODE_STATUS::SYNTAX, Pdu);
+    return 0;
+  }
+  uint32_t Ingested = 0;
+  for (uint32_t i = 0; i < Columns.Count(); ++i) {
+    Ingested += ServerIngest(Session, Stream, SPOQ_DECODE_STATUS::SUCCESS,
+                             {Pdu.Header, Columns.Reading(i)});
+  }
+  return Ingested;
+}
+
+// Decodes one reading, or a batch of them, encoded in Version and ingests
+// it, forwards its wire bytes to the subscribers of its sensor, then
+// persists them in the store if there is one
+void ServerIngestReading(_In_ SPOQ_SESSION* Session, _In_ HQUIC Stream,
+                         uint32_t Version, _In_ std::string_view Reading) {
+  SPOQ_PDU_VIEW Pdu;
+  SPOQ_DECODE_STATUS Decode = Version >= SPOQ_VERSION_BINARY
+                                  ? SpoqDecodeBinary(Reading, &Pdu)
+                                  : SpoqDecodeNdjson(Reading, &Pdu);
+  uint32_t Ingested;
+  if (Decode == SPOQ_DECODE_STATUS::SUCCESS &&
+      Version == SPOQ_VERSION_COLUMNAR &&
+      Pdu.Header.Version == SPOQ_VERSION_COLUMNAR) {
+    Ingested = ServerIngestBatch(Session, Stream, Pdu);
+  } else {
+    Ingested = ServerIngest(Session, Stream, Decode, Pdu) ? 1 : 0;
+  }
+  if (Ingested == 0) {
+    return;
+  }
+  Broker.Publish(Session->SensorId, Version, Reading);
+  if (!Store.IsOpen()) {
+    return;
+  }
+  if (Store.Append(Session->SensorId, Version, Reading)) {
+    SpoqMetrics().ReadingsStored.Add(Ingested);
+  } else {
+    SPOQ_LOG_WARN("[{}] Reading from sensor {} not stored", Stream,
+                  Session->SensorId);
+  }
+}
+
+// Processes one queued reading on an ingest worker, then lets go of its
+// session
+void ServerIngestItem(_In_ INGEST_ITEM* Item) {
+  auto Session = static_cast<SPOQ_SESSION*>(Item->Context);
+  ServerIngestReading(Session, Item->Stream, Item->Version, Item->Data());
+  IngestItemFree(Item);
+  SpoqSessionRelease(Session);
+}
+
+// Hands one reading received on Channel to the ingest worker of its
+// session's partition, so the stream callback can return to msquic at once.
+// Without workers the reading is ingested here.
+void ServerQueueReading(_In_ SPOQ_STREAM* Channel, uint32_t Version,
+                        _In_ std::string_view Reading) {
+  SPOQ_SESSION* Session = Channel->Session;
+  if (Session->State == SPOQ_STATE::ERROR) {
+    return;
+  }
+  if (!Ingest.Running()) {
+    ServerIngestReading(Session, Channel->Stream, Version, Reading);
+    return;
+  }
+  INGEST_ITEM* Item = IngestItemAlloc(Reading);
+  if (Item == nullptr) {
+    SPOQ_LOG_ERROR("[{}] Ingest buffer unavailable, dropped a reading",
+                   Channel->Stream);
+    SpoqMetrics().MessagesDropped.Add();
+    return;
+  }
+  Item->Context = Session;
+  Item->Stream = Channel->Stream;
+  Item->Version = Version;
+  // Readings still queued hold references. Once none is left the session
+  // can switch queues without overtaking them.
+  if (Session->Queue != Session->NextQueue &&
+      Session->References.load(std::memory_order_acquire) == 1) {
+    Session->Queue = Session->NextQueue;
+  }
+  Session->References.fetch_add(1, std::memory_order_relaxed);
+  Ingest.Push(Session->Queue, Item);
+}
+
+// Follows msquic's move of the connection to another partition. The session
+// and its data streams migrate to the NUMA node of the new ideal processor,
+// and its readings go to an ingest worker on that node from the next one
+// queued once the readings queued before have been processed. Heap buffers
+// the streams hold, such as framer carries and columnar batches, stay where
+// they were allocated.
+void ServerPlaceSession(_In_ SPOQ_SESSION* Session, uint16_t Processor,
+                        uint16_t Partition) {
+  const int Node = NumaNodeOfProcessor(Processor);
+  if (Node != Session->Node &&
+      NumaMove(Session, sizeof(SPOQ_SESSION), Node)) {
+    for (const auto& Channel : Session->Data) {
+      if (Channel != nullptr) {
+        NumaMove(Channel.get(), sizeof(SPOQ_STREAM), Node);
+      }
+    }
+    SPOQ_LOG_DEBUG("[{}] Session moved from NUMA node {} to {}",
+                   Session->Connection, Session->Node, Node);
+    Session->Node = Node;
+  }
+  Session->NextQueue = Ingest.QueueFor(Node, Partition);
+}
+
+// Handles one binary PDU, or columnar batch, received once that encoding has
+// been negotiated
+void ServerProcessBinary(_In_ SPOQ_STREAM* Channel,
+                         _In_ std::string_view body) {
+  SPOQ_SESSION* Session = Channel->Session;
+  SpoqMetrics().MessagesReceived.Add();
+  SpoqMetrics().BytesReceived.Add(body.size());
+  Session->Metrics.MessagesReceived.Add();
+  Session->Metrics.BytesReceived.Add(body.size());
+  Capture.Record(Session->CaptureId, Channel->Index, Session->SensorId,
+                 CAPTURE_EVENT::TO_SERVER, Session->Version, body);
+  ServerQueueReading(Channel, Session->Version, body);
+}
+
+// Handles one complete NDJSON message received on one of the session's
+// streams. Only the control stream negotiates.
+void ServerProcessMessage(_In_ SPOQ_STREAM* Channel,
+                          _In_ std::string_view message) {
+  SPOQ_SESSION* Session = Channel->Session;
+  HQUIC Stream = Channel->Stream;
+  // Print size in bytes and the message
+  SPOQ_LOG_DEBUG("[{}] Stream event: Received message ({} bytes): {}",
+                 Stream, message.size(), message);
+  SpoqMetrics().MessagesReceived.Add();
+  SpoqMetrics().BytesReceived.Add(message.size());
+  Session->Metrics.MessagesReceived.Add();
+  Session->Metrics.BytesReceived.Add(message.size());
+  Capture.Record(Session->CaptureId, Channel->Index, Session->SensorId,
+                 CAPTURE_EVENT::TO_SERVER, SPOQ_VERSION_NDJSON, message);
+
+  if (Session->State != SPOQ_STATE::NEGOTIATE) {
+    ServerQueueReading(Channel, SPOQ_VERSION_NDJSON, message);
+    return;
+  }
+  if (Channel->Index != 0) {
+    // Readings on a data stream that overtook the reply on the control
+    // stream, which the client is not meant to send
+    SPOQ_LOG_WARN("[{}] Stream event: Dropped a reading sent before "
+                  "negotiation finished", Stream);
+    SpoqMetrics().MessagesDropped.Add();
     return;
   }
+
+  SPOQ_PDU_VIEW Pdu;
+  SPOQ_DECODE_STATUS Decode = SpoqDecodeNdjson(message, &Pdu);
+  if (Decode != SPOQ_DECODE_STATUS::SUCCESS) {
+    SPOQ_LOG_ERROR("[{}] Negotiation event: malformed reply, {}", Stream,
+                   ToString(Decode));
+    SpoqMetrics().NegotiationsFailed.Add();
+    setSpoqState(Session->State, SPOQ_STATE::ERROR);
+    return;
+  }
+
+  SPOQ_LOG_INFO("[{}] Negotiation event: status = {}, version = {}", Stream,
+                Pdu.Header.Status, Pdu.Header.Version);
+  if (Pdu.Header.Status == SPOQ_STATUS_HELLO) {
+    ServerAnswerHello(Session, Pdu);
+    return;
+  }
+  // The client answers with the version and data streams it picked from the
+  // offer
+  if (Pdu.Header.Status == SPOQ_STATUS_SUCCESS &&
+      Pdu.Header.Version >= SPOQ_VERSION_NDJSON &&
+      Pdu.Header.Version <= MaxWireVersion &&
+      SpoqDataStreams(Pdu) <= MaxDataStreams) {
+    if (!ServerAdmit(Session, Sensors, Pdu.Header.SensorId,
+                     &Session->SensorEntry, "sensor")) {
+      return;
+    }
+    SPOQ_LOG_INFO("[{}] Negotiation event: SUCCESS!", Stream);
+    Session->SubscriptionCount =
+        SpoqSubscriptions(Pdu, Session->Subscriptions);
+    ServerEstablish(Session, Pdu.Header.SensorId, Pdu.Header.Version,
+                    WantsDatagrams(Pdu), SpoqDataStreams(Pdu));
+  } else {
+    SPOQ_LOG_ERROR("[{}] Negotiation event: FAILED!", Stream);
+    SpoqMetrics().NegotiationsFailed.Add();
+    setSpoqState(Session->State, SPOQ_STATE::ERROR);
+  }
+}
+
+// Stops forwarding readings to a subscriber, before its control stream is
+// closed
+void ServerUnsubscribe(_In_ SPOQ_SESSION* Session) {
+  if (Session->SubscriptionCount != 0) {
+    Broker.Unsubscribe(&Session->Control,
+                       {Session->Subscriptions, Session->SubscriptionCount});
+    Session->SubscriptionCount = 0;
+  }
 }
 
-// The server's callback for stream events from MsQuic.
+// Charges what a RECEIVE event delivered to the buckets of the session's
+// sensor. A stream whose sensor is over its rate stops receiving until the
+// debt is paid off, ADMISSION_MAX_PAUSE_NS at most at a time, so msquic's
+// flow control holds the client back. With -rate_action:reject its
+// connection is closed instead.
+void ServerMeter(_In_ SPOQ_STREAM* Channel, uint32_t Messages,
+                 uint64_t Bytes) {
+  SPOQ_SESSION* Session = Channel->Session;
+  ADMISSION_ENTRY* Sensor = Session->SensorEntry;
+  const uint64_t Now = MetricNow();
+  const uint64_t Debt = std::max(Sensor->Messages.Take(Messages, Now),
+                                 Sensor->Bytes.Take(Bytes, Now));
+  if (Debt == 0) {
+    return;
+  }
+  if (RateReject) {
+    SPOQ_LOG_WARN("[{}] Admission event: sensor {} over its rate, closing",
+                  Session->Connection, Session->SensorId);
+    SpoqMetrics().RateLimitedClosed.Add();
+    ServerRefuse(Session, SPOQ_ERROR_RATE_LIMITED);
+    return;
+  }
+  SPOQ_LOG_DEBUG("[{}] Admission event: sensor {} over its rate, paused for "
+                 "{} us", Channel->Stream, Session->SensorId,
+                 std::min(Debt, ADMISSION_MAX_PAUSE_NS) / 1000);
+  SpoqMetrics().ReceivePauses.Add();
+  Resumer.Pause(Channel->Stream, Now + std::min(Debt, ADMISSION_MAX_PAUSE_NS));
+}
+
+// The server's callback for stream events from MsQuic. Its context is the
+// session's control stream or one of its data streams.
 _IRQL_requires_max_(DISPATCH_LEVEL)
     _Function_class_(QUIC_STREAM_CALLBACK) QUIC_STATUS QUIC_API
     ServerStreamCallback(_In_ HQUIC Stream, _In_opt_ void* Context,
                          _Inout_ QUIC_STREAM_EVENT* Event) {
-  UNREFERENCED_PARAMETER(Context);
-  std::cout << "[" << Stream
-            << "] Stream event: " << QuicStreamEventTypeToString(Event->Type)
-            << "\n";
+  auto Channel = static_cast<SPOQ_STREAM*>(Context);
+  SPOQ_SESSION* Session = Channel->Session;
+  SPOQ_LOG_DEBUG("[{}] Stream event: {}", Stream,
+                 QuicStreamEventTypeToString(Event->Type));
   switch (Event->Type) {
-    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
-      auto sendBuffer =
-          static_cast<QUIC_BUFFER*>(Event->SEND_COMPLETE.ClientContext);
-      if (sendBuffer) {
-        std::string message(reinterpret_cast<const char*>(sendBuffer->Buffer),
-                            sendBuffer->Length);
-        std::cout << "[" << Stream << "] Stream event: Data sent: " << message;
-
-        // Free the original sendBuffer memory
-        free(sendBuffer);
-      } else {
-        std::cout << "[" << Stream << "] Stream event: Message send error!)\n";
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+      // A previous StreamSend call has completed. Return its buffers (a
+      // single message or a whole batch) to their pool for reuse. A bare FIN
+      // carries no context. The freed bytes may let a paused send resume.
+      if (Event->SEND_COMPLETE.Canceled) {
+        SPOQ_LOG_WARN("[{}] Stream event: Send canceled!", Stream);
+      }
+      Channel->Window.Completed(
+          SendContextBytes(Event->SEND_COMPLETE.ClientContext));
+      SendBufferRecordLatency(Event->SEND_COMPLETE.ClientContext);
+      SendBufferFree(Event->SEND_COMPLETE.ClientContext);
+      ServerSample(Session);
+      if (Channel->SendPaused && !Event->SEND_COMPLETE.Canceled &&
+          Channel->Window.HasRoom()) {
+        ServerSend(Channel);
+      }
+      break;
+    case QUIC_STREAM_EVENT_IDEAL_SEND_BUFFER_SIZE:
+      // msquic's estimate of the bytes to keep queued to fill the pipe
+      SPOQ_LOG_DEBUG("[{}] Stream event: Ideal send buffer size is {} bytes",
+                     Stream, Event->IDEAL_SEND_BUFFER_SIZE.ByteCount);
+      Channel->Window.SetIdeal(Event->IDEAL_SEND_BUFFER_SIZE.ByteCount);
+      if (Channel->SendPaused && Channel->Window.HasRoom()) {
+        ServerSend(Channel);
       }
       break;
-    }
     case QUIC_STREAM_EVENT_RECEIVE: {
-      // Data was received from the peer on the stream.
-      std::string buffer;
-
-      // Append incoming data to the string buffer
-      for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
-        buffer.append(
-            reinterpret_cast<const char*>(Event->RECEIVE.Buffers[i].Buffer),
-            Event->RECEIVE.Buffers[i].Length);
+      // Data was received from the peer on the stream. Complete messages are
+      // handled in place; a trailing partial line is kept for the next event.
+      // Negotiation is always NDJSON. A producing client's binary readings
+      // may follow its reply in the same event, so the split stops once
+      // binary is agreed and leaves them to the next event. What was
+      // consumed is then charged to the sensor's rate limits.
+      const uint64_t ReceiveStart = MetricNow();
+      uint64_t Consumed = 0;
+      uint32_t Messages = 0;
+      QUIC_STATUS Status;
+      if (Session->Version >= SPOQ_VERSION_BINARY &&
+          Session->State != SPOQ_STATE::NEGOTIATE) {
+        Status = Channel->BinaryFramer.Receive(
+            Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &Consumed,
+            [Channel, &Messages](std::string_view body) {
+              ServerProcessBinary(Channel, body);
+              ++Messages;
+            });
+      } else {
+        Status = Channel->Framer.Receive(
+            Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &Consumed,
+            [Channel, Session, &Messages](std::string_view message) {
+              ServerProcessMessage(Channel, message);
+              ++Messages;
+              return Session->Version == SPOQ_VERSION_NDJSON ||
+                     Session->State == SPOQ_STATE::NEGOTIATE;
+            });
       }
-      size_t pos = 0;
-      if ((pos = buffer.find('\n')) != std::string::npos) {
-        std::string message = buffer.substr(0, pos);
-        // Print size in bytes and the message
-        std::cout << "[" << Stream << "] Stream event: Received message ("
-                  << message.size() << " bytes): " << message << '\n';
+      if (QUIC_FAILED(Status)) {
+        SPOQ_LOG_ERROR("[{}] Stream event: Malformed framing!", Stream);
+        setSpoqState(Session->State, SPOQ_STATE::ERROR);
+        MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+        break;
       }
-
-      std::string vstr = "\"status\":\"";
-      if ((pos = buffer.find(vstr)) != std::string::npos) {
-        std::string status = buffer.substr(pos + vstr.length(), 1);
-        std::cout << "[" << Stream << "] Negotiation event: status = " << status
-                  << "\n";
-        if (status == "0") {
-          std::cout << "[" << Stream << "] Negotiation event: SUCCESS!\n";
-          setSpoqState(state, SPOQ_STATE::ESTABLISHED);
-          ServerSend(Stream);
-        } else {
-          std::cout << "[" << Stream << "] Negotiation event: FAILED!\n";
-          setSpoqState(state, SPOQ_STATE::ERROR);
-        }
+      Status = NdjsonReceiveComplete(Stream, Consumed,
+                                     Event->RECEIVE.TotalBufferLength);
+      if (Session->SensorEntry != nullptr && Messages != 0 &&
+          Session->State != SPOQ_STATE::ERROR) {
+        ServerMeter(Channel, Messages, Consumed);
       }
-      break;
+      SpoqMetrics().ReceiveLatency.RecordSince(ReceiveStart);
+      ServerSample(Session);
+      return Status;
     }
     case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
       break;
@@ -205,11 +901,24 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
       MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
       break;
     case QUIC_STREAM_EVENT_SEND_SHUTDOWN_COMPLETE:
-      // Both directions of the stream have been shut down and MsQuic is done
-      // with the stream. It can now be safely cleaned up.
+      // Our send direction has been shut down. The stream is not closed until
+      // SHUTDOWN_COMPLETE, since more events may still be delivered.
+      break;
     case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
       // Both directions of the stream have been shut down and MsQuic is done
-      // with the stream. It can now be safely cleaned up.
+      // with the stream. It can now be safely cleaned up, once no reading
+      // is being forwarded on it.
+      if (Channel == &Session->Control) {
+        ServerUnsubscribe(Session);
+      }
+      if (Channel->Stream == Stream) {
+        Channel->Stream = nullptr;
+        Channel->SendPaused = false;
+        Channel->Window.Close();
+      }
+      if (Resumer.Running()) {
+        Resumer.Cancel(Stream);
+      }
       MsQuic->StreamClose(Stream);
       break;
     default:
@@ -218,63 +927,209 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
   return QUIC_STATUS_SUCCESS;
 }
 
+// The callback of a stream the server refused. It was aborted when it
+// started, so it only waits for msquic to be done with it.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+    _Function_class_(QUIC_STREAM_CALLBACK) QUIC_STATUS QUIC_API
+    ServerRejectedStreamCallback(_In_ HQUIC Stream, _In_opt_ void* Context,
+                                 _Inout_ QUIC_STREAM_EVENT* Event) {
+  UNREFERENCED_PARAMETER(Context);
+  if (Event->Type == QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE) {
+    MsQuic->StreamClose(Stream);
+  }
+  return QUIC_STATUS_SUCCESS;
+}
+
+// Attaches a stream the peer started to its session. The stream's number
+// (its id without the two type bits) is its index: the client's first
+// stream is the control stream, and any after it are data streams.
+void ServerStreamStarted(_In_ SPOQ_SESSION* Session, _In_ HQUIC Stream) {
+  uint64_t StreamId = 0;
+  uint32_t IdLength = sizeof(StreamId);
+  if (QUIC_FAILED(MsQuic->GetParam(Stream, QUIC_PARAM_STREAM_ID, &IdLength,
+                                   &StreamId))) {
+    StreamId = 0;
+  }
+  const uint64_t Index = StreamId >> 2;
+  if (Index == 0) {
+    Session->Control.Session = Session;
+    Session->Control.Stream = Stream;
+    Session->Control.Batcher.Configure(SendMode);
+    MsQuic->SetCallbackHandler(Stream, (void*)ServerStreamCallback,
+                               &Session->Control);
+    // A stream opened in 0-RTT data starts negotiation before CONNECTED
+    if (Session->State == SPOQ_STATE::INIT) {
+      setSpoqState(Session->State, SPOQ_STATE::NEGOTIATE);
+    }
+    if (Session->State == SPOQ_STATE::NEGOTIATE) {
+      SendNegotiate(Session);
+    }
+    return;
+  }
+  // Data streams beyond those allowed, repeated, or beyond those agreed are
+  // refused
+  if (Index > MaxDataStreams || Session->Data[Index - 1] != nullptr ||
+      (ServerEstablished(Session) && Index > Session->DataStreamCount)) {
+    SPOQ_LOG_WARN("[{}] Stream event: Refused data stream {}", Stream, Index);
+    MsQuic->SetCallbackHandler(Stream, (void*)ServerRejectedStreamCallback,
+                               nullptr);
+    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+    return;
+  }
+  auto Channel = std::unique_ptr<SPOQ_STREAM>(new (std::nothrow) SPOQ_STREAM);
+  if (Channel == nullptr) {
+    SPOQ_LOG_ERROR("[{}] Stream event: Data stream {} allocation failed",
+                   Stream, Index);
+    MsQuic->SetCallbackHandler(Stream, (void*)ServerRejectedStreamCallback,
+                               nullptr);
+    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+    return;
+  }
+  Channel->Session = Session;
+  Channel->Stream = Stream;
+  Channel->Index = (uint32_t)Index;
+  Channel->Batcher.Configure(SendMode);
+  MsQuic->SetCallbackHandler(Stream, (void*)ServerStreamCallback,
+                             Channel.get());
+  Session->Data[Index - 1] = std::move(Channel);
+  SPOQ_LOG_DEBUG("[{}] Stream event: Data stream {} started", Stream, Index);
+  // A data stream that starts after negotiation sends at once; the others
+  // wait for ServerEstablish
+  if (ServerEstablished(Session)) {
+    ServerStartDataStream(Session->Data[Index - 1].get());
+  }
+}
+
 // The server's callback for connection events from MsQuic.
 _IRQL_requires_max_(DISPATCH_LEVEL)
     _Function_class_(QUIC_CONNECTION_CALLBACK) QUIC_STATUS QUIC_API
     ServerConnectionCallback(_In_ HQUIC Connection, _In_opt_ void* Context,
                              _Inout_ QUIC_CONNECTION_EVENT* Event) {
-  UNREFERENCED_PARAMETER(Context);
-  std::cout << "[" << Connection << "] Connection event: "
-            << QuicConnectionEventTypeToString(Event->Type) << "\n";
+  auto Session = static_cast<SPOQ_SESSION*>(Context);
+  SPOQ_LOG_DEBUG("[{}] Connection event: {}", Connection,
+                 QuicConnectionEventTypeToString(Event->Type));
   switch (Event->Type) {
-    case QUIC_CONNECTION_EVENT_CONNECTED:
-      // The handshake has completed for the connection.
-      setSpoqState(state, SPOQ_STATE::NEGOTIATE);
-      // MsQuic->ConnectionSendResumptionTicket(
-      //     Connection, QUIC_SEND_RESUMPTION_FLAG_NONE, 0, NULL);
+    case QUIC_CONNECTION_EVENT_CONNECTED: {
+      // The handshake has completed for the connection. A resumed client may
+      // have opened its stream in 0-RTT data already, and even finished
+      // negotiating.
+      SpoqMetrics().HandshakesCompleted.Add();
+      ServerSample(Session, true);
+      Session->Connected = true;
+      if (Session->Refusal != 0) {
+        MsQuic->ConnectionShutdown(Connection,
+                                   QUIC_CONNECTION_SHUTDOWN_FLAG_NONE,
+                                   Session->Refusal);
+        break;
+      }
+      if (Session->State == SPOQ_STATE::INIT) {
+        setSpoqState(Session->State, SPOQ_STATE::NEGOTIATE);
+      }
+      // Issue a ticket so that the client's next connection can resume this
+      // session with 0-RTT. It carries the client's identity, which the
+      // resumed connection does not present again.
+      QUIC_STATUS Status = MsQuic->ConnectionSendResumptionTicket(
+          Connection, QUIC_SEND_RESUMPTION_FLAG_FINAL,
+          Session->Identity != 0 ? sizeof(Session->Identity) : 0,
+          Session->Identity != 0 ? (const uint8_t*)&Session->Identity
+                                 : NULL);
+      if (QUIC_FAILED(Status)) {
+        SPOQ_LOG_WARN("[{}] ConnectionSendResumptionTicket failed, {}",
+                      Connection, SpoqLogHex(Status));
+      }
       break;
+    }
     case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
       // The connection has been shut down by the transport. Generally, this
       // is the expected way for the connection to shut down with this
       // protocol, since we let idle timeout kill the connection.
       if (Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status ==
           QUIC_STATUS_CONNECTION_IDLE) {
-        std::cout << "[" << Connection
-                  << "] Connection event: Successfully shut down on idle.\n";
+        SPOQ_LOG_INFO("[{}] Connection event: Successfully shut down on idle.",
+                      Connection);
       } else {
-        std::cout << "[" << Connection
-                  << "] Connection event: Shut down by transport, 0x"
-                  << std::hex << Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status
-                  << std::dec << "\n";
+        SPOQ_LOG_WARN(
+            "[{}] Connection event: Shut down by transport, {}", Connection,
+            SpoqLogHex(Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status));
         PrintQuicErrorCodeInfo(
             Event->SHUTDOWN_INITIATED_BY_TRANSPORT.ErrorCode);
       }
       break;
     case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_PEER:
       // The connection was explicitly shut down by the peer.
-      std::cout << "[" << Connection
-                << "] Connection event: Shut down by peer, 0x" << std::hex
-                << (unsigned long long)
-                       Event->SHUTDOWN_INITIATED_BY_PEER.ErrorCode
-                << std::dec << "\n";
+      SPOQ_LOG_WARN("[{}] Connection event: Shut down by peer, {}", Connection,
+                    SpoqLogHex(Event->SHUTDOWN_INITIATED_BY_PEER.ErrorCode));
       break;
     case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
       // The connection has completed the shutdown process and is ready to be
-      // safely cleaned up.
+      // safely cleaned up. All of the connection's streams have completed
+      // shutdown by now, so the session can be released with it. Readings
+      // still queued for ingest keep it until they are processed.
+      if (!Event->SHUTDOWN_COMPLETE.HandshakeCompleted) {
+        SpoqMetrics().HandshakesFailed.Add();
+      }
+      ServerUnsubscribe(Session);
+      Capture.Disconnect(Session->CaptureId, Session->SensorId);
+      if (Session->IdentityEntry != nullptr) {
+        Identities.Release(Session->IdentityEntry);
+      }
+      if (Session->SensorEntry != nullptr) {
+        Sensors.Release(Session->SensorEntry);
+      }
       MsQuic->ConnectionClose(Connection);
-      setSpoqState(state, SPOQ_STATE::WAITING);
+      setSpoqState(Session->State, SPOQ_STATE::CLOSED);
+      Sessions.Remove(Session);
+      SpoqSessionRelease(Session);
+      SPOQ_LOG_INFO("[{}] Connection event: {} active session(s)", Connection,
+                    Sessions.Size());
       break;
     case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED:
       // The peer has started/created a new stream. Begin sending data
-      MsQuic->SetCallbackHandler(Event->PEER_STREAM_STARTED.Stream,
-                                 (void*)ServerStreamCallback, NULL);
-      if (state == SPOQ_STATE::NEGOTIATE) {
-        SendNegotiate(Event->PEER_STREAM_STARTED.Stream);
+      ServerStreamStarted(Session, Event->PEER_STREAM_STARTED.Stream);
+      break;
+    case QUIC_CONNECTION_EVENT_DATAGRAM_STATE_CHANGED:
+      // Datagram sending became (un)available, e.g. once the peer's
+      // transport parameters are known or after a path MTU change.
+      Session->DatagramMaxLength =
+          Event->DATAGRAM_STATE_CHANGED.SendEnabled
+              ? Event->DATAGRAM_STATE_CHANGED.MaxSendLength
+              : 0;
+      break;
+    case QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED:
+      // A datagram reached a final state. Lost readings are only counted.
+      if (SpoqDatagramSendStateChanged(Event)) {
+        ++Session->DatagramsLost;
+        SpoqMetrics().DatagramsLost.Add();
       }
       break;
+    case QUIC_CONNECTION_EVENT_IDEAL_PROCESSOR_CHANGED:
+      // msquic moved the connection to another partition
+      ServerPlaceSession(Session, Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor,
+                         Event->IDEAL_PROCESSOR_CHANGED.PartitionIndex);
+      break;
     case QUIC_CONNECTION_EVENT_RESUMED:
       // The connection succeeded in doing a TLS resumption of a previous
       // connection's session.
+      SPOQ_LOG_DEBUG("[{}] Connection event: TLS session resumed", Connection);
+      SpoqMetrics().HandshakesResumed.Add();
+      if (Identities.Limited() &&
+          Event->RESUMED.ResumptionStateLength == sizeof(Session->Identity)) {
+        memcpy(&Session->Identity, Event->RESUMED.ResumptionState,
+               sizeof(Session->Identity));
+        ServerAdmit(Session, Identities, Session->Identity,
+                    &Session->IdentityEntry, "identity");
+      }
+      break;
+    case QUIC_CONNECTION_EVENT_PEER_CERTIFICATE_RECEIVED:
+      // msquic has validated the client's certificate, which it hands over
+      // DER encoded with portable certificates
+      if (Identities.Limited() &&
+          Event->PEER_CERTIFICATE_RECEIVED.Certificate != nullptr) {
+        Session->Identity = AdmissionIdentity(
+            (const QUIC_BUFFER*)Event->PEER_CERTIFICATE_RECEIVED.Certificate);
+        ServerAdmit(Session, Identities, Session->Identity,
+                    &Session->IdentityEntry, "identity");
+      }
       break;
     default:
       break;
@@ -291,21 +1146,73 @@ _IRQL_requires_max_(PASSIVE_LEVEL)
   UNREFERENCED_PARAMETER(Context);
   QUIC_STATUS Status = QUIC_STATUS_NOT_SUPPORTED;
   switch (Event->Type) {
-    case QUIC_LISTENER_EVENT_NEW_CONNECTION:
+    case QUIC_LISTENER_EVENT_NEW_CONNECTION: {
       // A new connection is being attempted by a client. For the handshake to
       // proceed, the server must provide a configuration for QUIC to use. The
       // app MUST set the callback handler before returning.
+      auto Session = new (std::nothrow) SPOQ_SESSION;
+      if (Session == nullptr) {
+        SPOQ_LOG_ERROR("Session allocation failed for new connection!");
+        Status = QUIC_STATUS_OUT_OF_MEMORY;
+        break;
+      }
+      Session->Connection = Event->NEW_CONNECTION.Connection;
+      // The listener callback runs on the connection's worker, so the session
+      // was allocated on its node
+      Session->Node = NumaCurrentNode();
+      Session->Queue = Session->NextQueue = Ingest.QueueFor(
+          Session->Node, NextPartition.fetch_add(1, std::memory_order_relaxed));
+      setSpoqState(Session->State, SPOQ_STATE::INIT);
+
       MsQuic->SetCallbackHandler(Event->NEW_CONNECTION.Connection,
-                                 (void*)ServerConnectionCallback, NULL);
+                                 (void*)ServerConnectionCallback, Session);
       Status = MsQuic->ConnectionSetConfiguration(
           Event->NEW_CONNECTION.Connection, Configuration);
+      if (QUIC_FAILED(Status)) {
+        // MsQuic rejects the connection and will not call back into it, so
+        // the session is never registered.
+        delete Session;
+        break;
+      }
+      Sessions.Insert(Session);
+      SpoqMetrics().ConnectionsAccepted.Add();
+      Session->CaptureId = Capture.Connect();
       break;
+    }
     default:
       break;
   }
   return Status;
 }
 
+// Renders the process-wide metrics and those of every live session
+void RenderMetrics(std::string& Out) {
+  SpoqMetrics().Render(Out);
+  Out.append("# HELP spoq_sessions_active Sessions attached to a connection\n"
+             "# TYPE spoq_sessions_active gauge\n"
+             "spoq_sessions_active ");
+  Out.append(std::to_string(Sessions.Size())).append("\n");
+  Out.append("# HELP spoq_store_segments Segment files in the reading store\n"
+             "# TYPE spoq_store_segments gauge\n"
+             "spoq_store_segments ");
+  Out.append(std::to_string(Store.SegmentCount())).append("\n");
+  Out.append("# HELP spoq_subscriptions Sensor subscriptions of live "
+             "sessions\n"
+             "# TYPE spoq_subscriptions gauge\n"
+             "spoq_subscriptions ");
+  Out.append(std::to_string(Broker.SubscriptionCount())).append("\n");
+  Ingest.Render(Out);
+  RenderConnectionMetrics(Out, [](auto&& Visit) {
+    Sessions.ForEach([&](const SPOQ_SESSION* Session) {
+      char Labels[64];
+      snprintf(Labels, sizeof(Labels), "connection=\"%p\",sensor=\"%llu\"",
+               (void*)Session->Connection,
+               (unsigned long long)Session->Metrics.SensorId.Get());
+      Visit(Labels, Session->Metrics);
+    });
+  });
+}
+
 // Helper function to load a server configuration. Uses the command line
 // arguments to load the credential part of the configuration.
 BOOLEAN
@@ -319,11 +1226,40 @@ ServerLoadConfiguration(_In_ int argc,
   // 0-RTT.
   Settings.ServerResumptionLevel = QUIC_SERVER_RESUME_AND_ZERORTT;
   Settings.IsSet.ServerResumptionLevel = TRUE;
-  // Configures the server's settings to allow for the peer to open a single
-  // bidirectional stream. By default connections are not configured to allow
-  // any streams from the peer.
-  Settings.PeerBidiStreamCount = 1;
+  // Configures the server's settings to allow for the peer to open its
+  // control stream and up to -max_streams bidirectional data streams. By
+  // default connections are not configured to allow any streams from the
+  // peer.
+  const char* Streams;
+  if ((Streams = GetValue(argc, argv, "max_streams")) != NULL) {
+    MaxDataStreams = std::min<uint32_t>((uint32_t)strtoul(Streams, NULL, 10),
+                                        SPOQ_MAX_DATA_STREAMS);
+  }
+  SPOQ_LOG_INFO("Data streams allowed per connection: {}", MaxDataStreams);
+  Settings.PeerBidiStreamCount = (uint16_t)(1 + MaxDataStreams);
   Settings.IsSet.PeerBidiStreamCount = TRUE;
+  // Each session's send window bounds what it queues, so msquic keeps our
+  // pooled buffers until they are acknowledged rather than copying them
+  // into a send buffer of its own.
+  Settings.SendBufferingEnabled = FALSE;
+  Settings.IsSet.SendBufferingEnabled = TRUE;
+  // Optionally allows readings to be exchanged as QUIC datagrams.
+  if (GetFlag(argc, argv, "datagram")) {
+    DatagramsEnabled = true;
+    Settings.DatagramReceiveEnabled = TRUE;
+    Settings.IsSet.DatagramReceiveEnabled = TRUE;
+  }
+  // Applies the tuning profile's windows, buffering and pacing last, so
+  // that it can override the choices above.
+  const char* TuningPath;
+  if ((TuningPath = GetValue(argc, argv, "tuning")) != NULL) {
+    if (!Tuning.Load(TuningPath)) {
+      return FALSE;
+    }
+    Tuning.Apply(&Settings);
+    SPOQ_LOG_INFO("Tuning profile {} loaded, autotuning {}", TuningPath,
+                  Tuning.Adaptive ? "on" : "off");
+  }
 
   QUIC_CREDENTIAL_CONFIG_HELPER Config;
   memset(&Config, 0, sizeof(Config));
@@ -348,11 +1284,11 @@ ServerLoadConfiguration(_In_ int argc,
         QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED;
     Config.CredConfig.Flags |= QUIC_CREDENTIAL_FLAG_SET_CA_CERTIFICATE_FILE;
 
-    std::cout << "Cert: " << Cert << "\n";
-    std::cout << "Key : " << KeyFile << "\n";
-    std::cout << "CA  : " << (CaFile ? CaFile : "none") << "\n";
+    SPOQ_LOG_INFO("Cert: {}", Cert);
+    SPOQ_LOG_INFO("Key : {}", KeyFile);
+    SPOQ_LOG_INFO("CA  : {}", CaFile ? CaFile : "none");
   } else {
-    std::cout << "Must specify ['cert_file', 'key_file', and 'ca_file']!\n";
+    SPOQ_LOG_ERROR("Must specify ['cert_file', 'key_file', and 'ca_file']!");
     return FALSE;
   }
 
@@ -363,8 +1299,7 @@ ServerLoadConfiguration(_In_ int argc,
                       Registration, &Alpn, 1, &Settings, sizeof(Settings), NULL,
                       &Configuration))) {
     setSpoqState(state, SPOQ_STATE::ERROR);
-    std::cout << "ConfigurationOpen failed, 0x" << std::hex << Status
-              << std::dec << " !\n ";
+    SPOQ_LOG_ERROR("ConfigurationOpen failed, {}!", SpoqLogHex(Status));
     return FALSE;
   }
 
@@ -372,8 +1307,8 @@ ServerLoadConfiguration(_In_ int argc,
   if (QUIC_FAILED(Status = MsQuic->ConfigurationLoadCredential(
                       Configuration, &Config.CredConfig))) {
     setSpoqState(state, SPOQ_STATE::ERROR);
-    std::cout << "ConfigurationLoadCredential failed, 0x" << std::hex << Status
-              << std::dec << "!\n";
+    SPOQ_LOG_ERROR("ConfigurationLoadCredential failed, {}!",
+                   SpoqLogHex(Status));
     return FALSE;
   }
 
@@ -402,12 +1337,90 @@ void RunServer(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
     return;
   }
 
+  const char* Mode;
+  if ((Mode = GetValue(argc, argv, "send_mode")) != NULL) {
+    SendMode = strcmp(Mode, "latency") == 0 ? SPOQ_SEND_MODE::LOW_LATENCY
+                                            : SPOQ_SEND_MODE::THROUGHPUT;
+  }
+  SPOQ_LOG_INFO("Send mode: {}", ToString(SendMode));
+
+  const char* Encoding;
+  if ((Encoding = GetValue(argc, argv, "encoding")) != NULL) {
+    MaxWireVersion = strcmp(Encoding, "ndjson") == 0   ? SPOQ_VERSION_NDJSON
+                     : strcmp(Encoding, "binary") == 0 ? SPOQ_VERSION_BINARY
+                                                       : SPOQ_VERSION_COLUMNAR;
+  }
+  SPOQ_LOG_INFO("Highest wire version offered: {}", MaxWireVersion);
+
+  // Limit each client identity and sensor. Only sensors have rates.
+  ADMISSION_LIMITS Limits;
+  const char* Value;
+  if ((Value = GetValue(argc, argv, "max_connections")) != NULL) {
+    Limits.MaxConnections = (uint32_t)strtoul(Value, NULL, 10);
+  }
+  if ((Value = GetValue(argc, argv, "handshake_rate")) != NULL) {
+    Limits.HandshakeRate = strtod(Value, NULL);
+  }
+  Identities.Configure(Limits);
+  if ((Value = GetValue(argc, argv, "sensor_message_rate")) != NULL) {
+    Limits.MessageRate = strtod(Value, NULL);
+  }
+  if ((Value = GetValue(argc, argv, "sensor_byte_rate")) != NULL) {
+    Limits.ByteRate = strtod(Value, NULL);
+  }
+  Sensors.Configure(Limits);
+  if ((Value = GetValue(argc, argv, "rate_action")) != NULL) {
+    RateReject = strcmp(Value, "reject") == 0;
+  }
+  if (Sensors.Limited()) {
+    SPOQ_LOG_INFO("Admission limits: {} connection(s), {} handshake(s)/s, "
+                  "{} message(s)/s, {} byte(s)/s per sensor, {} when over "
+                  "rate", Limits.MaxConnections, Limits.HandshakeRate,
+                  Limits.MessageRate, Limits.ByteRate,
+                  RateReject ? "reject" : "delay");
+  }
+  if (!RateReject && (Limits.MessageRate > 0 || Limits.ByteRate > 0)) {
+    Resumer.Start();
+  }
+
+  // Open the reading store, if asked to, before anything can be ingested
+  const char* StorePath;
+  if ((StorePath = GetValue(argc, argv, "store")) != NULL) {
+    uint64_t SegmentBytes = SERIES_DEFAULT_SEGMENT_BYTES;
+    uint64_t SegmentAgeNs = SERIES_DEFAULT_SEGMENT_AGE_NS;
+    if ((Value = GetValue(argc, argv, "segment_mb")) != NULL) {
+      SegmentBytes = strtoull(Value, NULL, 10) << 20;
+    }
+    if ((Value = GetValue(argc, argv, "segment_age")) != NULL) {
+      SegmentAgeNs = strtoull(Value, NULL, 10) * 1000000000;
+    }
+    if (!Store.Open(StorePath, SegmentBytes, SegmentAgeNs)) {
+      setSpoqState(state, SPOQ_STATE::ERROR);
+      return;
+    }
+  }
+
+  // Record what clients send, if asked to, from the first connection on
+  const char* CapturePath;
+  if ((CapturePath = GetValue(argc, argv, "capture")) != NULL &&
+      !Capture.Open(CapturePath)) {
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    return;
+  }
+
+  // Start the workers that process readings off the msquic threads
+  const char* Workers;
+  if ((Workers = GetValue(argc, argv, "ingest_workers")) != NULL) {
+    IngestWorkers = (uint32_t)strtoul(Workers, NULL, 10);
+  }
+  Ingest.Start(IngestWorkers, ServerIngestItem);
+  SPOQ_LOG_INFO("Ingest workers: {}", Ingest.WorkerCount());
+
   // Create/allocate a new listener object.
   if (QUIC_FAILED(Status = MsQuic->ListenerOpen(
                       Registration, ServerListenerCallback, NULL, &Listener))) {
     setSpoqState(state, SPOQ_STATE::ERROR);
-    std::cout << "ListenerOpen failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("ListenerOpen failed, {}!", SpoqLogHex(Status));
     shutdown();
   }
 
@@ -415,12 +1428,20 @@ void RunServer(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
   if (QUIC_FAILED(Status =
                       MsQuic->ListenerStart(Listener, &Alpn, 1, &Address))) {
     setSpoqState(state, SPOQ_STATE::ERROR);
-    std::cout << "ListenerStart failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("ListenerStart failed, {}!", SpoqLogHex(Status));
     shutdown();
   }
 
+  // Publish metrics if asked to
+  if (!Exporter.Start(GetValue(argc, argv, "metrics_socket"),
+                      GetValue(argc, argv, "metrics_file"), RenderMetrics)) {
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return;
+  }
+
   // Continue listening for connections until the Enter key is pressed.
+  SpoqLogFlush();
   std::cout << "Press Enter to exit.\n\n";
   setSpoqState(state, SPOQ_STATE::WAITING);
   std::cin.get();
@@ -430,6 +1451,12 @@ void RunServer(_In_ int argc, _In_reads_(argc) _Null_terminated_ char* argv[]) {
 
 int QUIC_MAIN_EXPORT main(_In_ int argc,
                           _In_reads_(argc) _Null_terminated_ char* argv[]) {
+  const char* LogLevel;
+  if ((LogLevel = GetValue(argc, argv, "log_level")) != NULL &&
+      !SpoqLogSetLevel(LogLevel)) {
+    std::cout << "Unknown log level '" << LogLevel << "'!\n";
+    return -1;
+  }
   setSpoqState(state, SPOQ_STATE::INIT);
   QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
 
@@ -442,6 +1469,15 @@ int QUIC_MAIN_EXPORT main(_In_ int argc,
         // This will block until all outstanding child objects have been
         // closed.
         MsQuic->RegistrationClose(Registration);
+        // No connection is left to queue readings, so the workers can
+        // finish what is queued and exit
+        Ingest.Stop();
+        Store.Close();
+        Capture.Close();
+        Resumer.Stop();
+        Exporter.Stop();
+        SpoqLogFlush();
+        SendPoolPrintStats();
       }
       MsQuicClose(MsQuic);
       setSpoqState(state, SPOQ_STATE::CLOSED);
@@ -451,18 +1487,27 @@ int QUIC_MAIN_EXPORT main(_In_ int argc,
   // Open a handle to the library and get the API function table.
   if (QUIC_FAILED(Status = MsQuicOpen2(&MsQuic))) {
     setSpoqState(state, SPOQ_STATE::ERROR);
-    std::cout << "MsQuicOpen2 failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("MsQuicOpen2 failed, {}!", SpoqLogHex(Status));
     shutdown();
     return (int)Status;
   }
 
+  const char* Profile;
+  if ((Profile = GetValue(argc, argv, "execution_profile")) != NULL &&
+      !ParseExecutionProfile(Profile, &RegConfig.ExecutionProfile)) {
+    SPOQ_LOG_ERROR("Unknown execution profile '{}'!", Profile);
+    setSpoqState(state, SPOQ_STATE::ERROR);
+    shutdown();
+    return -1;
+  }
+  SPOQ_LOG_INFO("Execution profile {}, {} NUMA node(s)",
+                ToString(RegConfig.ExecutionProfile), NumaNodeCount());
+
   // Create a registration for the app's connections.
   if (QUIC_FAILED(Status =
                       MsQuic->RegistrationOpen(&RegConfig, &Registration))) {
     setSpoqState(state, SPOQ_STATE::ERROR);
-    std::cout << "RegistrationOpen failed, 0x" << std::hex << Status << std::dec
-              << "!\n";
+    SPOQ_LOG_ERROR("RegistrationOpen failed, {}!", SpoqLogHex(Status));
     shutdown();
     return (int)Status;
   }